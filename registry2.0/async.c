@@ -0,0 +1,554 @@
+/*
+ * async.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "async.h"
+#include "centry.h"
+#include "entry.h"
+#include "pool.h"
+#include "probes.h"
+#include "registry.h"
+
+/*
+ * Asynchronous operations.
+ *
+ * `registry::entry search -async`, `$entry files -async` and `$entry map
+ * -async` run on a thread of their own, with a connection leased from the pool,
+ * and return a job token straight away. Results come back to the calling
+ * thread through its event queue, so nothing happens until it enters the event
+ * loop. The callback is invoked as
+ *
+ *     {*}$callback $token chunk $values
+ *
+ * for each chunk of up to ASYNC_CHUNK results (for `map`, the number of files
+ * mapped so far), and then exactly once as one of
+ *
+ *     {*}$callback $token done $count
+ *     {*}$callback $token error $message
+ *     {*}$callback $token cancelled {}
+ *
+ * `registry::cancel $token` asks the job to stop. The worker checks for that
+ * between chunks and, through a sqlite progress handler, in the middle of long
+ * statements; a cancelled `map` is rolled back. Chunks still in the queue when
+ * a job is cancelled are dropped.
+ */
+
+#define ASYNC_CHUNK 256
+
+/* virtual machine instructions between cancellation checks */
+#define ASYNC_PROGRESS_OPS 1000
+
+typedef enum {
+    ASYNC_SEARCH,
+    ASYNC_FILES,
+    ASYNC_MAP
+} async_op;
+
+typedef enum {
+    ASYNC_CHUNK_EVENT,
+    ASYNC_DONE_EVENT,
+    ASYNC_ERROR_EVENT,
+    ASYNC_CANCELLED_EVENT
+} async_event_kind;
+
+typedef struct async_event async_event;
+
+typedef struct {
+    async_op op;
+    char token[32];
+    Tcl_Interp* interp;
+    Tcl_ThreadId origin;
+    Tcl_Obj* callback;
+    sqlite3* db;
+    volatile int cancelled;
+    int orphaned;
+    /* arguments, all in `args` */
+    reg_arena args;
+    sqlite_int64 rowid;
+    char** keys;            /* search keys, or the files to map */
+    char** vals;
+    int count;
+    int strategy;
+    /* worker's state */
+    async_event* chunk;
+    int total;
+} async_job;
+
+struct async_event {
+    Tcl_Event header;
+    async_job* job;
+    async_event_kind kind;
+    int count;
+    void* values;
+    reg_arena arena;
+    char* message;
+};
+
+typedef struct {
+    Tcl_HashTable jobs;
+    int next;
+} async_table;
+
+static int async_event_proc(Tcl_Event* evPtr, int flags);
+static void async_job_free(async_job* job);
+
+static async_event* async_event_new(async_job* job, async_event_kind kind) {
+    async_event* ev = (async_event*)ckalloc(sizeof(async_event));
+    ev->header.proc = async_event_proc;
+    ev->job = job;
+    ev->kind = kind;
+    ev->count = 0;
+    ev->values = NULL;
+    ev->message = NULL;
+    reg_arena_init(&ev->arena, 4096);
+    return ev;
+}
+
+static void async_event_free(async_event* ev) {
+    reg_arena_free(&ev->arena);
+    free(ev->message);
+}
+
+/* worker side */
+
+static void async_queue(async_job* job, async_event* ev) {
+    Tcl_ThreadQueueEvent(job->origin, (Tcl_Event*)ev, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(job->origin);
+}
+
+static int async_progress(void* userdata) {
+    return ((async_job*)userdata)->cancelled;
+}
+
+static void async_cancelled(reg_error* errPtr) {
+    errPtr->code = "registry::cancelled";
+    errPtr->description = "operation was cancelled";
+    errPtr->free = NULL;
+}
+
+static void async_flush_chunk(async_job* job) {
+    if (job->chunk != NULL) {
+        async_queue(job, job->chunk);
+        job->chunk = NULL;
+    }
+}
+
+/*
+ * Returns the chunk being filled, starting a new one if needed, with room for
+ * ASYNC_CHUNK values of `size` bytes.
+ */
+static async_event* async_chunk(async_job* job, size_t size) {
+    if (job->chunk == NULL) {
+        job->chunk = async_event_new(job, ASYNC_CHUNK_EVENT);
+        job->chunk->values = reg_arena_alloc(&job->chunk->arena,
+                ASYNC_CHUNK * size);
+    }
+    return job->chunk;
+}
+
+static int async_visit_entry(void* userdata, sqlite_int64 rowid,
+        reg_error* errPtr) {
+    async_job* job = (async_job*)userdata;
+    async_event* chunk;
+    if (job->cancelled) {
+        async_cancelled(errPtr);
+        return 0;
+    }
+    chunk = async_chunk(job, sizeof(sqlite_int64));
+    ((sqlite_int64*)chunk->values)[chunk->count++] = rowid;
+    if (chunk->count == ASYNC_CHUNK) {
+        async_flush_chunk(job);
+    }
+    return 1;
+}
+
+static int async_visit_file(void* userdata, int row UNUSED, const char* value,
+        int len, reg_error* errPtr) {
+    async_job* job = (async_job*)userdata;
+    async_event* chunk;
+    if (job->cancelled) {
+        async_cancelled(errPtr);
+        return 0;
+    }
+    chunk = async_chunk(job, sizeof(char*));
+    ((char**)chunk->values)[chunk->count++] = reg_arena_strdup(&chunk->arena,
+            value, len);
+    if (chunk->count == ASYNC_CHUNK) {
+        async_flush_chunk(job);
+    }
+    return 1;
+}
+
+/*
+ * Maps the files a chunk at a time inside one transaction, reporting progress
+ * after each chunk. Anything short of finishing rolls the whole thing back.
+ */
+static int async_run_map(async_job* job, reg_error* errPtr) {
+    reg_entry entry;
+    int i;
+    REG_PROBE_START(start);
+    entry.rowid = job->rowid;
+    entry.db = job->db;
+    REG_PROBE1(txn_begin, "async");
+    if (sqlite3_exec(job->db, "BEGIN IMMEDIATE", NULL, NULL, NULL)
+            != SQLITE_OK) {
+        reg_sqlite_error(job->db, errPtr, "BEGIN IMMEDIATE");
+        return -1;
+    }
+    for (i=0; i<job->count; i+=ASYNC_CHUNK) {
+        int n = job->count - i;
+        if (n > ASYNC_CHUNK) {
+            n = ASYNC_CHUNK;
+        }
+        if (job->cancelled) {
+            async_cancelled(errPtr);
+            break;
+        }
+        if (reg_entry_map(job->db, &entry, job->keys + i, n, errPtr) != n) {
+            break;
+        }
+        job->chunk = async_event_new(job, ASYNC_CHUNK_EVENT);
+        job->chunk->count = i + n;
+        async_flush_chunk(job);
+    }
+    if (i < job->count
+            || sqlite3_exec(job->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        if (i >= job->count) {
+            reg_sqlite_error(job->db, errPtr, "COMMIT");
+        }
+        sqlite3_exec(job->db, "ROLLBACK", NULL, NULL, NULL);
+        REG_PROBE3(txn_rollback, "async", i, REG_PROBE_SINCE(start));
+        return -1;
+    }
+    REG_PROBE3(txn_commit, "async", job->count, REG_PROBE_SINCE(start));
+    return job->count;
+}
+
+static Tcl_ThreadCreateType async_main(ClientData clientData) {
+    async_job* job = (async_job*)clientData;
+    reg_error error;
+    reg_entry entry;
+    async_event* ev;
+    int result = -1;
+    sqlite3_progress_handler(job->db, ASYNC_PROGRESS_OPS, async_progress, job);
+    switch (job->op) {
+        case ASYNC_SEARCH:
+            result = reg_entry_search_visit(job->db, job->keys, job->vals,
+                    job->count, job->strategy, async_visit_entry, job, &error);
+            break;
+        case ASYNC_FILES:
+            entry.rowid = job->rowid;
+            entry.db = job->db;
+            result = reg_entry_files_visit(job->db, &entry, async_visit_file,
+                    job, &error);
+            break;
+        case ASYNC_MAP:
+            result = async_run_map(job, &error);
+            break;
+    }
+    sqlite3_progress_handler(job->db, 0, NULL, NULL);
+    if (result >= 0) {
+        async_flush_chunk(job);
+    } else if (job->chunk != NULL) {
+        async_event_free(job->chunk);
+        ckfree((char*)job->chunk);
+        job->chunk = NULL;
+    }
+    pool_release(job->db);
+    if (job->cancelled) {
+        ev = async_event_new(job, ASYNC_CANCELLED_EVENT);
+        if (result < 0) {
+            reg_error_destruct(&error);
+        }
+    } else if (result < 0) {
+        ev = async_event_new(job, ASYNC_ERROR_EVENT);
+        ev->message = strdup(error.description);
+        reg_error_destruct(&error);
+    } else {
+        ev = async_event_new(job, ASYNC_DONE_EVENT);
+        ev->count = result;
+    }
+    async_queue(job, ev);
+    Tcl_FinalizeThread();
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/* calling thread's side */
+
+static void delete_async_table(ClientData clientData,
+        Tcl_Interp* interp UNUSED) {
+    async_table* table = (async_table*)clientData;
+    Tcl_HashSearch search;
+    Tcl_HashEntry* hash;
+    for (hash = Tcl_FirstHashEntry(&table->jobs, &search); hash != NULL;
+            hash = Tcl_NextHashEntry(&search)) {
+        async_job* job = (async_job*)Tcl_GetHashValue(hash);
+        job->cancelled = 1;
+        job->orphaned = 1;
+    }
+    Tcl_DeleteHashTable(&table->jobs);
+    ckfree((char*)table);
+}
+
+static async_table* get_async_table(Tcl_Interp* interp) {
+    async_table* table = Tcl_GetAssocData(interp, "registry::jobs", NULL);
+    if (table == NULL) {
+        table = (async_table*)ckalloc(sizeof(async_table));
+        Tcl_InitHashTable(&table->jobs, TCL_STRING_KEYS);
+        table->next = 0;
+        Tcl_SetAssocData(interp, "registry::jobs", delete_async_table, table);
+    }
+    return table;
+}
+
+static Tcl_Obj* async_event_data(async_event* ev) {
+    Tcl_Obj* data;
+    int i;
+    switch (ev->job->op) {
+        case ASYNC_SEARCH:
+            if (ev->kind == ASYNC_CHUNK_EVENT) {
+                data = Tcl_NewListObj(0, NULL);
+                for (i=0; i<ev->count; i++) {
+                    Tcl_ListObjAppendElement(NULL, data,
+                            new_ref_obj(((sqlite_int64*)ev->values)[i]));
+                }
+                return data;
+            }
+            break;
+        case ASYNC_FILES:
+            if (ev->kind == ASYNC_CHUNK_EVENT) {
+                data = Tcl_NewListObj(0, NULL);
+                for (i=0; i<ev->count; i++) {
+                    Tcl_ListObjAppendElement(NULL, data,
+                            Tcl_NewStringObj(((char**)ev->values)[i], -1));
+                }
+                return data;
+            }
+            break;
+        case ASYNC_MAP:
+            break;
+    }
+    switch (ev->kind) {
+        case ASYNC_CHUNK_EVENT:
+        case ASYNC_DONE_EVENT:
+            return Tcl_NewIntObj(ev->count);
+        case ASYNC_ERROR_EVENT:
+            return Tcl_NewStringObj(ev->message, -1);
+        default:
+            return Tcl_NewObj();
+    }
+}
+
+/*
+ * Hands an event to the job's callback, and cleans up after the job once its
+ * last event is in.
+ */
+static int async_event_proc(Tcl_Event* evPtr, int flags UNUSED) {
+    static const char* kinds[] = { "chunk", "done", "error", "cancelled" };
+    async_event* ev = (async_event*)evPtr;
+    async_job* job = ev->job;
+    Tcl_Interp* interp = job->interp;
+    int last = (ev->kind != ASYNC_CHUNK_EVENT);
+    if (last && !job->orphaned) {
+        async_table* table = Tcl_GetAssocData(interp, "registry::jobs", NULL);
+        Tcl_HashEntry* hash = table == NULL ? NULL
+            : Tcl_FindHashEntry(&table->jobs, job->token);
+        if (hash != NULL) {
+            Tcl_DeleteHashEntry(hash);
+        }
+    }
+    if (!job->orphaned && !Tcl_InterpDeleted(interp)
+            && (last || !job->cancelled)) {
+        Tcl_Obj* cmd = Tcl_DuplicateObj(job->callback);
+        Tcl_IncrRefCount(cmd);
+        Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewStringObj(job->token, -1));
+        Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewStringObj(kinds[ev->kind],
+                    -1));
+        Tcl_ListObjAppendElement(NULL, cmd, async_event_data(ev));
+        Tcl_Preserve(interp);
+        if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK) {
+            Tcl_AddErrorInfo(interp, "\n    (registry async callback)");
+            Tcl_BackgroundError(interp);
+        }
+        Tcl_Release(interp);
+        Tcl_DecrRefCount(cmd);
+    }
+    async_event_free(ev);
+    if (last) {
+        Tcl_Release(interp);
+        async_job_free(job);
+    }
+    return 1;
+}
+
+static async_job* async_job_new(async_op op, Tcl_Obj* callback) {
+    async_job* job = (async_job*)ckalloc(sizeof(async_job));
+    memset(job, 0, sizeof(async_job));
+    job->op = op;
+    job->callback = callback;
+    Tcl_IncrRefCount(callback);
+    reg_arena_init(&job->args, 1024);
+    return job;
+}
+
+static void async_job_free(async_job* job) {
+    Tcl_DecrRefCount(job->callback);
+    reg_arena_free(&job->args);
+    ckfree((char*)job);
+}
+
+/*
+ * Leases the job a connection and starts its thread. On success, the job's
+ * token is the interp result; on failure the job is freed.
+ */
+static int async_start(Tcl_Interp* interp, async_job* job) {
+    Tcl_ThreadId thread;
+    async_table* table;
+    Tcl_HashEntry* hash;
+    int created;
+    sqlite3* db = registry_db(interp, 1);
+    if (db == NULL) {
+        async_job_free(job);
+        return TCL_ERROR;
+    }
+    if (!sqlite3_threadsafe()) {
+        Tcl_SetResult(interp, "sqlite was built without thread support",
+                TCL_STATIC);
+        async_job_free(job);
+        return TCL_ERROR;
+    }
+    if (registry_flags(interp) & REGISTRY_SNAPSHOT) {
+        Tcl_SetResult(interp, "can't run -async queries on a snapshot",
+                TCL_STATIC);
+        async_job_free(job);
+        return TCL_ERROR;
+    }
+    job->db = pool_lease(interp, sqlite3_db_filename(db, "registry"),
+            (registry_flags(interp) & REGISTRY_READONLY) ? POOL_READONLY : 0);
+    if (job->db == NULL) {
+        async_job_free(job);
+        return TCL_ERROR;
+    }
+    table = get_async_table(interp);
+    sprintf(job->token, "registry::job%d", table->next++);
+    job->interp = interp;
+    job->origin = Tcl_GetCurrentThread();
+    Tcl_Preserve(interp);
+    hash = Tcl_CreateHashEntry(&table->jobs, job->token, &created);
+    Tcl_SetHashValue(hash, job);
+    if (Tcl_CreateThread(&thread, async_main, job, TCL_THREAD_STACK_DEFAULT,
+                TCL_THREAD_NOFLAGS) != TCL_OK) {
+        Tcl_DeleteHashEntry(hash);
+        Tcl_Release(interp);
+        pool_release(job->db);
+        async_job_free(job);
+        Tcl_SetResult(interp, "couldn't create worker thread", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(job->token, -1));
+    return TCL_OK;
+}
+
+/**
+ * Starts `registry::entry search` on a worker. Results are entry references.
+ */
+int async_search(Tcl_Interp* interp, Tcl_Obj* callback, char** keys,
+        char** vals, int key_count, int strategy) {
+    async_job* job = async_job_new(ASYNC_SEARCH, callback);
+    int i;
+    job->keys = reg_arena_alloc(&job->args, (key_count + 1) * sizeof(char*));
+    job->vals = reg_arena_alloc(&job->args, (key_count + 1) * sizeof(char*));
+    for (i=0; i<key_count; i++) {
+        job->keys[i] = reg_arena_strdup(&job->args, keys[i], -1);
+        job->vals[i] = reg_arena_strdup(&job->args, vals[i], -1);
+    }
+    job->count = key_count;
+    job->strategy = strategy;
+    return async_start(interp, job);
+}
+
+/**
+ * Starts `$entry files` on a worker.
+ */
+int async_files(Tcl_Interp* interp, Tcl_Obj* callback, sqlite_int64 rowid) {
+    async_job* job = async_job_new(ASYNC_FILES, callback);
+    job->rowid = rowid;
+    return async_start(interp, job);
+}
+
+/**
+ * Starts `$entry map` on a worker. The files are mapped in a single
+ * transaction, so either all of them are or, on error or cancellation, none.
+ */
+int async_map(Tcl_Interp* interp, Tcl_Obj* callback, sqlite_int64 rowid,
+        int objc, Tcl_Obj* CONST objv[]) {
+    async_job* job = async_job_new(ASYNC_MAP, callback);
+    int i;
+    job->keys = reg_arena_alloc(&job->args, (objc + 1) * sizeof(char*));
+    for (i=0; i<objc; i++) {
+        int len;
+        char* file = Tcl_GetStringFromObj(objv[i], &len);
+        job->keys[i] = reg_arena_strdup(&job->args, file, len);
+    }
+    job->count = objc;
+    job->rowid = rowid;
+    return async_start(interp, job);
+}
+
+/*
+ * registry::cancel token
+ *
+ * Asks a running job to stop. Its callback will still be called once more,
+ * with `cancelled` (or `done`, if the job finished first).
+ */
+int cancel_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    Tcl_HashEntry* hash;
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "token");
+        return TCL_ERROR;
+    }
+    hash = Tcl_FindHashEntry(&get_async_table(interp)->jobs,
+            Tcl_GetString(objv[1]));
+    if (hash == NULL) {
+        Tcl_AppendResult(interp, "no such job \"", Tcl_GetString(objv[1]),
+                "\"", NULL);
+        return TCL_ERROR;
+    }
+    ((async_job*)Tcl_GetHashValue(hash))->cancelled = 1;
+    return TCL_OK;
+}
@@ -30,11 +30,13 @@
 #include <config.h>
 #endif
 
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sqlite3.h>
 
 #include "centry.h"
+#include "probes.h"
 
 /**
  * Concatenates `src` to string `dst`.
@@ -66,23 +68,113 @@ void reg_error_destruct(reg_error* errPtr) {
     }
 }
 
+struct reg_arena_block {
+    reg_arena_block* next;
+    size_t used;
+    size_t size;
+    double data[1];
+};
+
 /**
- * Appends `src` to the list `dst`.
+ * Initializes an empty arena.
+ *
+ * No memory is allocated until the first call to `reg_arena_alloc`. The first
+ * block will hold `block_size` bytes; each later block is twice the size of the
+ * one before it, so a result set of N bytes takes O(log N) calls to `malloc`.
+ */
+void reg_arena_init(reg_arena* arena, size_t block_size) {
+    arena->blocks = NULL;
+    arena->block_size = block_size;
+    arena->block_count = 0;
+}
+
+/**
+ * Allocates `size` bytes from `arena`.
+ *
+ * The memory is suitably aligned for any type and lives until the arena is
+ * freed.
+ */
+void* reg_arena_alloc(reg_arena* arena, size_t size) {
+    reg_arena_block* block = arena->blocks;
+    void* result;
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    if (block == NULL || block->used + size > block->size) {
+        size_t space = arena->block_size;
+        if (block != NULL) {
+            space = 2 * block->size;
+        }
+        if (space < size) {
+            space = size;
+        }
+        block = malloc(offsetof(reg_arena_block, data) + space);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = space;
+        arena->blocks = block;
+        arena->block_count++;
+    }
+    result = (char*)block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+/**
+ * Copies `len` bytes of `src` into `arena` and null-terminates them. If `len`
+ * is negative, `src` is assumed to be null-terminated.
+ */
+char* reg_arena_strdup(reg_arena* arena, const char* src, int len) {
+    char* result;
+    if (len < 0) {
+        len = strlen(src);
+    }
+    result = reg_arena_alloc(arena, len + 1);
+    if (result != NULL) {
+        memcpy(result, src, len);
+        result[len] = '\0';
+    }
+    return result;
+}
+
+/**
+ * Releases everything allocated from `arena`. The arena may be reused
+ * afterwards.
+ */
+void reg_arena_free(reg_arena* arena) {
+    reg_arena_block* block = arena->blocks;
+    while (block != NULL) {
+        reg_arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->block_count = 0;
+}
+
+/**
+ * Appends `src` to the list `dst`, which lives in `arena`.
  *
  * It's like `reg_strcat`, except `src` represents an element and not a sequence
- * of `char`s.
+ * of `char`s. When the list is full, a new one of twice the size is taken from
+ * the arena; the old one is simply abandoned, so the wasted space is never more
+ * than the final list.
  */
-static void reg_listcat(void*** dst, int* dst_len, int* dst_space, void* src) {
+static int reg_listcat(reg_arena* arena, void*** dst, int* dst_len,
+        int* dst_space, void* src) {
     if (*dst_len == *dst_space) {
-        void** old_dst = *dst;
-        void** new_dst = malloc(*dst_space * 2 * sizeof(void*));
+        void** new_dst = reg_arena_alloc(arena, *dst_space * 2 * sizeof(void*));
+        if (new_dst == NULL) {
+            return 0;
+        }
+        memcpy(new_dst, *dst, *dst_len * sizeof(void*));
         *dst_space *= 2;
-        memcpy(new_dst, old_dst, *dst_len);
         *dst = new_dst;
-        free(old_dst);
     }
     (*dst)[*dst_len] = src;
     (*dst_len)++;
+    return 1;
 }
 
 /**
@@ -121,6 +213,269 @@ void reg_sqlite_error(sqlite3* db, reg_error* errPtr, char* query) {
     }
 }
 
+#define REG_STMT_CACHE_SIZE 32
+
+typedef struct {
+    const char* query;
+    sqlite3_stmt* stmt;
+    int in_use;
+    unsigned long used;
+} reg_stmt_slot;
+
+/*
+ * Per-connection cache of prepared statements. Statements are keyed by the
+ * address of their query string, so only queries which live in static storage
+ * should go through `reg_prepare`; anything built with `sqlite3_mprintf` would
+ * just churn the cache.
+ */
+typedef struct reg_stmt_cache {
+    sqlite3* db;
+    reg_stmt_slot slots[REG_STMT_CACHE_SIZE];
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
+    struct reg_stmt_cache* next;
+} reg_stmt_cache;
+
+static reg_stmt_cache* reg_stmt_caches = NULL;
+
+static sqlite3_mutex* reg_stmt_mutex(void) {
+    return sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+}
+
+/*
+ * Finds the cache belonging to `db`, or NULL if it doesn't have one. Only the
+ * list of caches is shared between threads; a cache itself is only ever used
+ * by whoever holds its connection.
+ */
+static reg_stmt_cache* reg_stmt_cache_find(sqlite3* db) {
+    sqlite3_mutex* mutex = reg_stmt_mutex();
+    reg_stmt_cache* cache;
+    sqlite3_mutex_enter(mutex);
+    for (cache = reg_stmt_caches; cache != NULL; cache = cache->next) {
+        if (cache->db == db) {
+            break;
+        }
+    }
+    sqlite3_mutex_leave(mutex);
+    return cache;
+}
+
+/**
+ * Gives `db` a prepared statement cache. Until this is called, `reg_prepare`
+ * on `db` behaves just like `sqlite3_prepare_v2`.
+ */
+void reg_stmt_cache_attach(sqlite3* db) {
+    sqlite3_mutex* mutex;
+    reg_stmt_cache* cache;
+    if (reg_stmt_cache_find(db) != NULL) {
+        return;
+    }
+    cache = calloc(1, sizeof(reg_stmt_cache));
+    if (cache == NULL) {
+        return;
+    }
+    cache->db = db;
+    mutex = reg_stmt_mutex();
+    sqlite3_mutex_enter(mutex);
+    cache->next = reg_stmt_caches;
+    reg_stmt_caches = cache;
+    sqlite3_mutex_leave(mutex);
+}
+
+/**
+ * Finalizes every statement cached for `db` and drops its cache. This must be
+ * called before `db` is closed.
+ */
+void reg_stmt_cache_detach(sqlite3* db) {
+    sqlite3_mutex* mutex = reg_stmt_mutex();
+    reg_stmt_cache** link;
+    reg_stmt_cache* cache = NULL;
+    int i;
+    sqlite3_mutex_enter(mutex);
+    for (link = &reg_stmt_caches; *link != NULL; link = &(*link)->next) {
+        if ((*link)->db == db) {
+            cache = *link;
+            *link = cache->next;
+            break;
+        }
+    }
+    sqlite3_mutex_leave(mutex);
+    if (cache == NULL) {
+        return;
+    }
+    for (i=0; i<REG_STMT_CACHE_SIZE; i++) {
+        if (cache->slots[i].stmt != NULL) {
+            sqlite3_finalize(cache->slots[i].stmt);
+        }
+    }
+    free(cache);
+}
+
+/**
+ * Returns true if `stmt` is owned by its connection's statement cache, in which
+ * case it must be handed back with `reg_finalize` rather than finalized.
+ */
+int reg_stmt_cached(sqlite3_stmt* stmt) {
+    reg_stmt_cache* cache = reg_stmt_cache_find(sqlite3_db_handle(stmt));
+    int i;
+    if (cache != NULL) {
+        for (i=0; i<REG_STMT_CACHE_SIZE; i++) {
+            if (cache->slots[i].stmt == stmt) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reports the hit and miss counts of the statement cache for `db`, and zeroes
+ * them if `reset` is set. Returns 0 if `db` has no cache.
+ */
+int reg_stmt_cache_stats(sqlite3* db, unsigned long* hits,
+        unsigned long* misses, int reset) {
+    reg_stmt_cache* cache = reg_stmt_cache_find(db);
+    if (cache == NULL) {
+        return 0;
+    }
+    *hits = cache->hits;
+    *misses = cache->misses;
+    if (reset) {
+        cache->hits = 0;
+        cache->misses = 0;
+    }
+    return 1;
+}
+
+#ifdef REGISTRY_PROBES
+/*
+ * `sqlite3_step`, reported to the `step` probe.
+ */
+static int reg_step(sqlite3_stmt* stmt) {
+    REG_PROBE_START(start);
+    int r = sqlite3_step(stmt);
+    REG_PROBE3(step, sqlite3_sql(stmt), r, REG_PROBE_SINCE(start));
+    return r;
+}
+#else
+#define reg_step sqlite3_step
+#endif
+
+/**
+ * Prepares `query`, reusing a cached statement for it if `db` has one free.
+ *
+ * `query` must be a string with static storage, since its address is the cache
+ * key. If the statement for `query` is already in use (a caller further up the
+ * stack is still stepping it) a fresh, uncached statement is prepared instead.
+ * Whichever it returns, the statement is released with `reg_finalize`.
+ */
+int reg_prepare(sqlite3* db, const char* query, sqlite3_stmt** stmt) {
+    reg_stmt_cache* cache = reg_stmt_cache_find(db);
+    reg_stmt_slot* victim = NULL;
+    int i, r;
+    REG_PROBE_START(start);
+    if (cache == NULL) {
+        r = sqlite3_prepare_v2(db, query, -1, stmt, NULL);
+        REG_PROBE3(prepare, query, 0, REG_PROBE_SINCE(start));
+        return r;
+    }
+    for (i=0; i<REG_STMT_CACHE_SIZE; i++) {
+        reg_stmt_slot* slot = &cache->slots[i];
+        if (slot->query == query && !slot->in_use) {
+            slot->in_use = 1;
+            slot->used = ++cache->clock;
+            cache->hits++;
+            *stmt = slot->stmt;
+            REG_PROBE3(prepare, query, 1, REG_PROBE_SINCE(start));
+            return SQLITE_OK;
+        }
+        if (!slot->in_use && (victim == NULL || slot->used < victim->used)) {
+            victim = slot;
+        }
+    }
+    cache->misses++;
+    r = sqlite3_prepare_v2(db, query, -1, stmt, NULL);
+    if (r == SQLITE_OK && victim != NULL) {
+        if (victim->stmt != NULL) {
+            sqlite3_finalize(victim->stmt);
+        }
+        victim->query = query;
+        victim->stmt = *stmt;
+        victim->in_use = 1;
+        victim->used = ++cache->clock;
+    }
+    REG_PROBE3(prepare, query, 0, REG_PROBE_SINCE(start));
+    return r;
+}
+
+/**
+ * Releases a statement obtained from `reg_prepare`. Cached statements are reset
+ * and their bindings cleared so the next user finds them fresh; anything else
+ * is finalized. Passing NULL is harmless.
+ */
+void reg_finalize(sqlite3_stmt* stmt) {
+    reg_stmt_cache* cache;
+    int i;
+    if (stmt == NULL) {
+        return;
+    }
+    cache = reg_stmt_cache_find(sqlite3_db_handle(stmt));
+    if (cache != NULL) {
+        for (i=0; i<REG_STMT_CACHE_SIZE; i++) {
+            if (cache->slots[i].stmt == stmt) {
+                sqlite3_reset(stmt);
+                sqlite3_clear_bindings(stmt);
+                cache->slots[i].in_use = 0;
+                return;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+/*
+ * Writes that take more than one statement run inside a savepoint, so one that
+ * fails partway, or is aborted by a progress handler, leaves nothing behind.
+ * Savepoints nest, so this works the same whether or not the caller already has
+ * a transaction open.
+ */
+static int reg_savepoint(sqlite3* db, reg_error* errPtr) {
+    sqlite3_stmt* stmt;
+    char* query = "SAVEPOINT registry_op";
+    int ok = (reg_prepare(db, query, &stmt) == SQLITE_OK)
+        && (reg_step(stmt) == SQLITE_DONE);
+    if (!ok) {
+        reg_sqlite_error(db, errPtr, query);
+    }
+    reg_finalize(stmt);
+    return ok;
+}
+
+/*
+ * Closes the savepoint opened by `reg_savepoint`, first rolling back to it
+ * unless `ok`. An interrupted write makes sqlite roll back the whole
+ * transaction by itself, savepoint included, so there may be nothing left to
+ * undo. Returns `ok`.
+ */
+static int reg_release(sqlite3* db, int ok) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_get_autocommit(db)) {
+        return ok;
+    }
+    if (!ok) {
+        if (reg_prepare(db, "ROLLBACK TO registry_op", &stmt) == SQLITE_OK) {
+            reg_step(stmt);
+        }
+        reg_finalize(stmt);
+    }
+    if (reg_prepare(db, "RELEASE registry_op", &stmt) == SQLITE_OK) {
+        reg_step(stmt);
+    }
+    reg_finalize(stmt);
+    return ok;
+}
+
 /**
  * registry::entry create portname version revision variants epoch ?name?
  *
@@ -133,7 +488,7 @@ reg_entry* reg_entry_create(sqlite3* db, char* name, char* version,
     sqlite3_stmt* stmt;
     char* query = "INSERT INTO registry.ports "
         "(name, version, revision, variants, epoch) VALUES (?, ?, ?, ?, ?)";
-    if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    if ((reg_prepare(db, query, &stmt) == SQLITE_OK)
             && (sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC)
                 == SQLITE_OK)
             && (sqlite3_bind_text(stmt, 2, version, -1, SQLITE_STATIC)
@@ -144,59 +499,68 @@ reg_entry* reg_entry_create(sqlite3* db, char* name, char* version,
                 == SQLITE_OK)
             && (sqlite3_bind_text(stmt, 5, epoch, -1, SQLITE_STATIC)
                 == SQLITE_OK)
-            && (sqlite3_step(stmt) == SQLITE_DONE)) {
+            && (reg_step(stmt) == SQLITE_DONE)) {
         sqlite_int64 rowid = sqlite3_last_insert_rowid(db);
         reg_entry* entry = malloc(sizeof(reg_entry));
         entry->rowid = rowid;
         entry->db = db;
-        sqlite3_finalize(stmt);
+        reg_finalize(stmt);
         return entry;
     } else {
         reg_sqlite_error(db, errPtr, query);
-        sqlite3_finalize(stmt);
+        reg_finalize(stmt);
         return NULL;
     }
 }
 
-/**
- * returns the number actually deleted
- */
-int reg_entry_delete(sqlite3* db, reg_entry** entries, int entry_count,
-        reg_error* errPtr) {
+static int reg_delete_entries(sqlite3* db, reg_entry** entries,
+        int entry_count, reg_error* errPtr) {
     sqlite3_stmt* stmt;
-    /* BEGIN */
     char* query = "DELETE FROM registry.ports WHERE rowid=?";
-    if (sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK) {
+    if (reg_prepare(db, query, &stmt) == SQLITE_OK) {
         int i;
         for (i=0; i<entry_count; i++) {
             if ((sqlite3_bind_int64(stmt, 1, entries[i]->rowid) == SQLITE_OK)
-                    && (sqlite3_step(stmt) == SQLITE_DONE)) {
+                    && (reg_step(stmt) == SQLITE_DONE)) {
                 if (sqlite3_changes(db) == 0) {
                     errPtr->code = "registry::invalid-entry";
                     errPtr->description = "an invalid entry was passed";
                     errPtr->free = NULL;
-                    reg_entry_free(db, entries, i);
-                    /* COMMIT */
+                    reg_finalize(stmt);
                     return i;
                 }
             } else {
                 reg_sqlite_error(db, errPtr, query);
-                reg_entry_free(db, entries, i);
-                /* COMMIT */
+                reg_finalize(stmt);
                 return i;
             }
             sqlite3_reset(stmt);
         }
-        reg_entry_free(db, entries, entry_count);
-        /* COMMIT */
+        reg_finalize(stmt);
         return entry_count;
     } else {
         reg_sqlite_error(db, errPtr, query);
-        /* ROLLBACK */
         return 0;
     }
 }
 
+/**
+ * Deletes `entries` from the registry and returns the number actually deleted.
+ *
+ * Either every entry is deleted, or (on error) none are. The entries themselves
+ * are not freed; they belong to the caller, who may still need their rowids to
+ * clean up after them.
+ */
+int reg_entry_delete(sqlite3* db, reg_entry** entries, int entry_count,
+        reg_error* errPtr) {
+    int result;
+    if (!reg_savepoint(db, errPtr)) {
+        return 0;
+    }
+    result = reg_delete_entries(db, entries, entry_count, errPtr);
+    return reg_release(db, result == entry_count) ? result : 0;
+}
+
 /*
  * Frees the entries in `entries`.
  */
@@ -207,101 +571,154 @@ void reg_entry_free(sqlite3* db UNUSED, reg_entry** entries, int entry_count) {
     }
 }
 
-static int reg_stmt_to_entry(void* userdata, void** entry, void* stmt,
-        reg_error* errPtr UNUSED) {
-    reg_entry* e = malloc(sizeof(reg_entry));
-    e->db = (sqlite3*)userdata;
-    e->rowid = sqlite3_column_int64(stmt, 0);
-    *entry = e;
-    return 1;
-}
-
-static int reg_all_objects(sqlite3* db, char* query, int query_len,
-        void*** objects, cast_function* fn, free_function* del,
-        reg_error* errPtr) {
+/**
+ * Collects the entries whose rowids are returned by `query`.
+ *
+ * The entries and the list holding them are all allocated from `arena`, so the
+ * caller releases the whole result set with a single `reg_arena_free`.
+ */
+static int reg_all_entries(sqlite3* db, char* query, int query_len,
+        reg_entry*** objects, reg_arena* arena, reg_error* errPtr) {
     int r = SQLITE_ROW;
-    reg_entry* entry;
-    void** results = malloc(10*sizeof(void*));
+    void** results = reg_arena_alloc(arena, 16*sizeof(void*));
     int result_count = 0;
-    int result_space = 10;
+    int result_space = 16;
     sqlite3_stmt* stmt;
-    if (sqlite3_prepare(db, query, query_len, &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, query, query_len, &stmt, NULL) == SQLITE_OK) {
         while (r != SQLITE_DONE) {
-            r = sqlite3_step(stmt);
+            reg_entry* entry;
+            r = reg_step(stmt);
             switch (r) {
                 case SQLITE_ROW:
-                    if (fn(db, (void**)&entry, stmt, errPtr)) {
-                        reg_listcat(&results, &result_count, &result_space,
-                                entry);
-                        continue;
-                    } else {
-                        del(NULL, results, result_count);
-                        free(results);
-                        sqlite3_finalize(stmt);
-                        return -1;
+                    entry = reg_arena_alloc(arena, sizeof(reg_entry));
+                    if (entry != NULL) {
+                        entry->db = db;
+                        entry->rowid = sqlite3_column_int64(stmt, 0);
+                        if (reg_listcat(arena, &results, &result_count,
+                                    &result_space, entry)) {
+                            continue;
+                        }
                     }
+                    errPtr->code = "registry::no-memory";
+                    errPtr->description = "out of memory";
+                    errPtr->free = NULL;
+                    sqlite3_finalize(stmt);
+                    return -1;
                 case SQLITE_DONE:
                     break;
                 default:
-                    del(NULL, results, result_count);
-                    free(results);
-                    sqlite3_reset(stmt);
                     reg_sqlite_error(db, errPtr, query);
+                    sqlite3_finalize(stmt);
                     return -1;
             }
         }
-        *objects = results;
+        sqlite3_finalize(stmt);
+        *objects = (reg_entry**)results;
         return result_count;
     } else {
         reg_sqlite_error(db, errPtr, query);
-        free(results);
         return -1;
     }
 }
 
 /*
- * Searches the registry for ports for which each key's value is equal to the
- * given value. To find all ports, pass 0 key-value pairs.
- *
- * Vulnerable to SQL-injection attacks in the `keys` field. Pass it valid keys,
- * please.
+ * Builds the query behind `reg_entry_search`. The caller frees it with `free`.
  */
-int reg_entry_search(sqlite3* db, char** keys, char** vals, int key_count,
-        int strategy, reg_entry*** entries, reg_error* errPtr) {
+static char* reg_search_query(char** keys, char** vals, int key_count,
+        int strategy, int* query_len, reg_error* errPtr) {
     int i;
     char* kwd = " WHERE ";
     char* query;
-    int query_len = 0;
     int query_space = 32;
-    int result;
     /* get the strategy */
     char* op = reg_strategy_op(strategy, errPtr);
     if (op == NULL) {
-        return -1;
+        return NULL;
     }
+    *query_len = 0;
     query = malloc(33);
-    reg_strcat(&query, &query_len, &query_space,
+    reg_strcat(&query, query_len, &query_space,
             "SELECT rowid FROM registry.ports");
     /* build the query */
     for (i=0; i<key_count; i+=1) {
         char* cond = sqlite3_mprintf("%s%s%s'%q'", kwd, keys[i], op, vals[i]);
-        reg_strcat(&query, &query_len, &query_space, cond);
+        reg_strcat(&query, query_len, &query_space, cond);
         sqlite3_free(cond);
         kwd = " AND ";
     }
+    return query;
+}
+
+/*
+ * Searches the registry for ports for which each key's value is equal to the
+ * given value. To find all ports, pass 0 key-value pairs.
+ *
+ * Vulnerable to SQL-injection attacks in the `keys` field. Pass it valid keys,
+ * please.
+ */
+int reg_entry_search(sqlite3* db, char** keys, char** vals, int key_count,
+        int strategy, reg_entry*** entries, reg_arena* arena,
+        reg_error* errPtr) {
+    int query_len;
+    int result;
+    char* query = reg_search_query(keys, vals, key_count, strategy, &query_len,
+            errPtr);
+    if (query == NULL) {
+        return -1;
+    }
     /* do the query */
-    result = reg_all_objects(db, query, query_len, (void***)entries,
-            reg_stmt_to_entry, (free_function*)reg_entry_free, errPtr);
+    result = reg_all_entries(db, query, query_len, entries, arena, errPtr);
     free(query);
     return result;
 }
 
+/**
+ * Like `reg_entry_search`, but hands each match to `visitor` as it is found
+ * instead of collecting them, so the caller can stream a large result or stop
+ * partway. If the visitor returns 0 it must have set `errPtr`. Returns the
+ * number of entries visited, or -1 on error.
+ */
+int reg_entry_search_visit(sqlite3* db, char** keys, char** vals,
+        int key_count, int strategy, reg_entry_visitor* visitor,
+        void* userdata, reg_error* errPtr) {
+    int query_len;
+    int row = 0;
+    sqlite3_stmt* stmt;
+    char* query = reg_search_query(keys, vals, key_count, strategy, &query_len,
+            errPtr);
+    if (query == NULL) {
+        return -1;
+    }
+    if (sqlite3_prepare_v2(db, query, query_len, &stmt, NULL) == SQLITE_OK) {
+        while (1) {
+            int r = reg_step(stmt);
+            if (r == SQLITE_ROW) {
+                if (visitor(userdata, sqlite3_column_int64(stmt, 0), errPtr)) {
+                    row++;
+                    continue;
+                }
+                row = -1;
+            } else if (r != SQLITE_DONE) {
+                reg_sqlite_error(db, errPtr, query);
+                row = -1;
+            }
+            break;
+        }
+    } else {
+        reg_sqlite_error(db, errPtr, query);
+        row = -1;
+    }
+    sqlite3_finalize(stmt);
+    free(query);
+    return row;
+}
+
 /**
  * TODO: fix this to return ports where state=active too
  * TODO: add more arguments (epoch, revision, variants), maybe
  */
 int reg_entry_installed(sqlite3* db, char* name, char* version, 
-        reg_entry*** entries, reg_error* errPtr) {
+        reg_entry*** entries, reg_arena* arena, reg_error* errPtr) {
     char* keys[] = { "state", "name", "version" };
     char* values[] = { "installed", NULL, NULL };
     int key_count;
@@ -316,13 +733,14 @@ int reg_entry_installed(sqlite3* db, char* name, char* version,
             values[2] = version;
         }
     }
-    return reg_entry_search(db, keys, values, 0, key_count, entries, errPtr);
+    return reg_entry_search(db, keys, values, key_count, 0, entries, arena,
+            errPtr);
 }
 
 /**
  */
 int reg_entry_active(sqlite3* db, char* name, char* version, 
-        reg_entry*** entries, reg_error* errPtr) {
+        reg_entry*** entries, reg_arena* arena, reg_error* errPtr) {
     char* keys[] = { "state", "name", "version" };
     char* values[] = { "active", NULL, NULL };
     int key_count;
@@ -337,7 +755,8 @@ int reg_entry_active(sqlite3* db, char* name, char* version,
             values[2] = version;
         }
     }
-    return reg_entry_search(db, keys, values, 0, key_count, entries, errPtr);
+    return reg_entry_search(db, keys, values, key_count, 0, entries, arena,
+            errPtr);
 }
 
 int reg_entry_owner(sqlite3* db, char* path, reg_entry** entry,
@@ -345,30 +764,36 @@ int reg_entry_owner(sqlite3* db, char* path, reg_entry** entry,
     sqlite3_stmt* stmt;
     reg_entry* result;
     char* query = "SELECT port_id FROM files WHERE path=?";
-    if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    REG_PROBE_START(start);
+    if ((reg_prepare(db, query, &stmt) == SQLITE_OK)
             && (sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC)
                 == SQLITE_OK)) {
-        int r = sqlite3_step(stmt);
+        int r = reg_step(stmt);
         switch (r) {
             case SQLITE_ROW:
                 result = malloc(sizeof(reg_entry));
                 result->rowid = sqlite3_column_int64(stmt, 0);
                 result->db = db;
-                sqlite3_finalize(stmt);
+                reg_finalize(stmt);
                 *entry = result;
+                REG_PROBE3(owner, path, result->rowid,
+                        REG_PROBE_SINCE(start));
                 return 1;
             case SQLITE_DONE:
-                sqlite3_finalize(stmt);
+                reg_finalize(stmt);
                 *entry = NULL;
+                REG_PROBE3(owner, path, 0, REG_PROBE_SINCE(start));
                 return 1;
             default:
-                /* barf */
-                sqlite3_finalize(stmt);
+                reg_sqlite_error(db, errPtr, query);
+                reg_finalize(stmt);
+                REG_PROBE3(owner, path, -1, REG_PROBE_SINCE(start));
                 return 0;
         }
     } else {
         reg_sqlite_error(db, errPtr, query);
-        sqlite3_finalize(stmt);
+        reg_finalize(stmt);
+        REG_PROBE3(owner, path, -1, REG_PROBE_SINCE(start));
         return 0;
     }
 }
@@ -376,10 +801,11 @@ int reg_entry_owner(sqlite3* db, char* path, reg_entry** entry,
 int reg_entry_propget(sqlite3* db, reg_entry* entry, char* key, char** value,
         reg_error* errPtr) {
     sqlite3_stmt* stmt;
-    char* query = sqlite3_mprintf("SELECT `%q` FROM registry.entries "
+    int result = 0;
+    char* query = sqlite3_mprintf("SELECT `%q` FROM registry.ports "
             "WHERE rowid=%lld", key, entry->rowid);
-    if (sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK) {
-        int r = sqlite3_step(stmt);
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK) {
+        int r = reg_step(stmt);
         const char* column;
         int len;
         switch (r) {
@@ -387,121 +813,134 @@ int reg_entry_propget(sqlite3* db, reg_entry* entry, char* key, char** value,
                 column = sqlite3_column_text(stmt, 0);
                 len = sqlite3_column_bytes(stmt, 0);
                 *value = malloc(1 + len);
-                strcpy(*value, column);
-                sqlite3_finalize(stmt);
-                return 1;
+                memcpy(*value, column, len);
+                (*value)[len] = '\0';
+                result = 1;
+                break;
             case SQLITE_DONE:
                 errPtr->code = "registry::invalid-entry";
                 errPtr->description = "an invalid entry was passed";
                 errPtr->free = NULL;
-                sqlite3_finalize(stmt);
-                return 0;
+                break;
             default:
                 reg_sqlite_error(db, errPtr, query);
-                sqlite3_finalize(stmt);
-                return 0;
+                break;
         }
     } else {
         reg_sqlite_error(db, errPtr, query);
-        return 0;
     }
+    sqlite3_finalize(stmt);
+    sqlite3_free(query);
+    return result;
 }
 
 int reg_entry_propset(sqlite3* db, reg_entry* entry, char* key, char* value,
         reg_error* errPtr) {
     sqlite3_stmt* stmt;
-    char* query = sqlite3_mprintf("UPDATE registry.entries SET `%q` = '%q' "
+    int result = 0;
+    char* query = sqlite3_mprintf("UPDATE registry.ports SET `%q` = '%q' "
             "WHERE rowid=%lld", key, value, entry->rowid);
-    if (sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK) {
-        int r = sqlite3_step(stmt);
-        switch (r) {
-            case SQLITE_DONE:
-                sqlite3_finalize(stmt);
-                return 1;
-            default:
-                switch (sqlite3_reset(stmt)) {
-                    case SQLITE_CONSTRAINT:
-                        errPtr->code = "registry::constraint";
-                        errPtr->description = "a constraint was disobeyed";
-                        errPtr->free = NULL;
-                        sqlite3_finalize(stmt);
-                        return 0;
-                    default:
-                        reg_sqlite_error(db, errPtr, query);
-                        sqlite3_finalize(stmt);
-                        return 0;
-                }
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK) {
+        if (reg_step(stmt) == SQLITE_DONE) {
+            result = 1;
+        } else if (sqlite3_reset(stmt) == SQLITE_CONSTRAINT) {
+            errPtr->code = "registry::constraint";
+            errPtr->description = "a constraint was disobeyed";
+            errPtr->free = NULL;
+        } else {
+            reg_sqlite_error(db, errPtr, query);
         }
     } else {
         reg_sqlite_error(db, errPtr, query);
-        return 0;
     }
+    sqlite3_finalize(stmt);
+    sqlite3_free(query);
+    return result;
 }
 
-int reg_entry_map(sqlite3* db, reg_entry* entry, char** files, int file_count,
-        reg_error* errPtr) {
+static int reg_map_files(sqlite3* db, reg_entry* entry, char** files,
+        int file_count, reg_error* errPtr) {
     sqlite3_stmt* stmt;
     char* query = "INSERT INTO registry.files (port_id, path) VALUES (?, ?)";
-    if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    if ((reg_prepare(db, query, &stmt) == SQLITE_OK)
             && (sqlite3_bind_int64(stmt, 1, entry->rowid) == SQLITE_OK)) {
         int i;
         for (i=0; i<file_count; i++) {
             if (sqlite3_bind_text(stmt, 2, files[i], -1, SQLITE_STATIC)
                     == SQLITE_OK) {
-                int r = sqlite3_step(stmt);
+                int r = reg_step(stmt);
                 switch (r) {
                     case SQLITE_DONE:
                         sqlite3_reset(stmt);
                         continue;
-                    case SQLITE_ERROR:
+                    default:
                         switch (sqlite3_reset(stmt)) {
                             case SQLITE_CONSTRAINT:
                                 errPtr->code = "registry::already-owned";
                                 errPtr->description = "mapped file is already "
                                     "owned by another entry";
                                 errPtr->free = NULL;
-                                sqlite3_finalize(stmt);
+                                reg_finalize(stmt);
                                 return i;
                             default:
                                 reg_sqlite_error(db, errPtr, query);
-                                sqlite3_finalize(stmt);
+                                reg_finalize(stmt);
                                 return i;
                         }
                 }
             } else {
                 reg_sqlite_error(db, errPtr, query);
-                sqlite3_finalize(stmt);
+                reg_finalize(stmt);
                 return i;
             }
         }
-        sqlite3_finalize(stmt);
+        reg_finalize(stmt);
         return file_count;
     } else {
         reg_sqlite_error(db, errPtr, query);
-        sqlite3_finalize(stmt);
+        reg_finalize(stmt);
         return 0;
     }
 }
 
-int reg_entry_unmap(sqlite3* db, reg_entry* entry, char** files, int file_count,
+/**
+ * Maps `files` to `entry`. Either all of them are, and `file_count` is
+ * returned, or (on error) none are and 0 is.
+ */
+int reg_entry_map(sqlite3* db, reg_entry* entry, char** files, int file_count,
         reg_error* errPtr) {
+    int result;
+    REG_PROBE_START(start);
+    if (!reg_savepoint(db, errPtr)) {
+        return 0;
+    }
+    result = reg_map_files(db, entry, files, file_count, errPtr);
+    if (!reg_release(db, result == file_count)) {
+        result = 0;
+    }
+    REG_PROBE4(map, entry->rowid, file_count, result, REG_PROBE_SINCE(start));
+    return result;
+}
+
+static int reg_unmap_files(sqlite3* db, reg_entry* entry, char** files,
+        int file_count, reg_error* errPtr) {
     sqlite3_stmt* stmt;
     char* query = "DELETE FROM registry.files WHERE port_id=? AND path=?";
-    if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    if ((reg_prepare(db, query, &stmt) == SQLITE_OK)
             && (sqlite3_bind_int64(stmt, 1, entry->rowid) == SQLITE_OK)) {
         int i;
         for (i=0; i<file_count; i++) {
             if (sqlite3_bind_text(stmt, 2, files[i], -1, SQLITE_STATIC)
                     == SQLITE_OK) {
-                int r = sqlite3_step(stmt);
+                int r = reg_step(stmt);
                 switch (r) {
                     case SQLITE_DONE:
                         if (sqlite3_changes(db) == 0) {
                             errPtr->code = "registry::not-owned";
-                            errPtr->code = "this entry does not own the given "
-                                "file";
+                            errPtr->description = "this entry does not own "
+                                "the given file";
                             errPtr->free = NULL;
-                            sqlite3_finalize(stmt);
+                            reg_finalize(stmt);
                             return i;
                         } else {
                             sqlite3_reset(stmt);
@@ -509,66 +948,145 @@ int reg_entry_unmap(sqlite3* db, reg_entry* entry, char** files, int file_count,
                         }
                     default:
                         reg_sqlite_error(db, errPtr, query);
-                        sqlite3_finalize(stmt);
+                        reg_finalize(stmt);
                         return i;
                 }
             } else {
                 reg_sqlite_error(db, errPtr, query);
-                sqlite3_finalize(stmt);
+                reg_finalize(stmt);
                 return i;
             }
         }
-        sqlite3_finalize(stmt);
+        reg_finalize(stmt);
         return file_count;
     } else {
         reg_sqlite_error(db, errPtr, query);
-        sqlite3_finalize(stmt);
+        reg_finalize(stmt);
         return 0;
     }
 }
 
-int reg_entry_files(sqlite3* db, reg_entry* entry, char*** files,
+/**
+ * Unmaps `files` from `entry`. Either all of them are, and `file_count` is
+ * returned, or (on error) none are and 0 is.
+ */
+int reg_entry_unmap(sqlite3* db, reg_entry* entry, char** files, int file_count,
         reg_error* errPtr) {
+    int result;
+    REG_PROBE_START(start);
+    if (!reg_savepoint(db, errPtr)) {
+        return 0;
+    }
+    result = reg_unmap_files(db, entry, files, file_count, errPtr);
+    if (!reg_release(db, result == file_count)) {
+        result = 0;
+    }
+    REG_PROBE4(unmap, entry->rowid, file_count, result, REG_PROBE_SINCE(start));
+    return result;
+}
+
+/**
+ * Returns the number of files mapped to `entry`, or -1 on error.
+ *
+ * This is answered from the `file_port` index alone, so it is much cheaper than
+ * listing the files; callers use it to size their result storage up front.
+ */
+int reg_entry_file_count(sqlite3* db, reg_entry* entry, reg_error* errPtr) {
+    sqlite3_stmt* stmt;
+    char* query = "SELECT COUNT(*) FROM files WHERE port_id=?";
+    if ((reg_prepare(db, query, &stmt) == SQLITE_OK)
+            && (sqlite3_bind_int64(stmt, 1, entry->rowid) == SQLITE_OK)
+            && (reg_step(stmt) == SQLITE_ROW)) {
+        int count = sqlite3_column_int(stmt, 0);
+        reg_finalize(stmt);
+        return count;
+    } else {
+        reg_sqlite_error(db, errPtr, query);
+        reg_finalize(stmt);
+        return -1;
+    }
+}
+
+/**
+ * Calls `visitor` once for each file mapped to `entry`.
+ *
+ * The visitor receives the path straight from `sqlite3_column_text`; it is only
+ * valid for the duration of the call, so the visitor must copy whatever it
+ * wants to keep. If the visitor returns 0 it must have set `errPtr`, and the
+ * walk stops there. Returns the number of files visited, or -1 on error.
+ */
+int reg_entry_files_visit(sqlite3* db, reg_entry* entry,
+        reg_row_visitor* visitor, void* userdata, reg_error* errPtr) {
     sqlite3_stmt* stmt;
     char* query = "SELECT path FROM files WHERE port_id=?";
-    if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    if ((reg_prepare(db, query, &stmt) == SQLITE_OK)
             && (sqlite3_bind_int64(stmt, 1, entry->rowid) == SQLITE_OK)) {
-        char** result = malloc(10*sizeof(char*));
-        int result_count = 0;
-        int result_space = 10;
+        int row = 0;
         while (1) {
-            char* element;
-            const char* column;
-            int len, i, r;
-            r = sqlite3_step(stmt);
+            int r = reg_step(stmt);
             switch (r) {
                 case SQLITE_ROW:
-                    column = sqlite3_column_text(stmt, 0);
-                    len = sqlite3_column_bytes(stmt, 0);
-                    element = malloc(1+len);
-                    memcpy(element, column, len+1);
-                    reg_listcat((void*)&result, &result_count, &result_space,
-                            element);
-                    continue;
+                    if (visitor(userdata, row,
+                                (const char*)sqlite3_column_text(stmt, 0),
+                                sqlite3_column_bytes(stmt, 0), errPtr)) {
+                        row++;
+                        continue;
+                    }
+                    reg_finalize(stmt);
+                    return -1;
                 case SQLITE_DONE:
-                    break;
+                    reg_finalize(stmt);
+                    return row;
                 default:
-                    for (i=0; i<result_count; i++) {
-                        free(result[i]);
-                    }
-                    free(result);
                     reg_sqlite_error(db, errPtr, query);
-                    sqlite3_finalize(stmt);
+                    reg_finalize(stmt);
                     return -1;
             }
         }
-        sqlite3_finalize(stmt);
-        *files = result;
-        return result_count;
     } else {
         reg_sqlite_error(db, errPtr, query);
-        sqlite3_finalize(stmt);
+        reg_finalize(stmt);
         return -1;
     }
 }
 
+typedef struct {
+    reg_arena* arena;
+    void** list;
+    int count;
+    int space;
+} reg_file_list;
+
+static int reg_file_to_arena(void* userdata, int row UNUSED, const char* value,
+        int len, reg_error* errPtr) {
+    reg_file_list* files = (reg_file_list*)userdata;
+    char* element = reg_arena_strdup(files->arena, value, len);
+    if (element == NULL || !reg_listcat(files->arena, &files->list,
+                &files->count, &files->space, element)) {
+        errPtr->code = "registry::no-memory";
+        errPtr->description = "out of memory";
+        errPtr->free = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Lists the files mapped to `entry`.
+ *
+ * The list and every path in it are allocated from `arena`.
+ */
+int reg_entry_files(sqlite3* db, reg_entry* entry, char*** files,
+        reg_arena* arena, reg_error* errPtr) {
+    reg_file_list list;
+    list.arena = arena;
+    list.list = reg_arena_alloc(arena, 16*sizeof(char*));
+    list.count = 0;
+    list.space = 16;
+    if (reg_entry_files_visit(db, entry, reg_file_to_arena, &list, errPtr)
+            < 0) {
+        return -1;
+    }
+    *files = (char**)list.list;
+    return list.count;
+}
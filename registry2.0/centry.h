@@ -25,11 +25,14 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#ifndef _CENTRY_H
+#define _CENTRY_H
 
 #if HAVE_CONFIG_H
 #include <config.h>
 #endif
 
+#include <stddef.h>
 #include <sqlite3.h>
 
 typedef void reg_error_destructor(char* description);
@@ -45,11 +48,42 @@ typedef struct {
     sqlite3* db;
 } reg_entry;
 
+typedef struct reg_arena_block reg_arena_block;
+
+/*
+ * A bump allocator for result sets. Everything allocated from an arena is
+ * released at once by `reg_arena_free`; individual allocations are never
+ * freed.
+ */
+typedef struct {
+    reg_arena_block* blocks;
+    size_t block_size;
+    int block_count;
+} reg_arena;
+
 typedef int (cast_function)(void* userdata, void** dst, void* src,
         reg_error* errPtr);
 typedef void (free_function)(void* userdata, void** list, int count);
+typedef int (reg_entry_visitor)(void* userdata, sqlite_int64 rowid,
+        reg_error* errPtr);
+typedef int (reg_row_visitor)(void* userdata, int row, const char* value,
+        int len, reg_error* errPtr);
 
 void reg_error_destruct(reg_error* errPtr);
+void reg_sqlite_error(sqlite3* db, reg_error* errPtr, char* query);
+
+void reg_stmt_cache_attach(sqlite3* db);
+void reg_stmt_cache_detach(sqlite3* db);
+int reg_stmt_cached(sqlite3_stmt* stmt);
+int reg_stmt_cache_stats(sqlite3* db, unsigned long* hits,
+        unsigned long* misses, int reset);
+int reg_prepare(sqlite3* db, const char* query, sqlite3_stmt** stmt);
+void reg_finalize(sqlite3_stmt* stmt);
+
+void reg_arena_init(reg_arena* arena, size_t block_size);
+void* reg_arena_alloc(reg_arena* arena, size_t size);
+char* reg_arena_strdup(reg_arena* arena, const char* src, int len);
+void reg_arena_free(reg_arena* arena);
 
 reg_entry* reg_entry_create(sqlite3* db, char* name, char* version,
         char* revision, char* variants, char* epoch, reg_error* errPtr);
@@ -60,13 +94,38 @@ int reg_entry_delete(sqlite3* db, reg_entry** entries, int entry_count,
 void reg_entry_free(sqlite3* db, reg_entry** entries, int entry_count);
 
 int reg_entry_search(sqlite3* db, char** keys, char** vals, int key_count,
-        int strategy, reg_entry*** entries, reg_error* errPtr);
+        int strategy, reg_entry*** entries, reg_arena* arena,
+        reg_error* errPtr);
+
+int reg_entry_search_visit(sqlite3* db, char** keys, char** vals,
+        int key_count, int strategy, reg_entry_visitor* visitor,
+        void* userdata, reg_error* errPtr);
 
 int reg_entry_installed(sqlite3* db, char* name, char* version, 
-        reg_entry*** entries, reg_error* errPtr);
+        reg_entry*** entries, reg_arena* arena, reg_error* errPtr);
 
 int reg_entry_active(sqlite3* db, char* name, char* version, 
-        reg_entry*** entries, reg_error* errPtr);
+        reg_entry*** entries, reg_arena* arena, reg_error* errPtr);
 
 int reg_entry_owner(sqlite3* db, char* path, reg_entry** entry,
         reg_error* errPtr);
+
+int reg_entry_propget(sqlite3* db, reg_entry* entry, char* key, char** value,
+        reg_error* errPtr);
+int reg_entry_propset(sqlite3* db, reg_entry* entry, char* key, char* value,
+        reg_error* errPtr);
+
+int reg_entry_map(sqlite3* db, reg_entry* entry, char** files, int file_count,
+        reg_error* errPtr);
+int reg_entry_unmap(sqlite3* db, reg_entry* entry, char** files, int file_count,
+        reg_error* errPtr);
+
+int reg_entry_files(sqlite3* db, reg_entry* entry, char*** files,
+        reg_arena* arena, reg_error* errPtr);
+
+int reg_entry_file_count(sqlite3* db, reg_entry* entry, reg_error* errPtr);
+
+int reg_entry_files_visit(sqlite3* db, reg_entry* entry,
+        reg_row_visitor* visitor, void* userdata, reg_error* errPtr);
+
+#endif /* _CENTRY_H */
@@ -0,0 +1,258 @@
+/*
+ * changes.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "changes.h"
+
+/*
+ * Change tracking.
+ *
+ * Anything an interp caches about the registry is stale as soon as the
+ * registry changes, whether the interp changed it or another connection did,
+ * in this process or another. Caches register a listener with
+ * `changes_listen` and are told about both:
+ *
+ * - Rows the interp's own connection inserts, updates or deletes are reported
+ *   one by one, with the table and rowid, from a sqlite update hook. The hook
+ *   runs in the middle of the statement making the change, so listeners must
+ *   not use the registry. A change that is later rolled back is still
+ *   reported; forgetting too much is harmless. Rows of `files` are reported by
+ *   their own rowid, not their port's, so per-entry caches of file lists
+ *   should treat any change to `files` as affecting them all.
+ * - Changes committed by any other connection (another interp, the
+ *   background writer, an async job or another process) bump the connection's
+ *   `PRAGMA data_version`. `changes_check` compares it with the last value
+ *   seen at the start of each registry command, and if it moved reports
+ *   CHANGE_UNKNOWN for every table, since sqlite doesn't say what changed.
+ *
+ * Leasing a connection and giving it back also report CHANGE_UNKNOWN, as the
+ * data_version of one connection says nothing about another's.
+ */
+
+typedef struct change_entry change_entry;
+
+struct change_entry {
+    change_listener* listener;
+    ClientData clientData;
+    change_entry* next;
+};
+
+typedef struct {
+    sqlite3* db;
+    sqlite_int64 data_version;
+    change_entry* listeners;
+    unsigned long ports;
+    unsigned long files;
+    unsigned long remote;
+} change_state;
+
+static void changes_notify(change_state* state, int tables, int op,
+        sqlite_int64 rowid) {
+    change_entry* entry = state->listeners;
+    while (entry != NULL) {
+        /* a listener may unlisten itself */
+        change_entry* next = entry->next;
+        entry->listener(entry->clientData, tables, op, rowid);
+        entry = next;
+    }
+}
+
+static void delete_changes(ClientData clientData, Tcl_Interp* interp UNUSED) {
+    change_state* state = (change_state*)clientData;
+    while (state->listeners != NULL) {
+        change_entry* next = state->listeners->next;
+        ckfree((char*)state->listeners);
+        state->listeners = next;
+    }
+    if (state->db != NULL) {
+        sqlite3_update_hook(state->db, NULL, NULL);
+    }
+    ckfree((char*)state);
+}
+
+static change_state* get_changes(Tcl_Interp* interp) {
+    change_state* state = Tcl_GetAssocData(interp, "registry::changes", NULL);
+    if (state == NULL) {
+        state = (change_state*)ckalloc(sizeof(change_state));
+        memset(state, 0, sizeof(change_state));
+        Tcl_SetAssocData(interp, "registry::changes", delete_changes, state);
+    }
+    return state;
+}
+
+static void change_hook(void* userdata, int op, const char* dbname,
+        const char* table, sqlite_int64 rowid) {
+    change_state* state = (change_state*)userdata;
+    if (strcmp(dbname, "registry") != 0) {
+        return;
+    }
+    if (strcmp(table, "ports") == 0) {
+        state->ports++;
+        changes_notify(state, CHANGE_PORTS, op, rowid);
+    } else if (strcmp(table, "files") == 0) {
+        state->files++;
+        changes_notify(state, CHANGE_FILES, op, rowid);
+    }
+}
+
+/*
+ * Reads the connection's data_version, which changes whenever another
+ * connection commits to the registry. Returns -1 if it can't be read.
+ */
+static sqlite_int64 data_version(sqlite3* db) {
+    static const char* query = "PRAGMA registry.data_version";
+    sqlite3_stmt* stmt;
+    sqlite_int64 version = -1;
+    if (reg_prepare(db, query, &stmt) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            version = sqlite3_column_int64(stmt, 0);
+        }
+        reg_finalize(stmt);
+    }
+    return version;
+}
+
+/**
+ * Adds `listener` to those told about changes to the interp's registry.
+ */
+void changes_listen(Tcl_Interp* interp, change_listener* listener,
+        ClientData clientData) {
+    change_state* state = get_changes(interp);
+    change_entry* entry = (change_entry*)ckalloc(sizeof(change_entry));
+    entry->listener = listener;
+    entry->clientData = clientData;
+    entry->next = state->listeners;
+    state->listeners = entry;
+}
+
+/**
+ * Removes a listener added by `changes_listen`. Safe to call while the interp
+ * is being deleted.
+ */
+void changes_unlisten(Tcl_Interp* interp, change_listener* listener,
+        ClientData clientData) {
+    change_state* state = Tcl_GetAssocData(interp, "registry::changes", NULL);
+    change_entry** link;
+    if (state == NULL) {
+        return;
+    }
+    for (link = &state->listeners; *link != NULL; link = &(*link)->next) {
+        if ((*link)->listener == listener
+                && (*link)->clientData == clientData) {
+            change_entry* entry = *link;
+            *link = entry->next;
+            ckfree((char*)entry);
+            return;
+        }
+    }
+}
+
+/**
+ * Starts tracking changes made through `db`, newly leased by the interp.
+ */
+void changes_attach(Tcl_Interp* interp, sqlite3* db) {
+    change_state* state = get_changes(interp);
+    state->db = db;
+    state->data_version = data_version(db);
+    sqlite3_update_hook(db, change_hook, state);
+    changes_notify(state, CHANGE_ALL, CHANGE_UNKNOWN, 0);
+}
+
+/**
+ * Stops tracking changes made through `db`, which the interp is giving back.
+ * Safe to call while the interp is being deleted.
+ */
+void changes_detach(Tcl_Interp* interp, sqlite3* db) {
+    change_state* state = Tcl_GetAssocData(interp, "registry::changes", NULL);
+    sqlite3_update_hook(db, NULL, NULL);
+    if (state != NULL && state->db == db) {
+        state->db = NULL;
+        changes_notify(state, CHANGE_ALL, CHANGE_UNKNOWN, 0);
+    }
+}
+
+/**
+ * Tells listeners if anyone else has changed the registry since the last
+ * check. Called at the start of every registry command; it costs one cached
+ * `PRAGMA data_version`.
+ */
+void changes_check(Tcl_Interp* interp) {
+    change_state* state = Tcl_GetAssocData(interp, "registry::changes", NULL);
+    sqlite_int64 version;
+    if (state == NULL || state->db == NULL) {
+        return;
+    }
+    version = data_version(state->db);
+    if (version != state->data_version) {
+        state->data_version = version;
+        state->remote++;
+        changes_notify(state, CHANGE_ALL, CHANGE_UNKNOWN, 0);
+    }
+}
+
+/**
+ * Tells listeners anything may have changed, after writes through the interp's
+ * own connection that the update hook doesn't report, such as a DELETE of
+ * every row, which sqlite does by truncating the table.
+ */
+void changes_unknown(Tcl_Interp* interp) {
+    change_state* state = Tcl_GetAssocData(interp, "registry::changes", NULL);
+    if (state != NULL) {
+        changes_notify(state, CHANGE_ALL, CHANGE_UNKNOWN, 0);
+    }
+}
+
+/**
+ * Returns a dict of how many changes the interp has seen: rows of `ports` and
+ * of `files` changed through its connection, and `remote` changes by others.
+ * With `reset`, zeroes them afterwards.
+ */
+Tcl_Obj* changes_counts(Tcl_Interp* interp, int reset) {
+    change_state* state = get_changes(interp);
+    Tcl_Obj* result = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("ports", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(state->ports));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("files", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(state->files));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("remote", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(state->remote));
+    if (reset) {
+        state->ports = 0;
+        state->files = 0;
+        state->remote = 0;
+    }
+    return result;
+}
@@ -0,0 +1,56 @@
+/*
+ * changes.h
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _CHANGES_H
+#define _CHANGES_H
+
+#include <tcl.h>
+#include <sqlite3.h>
+
+/* tables a listener can hear about */
+#define CHANGE_PORTS 1
+#define CHANGE_FILES 2
+#define CHANGE_ALL (CHANGE_PORTS | CHANGE_FILES)
+
+/* the operation when something other than the interp changed the registry */
+#define CHANGE_UNKNOWN 0
+
+typedef void (change_listener)(ClientData clientData, int tables, int op,
+        sqlite_int64 rowid);
+
+void changes_listen(Tcl_Interp* interp, change_listener* listener,
+        ClientData clientData);
+void changes_unlisten(Tcl_Interp* interp, change_listener* listener,
+        ClientData clientData);
+
+void changes_attach(Tcl_Interp* interp, sqlite3* db);
+void changes_detach(Tcl_Interp* interp, sqlite3* db);
+void changes_check(Tcl_Interp* interp);
+void changes_unknown(Tcl_Interp* interp);
+Tcl_Obj* changes_counts(Tcl_Interp* interp, int reset);
+
+#endif /* _CHANGES_H */
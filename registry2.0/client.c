@@ -0,0 +1,255 @@
+/*
+ * client.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "client.h"
+#include "daemon.h"
+#include "entry.h"
+
+/*
+ * Using registryd from Tcl.
+ *
+ * If a registryd is serving the file given to `registry::open`, the interp
+ * connects to it instead of leasing a connection, and the commands that only
+ * read the registry and hand back references or plain values (`entry search
+ * -refs`, `entry owner -refs`, and property and file lookups on references)
+ * are answered by the daemon. The first command that needs a connection of its
+ * own, including anything that writes or creates an entry proc, leases one as
+ * `registry::open` would have (see `registry_db`), and from then on the daemon
+ * is no longer used. Regular expression searches always run locally, since
+ * registryd can't use Tcl's regular expressions.
+ *
+ * If the daemon goes away, its requests quietly fall back to a local
+ * connection.
+ */
+
+typedef struct {
+    int fd;
+    char* file;
+} client_state;
+
+static void client_delete(ClientData clientData, Tcl_Interp* interp UNUSED) {
+    client_state* state = (client_state*)clientData;
+    if (state->fd >= 0) {
+        close(state->fd);
+    }
+    ckfree(state->file);
+    ckfree((char*)state);
+}
+
+/**
+ * Connects the interp to the registryd serving `file`, if there is one.
+ * Returns 1 if it did.
+ */
+int client_attach(Tcl_Interp* interp, const char* file) {
+    client_state* state;
+    int fd = reg_daemon_connect(file);
+    if (fd < 0) {
+        return 0;
+    }
+    state = (client_state*)ckalloc(sizeof(client_state));
+    state->fd = fd;
+    state->file = ckalloc(strlen(file) + 1);
+    strcpy(state->file, file);
+    Tcl_SetAssocData(interp, "registry::daemon", client_delete, state);
+    return 1;
+}
+
+/**
+ * Returns the registry file if the interp opened it through registryd and
+ * hasn't leased a connection to it yet, or NULL otherwise.
+ */
+const char* client_pending(Tcl_Interp* interp) {
+    client_state* state = Tcl_GetAssocData(interp, "registry::daemon", NULL);
+    return state != NULL ? state->file : NULL;
+}
+
+void client_detach(Tcl_Interp* interp) {
+    Tcl_DeleteAssocData(interp, "registry::daemon");
+}
+
+/*
+ * Sends `request` to the interp's daemon. Returns TCL_OK with the reply in
+ * `reply`, TCL_ERROR with the daemon's error as the interp result, or
+ * CLIENT_FALLBACK if there is no daemon to ask (any more).
+ */
+static int client_call(Tcl_Interp* interp, reg_msg* request, reg_msg* reply) {
+    client_state* state = Tcl_GetAssocData(interp, "registry::daemon", NULL);
+    reg_error error;
+    int result;
+    if (state == NULL || state->fd < 0) {
+        reg_msg_free(request);
+        return CLIENT_FALLBACK;
+    }
+    result = reg_daemon_call(state->fd, request, reply, &error);
+    reg_msg_free(request);
+    if (result == 1) {
+        return TCL_OK;
+    }
+    reg_msg_free(reply);
+    if (result == 0) {
+        return registry_failed(interp, &error);
+    }
+    close(state->fd);
+    state->fd = -1;
+    return CLIENT_FALLBACK;
+}
+
+/*
+ * Sets the interp result to the reply's rowids as references: a list of them,
+ * or with `list` false, the only one (or nothing).
+ */
+static int client_refs(Tcl_Interp* interp, reg_msg* reply, int list) {
+    Tcl_Obj* result = Tcl_NewListObj(0, NULL);
+    const char* data;
+    size_t len;
+    while (reg_msg_next(reply, &data, &len)) {
+        sqlite_int64 rowid;
+        if (!reg_msg_rowid(data, len, &rowid)) {
+            Tcl_DecrRefCount(result);
+            reg_msg_free(reply);
+            Tcl_SetResult(interp, "malformed reply from registryd",
+                    TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (!list) {
+            Tcl_DecrRefCount(result);
+            result = new_ref_obj(rowid);
+            break;
+        }
+        Tcl_ListObjAppendElement(interp, result, new_ref_obj(rowid));
+    }
+    reg_msg_free(reply);
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+}
+
+/**
+ * `registry::entry search -refs` through the daemon.
+ */
+int client_search(Tcl_Interp* interp, char** keys, char** vals, int key_count,
+        int strategy) {
+    reg_msg request, reply;
+    char type = (char)strategy;
+    int i, result;
+    if (strategy == 2 || client_pending(interp) == NULL) {
+        return CLIENT_FALLBACK;
+    }
+    reg_msg_init(&request, REG_DAEMON_SEARCH);
+    reg_msg_add(&request, &type, 1);
+    for (i=0; i<key_count; i++) {
+        reg_msg_add(&request, keys[i], strlen(keys[i]));
+        reg_msg_add(&request, vals[i], strlen(vals[i]));
+    }
+    result = client_call(interp, &request, &reply);
+    if (result != TCL_OK) {
+        return result;
+    }
+    return client_refs(interp, &reply, 1);
+}
+
+/**
+ * `registry::entry owner -refs` through the daemon.
+ */
+int client_owner(Tcl_Interp* interp, const char* path) {
+    reg_msg request, reply;
+    int result;
+    if (client_pending(interp) == NULL) {
+        return CLIENT_FALLBACK;
+    }
+    reg_msg_init(&request, REG_DAEMON_OWNER);
+    reg_msg_add(&request, path, strlen(path));
+    result = client_call(interp, &request, &reply);
+    if (result != TCL_OK) {
+        return result;
+    }
+    return client_refs(interp, &reply, 0);
+}
+
+/**
+ * Looks up a property of a reference through the daemon.
+ */
+int client_propget(Tcl_Interp* interp, sqlite_int64 rowid, const char* key) {
+    reg_msg request, reply;
+    const char* data;
+    size_t len;
+    int result;
+    if (client_pending(interp) == NULL) {
+        return CLIENT_FALLBACK;
+    }
+    reg_msg_init(&request, REG_DAEMON_PROPGET);
+    reg_msg_add_rowid(&request, rowid);
+    reg_msg_add(&request, key, strlen(key));
+    result = client_call(interp, &request, &reply);
+    if (result != TCL_OK) {
+        return result;
+    }
+    if (reg_msg_next(&reply, &data, &len)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(data, (int)len));
+    }
+    reg_msg_free(&reply);
+    return TCL_OK;
+}
+
+/**
+ * Lists the files of a reference through the daemon.
+ */
+int client_files(Tcl_Interp* interp, sqlite_int64 rowid) {
+    reg_msg request, reply;
+    Tcl_Obj* result;
+    const char* data;
+    size_t len;
+    int code;
+    if (client_pending(interp) == NULL) {
+        return CLIENT_FALLBACK;
+    }
+    reg_msg_init(&request, REG_DAEMON_FILES);
+    reg_msg_add_rowid(&request, rowid);
+    code = client_call(interp, &request, &reply);
+    if (code != TCL_OK) {
+        return code;
+    }
+    result = Tcl_NewListObj(0, NULL);
+    while (reg_msg_next(&reply, &data, &len)) {
+        Tcl_ListObjAppendElement(interp, result,
+                Tcl_NewStringObj(data, (int)len));
+    }
+    reg_msg_free(&reply);
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+}
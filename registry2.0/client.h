@@ -0,0 +1,47 @@
+/*
+ * client.h
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include <tcl.h>
+#include <sqlite3.h>
+
+/* returned when registryd can't answer and the caller should do it itself */
+#define CLIENT_FALLBACK -1
+
+int client_attach(Tcl_Interp* interp, const char* file);
+const char* client_pending(Tcl_Interp* interp);
+void client_detach(Tcl_Interp* interp);
+
+int client_search(Tcl_Interp* interp, char** keys, char** vals, int key_count,
+        int strategy);
+int client_owner(Tcl_Interp* interp, const char* path);
+int client_propget(Tcl_Interp* interp, sqlite_int64 rowid, const char* key);
+int client_files(Tcl_Interp* interp, sqlite_int64 rowid);
+
+#endif /* _CLIENT_H */
@@ -0,0 +1,113 @@
+/*
+ * cregistry.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "cregistry.h"
+
+/* how long a writer waits on another before giving up, in milliseconds */
+#define REG_BUSY_TIMEOUT 10000
+
+/**
+ * Runs one query whose result, if any, is not wanted.
+ */
+static int reg_exec(sqlite3* db, char* query, int expected, reg_error* errPtr) {
+    sqlite3_stmt* stmt = NULL;
+    int ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+        && (sqlite3_step(stmt) == expected);
+    if (!ok) {
+        reg_sqlite_error(db, errPtr, query);
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+/**
+ * Opens the registry at `path`.
+ *
+ * The registry is attached as `registry` to a private in-memory database, as
+ * the Tcl layer does, so that the queries in centry.c work unchanged. With
+ * `REG_OPEN_READONLY` the file is opened with sqlite's `mode=ro`: it must
+ * already exist, nothing can be written to it, and its tables are taken on
+ * trust, which keeps opening cheap. Otherwise the registry is created if need
+ * be, checked with `reg_check_tables` and switched to WAL.
+ *
+ * Returns the connection, to be closed with `reg_close`, or NULL with `errPtr`
+ * set.
+ */
+sqlite3* reg_open(const char* path, int flags, reg_error* errPtr) {
+    sqlite3* db;
+    char* query;
+    int ok;
+    if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE
+                | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+        reg_sqlite_error(db, errPtr, NULL);
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlite3_busy_timeout(db, REG_BUSY_TIMEOUT);
+    if (flags & REG_OPEN_READONLY) {
+        char* uri = reg_readonly_uri(path);
+        reg_init_functions(db);
+        query = sqlite3_mprintf("ATTACH DATABASE '%q' AS registry", uri);
+        sqlite3_free(uri);
+        ok = reg_exec(db, query, SQLITE_DONE, errPtr);
+        sqlite3_free(query);
+    } else {
+        ok = reg_init_db(db, errPtr);
+        if (ok) {
+            query = sqlite3_mprintf("ATTACH DATABASE '%q' AS registry", path);
+            ok = reg_exec(db, query, SQLITE_DONE, errPtr);
+            sqlite3_free(query);
+        }
+        /* tables first, as switching to WAL fixes the file's auto_vacuum */
+        ok = ok && reg_check_tables(db, errPtr);
+        ok = ok && reg_exec(db, "PRAGMA registry.journal_mode=WAL", SQLITE_ROW,
+                errPtr);
+    }
+    if (!ok) {
+        sqlite3_close(db);
+        return NULL;
+    }
+    reg_stmt_cache_attach(db);
+    return db;
+}
+
+/**
+ * Closes a connection opened by `reg_open`, with its cached statements.
+ */
+void reg_close(sqlite3* db) {
+    reg_stmt_cache_detach(db);
+    sqlite3_close(db);
+}
@@ -0,0 +1,60 @@
+/*
+ * cregistry.h
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _CREGISTRY_H
+#define _CREGISTRY_H
+
+/*
+ * Public interface of libregistry, the registry without Tcl.
+ *
+ * libregistry is centry.c, sql.c, migrate.c, cregistry.c and daemon.c built as
+ * a static library. It needs only sqlite and the C library, so shell tools can
+ * read (or write) the registry without loading tclsh. This header and the
+ * headers it includes are the whole of its interface; `REG_API_VERSION` is
+ * bumped whenever any of them change incompatibly.
+ */
+
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "sql.h"
+#include "migrate.h"
+
+#define REG_API_VERSION 1
+
+/* where tools look for the registry unless told otherwise */
+#ifndef REG_DEFAULT_PATH
+#define REG_DEFAULT_PATH "/opt/local/var/macports/registry/registry.db"
+#endif
+
+/* flags for reg_open */
+#define REG_OPEN_READONLY 0x01
+
+sqlite3* reg_open(const char* path, int flags, reg_error* errPtr);
+void reg_close(sqlite3* db);
+
+#endif /* _CREGISTRY_H */
@@ -0,0 +1,307 @@
+/*
+ * daemon.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sqlite3.h>
+
+#include "daemon.h"
+
+/* a daemon that goes away must not kill its clients with SIGPIPE */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * Returns the path of the socket registryd listens on for the registry
+ * `file`, or NULL if it would be too long for a socket address (leaving room
+ * for the temporary name registryd creates it under). Free the result with
+ * `free`.
+ */
+char* reg_daemon_socket(const char* file) {
+    struct sockaddr_un addr;
+    size_t len = strlen(file);
+    char* path;
+    if (len + sizeof(".sock.new") > sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    path = malloc(len + sizeof(".sock"));
+    memcpy(path, file, len);
+    memcpy(path + len, ".sock", sizeof(".sock"));
+    return path;
+}
+
+/**
+ * Connects to the registryd serving `file`. Returns the socket, or -1 if no
+ * daemon is listening. Reads from the socket time out after
+ * REG_DAEMON_TIMEOUT seconds, so a daemon that hangs fails the call instead of
+ * its client.
+ */
+int reg_daemon_connect(const char* file) {
+    struct sockaddr_un addr;
+    char* path = reg_daemon_socket(file);
+    struct timeval timeout;
+    int fd;
+    if (path == NULL) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    free(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+    timeout.tv_sec = REG_DAEMON_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void reg_msg_reserve(reg_msg* msg, size_t len) {
+    if (msg->len + len > msg->space) {
+        while (msg->len + len > msg->space) {
+            msg->space *= 2;
+        }
+        msg->data = realloc(msg->data, msg->space);
+    }
+}
+
+static void put_u32(unsigned char* p, size_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static size_t get_u32(const unsigned char* p) {
+    return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8)
+        | (size_t)p[3];
+}
+
+/**
+ * Starts a message of the given type (a request's operation or a reply's
+ * status), ready for fields to be added.
+ */
+void reg_msg_init(reg_msg* msg, int type) {
+    msg->space = 256;
+    msg->data = malloc(msg->space);
+    msg->len = 5;
+    msg->pos = 5;
+    msg->data[4] = (unsigned char)type;
+}
+
+void reg_msg_free(reg_msg* msg) {
+    free(msg->data);
+    msg->data = NULL;
+}
+
+void reg_msg_add(reg_msg* msg, const void* data, size_t len) {
+    reg_msg_reserve(msg, 4 + len);
+    put_u32(msg->data + msg->len, len);
+    memcpy(msg->data + msg->len + 4, data, len);
+    msg->len += 4 + len;
+}
+
+void reg_msg_add_rowid(reg_msg* msg, sqlite_int64 rowid) {
+    unsigned char buf[8];
+    int i;
+    for (i=7; i>=0; i--) {
+        buf[i] = (unsigned char)rowid;
+        rowid >>= 8;
+    }
+    reg_msg_add(msg, buf, 8);
+}
+
+int reg_msg_type(reg_msg* msg) {
+    return msg->data[4];
+}
+
+/**
+ * Reads the next field of a message. Returns 1 and sets `data` and `len`, or
+ * returns 0 if there are no more fields (or the message is malformed).
+ */
+int reg_msg_next(reg_msg* msg, const char** data, size_t* len) {
+    size_t field;
+    if (msg->pos + 4 > msg->len) {
+        return 0;
+    }
+    field = get_u32(msg->data + msg->pos);
+    if (field > msg->len - msg->pos - 4) {
+        return 0;
+    }
+    *data = (const char*)msg->data + msg->pos + 4;
+    *len = field;
+    msg->pos += 4 + field;
+    return 1;
+}
+
+int reg_msg_rowid(const char* data, size_t len, sqlite_int64* rowid) {
+    const unsigned char* p = (const unsigned char*)data;
+    sqlite_int64 result = 0;
+    size_t i;
+    if (len != 8) {
+        return 0;
+    }
+    for (i=0; i<8; i++) {
+        result = (result << 8) | p[i];
+    }
+    *rowid = result;
+    return 1;
+}
+
+/**
+ * Writes a message to `fd`. Returns 1 on success and 0 if the connection
+ * failed.
+ */
+int reg_msg_send(int fd, reg_msg* msg) {
+    size_t done = 0;
+    put_u32(msg->data, msg->len - 4);
+    while (done < msg->len) {
+        ssize_t n = send(fd, msg->data + done, msg->len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+static int read_all(int fd, unsigned char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+/**
+ * Reads a message from `fd` into `msg`, which need not be initialized and
+ * must be freed with `reg_msg_free` even on failure. Returns 1 on success and
+ * 0 if the connection failed or sent something malformed.
+ */
+int reg_msg_recv(int fd, reg_msg* msg) {
+    unsigned char header[4];
+    size_t len;
+    msg->data = NULL;
+    if (!read_all(fd, header, 4)) {
+        return 0;
+    }
+    len = get_u32(header);
+    if (len < 1 || len > REG_DAEMON_MAX_MESSAGE) {
+        return 0;
+    }
+    msg->space = 4 + len;
+    msg->len = 4 + len;
+    msg->pos = 5;
+    msg->data = malloc(msg->space);
+    memcpy(msg->data, header, 4);
+    return read_all(fd, msg->data + 4, len);
+}
+
+static char* field_string(const char* data, size_t len) {
+    char* result = malloc(len + 1);
+    memcpy(result, data, len);
+    result[len] = '\0';
+    return result;
+}
+
+static void free_string(char* str) {
+    free(str);
+}
+
+/**
+ * Sends `request` to the daemon on `fd` and waits for its reply.
+ *
+ * Returns 1 if the request succeeded, leaving the reply's fields to be read
+ * from `reply`. Returns 0 if the daemon reported an error, which is copied to
+ * `errPtr`, and -1 if the connection failed, in which case the caller should
+ * give up on the daemon and do the work itself. `reply` must be freed with
+ * `reg_msg_free` in every case.
+ */
+int reg_daemon_call(int fd, reg_msg* request, reg_msg* reply,
+        reg_error* errPtr) {
+    const char* data;
+    size_t len;
+    reply->data = NULL;
+    if (!reg_msg_send(fd, request) || !reg_msg_recv(fd, reply)) {
+        errPtr->code = "registry::daemon-error";
+        errPtr->description = "lost connection to registryd";
+        errPtr->free = NULL;
+        return -1;
+    }
+    if (reg_msg_type(reply) == REG_DAEMON_OK) {
+        return 1;
+    }
+    errPtr->code = "registry::daemon-error";
+    errPtr->description = "registryd failed";
+    errPtr->free = NULL;
+    if (reg_msg_next(reply, &data, &len)) {
+        /* codes are static strings on the client side */
+        if (len == sizeof("registry::sqlite-error") - 1
+                && memcmp(data, "registry::sqlite-error", len) == 0) {
+            errPtr->code = "registry::sqlite-error";
+        } else if (len == sizeof("registry::invalid-entry") - 1
+                && memcmp(data, "registry::invalid-entry", len) == 0) {
+            errPtr->code = "registry::invalid-entry";
+        }
+        if (reg_msg_next(reply, &data, &len)) {
+            errPtr->description = field_string(data, len);
+            errPtr->free = free_string;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * daemon.h
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stddef.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+
+/*
+ * Protocol spoken between registryd and its clients over a Unix-domain socket.
+ *
+ * A message is a 4-byte big-endian payload length followed by the payload.
+ * A request's payload is a one-byte operation and then its fields; a reply's
+ * is a one-byte status and then its fields. Each field is a 4-byte big-endian
+ * length followed by that many bytes, with no terminator. Rowids travel as
+ * 8-byte big-endian fields, everything else as text. An error reply carries
+ * the error's code and description.
+ *
+ * The socket for the registry `file` is `file.sock`.
+ */
+
+#define REG_DAEMON_SEARCH 1     /* strategy, key, value, ... -> rowid ... */
+#define REG_DAEMON_OWNER 2      /* path -> rowid, or nothing */
+#define REG_DAEMON_PROPGET 3    /* rowid, key -> value */
+#define REG_DAEMON_FILES 4      /* rowid -> path ... */
+
+#define REG_DAEMON_OK 0
+#define REG_DAEMON_ERROR 1
+
+/*
+ * How long a client waits for a reply before giving up on the daemon and doing
+ * the work itself, in seconds.
+ */
+#define REG_DAEMON_TIMEOUT 5
+
+/* largest message either side will accept */
+#define REG_DAEMON_MAX_MESSAGE (64 * 1024 * 1024)
+
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    size_t space;
+    size_t pos;
+} reg_msg;
+
+char* reg_daemon_socket(const char* file);
+int reg_daemon_connect(const char* file);
+
+void reg_msg_init(reg_msg* msg, int type);
+void reg_msg_free(reg_msg* msg);
+void reg_msg_add(reg_msg* msg, const void* data, size_t len);
+void reg_msg_add_rowid(reg_msg* msg, sqlite_int64 rowid);
+int reg_msg_type(reg_msg* msg);
+int reg_msg_next(reg_msg* msg, const char** data, size_t* len);
+int reg_msg_rowid(const char* data, size_t len, sqlite_int64* rowid);
+int reg_msg_send(int fd, reg_msg* msg);
+int reg_msg_recv(int fd, reg_msg* msg);
+
+int reg_daemon_call(int fd, reg_msg* request, reg_msg* reply,
+        reg_error* errPtr);
+
+#endif /* _DAEMON_H */
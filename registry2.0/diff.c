@@ -0,0 +1,381 @@
+/*
+ * diff.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "changes.h"
+#include "diff.h"
+#include "registry.h"
+#include "sql.h"
+#include "util.h"
+#include "writer.h"
+
+/*
+ * Comparing registries.
+ *
+ * `registry::diff` attaches another registry read-only, as DIFF_SCHEMA, and
+ * walks the ports of both in order of (name, epoch, version, revision,
+ * variants), and the files of each port found in both in order of path,
+ * merging the two as it goes, the way a merge join does. Each side is read by
+ * a single query, so neither is ever held in memory; the only sorting is of
+ * one port's files at a time. The comparisons here must order rows just as
+ * sqlite's ORDER BY does, column collations and all, or the merge goes wrong.
+ */
+
+#define DIFF_SCHEMA "diff"
+
+/* columns of the ports queries: the rowid, the key, then the rest */
+#define DIFF_KEY_COLUMNS 5
+static const char* diff_columns[] = { "portfile", "url", "location", "state",
+    "date", NULL };
+#define DIFF_COLUMNS 5
+
+/*
+ * Orders column `col` of the current rows of `a` and `b` as sqlite does: NULLs
+ * first, then numbers, then text, then blobs, with text compared by the
+ * VERSION collation if `version` is set and byte by byte otherwise.
+ */
+static int diff_compare(sqlite3_stmt* a, sqlite3_stmt* b, int col,
+        int version) {
+    static const int ranks[] = { 0, 1, 1, 2, 3, 0 };
+    int ta = sqlite3_column_type(a, col);
+    int tb = sqlite3_column_type(b, col);
+    if (ranks[ta] != ranks[tb]) {
+        return ranks[ta] - ranks[tb];
+    }
+    switch (ta) {
+        case SQLITE_NULL:
+            return 0;
+        case SQLITE_INTEGER:
+        case SQLITE_FLOAT:
+            if (ta == SQLITE_INTEGER && tb == SQLITE_INTEGER) {
+                sqlite_int64 x = sqlite3_column_int64(a, col);
+                sqlite_int64 y = sqlite3_column_int64(b, col);
+                return (x > y) - (x < y);
+            } else {
+                double x = sqlite3_column_double(a, col);
+                double y = sqlite3_column_double(b, col);
+                return (x > y) - (x < y);
+            }
+        default: {
+            const void* x = (ta == SQLITE_TEXT) ? sqlite3_column_text(a, col)
+                : sqlite3_column_blob(a, col);
+            const void* y = (tb == SQLITE_TEXT) ? sqlite3_column_text(b, col)
+                : sqlite3_column_blob(b, col);
+            int xlen = sqlite3_column_bytes(a, col);
+            int ylen = sqlite3_column_bytes(b, col);
+            int result;
+            if (version && ta == SQLITE_TEXT) {
+                return reg_version_compare(xlen, x, ylen, y);
+            }
+            result = memcmp(x, y, xlen < ylen ? xlen : ylen);
+            return result != 0 ? result : xlen - ylen;
+        }
+    }
+}
+
+/*
+ * Orders the keys of the current ports of `a` and `b`.
+ */
+static int diff_compare_keys(sqlite3_stmt* a, sqlite3_stmt* b) {
+    int col, result = 0;
+    for (col=1; result == 0 && col<=DIFF_KEY_COLUMNS; col++) {
+        /* version and revision are COLLATE VERSION */
+        result = diff_compare(a, b, col, col == 3 || col == 4);
+    }
+    return result;
+}
+
+static Tcl_Obj* column_obj(sqlite3_stmt* stmt, int col) {
+    return Tcl_NewStringObj((const char*)sqlite3_column_text(stmt, col),
+            sqlite3_column_bytes(stmt, col));
+}
+
+/*
+ * Returns the key of the current port of `stmt`, as a list.
+ */
+static Tcl_Obj* diff_key(sqlite3_stmt* stmt) {
+    Tcl_Obj* key = Tcl_NewListObj(0, NULL);
+    int col;
+    for (col=1; col<=DIFF_KEY_COLUMNS; col++) {
+        Tcl_ListObjAppendElement(NULL, key, column_obj(stmt, col));
+    }
+    return key;
+}
+
+typedef struct {
+    Tcl_Interp* interp;
+    sqlite3* db;
+    Tcl_Obj* command;
+    Tcl_Obj* result;
+    int code;
+    sqlite3_stmt* files[2];
+} diff_state;
+
+/*
+ * Reports the difference `kind` about the port with key `key`, followed by
+ * whichever of `detail`, `before` and `after` aren't NULL: to the command, if
+ * there is one, and otherwise by adding it to the result. Returns whether to
+ * go on.
+ */
+static int diff_report(diff_state* state, const char* kind, Tcl_Obj* key,
+        Tcl_Obj* detail, Tcl_Obj* before, Tcl_Obj* after) {
+    Tcl_Obj* record = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, record, Tcl_NewStringObj(kind, -1));
+    Tcl_ListObjAppendElement(NULL, record, key);
+    if (detail != NULL) {
+        Tcl_ListObjAppendElement(NULL, record, detail);
+    }
+    if (before != NULL) {
+        Tcl_ListObjAppendElement(NULL, record, before);
+    }
+    if (after != NULL) {
+        Tcl_ListObjAppendElement(NULL, record, after);
+    }
+    if (state->command == NULL) {
+        Tcl_ListObjAppendElement(NULL, state->result, record);
+    } else {
+        Tcl_Obj* command = Tcl_DuplicateObj(state->command);
+        Tcl_IncrRefCount(command);
+        Tcl_ListObjAppendElement(NULL, command, record);
+        state->code = Tcl_EvalObjEx(state->interp, command, TCL_EVAL_GLOBAL);
+        Tcl_DecrRefCount(command);
+    }
+    return state->code == TCL_OK || state->code == TCL_CONTINUE;
+}
+
+/*
+ * Merges the files of the port with key `key`, which is `a` in this registry
+ * and `b` in the other, reporting paths only one of them has.
+ */
+static int diff_files(diff_state* state, Tcl_Obj* key, sqlite_int64 a,
+        sqlite_int64 b) {
+    sqlite3_stmt* fa = state->files[0];
+    sqlite3_stmt* fb = state->files[1];
+    int ra, rb, ok = 1;
+    sqlite3_bind_int64(fa, 1, a);
+    sqlite3_bind_int64(fb, 1, b);
+    ra = sqlite3_step(fa);
+    rb = sqlite3_step(fb);
+    while (ok && (ra == SQLITE_ROW || rb == SQLITE_ROW)) {
+        int cmp = (ra != SQLITE_ROW) ? 1 : (rb != SQLITE_ROW) ? -1
+            : diff_compare(fa, fb, 0, 0);
+        if (cmp < 0) {
+            ok = diff_report(state, "unmapped", key, column_obj(fa, 0), NULL,
+                    NULL);
+            ra = sqlite3_step(fa);
+        } else if (cmp > 0) {
+            ok = diff_report(state, "mapped", key, column_obj(fb, 0), NULL,
+                    NULL);
+            rb = sqlite3_step(fb);
+        } else {
+            ra = sqlite3_step(fa);
+            rb = sqlite3_step(fb);
+        }
+    }
+    if (ok && (ra != SQLITE_DONE || rb != SQLITE_DONE)) {
+        set_sqlite_result(state->interp, state->db, NULL);
+        state->code = TCL_ERROR;
+        ok = 0;
+    }
+    sqlite3_reset(fa);
+    sqlite3_reset(fb);
+    return ok;
+}
+
+/*
+ * Reports the differences between the port `a` of this registry and `b` of
+ * the other, which have the same key.
+ */
+static int diff_port(diff_state* state, sqlite3_stmt* a, sqlite3_stmt* b) {
+    Tcl_Obj* key = diff_key(a);
+    int i, ok = 1;
+    Tcl_IncrRefCount(key);
+    for (i=0; ok && i<DIFF_COLUMNS; i++) {
+        int col = 1 + DIFF_KEY_COLUMNS + i;
+        if (diff_compare(a, b, col, 0) != 0) {
+            ok = diff_report(state, "changed", key,
+                    Tcl_NewStringObj(diff_columns[i], -1), column_obj(a, col),
+                    column_obj(b, col));
+        }
+    }
+    ok = ok && diff_files(state, key, sqlite3_column_int64(a, 0),
+            sqlite3_column_int64(b, 0));
+    Tcl_DecrRefCount(key);
+    return ok;
+}
+
+/*
+ * Merges the ports of both registries, reporting every difference.
+ */
+static int diff_ports(diff_state* state) {
+    static const char* ports = "SELECT rowid, name, epoch, version, revision, "
+        "variants, portfile, url, location, state, date FROM %s.ports "
+        "ORDER BY name, epoch, version, revision, variants";
+    static const char* files = "SELECT path FROM %s.files WHERE port_id=? "
+        "ORDER BY path";
+    static const char* schemas[] = { "registry", DIFF_SCHEMA };
+    sqlite3_stmt* stmts[2] = { NULL, NULL };
+    int r[2];
+    int i, ok = 1;
+    for (i=0; ok && i<2; i++) {
+        char* query = sqlite3_mprintf(ports, schemas[i]);
+        ok = (sqlite3_prepare_v2(state->db, query, -1, &stmts[i], NULL)
+                == SQLITE_OK);
+        sqlite3_free(query);
+        query = sqlite3_mprintf(files, schemas[i]);
+        ok = ok && (sqlite3_prepare_v2(state->db, query, -1,
+                    &state->files[i], NULL) == SQLITE_OK);
+        sqlite3_free(query);
+        r[i] = ok ? sqlite3_step(stmts[i]) : SQLITE_ERROR;
+    }
+    if (!ok) {
+        set_sqlite_result(state->interp, state->db, NULL);
+        state->code = TCL_ERROR;
+    }
+    while (ok && (r[0] == SQLITE_ROW || r[1] == SQLITE_ROW)) {
+        int cmp = (r[0] != SQLITE_ROW) ? 1 : (r[1] != SQLITE_ROW) ? -1
+            : diff_compare_keys(stmts[0], stmts[1]);
+        if (cmp < 0) {
+            ok = diff_report(state, "removed", diff_key(stmts[0]), NULL, NULL,
+                    NULL);
+            r[0] = sqlite3_step(stmts[0]);
+        } else if (cmp > 0) {
+            ok = diff_report(state, "added", diff_key(stmts[1]), NULL, NULL,
+                    NULL);
+            r[1] = sqlite3_step(stmts[1]);
+        } else {
+            ok = diff_port(state, stmts[0], stmts[1]);
+            r[0] = sqlite3_step(stmts[0]);
+            r[1] = sqlite3_step(stmts[1]);
+        }
+    }
+    if (ok && (r[0] != SQLITE_DONE || r[1] != SQLITE_DONE)) {
+        set_sqlite_result(state->interp, state->db, NULL);
+        state->code = TCL_ERROR;
+        ok = 0;
+    }
+    for (i=0; i<2; i++) {
+        sqlite3_finalize(stmts[i]);
+        sqlite3_finalize(state->files[i]);
+    }
+    return ok;
+}
+
+/*
+ * Attaches the registry at `path` read-only as DIFF_SCHEMA.
+ */
+static int diff_attach(Tcl_Interp* interp, sqlite3* db, const char* path) {
+    sqlite3_stmt* stmt = NULL;
+    char* query = "ATTACH DATABASE ? AS " DIFF_SCHEMA;
+    char* uri = reg_readonly_uri(path);
+    int ok = (uri != NULL)
+        && (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+        && (sqlite3_bind_text(stmt, 1, uri, -1, SQLITE_STATIC) == SQLITE_OK)
+        && (sqlite3_step(stmt) == SQLITE_DONE);
+    if (!ok) {
+        set_sqlite_result(interp, db, query);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(uri);
+    return ok;
+}
+
+/**
+ * registry::diff ?-command command? other-db-file
+ *
+ * Compares the open registry with the one at `other-db-file`, which is only
+ * read, and returns their differences as a list. Ports are told apart by their
+ * name, epoch, version, revision and variants, and each difference is a list
+ * of its kind, the key of the port it's about, and more for some kinds:
+ *
+ *     added key              the port is only in the other registry
+ *     removed key            the port is only in this one
+ *     changed key col a b    the column is `a` here and `b` in the other
+ *     mapped key path        the port maps `path` only in the other
+ *     unmapped key path      the port maps `path` only here
+ *
+ * The files of added and removed ports aren't listed. With `-command`, each
+ * difference is appended to `command` and that called, as it's found, instead
+ * of being returned; if it returns with `break`, the comparison stops there.
+ * It must not change the registry. Both registries are read as they are at
+ * one moment, so this can't be used inside a snapshot (`registry::open
+ * -snapshot`), which is a moment already.
+ */
+int diff_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    diff_state state;
+    sqlite3* db;
+    int ok;
+    if (objc == 4 && strcmp(Tcl_GetString(objv[1]), "-command") == 0) {
+        state.command = objv[2];
+    } else if (objc == 2) {
+        state.command = NULL;
+    } else {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-command command? other-db-file");
+        return TCL_ERROR;
+    }
+    writer_sync(interp);
+    changes_check(interp);
+    db = registry_db(interp, 1);
+    if (db == NULL) {
+        return TCL_ERROR;
+    }
+    if (!diff_attach(interp, db, Tcl_GetString(objv[objc-1]))) {
+        return TCL_ERROR;
+    }
+    state.interp = interp;
+    state.db = db;
+    state.result = Tcl_NewListObj(0, NULL);
+    state.code = TCL_OK;
+    state.files[0] = state.files[1] = NULL;
+    Tcl_IncrRefCount(state.result);
+    ok = (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK);
+    if (!ok) {
+        set_sqlite_result(interp, db, "BEGIN");
+        state.code = TCL_ERROR;
+    }
+    ok = ok && diff_ports(&state);
+    if (!sqlite3_get_autocommit(db)) {
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+    sqlite3_exec(db, "DETACH DATABASE " DIFF_SCHEMA, NULL, NULL, NULL);
+    if (state.code == TCL_BREAK) {
+        state.code = TCL_OK;
+    } else if (state.code == TCL_OK) {
+        Tcl_SetObjResult(interp, state.result);
+    }
+    Tcl_DecrRefCount(state.result);
+    return state.code;
+}
@@ -0,0 +1,924 @@
+/*
+ * dump.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "changes.h"
+#include "dump.h"
+#include "entry.h"
+#include "maintain.h"
+#include "migrate.h"
+#include "registry.h"
+#include "sql.h"
+#include "util.h"
+#include "writer.h"
+
+/*
+ * Export and import.
+ *
+ * `registry::export` writes the whole registry to a channel as JSON Lines, one
+ * object per line, and `registry::import` reads it back, into this registry or
+ * any other, whatever the schema version of either; copying the sqlite file
+ * only works between hosts on the same one. The first line says what wrote
+ * it:
+ *
+ *     {"registry": 1, "schema": 1}
+ *
+ * `registry` is the version of this format and `schema` that of the exported
+ * tables. Then comes each port, followed by the files mapped to it:
+ *
+ *     {"type": "port", "name": "zlib", "version": "1.2.3", ...}
+ *     {"type": "file", "path": "/opt/local/lib/libz.dylib"}
+ *
+ * A port has a key for each of its columns that isn't NULL; strings, integers
+ * and reals keep their sqlite type. Rowids aren't kept, which is what lets an
+ * import add to a registry that has ports already.
+ *
+ * Export writes through a buffer of DUMP_BUFFER bytes from a single query, so
+ * it takes the same memory for any size of registry. Import reads the channel
+ * a chunk at a time, too, and loads it all in one transaction, so that a bad
+ * line or a conflict with a port or file already in the registry leaves
+ * nothing behind. Into an empty registry, the indexes that aren't needed to
+ * check constraints are dropped first and built again at the end, which is
+ * quicker than keeping them up to date row by row. What's left is mostly
+ * sqlite's own work keeping the unique index on paths.
+ */
+
+#define DUMP_FORMAT 1
+#define DUMP_BUFFER 65536
+#define DUMP_MAX_FIELDS 16
+/* page cache for an import, in KiB; the unique index on paths wants it */
+#define DUMP_CACHE_SIZE 65536
+
+static const char* port_columns[] = { "name", "portfile", "url", "location",
+    "epoch", "version", "revision", "variants", "state", "date", NULL };
+#define PORT_COLUMNS 10
+
+/*
+ * Writes what's buffered in `out` to `chan`, setting an error in `interp` if
+ * that fails.
+ */
+static int dump_flush(Tcl_Interp* interp, Tcl_Channel chan, Tcl_DString* out) {
+    if (Tcl_DStringLength(out) > 0
+            && Tcl_WriteChars(chan, Tcl_DStringValue(out),
+                Tcl_DStringLength(out)) < 0) {
+        Tcl_ResetResult(interp);
+        Tcl_AppendResult(interp, "error writing \"",
+                Tcl_GetChannelName(chan), "\": ", Tcl_PosixError(interp),
+                NULL);
+        return 0;
+    }
+    Tcl_DStringSetLength(out, 0);
+    return 1;
+}
+
+/*
+ * Appends `len` bytes of `str` to `out` as a JSON string.
+ */
+static void dump_string(Tcl_DString* out, const char* str, int len) {
+    int start = 0, i;
+    Tcl_DStringAppend(out, "\"", 1);
+    for (i=0; i<len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        Tcl_DStringAppend(out, str + start, i - start);
+        start = i + 1;
+        switch (c) {
+            case '"':
+                Tcl_DStringAppend(out, "\\\"", 2);
+                break;
+            case '\\':
+                Tcl_DStringAppend(out, "\\\\", 2);
+                break;
+            case '\n':
+                Tcl_DStringAppend(out, "\\n", 2);
+                break;
+            case '\t':
+                Tcl_DStringAppend(out, "\\t", 2);
+                break;
+            default: {
+                char escape[8];
+                sprintf(escape, "\\u%04x", c);
+                Tcl_DStringAppend(out, escape, 6);
+            }
+        }
+    }
+    Tcl_DStringAppend(out, str + start, len - start);
+    Tcl_DStringAppend(out, "\"", 1);
+}
+
+/*
+ * Appends `, "key": value` to `out` for column `col` of `stmt`, unless it is
+ * NULL.
+ */
+static void dump_field(Tcl_DString* out, const char* key, sqlite3_stmt* stmt,
+        int col) {
+    char number[32];
+    switch (sqlite3_column_type(stmt, col)) {
+        case SQLITE_NULL:
+            return;
+        case SQLITE_INTEGER:
+            sprintf(number, "%lld",
+                    (long long)sqlite3_column_int64(stmt, col));
+            break;
+        case SQLITE_FLOAT:
+            sprintf(number, "%.17g", sqlite3_column_double(stmt, col));
+            /* keep it a real when read back */
+            if (strpbrk(number, ".eEn") == NULL) {
+                strcat(number, ".0");
+            }
+            break;
+        default:
+            number[0] = '\0';
+    }
+    Tcl_DStringAppend(out, ", \"", 3);
+    Tcl_DStringAppend(out, key, -1);
+    Tcl_DStringAppend(out, "\": ", 3);
+    if (number[0] != '\0') {
+        Tcl_DStringAppend(out, number, -1);
+    } else {
+        dump_string(out, (const char*)sqlite3_column_text(stmt, col),
+                sqlite3_column_bytes(stmt, col));
+    }
+}
+
+/**
+ * Returns a dict of how many `ports` and `files` were exported or imported.
+ */
+Tcl_Obj* dump_counts(Tcl_Interp* interp, sqlite_int64 ports,
+        sqlite_int64 files) {
+    Tcl_Obj* result = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("ports", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(ports));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("files", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(files));
+    return result;
+}
+
+/*
+ * Looks up the channel named `name`, which must be open for `mode`.
+ */
+static Tcl_Channel dump_channel(Tcl_Interp* interp, Tcl_Obj* name, int mode) {
+    int chan_mode;
+    Tcl_Channel chan = Tcl_GetChannel(interp, Tcl_GetString(name), &chan_mode);
+    if (chan != NULL && !(chan_mode & mode)) {
+        Tcl_AppendResult(interp, "channel \"", Tcl_GetString(name),
+                (mode == TCL_READABLE) ? "\" wasn't opened for reading"
+                : "\" wasn't opened for writing", NULL);
+        return NULL;
+    }
+    return chan;
+}
+
+/*
+ * registry::export channel
+ *
+ * Writes the registry to `channel`, which should use the utf-8 encoding, as
+ * described above, and returns a dict of how many `ports` and `files` it
+ * wrote. Works on a read-only registry too, and within a snapshot exports what
+ * the snapshot sees.
+ */
+int export_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    static char* query = "SELECT ports.rowid, ports.name, ports.portfile, "
+        "ports.url, ports.location, ports.epoch, ports.version, "
+        "ports.revision, ports.variants, ports.state, ports.date, "
+        "files.path, files.mtime FROM registry.ports "
+        "LEFT JOIN registry.files ON files.port_id = +ports.rowid "
+        "ORDER BY ports.rowid";
+    sqlite3* db;
+    sqlite3_stmt* stmt = NULL;
+    Tcl_Channel chan;
+    Tcl_DString out;
+    reg_error error;
+    sqlite_int64 port = 0, ports = 0, files = 0;
+    int version, r, ok;
+    char header[64];
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "channel");
+        return TCL_ERROR;
+    }
+    chan = dump_channel(interp, objv[1], TCL_WRITABLE);
+    if (chan == NULL) {
+        return TCL_ERROR;
+    }
+    writer_sync(interp);
+    changes_check(interp);
+    db = registry_db(interp, 1);
+    if (db == NULL) {
+        return TCL_ERROR;
+    }
+    version = reg_schema_version(db, &error);
+    if (version < 0) {
+        return registry_failed(interp, &error);
+    }
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+        set_sqlite_result(interp, db, query);
+        return TCL_ERROR;
+    }
+    Tcl_DStringInit(&out);
+    sprintf(header, "{\"registry\": %d, \"schema\": %d}\n", DUMP_FORMAT,
+            version);
+    Tcl_DStringAppend(&out, header, -1);
+    ok = 1;
+    while (ok && (r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        sqlite_int64 rowid = sqlite3_column_int64(stmt, 0);
+        if (rowid != port) {
+            int i;
+            port = rowid;
+            ports++;
+            Tcl_DStringAppend(&out, "{\"type\": \"port\"", -1);
+            for (i=0; i<PORT_COLUMNS; i++) {
+                dump_field(&out, port_columns[i], stmt, i + 1);
+            }
+            Tcl_DStringAppend(&out, "}\n", 2);
+        }
+        if (sqlite3_column_type(stmt, PORT_COLUMNS + 1) != SQLITE_NULL) {
+            files++;
+            Tcl_DStringAppend(&out, "{\"type\": \"file\"", -1);
+            dump_field(&out, "path", stmt, PORT_COLUMNS + 1);
+            dump_field(&out, "mtime", stmt, PORT_COLUMNS + 2);
+            Tcl_DStringAppend(&out, "}\n", 2);
+        }
+        if (Tcl_DStringLength(&out) >= DUMP_BUFFER) {
+            ok = dump_flush(interp, chan, &out);
+        }
+    }
+    if (ok && r != SQLITE_DONE) {
+        set_sqlite_result(interp, db, query);
+        ok = 0;
+    }
+    sqlite3_finalize(stmt);
+    ok = ok && dump_flush(interp, chan, &out);
+    Tcl_DStringFree(&out);
+    if (!ok) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, dump_counts(interp, ports, files));
+    return TCL_OK;
+}
+
+/*
+ * A value parsed from a line of JSON. Strings point into the line, which they
+ * are unescaped in place.
+ */
+typedef struct {
+    const char* key;
+    int key_len;
+    int type;
+    const char* str;
+    int len;
+    sqlite_int64 integer;
+    double real;
+} dump_value;
+
+/*
+ * Appends code point `c` to `w` as UTF-8 and returns the end of it.
+ */
+static char* utf8_encode(char* w, unsigned long c) {
+    if (c < 0x80) {
+        *w++ = (char)c;
+    } else if (c < 0x800) {
+        *w++ = (char)(0xc0 | (c >> 6));
+        *w++ = (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        *w++ = (char)(0xe0 | (c >> 12));
+        *w++ = (char)(0x80 | ((c >> 6) & 0x3f));
+        *w++ = (char)(0x80 | (c & 0x3f));
+    } else {
+        *w++ = (char)(0xf0 | (c >> 18));
+        *w++ = (char)(0x80 | ((c >> 12) & 0x3f));
+        *w++ = (char)(0x80 | ((c >> 6) & 0x3f));
+        *w++ = (char)(0x80 | (c & 0x3f));
+    }
+    return w;
+}
+
+/*
+ * Reads the four hex digits of a \u escape at `p`.
+ */
+static int parse_hex(const char* p, unsigned long* c) {
+    int i;
+    *c = 0;
+    for (i=0; i<4; i++) {
+        char h = p[i];
+        *c <<= 4;
+        if (h >= '0' && h <= '9') {
+            *c |= h - '0';
+        } else if (h >= 'a' && h <= 'f') {
+            *c |= h - 'a' + 10;
+        } else if (h >= 'A' && h <= 'F') {
+            *c |= h - 'A' + 10;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Parses the JSON string starting after the quote at `*pp`, unescaping it in
+ * place, and leaves `*pp` after its closing quote. An escaped string is never
+ * longer than the string it stands for, so this never overtakes itself.
+ */
+static int parse_string(char** pp, const char** str, int* len) {
+    char* p = *pp;
+    char* w = p;
+    *str = p;
+    for (;;) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"') {
+            break;
+        } else if (c < 0x20) {
+            return 0;
+        } else if (c != '\\') {
+            *w++ = *p++;
+            continue;
+        }
+        p++;
+        switch (*p++) {
+            case '"': *w++ = '"'; break;
+            case '\\': *w++ = '\\'; break;
+            case '/': *w++ = '/'; break;
+            case 'b': *w++ = '\b'; break;
+            case 'f': *w++ = '\f'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case 't': *w++ = '\t'; break;
+            case 'u': {
+                unsigned long c1, c2;
+                if (!parse_hex(p, &c1)) {
+                    return 0;
+                }
+                p += 4;
+                if (c1 >= 0xd800 && c1 < 0xdc00 && p[0] == '\\'
+                        && p[1] == 'u' && parse_hex(p + 2, &c2)
+                        && c2 >= 0xdc00 && c2 < 0xe000) {
+                    c1 = 0x10000 + ((c1 - 0xd800) << 10) + (c2 - 0xdc00);
+                    p += 6;
+                }
+                w = utf8_encode(w, c1);
+                break;
+            }
+            default:
+                return 0;
+        }
+    }
+    *len = (int)(w - *str);
+    *pp = p + 1;
+    return 1;
+}
+
+/*
+ * Parses the JSON value at `*pp` into `value`.
+ */
+static int parse_value(char** pp, dump_value* value) {
+    char* p = *pp;
+    if (*p == '"') {
+        *pp = p + 1;
+        value->type = SQLITE_TEXT;
+        return parse_string(pp, &value->str, &value->len);
+    } else if (strncmp(p, "null", 4) == 0) {
+        value->type = SQLITE_NULL;
+        *pp = p + 4;
+    } else if (strncmp(p, "true", 4) == 0) {
+        value->type = SQLITE_INTEGER;
+        value->integer = 1;
+        *pp = p + 4;
+    } else if (strncmp(p, "false", 5) == 0) {
+        value->type = SQLITE_INTEGER;
+        value->integer = 0;
+        *pp = p + 5;
+    } else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+        char* end;
+        errno = 0;
+        value->type = SQLITE_INTEGER;
+        value->integer = strtoll(p, &end, 10);
+        if (*end == '.' || *end == 'e' || *end == 'E' || errno == ERANGE) {
+            value->type = SQLITE_FLOAT;
+            value->real = strtod(p, &end);
+        }
+        if (end == p) {
+            return 0;
+        }
+        *pp = end;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static char* skip_space(char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+/*
+ * Parses `line`, which must be a JSON object whose values are all scalars,
+ * into `values`. Returns how many there were, or -1 if the line isn't one.
+ */
+static int parse_line(char* line, dump_value* values) {
+    char* p = skip_space(line);
+    int count = 0;
+    if (*p++ != '{') {
+        return -1;
+    }
+    p = skip_space(p);
+    if (*p == '}') {
+        p++;
+    } else {
+        for (;;) {
+            dump_value* value = &values[count];
+            if (count == DUMP_MAX_FIELDS || *p++ != '"'
+                    || !parse_string(&p, &value->key, &value->key_len)) {
+                return -1;
+            }
+            p = skip_space(p);
+            if (*p++ != ':') {
+                return -1;
+            }
+            p = skip_space(p);
+            if (!parse_value(&p, value)) {
+                return -1;
+            }
+            count++;
+            p = skip_space(p);
+            if (*p == '}') {
+                p++;
+                break;
+            } else if (*p++ != ',') {
+                return -1;
+            }
+            p = skip_space(p);
+        }
+    }
+    return *skip_space(p) == '\0' ? count : -1;
+}
+
+static int key_is(dump_value* value, const char* key) {
+    return strncmp(value->key, key, value->key_len) == 0
+        && key[value->key_len] == '\0';
+}
+
+static int bind_value(sqlite3_stmt* stmt, int index, dump_value* value) {
+    switch (value->type) {
+        case SQLITE_TEXT:
+            return sqlite3_bind_text(stmt, index, value->str, value->len,
+                    SQLITE_STATIC);
+        case SQLITE_INTEGER:
+            return sqlite3_bind_int64(stmt, index, value->integer);
+        case SQLITE_FLOAT:
+            return sqlite3_bind_double(stmt, index, value->real);
+        default:
+            return sqlite3_bind_null(stmt, index);
+    }
+}
+
+/*
+ * The state of one import.
+ */
+typedef struct {
+    Tcl_Interp* interp;
+    sqlite3* db;
+    Tcl_Channel chan;
+    Tcl_Obj* chunk;
+    Tcl_DString buffer;
+    int pos;
+    int eof;
+    int line_number;
+    sqlite3_stmt* port_stmt;
+    sqlite3_stmt* file_stmt;
+    sqlite_int64 port;
+    sqlite_int64 ports;
+    sqlite_int64 files;
+    int cache_size;
+    dump_indexes indexes;
+} dump_import;
+
+/*
+ * Fails the import with `message` about the current line.
+ */
+static int import_error(dump_import* import, const char* code,
+        const char* message) {
+    char number[32];
+    sprintf(number, "%d", import->line_number);
+    Tcl_ResetResult(import->interp);
+    Tcl_AppendResult(import->interp, "line ", number, ": ", message, NULL);
+    if (code != NULL) {
+        Tcl_SetErrorCode(import->interp, code, NULL);
+    }
+    return 0;
+}
+
+/*
+ * Fails the import with sqlite's error.
+ */
+static int import_sqlite_error(dump_import* import) {
+    return import_error(import, NULL, sqlite3_errmsg(import->db));
+}
+
+/*
+ * Reads the next non-blank line into `values`. Returns how many values it
+ * has, 0 at the end of the channel, or -1 on error.
+ *
+ * The channel is read DUMP_BUFFER characters at a time into `import->buffer`,
+ * and lines are split there, which costs much less than a Tcl_Gets each.
+ */
+static int import_line(dump_import* import, dump_value* values) {
+    for (;;) {
+        char* buffer = Tcl_DStringValue(&import->buffer);
+        int length = Tcl_DStringLength(&import->buffer);
+        char* line = buffer + import->pos;
+        char* end = memchr(line, '\n', length - import->pos);
+        int count;
+        if (end == NULL && !import->eof) {
+            const char* chunk;
+            int chunk_length, read;
+            /* keep what's left of the last chunk and add the next */
+            memmove(buffer, line, length - import->pos);
+            Tcl_DStringSetLength(&import->buffer, length - import->pos);
+            import->pos = 0;
+            read = Tcl_ReadChars(import->chan, import->chunk, DUMP_BUFFER, 0);
+            if (read < 0) {
+                Tcl_ResetResult(import->interp);
+                Tcl_AppendResult(import->interp, "error reading \"",
+                        Tcl_GetChannelName(import->chan), "\": ",
+                        Tcl_PosixError(import->interp), NULL);
+                return -1;
+            }
+            import->eof = (read == 0);
+            chunk = Tcl_GetStringFromObj(import->chunk, &chunk_length);
+            Tcl_DStringAppend(&import->buffer, chunk, chunk_length);
+            continue;
+        } else if (end == NULL) {
+            if (import->pos == length) {
+                return 0;
+            }
+            /* the last line needn't end with a newline */
+            end = buffer + length;
+        }
+        *end = '\0';
+        import->pos = (end == buffer + length) ? length
+            : (int)(end - buffer) + 1;
+        import->line_number++;
+        if (*skip_space(line) == '\0') {
+            continue;
+        }
+        count = parse_line(line, values);
+        if (count < 0) {
+            import_error(import, "registry::invalid-dump", "not a JSON object "
+                    "of strings, numbers and nulls");
+        }
+        return count;
+    }
+}
+
+static int import_exec(dump_import* import, const char* query) {
+    if (sqlite3_exec(import->db, query, NULL, NULL, NULL) != SQLITE_OK) {
+        set_sqlite_result(import->interp, import->db, query);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Saves the page cache size and raises it for the import.
+ */
+static int import_cache(dump_import* import) {
+    sqlite3_stmt* stmt = NULL;
+    char* query = "PRAGMA registry.cache_size";
+    int ok = (sqlite3_prepare_v2(import->db, query, -1, &stmt, NULL)
+            == SQLITE_OK) && (sqlite3_step(stmt) == SQLITE_ROW);
+    if (ok) {
+        import->cache_size = sqlite3_column_int(stmt, 0);
+    } else {
+        set_sqlite_result(import->interp, import->db, query);
+    }
+    sqlite3_finalize(stmt);
+    if (ok) {
+        char set[64];
+        sprintf(set, "PRAGMA registry.cache_size=%d", -DUMP_CACHE_SIZE);
+        ok = import_exec(import, set);
+    }
+    return ok;
+}
+
+/**
+ * If the registry has no ports, drops the indexes of `ports` and `files` that
+ * sqlite didn't make itself for UNIQUE constraints, remembering in `indexes`
+ * how to make them again with `dump_create_indexes`. Either way, `indexes`
+ * must be freed with `dump_free_indexes`.
+ */
+int dump_drop_indexes(Tcl_Interp* interp, sqlite3* db, dump_indexes* indexes) {
+    sqlite3_stmt* stmt = NULL;
+    char* query = "SELECT name, sql FROM registry.sqlite_master "
+        "WHERE type='index' AND tbl_name IN ('ports', 'files') "
+        "AND sql IS NOT NULL AND NOT EXISTS (SELECT 1 FROM registry.ports)";
+    const char* create = "CREATE INDEX ";
+    int r, i, ok = 1;
+    indexes->queries = NULL;
+    indexes->count = 0;
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+        set_sqlite_result(interp, db, query);
+        return 0;
+    }
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char* sql = (const char*)sqlite3_column_text(stmt, 1);
+        /* they're kept as written, without the schema name */
+        if (strncmp(sql, create, strlen(create)) != 0) {
+            continue;
+        }
+        indexes->queries = (char**)ckrealloc((char*)indexes->queries,
+                (indexes->count + 2) * sizeof(char*));
+        indexes->queries[indexes->count++] = sqlite3_mprintf(
+                "DROP INDEX registry.\"%w\"", sqlite3_column_text(stmt, 0));
+        indexes->queries[indexes->count++] = sqlite3_mprintf(
+                "%sregistry.%s", create, sql + strlen(create));
+    }
+    if (r != SQLITE_DONE) {
+        set_sqlite_result(interp, db, query);
+        ok = 0;
+    }
+    sqlite3_finalize(stmt);
+    for (i=0; ok && i<indexes->count; i+=2) {
+        if (sqlite3_exec(db, indexes->queries[i], NULL, NULL, NULL)
+                != SQLITE_OK) {
+            set_sqlite_result(interp, db, indexes->queries[i]);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+/**
+ * Makes the indexes dropped by `dump_drop_indexes` again.
+ */
+int dump_create_indexes(Tcl_Interp* interp, sqlite3* db,
+        dump_indexes* indexes) {
+    int i;
+    for (i=1; i<indexes->count; i+=2) {
+        if (sqlite3_exec(db, indexes->queries[i], NULL, NULL, NULL)
+                != SQLITE_OK) {
+            set_sqlite_result(interp, db, indexes->queries[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void dump_free_indexes(dump_indexes* indexes) {
+    int i;
+    for (i=0; i<indexes->count; i++) {
+        sqlite3_free(indexes->queries[i]);
+    }
+    if (indexes->queries != NULL) {
+        ckfree((char*)indexes->queries);
+    }
+}
+
+/*
+ * Checks the line `registry::export` starts with.
+ */
+static int import_header(dump_import* import) {
+    dump_value values[DUMP_MAX_FIELDS];
+    int count = import_line(import, values);
+    int format = 0, schema = 0, i;
+    if (count < 0) {
+        return 0;
+    }
+    for (i=0; i<count; i++) {
+        if (values[i].type != SQLITE_INTEGER) {
+            continue;
+        } else if (key_is(&values[i], "registry")) {
+            format = (int)values[i].integer;
+        } else if (key_is(&values[i], "schema")) {
+            schema = (int)values[i].integer;
+        }
+    }
+    if (format != DUMP_FORMAT || schema < 1) {
+        return import_error(import, "registry::invalid-dump",
+                "not a registry export");
+    } else if (schema > REG_SCHEMA_VERSION) {
+        return import_error(import, "registry::invalid-dump",
+                "exported from a newer registry");
+    }
+    return 1;
+}
+
+static int import_port(dump_import* import, dump_value* values, int count) {
+    int i, j;
+    sqlite3_clear_bindings(import->port_stmt);
+    for (i=0; i<count; i++) {
+        if (key_is(&values[i], "type")) {
+            continue;
+        }
+        for (j=0; j<PORT_COLUMNS; j++) {
+            if (key_is(&values[i], port_columns[j])) {
+                break;
+            }
+        }
+        if (j == PORT_COLUMNS) {
+            return import_error(import, "registry::invalid-dump",
+                    "unknown port column");
+        }
+        bind_value(import->port_stmt, j + 1, &values[i]);
+    }
+    if (sqlite3_step(import->port_stmt) != SQLITE_DONE) {
+        if (sqlite3_reset(import->port_stmt) == SQLITE_CONSTRAINT) {
+            return import_error(import, "registry::constraint",
+                    "port is already in the registry");
+        }
+        return import_sqlite_error(import);
+    }
+    sqlite3_reset(import->port_stmt);
+    import->port = sqlite3_last_insert_rowid(import->db);
+    import->ports++;
+    return 1;
+}
+
+static int import_file(dump_import* import, dump_value* values, int count) {
+    int i, path = 0;
+    if (import->port == 0) {
+        return import_error(import, "registry::invalid-dump",
+                "file before any port");
+    }
+    sqlite3_bind_int64(import->file_stmt, 1, import->port);
+    sqlite3_bind_null(import->file_stmt, 3);
+    for (i=0; i<count; i++) {
+        if (key_is(&values[i], "path") && values[i].type == SQLITE_TEXT) {
+            bind_value(import->file_stmt, 2, &values[i]);
+            path = 1;
+        } else if (key_is(&values[i], "mtime")) {
+            bind_value(import->file_stmt, 3, &values[i]);
+        } else if (!key_is(&values[i], "type")) {
+            return import_error(import, "registry::invalid-dump",
+                    "unknown file column");
+        }
+    }
+    if (!path) {
+        return import_error(import, "registry::invalid-dump",
+                "file without a path");
+    }
+    if (sqlite3_step(import->file_stmt) != SQLITE_DONE) {
+        if (sqlite3_reset(import->file_stmt) == SQLITE_CONSTRAINT) {
+            return import_error(import, "registry::already-owned",
+                    "mapped file is already owned by another entry");
+        }
+        return import_sqlite_error(import);
+    }
+    sqlite3_reset(import->file_stmt);
+    import->files++;
+    return 1;
+}
+
+/*
+ * Loads every line after the header.
+ */
+static int import_rows(dump_import* import) {
+    dump_value values[DUMP_MAX_FIELDS];
+    char* port_query = "INSERT INTO registry.ports (name, portfile, url, "
+        "location, epoch, version, revision, variants, state, date) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    char* file_query = "INSERT INTO registry.files (port_id, path, mtime) "
+        "VALUES (?, ?, ?)";
+    int count, ok = 1;
+    if (sqlite3_prepare_v2(import->db, port_query, -1, &import->port_stmt,
+                NULL) != SQLITE_OK) {
+        set_sqlite_result(import->interp, import->db, port_query);
+        return 0;
+    }
+    if (sqlite3_prepare_v2(import->db, file_query, -1, &import->file_stmt,
+                NULL) != SQLITE_OK) {
+        set_sqlite_result(import->interp, import->db, file_query);
+        return 0;
+    }
+    while (ok && (count = import_line(import, values)) > 0) {
+        const char* type = NULL;
+        int i;
+        for (i=0; i<count; i++) {
+            if (key_is(&values[i], "type") && values[i].type == SQLITE_TEXT) {
+                type = values[i].str;
+                if (values[i].len == 4 && strncmp(type, "port", 4) == 0) {
+                    ok = import_port(import, values, count);
+                } else if (values[i].len == 4
+                        && strncmp(type, "file", 4) == 0) {
+                    ok = import_file(import, values, count);
+                } else {
+                    type = NULL;
+                }
+                break;
+            }
+        }
+        if (ok && type == NULL) {
+            ok = import_error(import, "registry::invalid-dump",
+                    "line is neither a port nor a file");
+        }
+    }
+    return ok && count == 0;
+}
+
+/*
+ * registry::import channel
+ *
+ * Adds the ports and files `registry::export` wrote to `channel`, which should
+ * use the utf-8 encoding, to the registry, and returns a dict of how many
+ * `ports` and `files` it added. Either all of them are added or, on error,
+ * none are; an error in the export itself is reported with its line number and
+ * the error code `registry::invalid-dump`.
+ */
+int import_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    dump_import import;
+    int ok;
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "channel");
+        return TCL_ERROR;
+    }
+    memset(&import, 0, sizeof(import));
+    import.interp = interp;
+    import.chan = dump_channel(interp, objv[1], TCL_READABLE);
+    if (import.chan == NULL) {
+        return TCL_ERROR;
+    }
+    writer_sync(interp);
+    changes_check(interp);
+    import.db = registry_db(interp, 1);
+    if (import.db == NULL) {
+        return TCL_ERROR;
+    }
+    if (registry_flags(interp) & REGISTRY_READONLY) {
+        Tcl_SetResult(interp, "registry is open read-only", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (!import_cache(&import)) {
+        return TCL_ERROR;
+    }
+    import.chunk = Tcl_NewObj();
+    Tcl_IncrRefCount(import.chunk);
+    Tcl_DStringInit(&import.buffer);
+    ok = import_exec(&import, "BEGIN IMMEDIATE")
+        && import_header(&import)
+        && dump_drop_indexes(interp, import.db, &import.indexes)
+        && import_rows(&import);
+    sqlite3_finalize(import.port_stmt);
+    sqlite3_finalize(import.file_stmt);
+    ok = ok && dump_create_indexes(interp, import.db, &import.indexes);
+    ok = ok && import_exec(&import, "COMMIT");
+    if (!ok && !sqlite3_get_autocommit(import.db)) {
+        sqlite3_exec(import.db, "ROLLBACK", NULL, NULL, NULL);
+    }
+    /* back to what it was */
+    {
+        char set[64];
+        sprintf(set, "PRAGMA registry.cache_size=%d", import.cache_size);
+        sqlite3_exec(import.db, set, NULL, NULL, NULL);
+    }
+    dump_free_indexes(&import.indexes);
+    Tcl_DecrRefCount(import.chunk);
+    Tcl_DStringFree(&import.buffer);
+    maintain_check(interp);
+    if (!ok) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, dump_counts(interp, import.ports, import.files));
+    return TCL_OK;
+}
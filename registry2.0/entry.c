@@ -30,8 +30,10 @@
 #include <config.h>
 #endif
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <tcl.h>
 #include <sqlite3.h>
 
@@ -39,6 +41,14 @@
 #include "entryobj.h"
 #include "registry.h"
 #include "util.h"
+#include "writer.h"
+#include "async.h"
+#include "stats.h"
+#include "probes.h"
+#include "client.h"
+#include "changes.h"
+#include "results.h"
+#include "maintain.h"
 
 int registry_failed(Tcl_Interp* interp, reg_error* errPtr) {
     Tcl_Obj* result = Tcl_NewStringObj(errPtr->description, -1);
@@ -48,18 +58,563 @@ int registry_failed(Tcl_Interp* interp, reg_error* errPtr) {
     return TCL_ERROR;
 }
 
-static reg_entry* get_entry(Tcl_Interp* interp, char* name, reg_error* errPtr) {
-    return (reg_entry*)get_object(interp, name, "entry", entry_obj_cmd, errPtr);
+/*
+ * Entry handles.
+ *
+ * Every entry proc is backed by an `entry_handle`. The handles of an interp are
+ * kept in a `handle_table`, indexed by rowid so that a search which finds an
+ * entry that already has a proc returns that proc, and linked in
+ * least-recently-used order so that `registry::entry limit` can cap how many
+ * exist at once. Handles evicted by the cap leave behind a small tombstone
+ * mapping their name to their rowid; if the name is used again,
+ * `::registry::unknown` brings the proc back.
+ */
+typedef struct handle_table handle_table;
+typedef struct entry_handle entry_handle;
+
+struct entry_handle {
+    reg_entry entry; /* must come first; entry_obj_cmd takes a reg_entry* */
+    handle_table* table;
+    Tcl_Command token;
+    entry_handle* prev;
+    entry_handle* next;
+    int busy;
+    int indexed;
+};
+
+struct handle_table {
+    Tcl_Interp* interp;
+    Tcl_HashTable by_rowid;
+    Tcl_HashTable tombstones;
+    Tcl_HashTable tomb_rowids;
+    entry_handle* head;
+    entry_handle* tail;
+    int count;
+    int limit;
+    int next_name;
+};
+
+static int entry_handle_cmd(ClientData clientData, Tcl_Interp* interp,
+        int objc, Tcl_Obj* CONST objv[]);
+
+/*
+ * Tombstones are indexed both by name (to revive a proc when its name is used)
+ * and by rowid (so a search that finds the entry again reuses the name instead
+ * of minting a new one). There is at most one per entry.
+ */
+static void tomb_add(handle_table* table, const char* name,
+        sqlite_int64 rowid) {
+    int created;
+    Tcl_HashEntry* hash = Tcl_CreateHashEntry(&table->tombstones, name,
+            &created);
+    if (created) {
+        sqlite_int64* value = (sqlite_int64*)ckalloc(sizeof(sqlite_int64));
+        *value = rowid;
+        Tcl_SetHashValue(hash, value);
+        Tcl_SetHashValue(Tcl_CreateHashEntry(&table->tomb_rowids,
+                    (char*)(size_t)rowid, &created), hash);
+    }
+}
+
+static void tomb_remove(handle_table* table, Tcl_HashEntry* hash) {
+    sqlite_int64* rowid = (sqlite_int64*)Tcl_GetHashValue(hash);
+    Tcl_HashEntry* by_rowid = Tcl_FindHashEntry(&table->tomb_rowids,
+            (char*)(size_t)*rowid);
+    if (by_rowid != NULL && Tcl_GetHashValue(by_rowid) == hash) {
+        Tcl_DeleteHashEntry(by_rowid);
+    }
+    ckfree((char*)rowid);
+    Tcl_DeleteHashEntry(hash);
+}
+
+static char* tomb_find(handle_table* table, sqlite_int64 rowid) {
+    Tcl_HashEntry* by_rowid = Tcl_FindHashEntry(&table->tomb_rowids,
+            (char*)(size_t)rowid);
+    if (by_rowid != NULL) {
+        Tcl_HashEntry* hash = (Tcl_HashEntry*)Tcl_GetHashValue(by_rowid);
+        if (*(sqlite_int64*)Tcl_GetHashValue(hash) == rowid) {
+            return Tcl_GetHashKey(&table->tombstones, hash);
+        }
+    }
+    return NULL;
+}
+
+static void tomb_clear(handle_table* table) {
+    Tcl_HashSearch search;
+    Tcl_HashEntry* hash;
+    for (hash = Tcl_FirstHashEntry(&table->tombstones, &search); hash != NULL;
+            hash = Tcl_NextHashEntry(&search)) {
+        ckfree((char*)Tcl_GetHashValue(hash));
+    }
+    Tcl_DeleteHashTable(&table->tombstones);
+    Tcl_DeleteHashTable(&table->tomb_rowids);
+    Tcl_InitHashTable(&table->tombstones, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&table->tomb_rowids, TCL_ONE_WORD_KEYS);
+}
+
+/*
+ * Forgets the tombstone of an entry deleted through the interp's connection,
+ * so its old name can't bring back a proc for a row that is gone (or that
+ * sqlite has since given to another port). Handles hold nothing but a rowid,
+ * so changes by others need no action.
+ */
+static void handle_changed(ClientData clientData, int tables, int op,
+        sqlite_int64 rowid) {
+    handle_table* table = (handle_table*)clientData;
+    if (tables == CHANGE_PORTS && op == SQLITE_DELETE) {
+        Tcl_HashEntry* by_rowid = Tcl_FindHashEntry(&table->tomb_rowids,
+                (char*)(size_t)rowid);
+        if (by_rowid != NULL && tomb_find(table, rowid) != NULL) {
+            tomb_remove(table, (Tcl_HashEntry*)Tcl_GetHashValue(by_rowid));
+        }
+    }
+}
+
+static void delete_handle_table(ClientData clientData, Tcl_Interp* interp) {
+    handle_table* table = (handle_table*)clientData;
+    entry_handle* handle;
+    changes_unlisten(interp, handle_changed, table);
+    /* any procs still alive outlive the table; cut them loose */
+    for (handle = table->head; handle != NULL; handle = handle->next) {
+        handle->table = NULL;
+    }
+    tomb_clear(table);
+    Tcl_DeleteHashTable(&table->tombstones);
+    Tcl_DeleteHashTable(&table->tomb_rowids);
+    Tcl_DeleteHashTable(&table->by_rowid);
+    ckfree((char*)table);
+}
+
+static handle_table* get_handle_table(Tcl_Interp* interp) {
+    handle_table* table = Tcl_GetAssocData(interp, "registry::handles", NULL);
+    if (table == NULL) {
+        table = (handle_table*)ckalloc(sizeof(handle_table));
+        table->interp = interp;
+        Tcl_InitHashTable(&table->by_rowid, TCL_ONE_WORD_KEYS);
+        Tcl_InitHashTable(&table->tombstones, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&table->tomb_rowids, TCL_ONE_WORD_KEYS);
+        table->head = NULL;
+        table->tail = NULL;
+        table->count = 0;
+        table->limit = 0;
+        table->next_name = 0;
+        Tcl_SetAssocData(interp, "registry::handles", delete_handle_table,
+                table);
+        changes_listen(interp, handle_changed, table);
+    }
+    return table;
+}
+
+static void handle_unlink(entry_handle* handle) {
+    handle_table* table = handle->table;
+    if (handle->prev != NULL) {
+        handle->prev->next = handle->next;
+    } else {
+        table->head = handle->next;
+    }
+    if (handle->next != NULL) {
+        handle->next->prev = handle->prev;
+    } else {
+        table->tail = handle->prev;
+    }
+}
+
+/**
+ * Moves `handle` to the front of the LRU list.
+ */
+static void handle_touch(entry_handle* handle) {
+    handle_table* table = handle->table;
+    if (table == NULL || table->head == handle) {
+        return;
+    }
+    handle_unlink(handle);
+    handle->prev = NULL;
+    handle->next = table->head;
+    table->head->prev = handle;
+    table->head = handle;
+}
+
+/**
+ * Looks up the indexed handle for `rowid`, if there is one.
+ */
+static entry_handle* handle_find(handle_table* table, sqlite_int64 rowid) {
+    Tcl_HashEntry* hash = Tcl_FindHashEntry(&table->by_rowid,
+            (char*)(size_t)rowid);
+    if (hash != NULL) {
+        entry_handle* handle = (entry_handle*)Tcl_GetHashValue(hash);
+        if (handle->entry.rowid == rowid) {
+            return handle;
+        }
+    }
+    return NULL;
 }
 
 static void delete_entry(ClientData clientData) {
-    reg_entry_free(NULL, &clientData, 1);
+    entry_handle* handle = (entry_handle*)clientData;
+    handle_table* table = handle->table;
+    if (table != NULL) {
+        if (handle->indexed) {
+            Tcl_HashEntry* hash = Tcl_FindHashEntry(&table->by_rowid,
+                    (char*)(size_t)handle->entry.rowid);
+            if (hash != NULL && Tcl_GetHashValue(hash) == handle) {
+                Tcl_DeleteHashEntry(hash);
+            }
+        }
+        handle_unlink(handle);
+        table->count--;
+    }
+    Tcl_EventuallyFree(handle, TCL_DYNAMIC);
 }
 
-static int set_entry(Tcl_Interp* interp, char* name, reg_entry* entry,
-        reg_error* errPtr) {
-    return set_object(interp, name, entry, "entry", entry_obj_cmd, delete_entry,
-                errPtr);
+/**
+ * Evicts least-recently-used handles until the table is within its limit.
+ * Handles whose procs are currently running are skipped. Indexed handles leave
+ * a tombstone behind; the others were made from references, which can make
+ * them again by themselves.
+ */
+static void handle_evict(handle_table* table) {
+    entry_handle* handle = table->tail;
+    while (table->limit > 0 && table->count > table->limit
+            && handle != NULL) {
+        entry_handle* prev = handle->prev;
+        if (handle->busy == 0) {
+            if (handle->indexed) {
+                Tcl_Obj* name = Tcl_NewObj();
+                Tcl_IncrRefCount(name);
+                Tcl_GetCommandFullName(table->interp, handle->token, name);
+                tomb_add(table, Tcl_GetString(name), handle->entry.rowid);
+                Tcl_DecrRefCount(name);
+            }
+            Tcl_DeleteCommandFromToken(table->interp, handle->token);
+        }
+        handle = prev;
+    }
+}
+
+/**
+ * Creates the proc `name` for the entry with the given rowid.
+ *
+ * If `indexed` is set, the proc becomes the one `entry_to_obj` hands out for
+ * that rowid. Creating a handle may evict others if the table is over its
+ * limit.
+ */
+static entry_handle* set_entry(Tcl_Interp* interp, char* name,
+        sqlite_int64 rowid, sqlite3* db, int indexed, reg_error* errPtr) {
+    handle_table* table = get_handle_table(interp);
+    entry_handle* handle = (entry_handle*)ckalloc(sizeof(entry_handle));
+    Tcl_HashEntry* hash;
+    handle->entry.rowid = rowid;
+    handle->entry.db = db;
+    handle->table = table;
+    handle->busy = 0;
+    handle->indexed = indexed;
+    if (!set_object(interp, name, handle, "entry", entry_handle_cmd,
+                delete_entry, errPtr)) {
+        ckfree((char*)handle);
+        return NULL;
+    }
+    handle->token = Tcl_FindCommand(interp, name, NULL, TCL_GLOBAL_ONLY);
+    handle->prev = NULL;
+    handle->next = table->head;
+    if (table->head != NULL) {
+        table->head->prev = handle;
+    } else {
+        table->tail = handle;
+    }
+    table->head = handle;
+    table->count++;
+    if (indexed) {
+        int created;
+        hash = Tcl_CreateHashEntry(&table->by_rowid, (char*)(size_t)rowid,
+                &created);
+        Tcl_SetHashValue(hash, handle);
+    }
+    /* a live name can't be a tombstone any more */
+    if (table->tombstones.numEntries > 0) {
+        Tcl_Obj* fullName = Tcl_NewObj();
+        Tcl_IncrRefCount(fullName);
+        Tcl_GetCommandFullName(interp, handle->token, fullName);
+        hash = Tcl_FindHashEntry(&table->tombstones, Tcl_GetString(fullName));
+        if (hash != NULL) {
+            tomb_remove(table, hash);
+        }
+        Tcl_DecrRefCount(fullName);
+    }
+    handle->busy++;
+    handle_evict(table);
+    handle->busy--;
+    REG_PROBE3(handle_create, name, rowid, table->count);
+    return handle;
+}
+
+/**
+ * Generates a name for a new entry proc. The table remembers where it left
+ * off, so naming N procs takes O(N) rather than O(N^2).
+ */
+static char* handle_name(Tcl_Interp* interp) {
+    handle_table* table = get_handle_table(interp);
+    return unique_name(interp, "registry::entry", &table->next_name);
+}
+
+/**
+ * Deletes every entry proc in `interp`, and forgets every tombstone.
+ */
+void close_all_entries(Tcl_Interp* interp) {
+    handle_table* table = Tcl_GetAssocData(interp, "registry::handles", NULL);
+    if (table == NULL) {
+        return;
+    }
+    while (table->head != NULL) {
+        Tcl_DeleteCommandFromToken(interp, table->head->token);
+    }
+    tomb_clear(table);
+    table->next_name = 0;
+}
+
+/**
+ * The proc for an entry handle. Marks the handle as recently used (and as
+ * in use, so it can't be evicted out from under itself) and passes the call on
+ * to `entry_obj_cmd`.
+ */
+static int entry_handle_cmd(ClientData clientData, Tcl_Interp* interp,
+        int objc, Tcl_Obj* CONST objv[]) {
+    entry_handle* handle = (entry_handle*)clientData;
+    int result;
+    handle_touch(handle);
+    handle->busy++;
+    Tcl_Preserve(handle);
+    result = entry_obj_cmd((ClientData)&handle->entry, interp, objc, objv);
+    handle->busy--;
+    Tcl_Release(handle);
+    return result;
+}
+
+static reg_entry* get_entry(Tcl_Interp* interp, char* name, reg_error* errPtr) {
+    entry_handle* handle = (entry_handle*)get_object(interp, name, "entry",
+            entry_handle_cmd, errPtr);
+    return handle == NULL ? NULL : &handle->entry;
+}
+
+/*
+ * Entry references.
+ *
+ * `registry::entry search -refs` returns plain Tcl values instead of procs. A
+ * reference carries the rowid of its entry in its internal representation, so
+ * scanning thousands of entries creates no commands at all. Its string form is
+ * `registry::ref<rowid>`; if a script uses it as a command, the unknown handler
+ * installed by `install_ref_handler` creates that proc on the spot.
+ */
+#define REF_PREFIX "registry::ref"
+
+static void ref_free_int_rep(Tcl_Obj* obj);
+static void ref_dup_int_rep(Tcl_Obj* src, Tcl_Obj* dst);
+static void ref_update_string(Tcl_Obj* obj);
+static int ref_set_from_any(Tcl_Interp* interp, Tcl_Obj* obj);
+
+static Tcl_ObjType ref_type = {
+    "registry::ref",
+    ref_free_int_rep,
+    ref_dup_int_rep,
+    ref_update_string,
+    ref_set_from_any
+};
+
+static void ref_set_int_rep(Tcl_Obj* obj, sqlite_int64 rowid) {
+    reg_entry* entry = (reg_entry*)ckalloc(sizeof(reg_entry));
+    entry->rowid = rowid;
+    entry->db = NULL;
+    obj->internalRep.otherValuePtr = entry;
+    obj->typePtr = &ref_type;
+}
+
+static void ref_free_int_rep(Tcl_Obj* obj) {
+    ckfree((char*)obj->internalRep.otherValuePtr);
+}
+
+static void ref_dup_int_rep(Tcl_Obj* src, Tcl_Obj* dst) {
+    ref_set_int_rep(dst, ((reg_entry*)src->internalRep.otherValuePtr)->rowid);
+}
+
+static void ref_update_string(Tcl_Obj* obj) {
+    char buffer[sizeof(REF_PREFIX) + TCL_INTEGER_SPACE * 2];
+    int len;
+    sprintf(buffer, "%s%lld", REF_PREFIX,
+            ((reg_entry*)obj->internalRep.otherValuePtr)->rowid);
+    len = strlen(buffer);
+    obj->bytes = ckalloc(len + 1);
+    memcpy(obj->bytes, buffer, len + 1);
+    obj->length = len;
+}
+
+/**
+ * Parses `registry::ref<rowid>` (optionally fully qualified) into its rowid.
+ * Returns 1 on success.
+ */
+static int ref_parse(const char* name, sqlite_int64* rowid) {
+    char* end;
+    if (strncmp(name, "::", 2) == 0) {
+        name += 2;
+    }
+    if (strncmp(name, REF_PREFIX, sizeof(REF_PREFIX) - 1) != 0) {
+        return 0;
+    }
+    name += sizeof(REF_PREFIX) - 1;
+    if (*name < '0' || *name > '9') {
+        return 0;
+    }
+    *rowid = strtoll(name, &end, 10);
+    return *end == '\0';
+}
+
+static int ref_set_from_any(Tcl_Interp* interp, Tcl_Obj* obj) {
+    sqlite_int64 rowid;
+    if (!ref_parse(Tcl_GetString(obj), &rowid)) {
+        if (interp != NULL) {
+            Tcl_ResetResult(interp);
+            Tcl_AppendResult(interp, "expected entry reference but got \"",
+                    Tcl_GetString(obj), "\"", NULL);
+        }
+        return TCL_ERROR;
+    }
+    if (obj->typePtr != NULL && obj->typePtr->freeIntRepProc != NULL) {
+        obj->typePtr->freeIntRepProc(obj);
+    }
+    ref_set_int_rep(obj, rowid);
+    return TCL_OK;
+}
+
+/**
+ * Re-creates the proc `name` if it's a reference or the tombstone of an
+ * evicted handle. Returns 1 and sets `procName` to the proc's fully qualified
+ * name if `name` now names an entry proc.
+ */
+static int revive_entry(Tcl_Interp* interp, Tcl_Obj* nameObj,
+        Tcl_Obj** procName) {
+    char* name = Tcl_GetString(nameObj);
+    handle_table* table = get_handle_table(interp);
+    sqlite_int64 rowid;
+    int indexed = 0;
+    Tcl_DString qualified;
+    Tcl_CmdInfo info;
+    Tcl_DStringInit(&qualified);
+    if (ref_parse(name, &rowid)) {
+        char buffer[sizeof(REF_PREFIX) + TCL_INTEGER_SPACE * 2 + 2];
+        sprintf(buffer, "::%s%lld", REF_PREFIX, rowid);
+        Tcl_DStringAppend(&qualified, buffer, -1);
+    } else {
+        Tcl_HashEntry* hash;
+        if (strncmp(name, "::", 2) != 0) {
+            Tcl_DStringAppend(&qualified, "::", 2);
+        }
+        Tcl_DStringAppend(&qualified, name, -1);
+        hash = Tcl_FindHashEntry(&table->tombstones,
+                Tcl_DStringValue(&qualified));
+        if (hash == NULL) {
+            Tcl_DStringFree(&qualified);
+            return 0;
+        }
+        rowid = *(sqlite_int64*)Tcl_GetHashValue(hash);
+        indexed = (handle_find(table, rowid) == NULL);
+    }
+    if (!Tcl_GetCommandInfo(interp, Tcl_DStringValue(&qualified), &info)) {
+        reg_error error;
+        sqlite3* db = registry_db(interp, 1);
+        if (db == NULL || set_entry(interp, Tcl_DStringValue(&qualified),
+                    rowid, db, indexed, &error) == NULL) {
+            if (db != NULL) {
+                reg_error_destruct(&error);
+            }
+            Tcl_DStringFree(&qualified);
+            return 0;
+        }
+    }
+    *procName = Tcl_NewStringObj(Tcl_DStringValue(&qualified), -1);
+    Tcl_DStringFree(&qualified);
+    return 1;
+}
+
+/**
+ * ::registry::unknown cmd ?arg ...?
+ *
+ * Installed as the global namespace's unknown handler when the package is
+ * loaded. If `cmd` is a reference, or an entry proc that was evicted by
+ * `registry::entry limit`, creates its proc and invokes it; otherwise passes
+ * everything on to the handler it replaced.
+ */
+static int ref_unknown(ClientData clientData, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    Tcl_Obj* previous = (Tcl_Obj*)clientData;
+    Tcl_Obj* name;
+    if (objc >= 2 && revive_entry(interp, objv[1], &name)) {
+        int result;
+        Tcl_Obj** args = (Tcl_Obj**)ckalloc((objc - 1) * sizeof(Tcl_Obj*));
+        memcpy(args, objv + 1, (objc - 1) * sizeof(Tcl_Obj*));
+        args[0] = name;
+        Tcl_IncrRefCount(name);
+        result = Tcl_EvalObjv(interp, objc - 1, args, 0);
+        Tcl_DecrRefCount(name);
+        ckfree((char*)args);
+        return result;
+    } else {
+        int result;
+        Tcl_Obj* cmd = Tcl_DuplicateObj(previous);
+        Tcl_IncrRefCount(cmd);
+        if (Tcl_ListObjReplace(interp, cmd, INT_MAX, 0, objc-1, objv+1)
+                != TCL_OK) {
+            Tcl_DecrRefCount(cmd);
+            return TCL_ERROR;
+        }
+        /* in the caller's frame, where ::unknown's `uplevel 1` expects */
+        result = Tcl_EvalObjEx(interp, cmd, 0);
+        Tcl_DecrRefCount(cmd);
+        return result;
+    }
+}
+
+static void ref_unknown_delete(ClientData clientData) {
+    Tcl_DecrRefCount((Tcl_Obj*)clientData);
+}
+
+/**
+ * Makes references usable as commands in `interp`.
+ *
+ * This chains `::registry::unknown` in front of whatever unknown handler the
+ * global namespace had (`::unknown` by default). It is called once when the
+ * package is loaded, so handing out references never creates commands. It
+ * relies on `namespace unknown`, so on interps without it references simply
+ * can't be invoked directly; the `registry::entry` subcommands still accept
+ * them.
+ */
+void install_ref_handler(Tcl_Interp* interp) {
+    Tcl_Obj* saved;
+    Tcl_Obj* previous;
+    saved = Tcl_GetObjResult(interp);
+    Tcl_IncrRefCount(saved);
+    if (Tcl_EvalEx(interp, "::namespace eval :: {::namespace unknown}", -1,
+                TCL_EVAL_GLOBAL) == TCL_OK) {
+        previous = Tcl_GetObjResult(interp);
+        if (Tcl_GetCharLength(previous) == 0) {
+            previous = Tcl_NewStringObj("::unknown", -1);
+        }
+        Tcl_IncrRefCount(previous);
+        Tcl_CreateObjCommand(interp, "::registry::unknown", ref_unknown,
+                previous, ref_unknown_delete);
+        Tcl_EvalEx(interp, "::namespace eval :: "
+                "{::namespace unknown ::registry::unknown}", -1,
+                TCL_EVAL_GLOBAL);
+    }
+    Tcl_SetObjResult(interp, saved);
+    Tcl_DecrRefCount(saved);
+}
+
+/**
+ * Returns a new reference to the entry with the given rowid.
+ */
+Tcl_Obj* new_ref_obj(sqlite_int64 rowid) {
+    Tcl_Obj* obj = Tcl_NewObj();
+    Tcl_InvalidateStringRep(obj);
+    ref_set_int_rep(obj, rowid);
+    return obj;
 }
 
 /**
@@ -87,82 +642,106 @@ static int entry_create(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
         reg_entry* entry = reg_entry_create(db, name, version, revision,
                 variants, epoch, &error);
         if (entry != NULL) {
-            char* name = unique_name(interp, "registry::entry");
-            if (set_entry(interp, name, entry, &error)) {
+            char* name = handle_name(interp);
+            if (set_entry(interp, name, entry->rowid, db, 1, &error)) {
                 Tcl_Obj* res = Tcl_NewStringObj(name, -1);
                 Tcl_SetObjResult(interp, res);
                 free(name);
+                free(entry);
                 return TCL_OK;
             } else {
                 reg_error ignored;
                 free(name);
                 reg_entry_delete(db, &entry, 1, &ignored);
+                free(entry);
             }
         }
         return registry_failed(interp, &error);
     }
 }
 
+/**
+ * Finds the entry named by `obj`, which may be either an entry proc or a
+ * reference. The entry belongs to the proc or to `obj` respectively, so it
+ * must not be freed and is only valid while `obj` is.
+ */
 static int obj_to_entry(Tcl_Interp* interp, reg_entry** entry, Tcl_Obj* obj,
         reg_error* errPtr) {
-    reg_entry* result = get_entry(interp, Tcl_GetString(obj), errPtr);
-    if (result == NULL) {
+    reg_entry* result;
+    if (obj->typePtr != &ref_type) {
+        result = get_entry(interp, Tcl_GetString(obj), errPtr);
+        if (result != NULL) {
+            *entry = result;
+            return 1;
+        }
+        if (Tcl_ConvertToType(NULL, obj, &ref_type) != TCL_OK) {
+            return 0;
+        }
+        reg_error_destruct(errPtr);
+    }
+    result = (reg_entry*)obj->internalRep.otherValuePtr;
+    result->db = registry_db(interp, 1);
+    if (result->db == NULL) {
+        errPtr->code = "registry::not-open";
+        errPtr->description = "registry is not open";
+        errPtr->free = NULL;
         return 0;
-    } else {
-        *entry = result;
-        return 1;
     }
+    *entry = result;
+    return 1;
+}
+
+static int entry_to_ref(Tcl_Interp* interp UNUSED, Tcl_Obj** obj,
+        reg_entry* entry, reg_error* errPtr UNUSED) {
+    *obj = new_ref_obj(entry->rowid);
+    return 1;
 }
 
 /**
- * TODO: don't create procs for entries that already have them
+ * Returns the proc for `entry`, creating one if it doesn't have one yet.
  */
 static int entry_to_obj(Tcl_Interp* interp, Tcl_Obj** obj, reg_entry* entry,
         reg_error* errPtr) {
-    sqlite3* db = registry_db(interp, 0);
-    if (db == NULL) {
-        return 0;
-    } else {
-        sqlite3_stmt* stmt;
-        char* query = "SELECT proc FROM entry_procs WHERE entry_id=?";
-        if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
-                && (sqlite3_bind_int64(stmt, 1, entry->rowid) == SQLITE_OK)) {
-            int r = sqlite3_step(stmt);
-            char* name;
-            switch (r) {
-                case SQLITE_ROW:
-                    name = sqlite3_column_text(stmt, 0);
-                    *obj = Tcl_NewStringObj(name,
-                            sqlite3_column_bytes(stmt, 0));
-                    sqlite3_finalize(stmt);
-                    return 1;
-                case SQLITE_DONE:
-                    name = unique_name(interp, "registry::entry");
-                    sqlite3_finalize(stmt);
-                    if (set_entry(interp, name, entry, errPtr)) {
-                        /* insert record (not currently error-checked)
-                         * TODO: check it */
-                        sqlite3_prepare(db, "INSERT INTO entry_procs (entry_id,"
-                                "proc) VALUES (?,?)", -1, &stmt, NULL);
-                        sqlite3_bind_int64(stmt, 1, entry->rowid);
-                        sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
-                        sqlite3_step(stmt);
-                        sqlite3_finalize(stmt);
-                        *obj = Tcl_NewStringObj(name, -1);
-                        free(name);
-                        return 1;
-                    }
-                    free(name);
-                    break;
-                default:
-                    reg_sqlite_error(db, errPtr, query);
-                    break;
-            }
+    handle_table* table = get_handle_table(interp);
+    entry_handle* handle = handle_find(table, entry->rowid);
+    if (handle == NULL) {
+        char* tomb = tomb_find(table, entry->rowid);
+        if (tomb != NULL) {
+            Tcl_DString name;
+            Tcl_DStringInit(&name);
+            Tcl_DStringAppend(&name, tomb, -1);
+            handle = set_entry(interp, Tcl_DStringValue(&name), entry->rowid,
+                    entry->db, 1, errPtr);
+            Tcl_DStringFree(&name);
         } else {
-            reg_sqlite_error(db, errPtr, query);
+            char* name = handle_name(interp);
+            handle = set_entry(interp, name, entry->rowid, entry->db, 1,
+                    errPtr);
+            free(name);
         }
-        sqlite3_finalize(stmt);
-        return 0;
+        if (handle == NULL) {
+            return 0;
+        }
+    } else {
+        handle_touch(handle);
+    }
+    *obj = Tcl_NewObj();
+    Tcl_GetCommandFullName(interp, handle->token, *obj);
+    return 1;
+}
+
+/**
+ * Deletes the proc for `obj`, if it has one. For a reference, that's the proc
+ * (if any) that was created when it was invoked.
+ */
+static void close_entry(Tcl_Interp* interp, Tcl_Obj* obj) {
+    if (obj->typePtr == &ref_type) {
+        char name[sizeof(REF_PREFIX) + TCL_INTEGER_SPACE * 2 + 2];
+        sprintf(name, "::%s%lld", REF_PREFIX,
+                ((reg_entry*)obj->internalRep.otherValuePtr)->rowid);
+        Tcl_DeleteCommand(interp, name);
+    } else {
+        Tcl_DeleteCommand(interp, Tcl_GetString(obj));
     }
 }
 
@@ -183,11 +762,15 @@ static int entry_delete(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
         reg_error error;
         if (recast(interp, obj_to_entry, NULL, &entries, &(objv[2]), objc-2,
                     &error)) {
-            if (reg_entry_delete(db, entries, objc-2, &error)) {
-                free(entries);
+            int deleted = reg_entry_delete(db, entries, objc-2, &error);
+            int i;
+            free(entries);
+            for (i=0; i<deleted; i++) {
+                close_entry(interp, objv[i+2]);
+            }
+            if (deleted == objc-2) {
                 return TCL_OK;
             }
-            free(entries);
         }
         return registry_failed(interp, &error);
     }
@@ -215,7 +798,7 @@ static int entry_open(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
         char* epoch = Tcl_GetString(objv[6]);
         char* query = "SELECT rowid FROM registry.ports WHERE "
             "name=? AND version=? AND revision=? AND variants=? AND epoch=?";
-        if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
+        if ((sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
                 && (sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC)
                     == SQLITE_OK)
                 && (sqlite3_bind_text(stmt, 2, version, -1, SQLITE_STATIC)
@@ -260,49 +843,120 @@ static int entry_open(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
 
 \*
  * registry::entry close ?entry ...?
+ * registry::entry close -all
  *
- * Closes an entry. It will remain in the registry until next time.
+ * Closes an entry. It will remain in the registry until next time. With -all,
+ * closes every entry proc in the interp.
  */
 static int entry_close(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
     int i;
+    if (objc == 3 && strcmp(Tcl_GetString(objv[2]), "-all") == 0) {
+        close_all_entries(interp);
+        return TCL_OK;
+    }
     for (i=2; i<objc; i++) {
         reg_error error;
-        char* proc = Tcl_GetString(objv[i]);
-        reg_entry* entry = get_entry(interp, proc, &error);
-        if (entry == NULL) {
+        reg_entry* entry;
+        if (!obj_to_entry(interp, &entry, objv[i], &error)) {
             return registry_failed(interp, &error);
-        } else {
-            Tcl_DeleteCommand(interp, proc);
         }
     }
+    for (i=2; i<objc; i++) {
+        close_entry(interp, objv[i]);
+    }
     return TCL_OK;
 }
 
 /*
- * registry::entry search ?key value ...?
+ * registry::entry limit ?count?
  *
- * Searches the registry for ports for which each key's value is equal to the
- * given value. To find all ports, call `entry search` with no key-value pairs.
+ * Returns or sets the maximum number of entry procs that may exist at once;
+ * 0, the default, means no limit. When a new proc would exceed the limit, the
+ * least recently used procs that aren't currently running are deleted. Their
+ * names keep working: using one brings its proc back.
+ */
+static int entry_limit(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
+    handle_table* table = get_handle_table(interp);
+    if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?count?");
+        return TCL_ERROR;
+    }
+    if (objc == 3) {
+        int limit;
+        if (Tcl_GetIntFromObj(interp, objv[2], &limit) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (limit < 0) {
+            Tcl_SetResult(interp, "limit must not be negative", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        table->limit = limit;
+        handle_evict(table);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(table->limit));
+    return TCL_OK;
+}
+
+#define SEARCH_REFS 1
+#define SEARCH_GLOB 2
+#define SEARCH_REGEXP 4
+
+static option_spec search_options[] = {
+    { "-refs", SEARCH_REFS },
+    { "-exact", 0 },
+    { "-glob", SEARCH_GLOB },
+    { "-regexp", SEARCH_REGEXP },
+    { "--", END_FLAGS },
+    { NULL, 0 }
+};
+
+/*
+ * registry::entry search ?-async callback? ?-refs? ?-exact|-glob|-regexp?
+ *         ?key value ...?
  *
- * TODO: allow selection of -exact, -glob, and -regexp matching.
+ * Searches the registry for ports for which each key's value matches the given
+ * value: is equal to it (the default, or -exact), or matches it as a glob
+ * pattern or regular expression. To find all ports, call `entry search` with no
+ * key-value pairs.
+ *
+ * Normally each result is an entry proc. With -refs, the results are entry
+ * references instead, which cost no commands; see `ref_type`. With -async, the
+ * search runs on a worker thread and its results, always references, are handed
+ * to `callback` in chunks; see async.c.
  */
 static int entry_search(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
     int i;
-    sqlite3* db = registry_db(interp, 1);
-    if (objc % 2 == 1) {
-        Tcl_WrongNumArgs(interp, 2, objv, "search ?key value ...?");
+    int start = 2;
+    int flags;
+    int strategy;
+    Tcl_Obj* callback = NULL;
+    sqlite3* db;
+    if (objc > 3 && strcmp(Tcl_GetString(objv[2]), "-async") == 0) {
+        callback = objv[3];
+        start = 4;
+    }
+    if (parse_flags(interp, objc, objv, &start, search_options, &flags)
+            != TCL_OK) {
         return TCL_ERROR;
-    } else if (db == NULL) {
+    }
+    strategy = (flags & SEARCH_REGEXP) ? 2 : (flags & SEARCH_GLOB) ? 1 : 0;
+    if ((objc - start) % 2 == 1) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-async callback? ?-refs? "
+                "?-exact|-glob|-regexp? ?key value ...?");
+        return TCL_ERROR;
+    } else if (!Tcl_GetAssocData(interp, "registry::attached", NULL)) {
+        Tcl_SetResult(interp, "registry is not open", TCL_STATIC);
         return TCL_ERROR;
     } else {
         char** keys;
         char** vals;
-        int key_count = objc/2 - 1;
+        int key_count = (objc - start) / 2;
         reg_entry** entries;
         reg_error error;
+        reg_arena arena;
         int entry_count;
         /* ensure that valid search keys were used */
-        for (i=2; i<objc; i+=2) {
+        for (i=start; i<objc; i+=2) {
             int index;
             if (Tcl_GetIndexFromObj(interp, objv[i], entry_props, "search key",
                         0, &index) != TCL_OK) {
@@ -311,26 +965,109 @@ static int entry_search(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
         }
         keys = malloc(key_count * sizeof(char*));
         vals = malloc(key_count * sizeof(char*));
-        for (i=0; i<key_count; i+=2) {
-            keys[i] = Tcl_GetString(objv[2*i+2]);
-            vals[i] = Tcl_GetString(objv[2*i+3]);
+        for (i=0; i<key_count; i++) {
+            keys[i] = Tcl_GetString(objv[2*i+start]);
+            vals[i] = Tcl_GetString(objv[2*i+start+1]);
+        }
+        if (callback != NULL) {
+            int result = async_search(interp, callback, keys, vals, key_count,
+                    strategy);
+            free(keys);
+            free(vals);
+            return result;
+        }
+        if (flags & SEARCH_REFS) {
+            int result = client_search(interp, keys, vals, key_count,
+                    strategy);
+            if (result != CLIENT_FALLBACK) {
+                free(keys);
+                free(vals);
+                return result;
+            }
+        }
+        db = registry_db(interp, 1);
+        if (db == NULL) {
+            free(keys);
+            free(vals);
+            return TCL_ERROR;
+        }
+        reg_arena_init(&arena, 4096);
+        entry_count = results_get(interp, strategy, keys, vals, key_count, db,
+                &entries, &arena);
+        if (entry_count < 0) {
+            entry_count = reg_entry_search(db, keys, vals, key_count,
+                    strategy, &entries, &arena, &error);
+            if (entry_count >= 0) {
+                results_put(interp, strategy, keys, vals, key_count, entries,
+                        entry_count);
+            }
         }
-        entry_count = reg_entry_search(db, keys, vals, key_count, 0, &entries,
-                &error);
+        free(keys);
+        free(vals);
         if (entry_count >= 0) {
             Tcl_Obj* resultObj;
             Tcl_Obj** objs;
-            recast(interp, entry_to_obj, NULL, &objs, entries, entry_count,
-                        &error);
-            resultObj = Tcl_NewListObj(entry_count, objs);
-            Tcl_SetObjResult(interp, resultObj);
-            free(entries);
-            return TCL_OK;
+            if (recast(interp, (flags & SEARCH_REFS) ? entry_to_ref
+                        : entry_to_obj, NULL, &objs, entries, entry_count,
+                        &error)) {
+                resultObj = Tcl_NewListObj(entry_count, objs);
+                Tcl_SetObjResult(interp, resultObj);
+                free(objs);
+                reg_arena_free(&arena);
+                return TCL_OK;
+            }
         }
+        reg_arena_free(&arena);
         return registry_failed(interp, &error);
     }
 }
 
+/**
+ * registry::entry cmd entry ?arg ...?
+ *
+ * Invokes `cmd` on the given entry, exactly as `$entry cmd ?arg ...?` would.
+ * This lets callers holding references (or proc names) use entries without
+ * creating a proc for each one.
+ */
+static int entry_ref_cmd(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
+    reg_entry* entry;
+    reg_error error;
+    Tcl_Obj** args;
+    int result;
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "entry ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (objc == 3 && client_pending(interp) != NULL
+            && Tcl_ConvertToType(NULL, objv[2], &ref_type) == TCL_OK) {
+        /* reads through registryd; see client.c */
+        sqlite_int64 rowid =
+            ((reg_entry*)objv[2]->internalRep.otherValuePtr)->rowid;
+        const char* cmd = Tcl_GetString(objv[1]);
+        int index;
+        result = CLIENT_FALLBACK;
+        if (strcmp(cmd, "files") == 0) {
+            result = client_files(interp, rowid);
+        } else if (Tcl_GetIndexFromObj(NULL, objv[1], entry_props, NULL, 0,
+                    &index) == TCL_OK) {
+            result = client_propget(interp, rowid, entry_props[index]);
+        }
+        if (result != CLIENT_FALLBACK) {
+            return result;
+        }
+    }
+    if (!obj_to_entry(interp, &entry, objv[2], &error)) {
+        return registry_failed(interp, &error);
+    }
+    args = (Tcl_Obj**)ckalloc((objc - 1) * sizeof(Tcl_Obj*));
+    args[0] = objv[2];
+    args[1] = objv[1];
+    memcpy(&args[2], &objv[3], (objc - 3) * sizeof(Tcl_Obj*));
+    result = entry_obj_cmd((ClientData)entry, interp, objc - 1, args);
+    ckfree((char*)args);
+    return result;
+}
+
 /**
  * registry::entry exists name
  *
@@ -353,6 +1090,52 @@ static int entry_exists(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
     return TCL_OK;
 }
 
+/**
+ * registry::entry owner ?-refs? path
+ *
+ * Returns the entry that owns the file `path` (as a reference with -refs), or
+ * the empty string if no entry does.
+ */
+static int entry_owner(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
+    sqlite3* db;
+    int start = 2;
+    int flags;
+    reg_entry* entry;
+    reg_error error;
+    if (parse_flags(interp, objc, objv, &start, search_options, &flags)
+            != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc - start != 1) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-refs? path");
+        return TCL_ERROR;
+    }
+    if (flags & SEARCH_REFS) {
+        int result = client_owner(interp, Tcl_GetString(objv[start]));
+        if (result != CLIENT_FALLBACK) {
+            return result;
+        }
+    }
+    db = registry_db(interp, 1);
+    if (db == NULL) {
+        return TCL_ERROR;
+    }
+    if (!reg_entry_owner(db, Tcl_GetString(objv[start]), &entry, &error)) {
+        return registry_failed(interp, &error);
+    }
+    if (entry != NULL) {
+        Tcl_Obj* result;
+        int ok = ((flags & SEARCH_REFS) ? entry_to_ref : entry_to_obj)(interp,
+                &result, entry, &error);
+        reg_entry_free(db, &entry, 1);
+        if (!ok) {
+            return registry_failed(interp, &error);
+        }
+        Tcl_SetObjResult(interp, result);
+    }
+    return TCL_OK;
+}
+
 /**
  * registry::entry installed ?name? ?version?
  *
@@ -446,7 +1229,7 @@ static int entry_owner(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
         int len;
         char* path = Tcl_GetStringFromObj(objv[2], &len);
         char* query = "SELECT port_id FROM files WHERE path=?";
-        if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
+        if ((sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
                 && (sqlite3_bind_text(stmt, 1, path, len, SQLITE_STATIC)
                     == SQLITE_OK)) {
             if (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -482,8 +1265,24 @@ static entry_cmd_type entry_cmds[] = {
     { "open", entry_open },
     */
     { "close", entry_close },
+    { "limit", entry_limit },
     { "search", entry_search },
     { "exists", entry_exists },
+    { "owner", entry_owner },
+    /* Per-entry commands, taking the entry as their first argument */
+    { "name", entry_ref_cmd },
+    { "portfile", entry_ref_cmd },
+    { "url", entry_ref_cmd },
+    { "location", entry_ref_cmd },
+    { "epoch", entry_ref_cmd },
+    { "version", entry_ref_cmd },
+    { "revision", entry_ref_cmd },
+    { "variants", entry_ref_cmd },
+    { "date", entry_ref_cmd },
+    { "state", entry_ref_cmd },
+    { "map", entry_ref_cmd },
+    { "unmap", entry_ref_cmd },
+    { "files", entry_ref_cmd },
     /*
     { "installed", entry_installed },
     { "active", entry_active },
@@ -508,7 +1307,21 @@ int entry_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
     if (Tcl_GetIndexFromObjStruct(interp, objv[1], entry_cmds,
                 sizeof(entry_cmd_type), "cmd", 0, &cmd_index) == TCL_OK) {
         entry_cmd_type* cmd = &entry_cmds[cmd_index];
-        return cmd->function(interp, objc, objv);
+        Tcl_Time start;
+        int timed, result;
+        /* per-entry commands sort this out (and are timed) in entry_obj_cmd */
+        if (cmd->function == entry_ref_cmd) {
+            return cmd->function(interp, objc, objv);
+        }
+        timed = latency_start(interp, &start);
+        writer_sync(interp);
+        changes_check(interp);
+        result = cmd->function(interp, objc, objv);
+        maintain_check(interp);
+        if (timed) {
+            latency_record(interp, "entry", cmd->name, &start);
+        }
+        return result;
     }
     return TCL_ERROR;
 }
@@ -30,6 +30,14 @@
 
 #include <tcl.h>
 
+#include "centry.h"
+
+int registry_failed(Tcl_Interp* interp, reg_error* errPtr);
+
+void install_ref_handler(Tcl_Interp* interp);
+Tcl_Obj* new_ref_obj(sqlite_int64 rowid);
+void close_all_entries(Tcl_Interp* interp);
+
 int entry_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
         Tcl_Obj* CONST objv[]);
 
@@ -35,9 +35,15 @@
 #include <tcl.h>
 #include <sqlite3.h>
 
+#include "entry.h"
 #include "entryobj.h"
 #include "registry.h"
 #include "util.h"
+#include "writer.h"
+#include "async.h"
+#include "stats.h"
+#include "changes.h"
+#include "maintain.h"
 
 const char* entry_props[] = {
     "name",
@@ -65,7 +71,7 @@ static int entry_obj_prop(Tcl_Interp* interp, entry_t* entry, int objc,
             char* prop = Tcl_GetString(objv[1]);
             char* query = sqlite3_mprintf("SELECT %s FROM registry.ports WHERE "
                     "rowid='%lld'", prop, entry->rowid);
-            if ((sqlite3_prepare(entry->db, query, -1, &stmt, NULL)
+            if ((sqlite3_prepare_v2(entry->db, query, -1, &stmt, NULL)
                         == SQLITE_OK)
                     && (sqlite3_step(stmt) == SQLITE_ROW)) {
                 /* eliminate compiler warning about signedness */
@@ -85,11 +91,18 @@ static int entry_obj_prop(Tcl_Interp* interp, entry_t* entry, int objc,
         if (Tcl_GetIndexFromObj(interp, objv[1], entry_props, "prop", 0, &index)
                 == TCL_OK) {
             sqlite3_stmt* stmt;
+            reg_writer* writer = interp_writer(interp);
             char* prop = Tcl_GetString(objv[1]);
             char* value = Tcl_GetString(objv[2]);
-            char* query = sqlite3_mprintf("UPDATE registry.ports SET %s='%q' "
+            char* query;
+            if (writer != NULL) {
+                writer_propset(writer, entry->rowid, entry_props[index],
+                        objv[2]);
+                return TCL_OK;
+            }
+            query = sqlite3_mprintf("UPDATE registry.ports SET %s='%q' "
                     "WHERE rowid='%lld'", prop, value, entry->rowid);
-            if ((sqlite3_prepare(entry->db, query, -1, &stmt, NULL)
+            if ((sqlite3_prepare_v2(entry->db, query, -1, &stmt, NULL)
                         == SQLITE_OK)
                     && (sqlite3_step(stmt) == SQLITE_DONE)) {
                 sqlite3_finalize(stmt);
@@ -105,122 +118,280 @@ static int entry_obj_prop(Tcl_Interp* interp, entry_t* entry, int objc,
     return TCL_ERROR;
 }
 
+typedef int (mapping_function)(sqlite3* db, reg_entry* entry, char** files,
+        int file_count, reg_error* errPtr);
+
+/*
+ * Runs `fn` on the files in objv[2..]. The files are either all mapped (or
+ * unmapped) or, if one of them fails, none are.
+ */
+static int entry_obj_mapping(Tcl_Interp* interp, entry_t* entry, int objc,
+        Tcl_Obj* CONST objv[], mapping_function* fn) {
+    int file_count = objc - 2;
+    char** files;
+    reg_error error;
+    int i, result;
+    if (file_count == 0) {
+        return TCL_OK;
+    }
+    files = (char**)ckalloc(file_count * sizeof(char*));
+    for (i=0; i<file_count; i++) {
+        files[i] = Tcl_GetString(objv[i+2]);
+    }
+    result = fn(entry->db, (reg_entry*)entry, files, file_count, &error);
+    ckfree((char*)files);
+    if (result != file_count) {
+        return registry_failed(interp, &error);
+    }
+    return TCL_OK;
+}
+
 /*
  * ${entry} map ?file ...?
+ * ${entry} map -async callback ?file ...?
  *
  * Maps the listed files to the port represented by ${entry}. This will throw an
- * error if a file is mapped to an already-existing file, but not a very
- * descriptive one.
+ * error if a file is already owned by another entry. Nothing is mapped unless
+ * every file can be.
  *
- * TODO: more descriptive error on duplicated file
+ * With a background writer running, the files are only queued, and any error
+ * is thrown by the next `registry::flush` instead. With -async, they are mapped
+ * on a worker thread in a single transaction, and `callback` hears about the
+ * progress; see async.c.
  */
 static int entry_obj_map(Tcl_Interp* interp, entry_t* entry, int objc,
         Tcl_Obj* CONST objv[]) {
-    sqlite3_stmt* stmt;
-    char* query = "INSERT INTO files (port_id, path) VALUES (?, ?)";
-    /* BEGIN */
-    if ((sqlite3_prepare(entry->db, query, -1, &stmt, NULL) == SQLITE_OK)
-            && (sqlite3_bind_int(stmt, 1, entry->rowid) == SQLITE_OK)) {
-        int i;
-        for (i=2; i<objc; i++) {
-            int len;
-            char* path = Tcl_GetStringFromObj(objv[i], &len);
-            if ((sqlite3_bind_text(stmt, 2, path, len, SQLITE_STATIC)
-                        != SQLITE_OK)
-                    || (sqlite3_step(stmt) != SQLITE_DONE)) {
-                set_sqlite_result(interp, entry->db, query);
-                sqlite3_finalize(stmt);
-                /* END or ROLLBACK? */
-                return TCL_ERROR;
-            }
-            sqlite3_reset(stmt);
+    reg_writer* writer = interp_writer(interp);
+    if (objc > 2 && strcmp(Tcl_GetString(objv[2]), "-async") == 0) {
+        if (objc < 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "-async callback ?file ...?");
+            return TCL_ERROR;
         }
-        sqlite3_finalize(stmt);
-        /* END */
+        writer_sync(interp);
+        return async_map(interp, objv[3], entry->rowid, objc - 4, objv + 4);
+    }
+    if (writer != NULL) {
+        writer_map(writer, entry->rowid, objc - 2, objv + 2);
         return TCL_OK;
-    } else {
-        set_sqlite_result(interp, entry->db, query);
-        sqlite3_finalize(stmt);
-        /* END */
-        return TCL_ERROR;
     }
+    return entry_obj_mapping(interp, entry, objc, objv, reg_entry_map);
 }
 
 /*
  * ${entry} unmap ?file ...?
  *
- * Unmaps the listed files from the given port. Will throw an error if a file
- * that is not mapped to the port is attempted to be unmapped.
+ * Unmaps the listed files from the given port. Will throw an error, and unmap
+ * nothing, if any of the files is not mapped to the port. As with `map`, a
+ * running background writer only queues the request.
  */
 static int entry_obj_unmap(Tcl_Interp* interp, entry_t* entry, int objc,
         Tcl_Obj* CONST objv[]) {
-    sqlite3_stmt* stmt;
-    char* query = "DELETE FROM files WHERE port_id=? AND path=?";
-    /* BEGIN */
-    if (sqlite3_prepare(entry->db, query, -1, &stmt, NULL) == SQLITE_OK) {
-        int i;
-        for (i=2; i<objc; i++) {
-            int len;
-            char* path = Tcl_GetStringFromObj(objv[i], &len);
-            if ((sqlite3_bind_int(stmt, 1, entry->rowid) != SQLITE_OK)
-                    || (sqlite3_bind_text(stmt, 2, path, len, SQLITE_STATIC)
-                        != SQLITE_OK)
-                    || (sqlite3_step(stmt) != SQLITE_DONE)) {
-                if (sqlite3_reset(stmt) == SQLITE_CONSTRAINT) {
-                    Tcl_AppendResult(interp, "an existing port owns \"", path,
-                            "\"", NULL);
-                } else {
-                    set_sqlite_result(interp, entry->db, query);
-                }
-                sqlite3_finalize(stmt);
-                /* END or ROLLBACK? */
-                return TCL_ERROR;
-            }
-            if (sqlite3_changes(entry->db) == 0) {
-                Tcl_AppendResult(interp, Tcl_GetString(objv[i]), " is not "
-                        "mapped to this entry", NULL);
-                sqlite3_finalize(stmt);
-                /* END or ROLLBACK? */
-                return TCL_ERROR;
-            }
-            sqlite3_reset(stmt);
-        }
-        sqlite3_finalize(stmt);
-        /* END */
+    reg_writer* writer = interp_writer(interp);
+    if (writer != NULL) {
+        writer_unmap(writer, entry->rowid, objc - 2, objv + 2);
         return TCL_OK;
-    } else {
-        set_sqlite_result(interp, entry->db, query);
-        sqlite3_finalize(stmt);
-        /* END */
-        return TCL_ERROR;
+    }
+    return entry_obj_mapping(interp, entry, objc, objv, reg_entry_unmap);
+}
+
+/*
+ * A path that shares its directory with its neighbors.
+ *
+ * `$entry files -compact` returns paths of this type. Consecutive files in the
+ * same directory point at one refcounted copy of the directory, and only the
+ * last component is stored per file. The full string is only built if a caller
+ * actually asks for it.
+ */
+typedef struct {
+    int refCount;
+    int len;
+    char str[1];
+} path_prefix;
+
+static void path_free_int_rep(Tcl_Obj* obj);
+static void path_dup_int_rep(Tcl_Obj* src, Tcl_Obj* dst);
+static void path_update_string(Tcl_Obj* obj);
+
+static Tcl_ObjType path_type = {
+    "registry::path",
+    path_free_int_rep,
+    path_dup_int_rep,
+    path_update_string,
+    NULL
+};
+
+static path_prefix* path_prefix_new(const char* str, int len) {
+    path_prefix* prefix = (path_prefix*)ckalloc(sizeof(path_prefix) + len);
+    prefix->refCount = 0;
+    prefix->len = len;
+    memcpy(prefix->str, str, len);
+    prefix->str[len] = '\0';
+    return prefix;
+}
+
+static void path_prefix_release(path_prefix* prefix) {
+    if (--prefix->refCount == 0) {
+        ckfree((char*)prefix);
     }
 }
 
+static Tcl_Obj* path_new_obj(path_prefix* prefix, const char* suffix,
+        int len) {
+    Tcl_Obj* obj = Tcl_NewObj();
+    char* copy = ckalloc(len + 1);
+    memcpy(copy, suffix, len);
+    copy[len] = '\0';
+    Tcl_InvalidateStringRep(obj);
+    prefix->refCount++;
+    obj->internalRep.twoPtrValue.ptr1 = prefix;
+    obj->internalRep.twoPtrValue.ptr2 = copy;
+    obj->typePtr = &path_type;
+    return obj;
+}
+
+static void path_free_int_rep(Tcl_Obj* obj) {
+    path_prefix_release((path_prefix*)obj->internalRep.twoPtrValue.ptr1);
+    ckfree((char*)obj->internalRep.twoPtrValue.ptr2);
+}
+
+static void path_dup_int_rep(Tcl_Obj* src, Tcl_Obj* dst) {
+    path_prefix* prefix = (path_prefix*)src->internalRep.twoPtrValue.ptr1;
+    char* suffix = (char*)src->internalRep.twoPtrValue.ptr2;
+    int len = strlen(suffix);
+    char* copy = ckalloc(len + 1);
+    memcpy(copy, suffix, len + 1);
+    prefix->refCount++;
+    dst->internalRep.twoPtrValue.ptr1 = prefix;
+    dst->internalRep.twoPtrValue.ptr2 = copy;
+    dst->typePtr = &path_type;
+}
+
+static void path_update_string(Tcl_Obj* obj) {
+    path_prefix* prefix = (path_prefix*)obj->internalRep.twoPtrValue.ptr1;
+    char* suffix = (char*)obj->internalRep.twoPtrValue.ptr2;
+    int len = strlen(suffix);
+    obj->bytes = ckalloc(prefix->len + len + 1);
+    memcpy(obj->bytes, prefix->str, prefix->len);
+    memcpy(obj->bytes + prefix->len, suffix, len + 1);
+    obj->length = prefix->len + len;
+}
+
+typedef struct {
+    Tcl_Obj** objs;
+    int count;
+    int space;
+    path_prefix* prefix;
+} files_list;
+
+/*
+ * Row visitors for `$entry files`. Each element is made straight from the text
+ * sqlite hands us and stored in a slot sized by `reg_entry_file_count`, so the
+ * paths are copied exactly once and the list is never regrown. (If files were
+ * mapped in between, the slots grow to fit.)
+ */
+static Tcl_Obj** file_slot(files_list* list, int row) {
+    if (row >= list->space) {
+        list->space = 2 * row + 1;
+        list->objs = (Tcl_Obj**)ckrealloc((char*)list->objs,
+                list->space * sizeof(Tcl_Obj*));
+    }
+    list->count = row + 1;
+    return &list->objs[row];
+}
+
+static int file_to_obj(void* userdata, int row, const char* value, int len,
+        reg_error* errPtr UNUSED) {
+    files_list* list = (files_list*)userdata;
+    *file_slot(list, row) = Tcl_NewStringObj(value, len);
+    return 1;
+}
+
+static int file_to_path_obj(void* userdata, int row, const char* value,
+        int len, reg_error* errPtr UNUSED) {
+    files_list* list = (files_list*)userdata;
+    int dir_len = len;
+    while (dir_len > 0 && value[dir_len-1] != '/') {
+        dir_len--;
+    }
+    if (list->prefix == NULL || list->prefix->len != dir_len
+            || memcmp(list->prefix->str, value, dir_len) != 0) {
+        path_prefix* prefix = path_prefix_new(value, dir_len);
+        prefix->refCount++;
+        if (list->prefix != NULL) {
+            path_prefix_release(list->prefix);
+        }
+        list->prefix = prefix;
+    }
+    *file_slot(list, row) = path_new_obj(list->prefix, value + dir_len,
+            len - dir_len);
+    return 1;
+}
+
+#define FILES_COMPACT 1
+
+static option_spec files_options[] = {
+    { "-compact", FILES_COMPACT },
+    { "--", END_FLAGS },
+    { NULL, 0 }
+};
+
+/*
+ * ${entry} files ?-compact?
+ * ${entry} files -async callback
+ *
+ * Lists the files mapped to the port. With -compact, paths in the same
+ * directory share a single copy of the directory name until their string
+ * representations are needed, which saves a good deal of memory for ports that
+ * install many thousands of files. With -async, the files are listed on a
+ * worker thread and handed to `callback` in chunks; see async.c.
+ */
 static int entry_obj_files(Tcl_Interp* interp, entry_t* entry, int objc,
         Tcl_Obj* CONST objv[]) {
-    sqlite3_stmt* stmt;
-    char* query = "SELECT path FROM files WHERE port_id=?";
-    if (objc != 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, "files");
+    int start = 2;
+    int flags;
+    int count;
+    files_list list;
+    reg_error error;
+    if (objc > 2 && strcmp(Tcl_GetString(objv[2]), "-async") == 0) {
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "-async callback");
+            return TCL_ERROR;
+        }
+        return async_files(interp, objv[3], entry->rowid);
+    }
+    if (parse_flags(interp, objc, objv, &start, files_options, &flags)
+            != TCL_OK) {
         return TCL_ERROR;
     }
-    if ((sqlite3_prepare(entry->db, query, -1, &stmt, NULL) == SQLITE_OK)
-            && (sqlite3_bind_int64(stmt, 1, entry->rowid) == SQLITE_OK)) {
-        Tcl_Obj* result = Tcl_NewListObj(0, NULL);
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            char* value = sqlite3_column_text(stmt, 0);
-            int len = sqlite3_column_bytes(stmt, 0);
-            Tcl_Obj* element = Tcl_NewStringObj(value, len);
-            Tcl_ListObjAppendElement(interp, result, element);
-        }
-        sqlite3_finalize(stmt);
-        Tcl_SetObjResult(interp, result);
-        return TCL_OK;
-    } else {
-        set_sqlite_result(interp, entry->db, query);
-        sqlite3_finalize(stmt);
+    if (start != objc) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-compact?");
         return TCL_ERROR;
     }
+    count = reg_entry_file_count(entry->db, (reg_entry*)entry, &error);
+    if (count < 0) {
+        return registry_failed(interp, &error);
+    }
+    list.objs = (Tcl_Obj**)ckalloc((count > 0 ? count : 1) * sizeof(Tcl_Obj*));
+    list.count = 0;
+    list.space = count;
+    list.prefix = NULL;
+    count = reg_entry_files_visit(entry->db, (reg_entry*)entry,
+            (flags & FILES_COMPACT) ? file_to_path_obj : file_to_obj, &list,
+            &error);
+    if (list.prefix != NULL) {
+        path_prefix_release(list.prefix);
+    }
+    if (count < 0) {
+        int i;
+        for (i=0; i<list.count; i++) {
+            Tcl_DecrRefCount(list.objs[i]);
+        }
+        ckfree((char*)list.objs);
+        return registry_failed(interp, &error);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewListObj(count, list.objs));
+    ckfree((char*)list.objs);
+    return TCL_OK;
 }
 
 typedef struct {
@@ -264,7 +435,22 @@ int entry_obj_cmd(ClientData clientData, Tcl_Interp* interp, int objc,
     if (Tcl_GetIndexFromObjStruct(interp, objv[1], entry_cmds,
                 sizeof(entry_obj_cmd_type), "cmd", 0, &cmd_index) == TCL_OK) {
         entry_obj_cmd_type* cmd = &entry_cmds[cmd_index];
-        return cmd->function(interp, (entry_t*)clientData, objc, objv);
+        Tcl_Time start;
+        int timed = latency_start(interp, &start);
+        int result;
+        /* anything the background writer can't take must see its writes */
+        if (!(cmd->function == entry_obj_map
+                    || cmd->function == entry_obj_unmap
+                    || (cmd->function == entry_obj_prop && objc == 3))) {
+            writer_sync(interp);
+        }
+        changes_check(interp);
+        result = cmd->function(interp, (entry_t*)clientData, objc, objv);
+        maintain_check(interp);
+        if (timed) {
+            latency_record(interp, "entry", cmd->name, &start);
+        }
+        return result;
     }
     return TCL_ERROR;
 }
@@ -102,7 +102,7 @@ static int item_create(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
         }
     } else {
         /* item create */
-        char* name = unique_name(interp, "registry::item");
+        char* name = unique_name(interp, "registry::item", NULL);
         if (set_item(interp, name, item) == TCL_OK) {
             Tcl_Obj* res = Tcl_NewStringObj(name, -1);
             Tcl_SetObjResult(interp, res);
@@ -258,6 +258,10 @@ int item_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
     if (Tcl_GetIndexFromObjStruct(interp, objv[1], item_cmds,
                 sizeof(item_cmd_type), "cmd", 0, &cmd_index) == TCL_OK) {
         item_cmd_type* cmd = &item_cmds[cmd_index];
+        sqlite3* db = registry_db(interp, 0);
+        if (db == NULL || init_temp(interp, db) != TCL_OK) {
+            return TCL_ERROR;
+        }
         return cmd->function(interp, objc, objv);
     }
     return TCL_ERROR;
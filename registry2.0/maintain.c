@@ -0,0 +1,402 @@
+/*
+ * maintain.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "changes.h"
+#include "maintain.h"
+#include "registry.h"
+#include "util.h"
+
+/*
+ * Planner statistics.
+ *
+ * sqlite chooses between the registry's indexes using the statistics ANALYZE
+ * leaves in `sqlite_stat1`; without them it guesses, and for a search on both
+ * `state` and `name` it may well guess `port_state`, which matches half the
+ * registry, over `port_name`, which matches a row or two. So statistics are
+ * kept up to date three ways:
+ *
+ * - Each interp counts the rows of each table its own connection changes
+ *   (through changes.c), and once a table has had more than
+ *   MAINTAIN_MIN_CHANGES changed, and more than a tenth of the rows it had when
+ *   last analyzed, the registry command that did it finishes by analyzing that
+ *   table. That ANALYZE looks at no more than MAINTAIN_ANALYSIS_LIMIT rows of
+ *   each index, so it stays quick on any size of registry.
+ * - `registry::close` runs `PRAGMA optimize`, which analyzes whatever sqlite
+ *   thinks the connection's queries would have been better planned with fresh
+ *   statistics for. That covers changes made by the background writer and
+ *   other processes, which the counts don't see.
+ * - `registry::maintain -analyze` analyzes everything, fully.
+ */
+
+#define MAINTAIN_MIN_CHANGES 1000
+#define MAINTAIN_ANALYSIS_LIMIT 1000
+
+typedef struct {
+    const char* table;
+    int flag;
+    sqlite_int64 changed;
+} maintain_table;
+
+typedef struct {
+    maintain_table tables[2];
+} maintain_state;
+
+static void maintain_changed(ClientData clientData, int tables, int op,
+        sqlite_int64 rowid UNUSED) {
+    maintain_state* state = (maintain_state*)clientData;
+    int i;
+    if (op == CHANGE_UNKNOWN) {
+        return;
+    }
+    for (i=0; i<2; i++) {
+        if (tables & state->tables[i].flag) {
+            state->tables[i].changed++;
+        }
+    }
+}
+
+static void delete_maintain(ClientData clientData, Tcl_Interp* interp) {
+    changes_unlisten(interp, maintain_changed, clientData);
+    ckfree((char*)clientData);
+}
+
+static maintain_state* get_maintain(Tcl_Interp* interp) {
+    maintain_state* state = Tcl_GetAssocData(interp, "registry::maintain",
+            NULL);
+    if (state == NULL) {
+        state = (maintain_state*)ckalloc(sizeof(maintain_state));
+        state->tables[0].table = "ports";
+        state->tables[0].flag = CHANGE_PORTS;
+        state->tables[0].changed = 0;
+        state->tables[1].table = "files";
+        state->tables[1].flag = CHANGE_FILES;
+        state->tables[1].changed = 0;
+        Tcl_SetAssocData(interp, "registry::maintain", delete_maintain, state);
+        changes_listen(interp, maintain_changed, state);
+    }
+    return state;
+}
+
+/*
+ * Returns how many rows `table` had when it was last analyzed, from the first
+ * number in its `sqlite_stat1` rows, or 0 if it never was.
+ */
+static sqlite_int64 analyzed_rows(sqlite3* db, const char* table) {
+    sqlite3_stmt* stmt = NULL;
+    sqlite_int64 rows = 0;
+    if (sqlite3_prepare_v2(db, "SELECT stat FROM registry.sqlite_stat1 "
+                "WHERE tbl=? LIMIT 1", -1, &stmt, NULL) == SQLITE_OK
+            && sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC)
+                == SQLITE_OK
+            && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* stat = (const char*)sqlite3_column_text(stmt, 0);
+        if (stat != NULL) {
+            rows = strtoll(stat, NULL, 10);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rows;
+}
+
+/*
+ * Runs ANALYZE on `target` (a table, or the whole registry) looking at no more
+ * than `limit` rows of each index, or all of them if `limit` is 0.
+ */
+static int analyze(sqlite3* db, const char* target, int limit) {
+    char* query = sqlite3_mprintf("PRAGMA analysis_limit=%d; ANALYZE %s; "
+            "PRAGMA analysis_limit=0", limit, target);
+    int result = sqlite3_exec(db, query, NULL, NULL, NULL);
+    sqlite3_free(query);
+    return result;
+}
+
+/**
+ * Analyzes any table the interp has changed enough of since it was last
+ * analyzed. Called at the end of each registry command; failures are ignored,
+ * as the statistics will be brought up to date another time.
+ */
+void maintain_check(Tcl_Interp* interp) {
+    maintain_state* state = get_maintain(interp);
+    sqlite3* db;
+    int i;
+    for (i=0; i<2; i++) {
+        maintain_table* t = &state->tables[i];
+        if (t->changed <= MAINTAIN_MIN_CHANGES) {
+            continue;
+        }
+        db = Tcl_GetAssocData(interp, "registry::db", NULL);
+        if (db == NULL || !sqlite3_get_autocommit(db)) {
+            return;
+        }
+        if (t->changed > analyzed_rows(db, t->table) / 10) {
+            char* target = sqlite3_mprintf("registry.%s", t->table);
+            analyze(db, target, MAINTAIN_ANALYSIS_LIMIT);
+            sqlite3_free(target);
+            t->changed = 0;
+        }
+    }
+}
+
+/**
+ * Lets sqlite refresh whatever statistics the interp's queries suggest are
+ * stale. Called by `registry::close` while the connection is still leased.
+ */
+void maintain_close(Tcl_Interp* interp) {
+    sqlite3* db = Tcl_GetAssocData(interp, "registry::db", NULL);
+    if (db != NULL && !(registry_flags(interp) & REGISTRY_READONLY)
+            && sqlite3_get_autocommit(db)) {
+        sqlite3_exec(db, "PRAGMA registry.optimize", NULL, NULL, NULL);
+    }
+}
+
+/*
+ * Free pages.
+ *
+ * Deleting entries and files leaves pages of the registry file unused. They
+ * are reused for later writes, but until then the file is bigger than it need
+ * be, and the pages still in use spread further through it, which costs reads
+ * when the page cache is cold. New registries are created with
+ * `auto_vacuum=INCREMENTAL` (see `reg_create_tables`), so that
+ * `registry::maintain -vacuum` can give a few free pages at a time back to the
+ * file system, each step holding the write lock only briefly. Older registries
+ * have to be rebuilt once with `-vacuum -full` first, which also puts every
+ * table's pages back in order, but rewrites the whole file under the write
+ * lock. What `registry::maintain` reports helps decide when that is worth it.
+ */
+
+#define MAINTAIN_VACUUM_PAGES 100
+/* PRAGMA auto_vacuum's value for INCREMENTAL */
+#define MAINTAIN_INCREMENTAL 2
+
+/*
+ * Appends `key` and the integer result of `query` to `result`.
+ */
+static int append_pragma(Tcl_Interp* interp, Tcl_Obj* result, sqlite3* db,
+        const char* key, const char* query) {
+    sqlite3_stmt* stmt = NULL;
+    int ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+        && (sqlite3_step(stmt) == SQLITE_ROW);
+    if (ok) {
+        Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj(key, -1));
+        Tcl_ListObjAppendElement(interp, result,
+                Tcl_NewWideIntObj(sqlite3_column_int64(stmt, 0)));
+    } else {
+        set_sqlite_result(interp, db, query);
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+/*
+ * Returns a dict describing how the registry file is laid out: its
+ * `page_size`, `pages` and `free_pages`, its `auto_vacuum` mode, and, if
+ * sqlite was built with the dbstat table, its `fragmentation`: the fraction of
+ * leaf pages that don't directly follow the previous leaf of the same table or
+ * index, which is what makes scans seek.
+ */
+static Tcl_Obj* maintain_report(Tcl_Interp* interp, sqlite3* db) {
+    static const char* modes[] = { "none", "full", "incremental" };
+    Tcl_Obj* result = Tcl_NewListObj(0, NULL);
+    sqlite3_stmt* stmt = NULL;
+    Tcl_IncrRefCount(result);
+    if (!append_pragma(interp, result, db, "page_size",
+                "PRAGMA registry.page_size")
+            || !append_pragma(interp, result, db, "pages",
+                "PRAGMA registry.page_count")
+            || !append_pragma(interp, result, db, "free_pages",
+                "PRAGMA registry.freelist_count")
+            || !append_pragma(interp, result, db, "auto_vacuum",
+                "PRAGMA registry.auto_vacuum")) {
+        Tcl_DecrRefCount(result);
+        return NULL;
+    }
+    /* name the mode, which is always the last value so far */
+    {
+        Tcl_Obj* mode;
+        int count, index;
+        Tcl_ListObjLength(interp, result, &count);
+        Tcl_ListObjIndex(interp, result, count - 1, &mode);
+        if (Tcl_GetIntFromObj(NULL, mode, &index) == TCL_OK && index >= 0
+                && index <= 2) {
+            mode = Tcl_NewStringObj(modes[index], -1);
+            Tcl_ListObjReplace(interp, result, count - 1, 1, 1, &mode);
+        }
+    }
+    if (sqlite3_prepare_v2(db, "SELECT COUNT(*), SUM(pageno != prev + 1) "
+                "FROM (SELECT pageno, LAG(pageno) OVER "
+                "(PARTITION BY name ORDER BY path) AS prev "
+                "FROM dbstat('registry') WHERE pagetype='leaf')", -1, &stmt,
+                NULL) == SQLITE_OK
+            && sqlite3_step(stmt) == SQLITE_ROW) {
+        sqlite_int64 leaves = sqlite3_column_int64(stmt, 0);
+        sqlite_int64 breaks = sqlite3_column_int64(stmt, 1);
+        Tcl_ListObjAppendElement(interp, result,
+                Tcl_NewStringObj("fragmentation", -1));
+        Tcl_ListObjAppendElement(interp, result, Tcl_NewDoubleObj(
+                    leaves > 0 ? (double)breaks / leaves : 0.0));
+    }
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+/*
+ * registry::maintain ?-analyze? ?-vacuum ?-pages n|-full??
+ *
+ * Maintenance of the open registry. `-analyze` gathers the planner's
+ * statistics for every table and index afresh, reading all of their rows.
+ * `-vacuum` gives up to `n` free pages (100 by default) back to the file
+ * system, which older registries can't do, or with `-full` switches the file
+ * to `auto_vacuum=INCREMENTAL` and rebuilds it with VACUUM; see above. Either
+ * way, returns a dict describing the file afterwards, as `maintain_report`
+ * does; with no options, that's all it does, which works on a read-only
+ * registry too.
+ */
+int maintain_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    static const char* options[] = { "-analyze", "-vacuum", "-pages", "-full",
+        NULL };
+    enum { OPT_ANALYZE, OPT_VACUUM, OPT_PAGES, OPT_FULL };
+    int analyze_all = 0, vacuum = 0, full = 0;
+    int pages = MAINTAIN_VACUUM_PAGES;
+    int pages_set = 0;
+    Tcl_Obj* report;
+    sqlite3* db;
+    int i;
+    for (i=1; i<objc; i++) {
+        int index;
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &index)
+                != TCL_OK) {
+            return TCL_ERROR;
+        }
+        switch (index) {
+            case OPT_ANALYZE:
+                analyze_all = 1;
+                break;
+            case OPT_VACUUM:
+                vacuum = 1;
+                break;
+            case OPT_FULL:
+                full = 1;
+                break;
+            case OPT_PAGES:
+                if (i+1 == objc) {
+                    Tcl_WrongNumArgs(interp, 1, objv,
+                            "?-analyze? ?-vacuum ?-pages n|-full??");
+                    return TCL_ERROR;
+                }
+                if (Tcl_GetIntFromObj(interp, objv[++i], &pages) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (pages < 1) {
+                    Tcl_SetResult(interp, "pages must be positive", TCL_STATIC);
+                    return TCL_ERROR;
+                }
+                pages_set = 1;
+                break;
+        }
+    }
+    if ((pages_set || full) && !vacuum) {
+        Tcl_SetResult(interp, "-pages and -full require -vacuum", TCL_STATIC);
+        return TCL_ERROR;
+    } else if (pages_set && full) {
+        Tcl_SetResult(interp, "-pages and -full can't be used together",
+                TCL_STATIC);
+        return TCL_ERROR;
+    }
+    db = registry_db(interp, 1);
+    if (db == NULL) {
+        return TCL_ERROR;
+    }
+    if ((analyze_all || vacuum)
+            && (registry_flags(interp) & REGISTRY_READONLY)) {
+        Tcl_SetResult(interp, "registry is open read-only", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (analyze_all) {
+        maintain_state* state = get_maintain(interp);
+        if (analyze(db, "registry", 0) != SQLITE_OK) {
+            set_sqlite_result(interp, db, "ANALYZE registry");
+            return TCL_ERROR;
+        }
+        for (i=0; i<2; i++) {
+            state->tables[i].changed = 0;
+        }
+    }
+    if (vacuum && !full) {
+        sqlite3_stmt* stmt = NULL;
+        char* query = "PRAGMA registry.auto_vacuum";
+        int mode = -1;
+        if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK
+                && sqlite3_step(stmt) == SQLITE_ROW) {
+            mode = sqlite3_column_int(stmt, 0);
+        } else {
+            set_sqlite_result(interp, db, query);
+        }
+        sqlite3_finalize(stmt);
+        if (mode < 0) {
+            return TCL_ERROR;
+        } else if (mode != MAINTAIN_INCREMENTAL) {
+            /* incremental_vacuum would quietly do nothing */
+            Tcl_SetResult(interp, "registry can't give back pages "
+                    "incrementally; convert it with -vacuum -full", TCL_STATIC);
+            return TCL_ERROR;
+        }
+    }
+    if (vacuum) {
+        /* VACUUM only takes up a new auto_vacuum mode set just before it */
+        char* query = full ? sqlite3_mprintf("PRAGMA registry.auto_vacuum="
+                "INCREMENTAL; VACUUM registry")
+            : sqlite3_mprintf("PRAGMA registry.incremental_vacuum(%d)", pages);
+        int result = sqlite3_exec(db, query, NULL, NULL, NULL);
+        if (result != SQLITE_OK) {
+            set_sqlite_result(interp, db, query);
+        }
+        sqlite3_free(query);
+        if (result != SQLITE_OK) {
+            return TCL_ERROR;
+        }
+        /* let the file shrink now, if nobody is reading older pages */
+        sqlite3_wal_checkpoint_v2(db, "registry", SQLITE_CHECKPOINT_PASSIVE,
+                NULL, NULL);
+    }
+    report = maintain_report(interp, db);
+    if (report == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, report);
+    Tcl_DecrRefCount(report);
+    return TCL_OK;
+}
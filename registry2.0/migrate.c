@@ -0,0 +1,264 @@
+/*
+ * migrate.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "migrate.h"
+
+/*
+ * Schema migrations.
+ *
+ * A registry records its schema version in `metadata`. A migration takes it
+ * from one version to the next in steps, and a step that rewrites a table does
+ * so a chunk of rows at a time, so that no transaction holds the write lock
+ * for long, even on a registry with millions of files. Each transaction also
+ * records how far the migration has got as the `migration` row of `metadata`
+ * (the version being migrated to, the step, and the last rowid done), and the
+ * next one starts from there. So a migration that is interrupted, or whose
+ * process dies, picks up where it stopped the next time `reg_migrate` runs, and
+ * two processes migrating at once just share the work.
+ */
+
+/*
+ * Migrations from each schema version to the next, oldest first, ending with
+ * one without steps. REG_SCHEMA_VERSION is the version the last one migrates
+ * to, and `reg_create_tables` creates version 1.
+ */
+const reg_migration reg_migrations[] = {
+    { 0, NULL, NULL }
+};
+
+static int migrate_exec(sqlite3* db, const char* query, reg_error* errPtr) {
+    if (sqlite3_exec(db, query, NULL, NULL, NULL) != SQLITE_OK) {
+        reg_sqlite_error(db, errPtr, (char*)query);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Runs `query`, with up to two integers bound, and stores the first column of
+ * its first row in `value`. Returns 1 if there was a non-null one, 0 if not,
+ * and -1 on error.
+ */
+static int migrate_int(sqlite3* db, const char* query, int bind,
+        sqlite_int64 a, sqlite_int64 b, sqlite_int64* value,
+        reg_error* errPtr) {
+    sqlite3_stmt* stmt = NULL;
+    int result = -1;
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK
+            && (bind < 1 || sqlite3_bind_int64(stmt, 1, a) == SQLITE_OK)
+            && (bind < 2 || sqlite3_bind_int64(stmt, 2, b) == SQLITE_OK)) {
+        switch (sqlite3_step(stmt)) {
+            case SQLITE_ROW:
+                result = (sqlite3_column_type(stmt, 0) != SQLITE_NULL);
+                *value = sqlite3_column_int64(stmt, 0);
+                break;
+            case SQLITE_DONE:
+                result = 0;
+                break;
+        }
+    }
+    if (result < 0) {
+        reg_sqlite_error(db, errPtr, (char*)query);
+    }
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+/**
+ * Returns the schema version recorded in the registry's `metadata`, 0 if it
+ * records none, or -1 on error.
+ */
+int reg_schema_version(sqlite3* db, reg_error* errPtr) {
+    sqlite_int64 version = 0;
+    int found = migrate_int(db, "SELECT CAST(value AS INTEGER) "
+            "FROM registry.metadata WHERE key='version'", 0, 0, 0, &version,
+            errPtr);
+    return found < 0 ? -1 : (int)version;
+}
+
+/*
+ * Reads the checkpoint of the migration to `version`, if that is the one the
+ * registry records; otherwise the migration starts at its beginning.
+ */
+static int migrate_checkpoint(sqlite3* db, int version, int* step,
+        sqlite_int64* done, reg_error* errPtr) {
+    char* query = "SELECT value FROM registry.metadata WHERE key='migration'";
+    sqlite3_stmt* stmt = NULL;
+    int ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK);
+    *step = 0;
+    *done = 0;
+    if (ok) {
+        int r = sqlite3_step(stmt);
+        if (r == SQLITE_ROW) {
+            const char* value = (const char*)sqlite3_column_text(stmt, 0);
+            int v, s;
+            long long d;
+            if (value != NULL && sscanf(value, "%d %d %lld", &v, &s, &d) == 3
+                    && v == version) {
+                *step = s;
+                *done = d;
+            }
+        } else if (r != SQLITE_DONE) {
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        reg_sqlite_error(db, errPtr, query);
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+/*
+ * Does the next unit of work of migration `m`, from `step` and `done`, and
+ * advances them: one run of a step without a table, one chunk of a step with
+ * one, or, after the last step, recording the new version.
+ */
+static int migrate_unit(sqlite3* db, const reg_migration* m, int chunk,
+        int* step, sqlite_int64* done, sqlite_int64* total,
+        reg_error* errPtr) {
+    const reg_migration_step* s = &m->steps[*step];
+    char* query;
+    int ok, found;
+    *total = 0;
+    if (s->sql == NULL) {
+        query = sqlite3_mprintf("UPDATE registry.metadata SET value=%d "
+                "WHERE key='version'; "
+                "DELETE FROM registry.metadata WHERE key='migration'; "
+                "PRAGMA registry.user_version=%d", m->version, m->version);
+        ok = migrate_exec(db, query, errPtr);
+        sqlite3_free(query);
+        return ok;
+    }
+    if (s->table == NULL) {
+        ok = migrate_exec(db, s->sql, errPtr);
+        (*step)++;
+        *done = 0;
+    } else {
+        sqlite3_stmt* stmt = NULL;
+        sqlite_int64 last;
+        query = sqlite3_mprintf("SELECT MAX(rowid) FROM registry.\"%w\"",
+                s->table);
+        ok = (migrate_int(db, query, 0, 0, 0, total, errPtr) >= 0);
+        sqlite3_free(query);
+        if (!ok) {
+            return 0;
+        }
+        /* the chunk ends `chunk` rows on, or at the end of the table */
+        query = sqlite3_mprintf("SELECT rowid FROM registry.\"%w\" "
+                "WHERE rowid > ?1 ORDER BY rowid LIMIT 1 OFFSET ?2", s->table);
+        found = migrate_int(db, query, 2, *done, chunk - 1, &last, errPtr);
+        sqlite3_free(query);
+        if (found == 0) {
+            found = (*total > *done);
+            last = *total;
+        }
+        if (found < 0) {
+            return 0;
+        } else if (found == 0) {
+            (*step)++;
+            *done = 0;
+        } else {
+            ok = (sqlite3_prepare_v2(db, s->sql, -1, &stmt, NULL) == SQLITE_OK)
+                && (sqlite3_bind_int64(stmt, 1, *done) == SQLITE_OK)
+                && (sqlite3_bind_int64(stmt, 2, last) == SQLITE_OK)
+                && (sqlite3_step(stmt) == SQLITE_DONE);
+            if (!ok) {
+                reg_sqlite_error(db, errPtr, (char*)s->sql);
+            }
+            sqlite3_finalize(stmt);
+            *done = last;
+        }
+    }
+    if (ok) {
+        query = sqlite3_mprintf("INSERT OR REPLACE INTO registry.metadata "
+                "(key, value) VALUES ('migration', '%d %d %lld')", m->version,
+                *step, (long long)*done);
+        ok = migrate_exec(db, query, errPtr);
+        sqlite3_free(query);
+    }
+    return ok;
+}
+
+/**
+ * Migrates the registry to the latest version `migrations` knows of.
+ *
+ * Each unit of work runs in its own transaction, with at most `chunk` rows
+ * changed by each, and `progress`, if not NULL, is called after each. The
+ * connection must not be in a transaction already. Returns the registry's
+ * schema version afterwards, or -1 with `errPtr` set if a transaction failed
+ * or `progress` interrupted the migration; either way, everything committed
+ * so far stays, and the next call carries on from there.
+ */
+int reg_migrate(sqlite3* db, const reg_migration* migrations, int chunk,
+        reg_migrate_progress* progress, void* userdata, reg_error* errPtr) {
+    if (chunk < 1) {
+        chunk = REG_MIGRATE_CHUNK;
+    }
+    for (;;) {
+        const reg_migration* m;
+        int version, step, ok;
+        sqlite_int64 done, total;
+        if (!migrate_exec(db, "BEGIN IMMEDIATE", errPtr)) {
+            return -1;
+        }
+        /* read the state inside the transaction, in case others migrate too */
+        version = reg_schema_version(db, errPtr);
+        ok = (version >= 0);
+        for (m = migrations; ok && m->steps != NULL; m++) {
+            if (m->version == version + 1) {
+                break;
+            }
+        }
+        if (ok && m->steps == NULL) {
+            return migrate_exec(db, "COMMIT", errPtr) ? version : -1;
+        }
+        ok = ok && migrate_checkpoint(db, m->version, &step, &done, errPtr)
+            && migrate_unit(db, m, chunk, &step, &done, &total, errPtr)
+            && migrate_exec(db, "COMMIT", errPtr);
+        if (!ok) {
+            sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+            return -1;
+        }
+        if (progress != NULL
+                && !progress(userdata, m->version, step, done, total)) {
+            errPtr->code = "registry::interrupted";
+            errPtr->description = "migration interrupted";
+            errPtr->free = NULL;
+            return -1;
+        }
+    }
+}
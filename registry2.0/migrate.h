@@ -0,0 +1,75 @@
+/*
+ * migrate.h
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _MIGRATE_H
+#define _MIGRATE_H
+
+#include <sqlite3.h>
+
+#include "centry.h"
+
+/* rows a chunked migration step changes per transaction, unless told otherwise */
+#define REG_MIGRATE_CHUNK 10000
+
+/*
+ * One step of a migration. A step with a `table` runs `sql` once for each chunk
+ * of that table's rows, with ?1 bound to the last rowid of the previous chunk
+ * (0 for the first) and ?2 to the last of this one, so it should only touch
+ * rows with `rowid > ?1 AND rowid <= ?2`. A step without runs `sql`, which may
+ * hold several statements, once.
+ */
+typedef struct {
+    const char* sql;
+    const char* table;
+} reg_migration_step;
+
+/*
+ * A migration from schema version `version - 1` to `version`, as a list of
+ * steps ending with one whose `sql` is NULL.
+ */
+typedef struct {
+    int version;
+    const char* description;
+    const reg_migration_step* steps;
+} reg_migration;
+
+/*
+ * Called after each transaction of a migration, with the version being
+ * migrated to, the step, and how far the step has got through its table
+ * (`done` and `total` rowids; both 0 for a step without one). Returning 0
+ * interrupts the migration.
+ */
+typedef int (reg_migrate_progress)(void* userdata, int version, int step,
+        sqlite_int64 done, sqlite_int64 total);
+
+extern const reg_migration reg_migrations[];
+
+int reg_schema_version(sqlite3* db, reg_error* errPtr);
+int reg_migrate(sqlite3* db, const reg_migration* migrations, int chunk,
+        reg_migrate_progress* progress, void* userdata, reg_error* errPtr);
+
+#endif /* _MIGRATE_H */
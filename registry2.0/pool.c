@@ -0,0 +1,312 @@
+/*
+ * pool.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "pool.h"
+#include "sql.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * How long a connection waits for another one to finish writing before giving
+ * up with SQLITE_BUSY, in milliseconds.
+ */
+#define POOL_BUSY_TIMEOUT 30000
+
+/* Idle connections kept per registry file; extras are closed on release. */
+#define POOL_MAX_IDLE 4
+
+typedef struct pool_conn {
+    char* file;
+    int flags;
+    dev_t dev;
+    ino_t ino;
+    sqlite3* db;
+    Tcl_ThreadId owner;
+    int leased;
+    struct pool_conn* next;
+} pool_conn;
+
+static pool_conn* pool = NULL;
+static int pool_exit_handler = 0;
+TCL_DECLARE_MUTEX(pool_mutex)
+/* held while a new connection checks its registry's tables; see pool_open */
+TCL_DECLARE_MUTEX(pool_check_mutex)
+
+/*
+ * Closes a connection the pool no longer wants. Its cached statements have to
+ * go first or sqlite3_close will refuse.
+ */
+static void pool_close(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    reg_stmt_cache_detach(db);
+    while ((stmt = sqlite3_next_stmt(db, NULL)) != NULL) {
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+}
+
+/*
+ * Closes every idle connection when the process exits. Connections still on
+ * lease belong to interps that were never deleted, and are left alone.
+ */
+static void pool_shutdown(ClientData clientData UNUSED) {
+    pool_conn** link;
+    Tcl_MutexLock(&pool_mutex);
+    link = &pool;
+    while (*link != NULL) {
+        pool_conn* conn = *link;
+        if (conn->leased) {
+            link = &conn->next;
+        } else {
+            *link = conn->next;
+            pool_close(conn->db);
+            free(conn->file);
+            free(conn);
+        }
+    }
+    Tcl_MutexUnlock(&pool_mutex);
+}
+
+/*
+ * Opens a new connection with `file` attached as the registry.
+ *
+ * The main database is private to the connection and holds its temporary
+ * tables, if it ever needs them, just as it does for an unpooled connection.
+ * The registry is switched to WAL so that readers on other connections never
+ * block on the writer and vice versa; writers queue up behind each other on
+ * the busy timeout. A registry with no tables in it yet gets them here, and
+ * one of an older schema is migrated (see `reg_check_tables`). That can take a
+ * while, so it is done without the pool mutex, which would hold up every other
+ * lease and release; a mutex of its own keeps two connections from creating
+ * the same tables at once.
+ *
+ * With POOL_READONLY the registry is attached with sqlite's `mode=ro` instead,
+ * left as it is, and read through a memory map of up to 256MB. That is safe
+ * next to writers: sqlite never writes through the map, and reads pages newer
+ * than the database file from the WAL.
+ */
+static sqlite3* pool_open(Tcl_Interp* interp, const char* file, int flags) {
+    sqlite3* db;
+    sqlite3_stmt* stmt = NULL;
+    char* query;
+    int ok;
+    if (sqlite3_open_v2("", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+                | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+        set_sqlite_result(interp, db, NULL);
+        sqlite3_close(db);
+        return NULL;
+    }
+    if (init_db(interp, db) != TCL_OK) {
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlite3_busy_timeout(db, POOL_BUSY_TIMEOUT);
+    if (flags & POOL_READONLY) {
+        char* uri = reg_readonly_uri(file);
+        query = sqlite3_mprintf("ATTACH DATABASE '%q' AS registry", uri);
+        sqlite3_free(uri);
+    } else {
+        query = sqlite3_mprintf("ATTACH DATABASE '%q' AS registry", file);
+    }
+    ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+        && (sqlite3_step(stmt) == SQLITE_DONE);
+    if (!ok) {
+        set_sqlite_result(interp, db, query);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(query);
+    if (ok && (flags & POOL_READONLY)) {
+        sqlite3_exec(db, "PRAGMA registry.mmap_size=268435456", NULL, NULL,
+                NULL);
+    } else if (ok) {
+        Tcl_MutexLock(&pool_check_mutex);
+        /* tables first, as switching to WAL fixes the file's auto_vacuum */
+        ok = (check_tables(interp, db) == TCL_OK);
+        if (ok) {
+            query = "PRAGMA registry.journal_mode=WAL";
+            ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+                && (sqlite3_step(stmt) == SQLITE_ROW);
+            if (!ok) {
+                set_sqlite_result(interp, db, query);
+            }
+            sqlite3_finalize(stmt);
+        }
+        Tcl_MutexUnlock(&pool_check_mutex);
+    }
+    if (!ok) {
+        sqlite3_close(db);
+        return NULL;
+    }
+    reg_stmt_cache_attach(db);
+    return db;
+}
+
+/**
+ * Leases a connection to the registry at `file` for the calling interp.
+ *
+ * Connections are shared by every interp in the process, on any thread: an
+ * idle connection to the same file, opened with the same `flags`, is handed out
+ * if there is one, and a new one is opened otherwise. A leased connection
+ * keeps its prepared statements from earlier leases, which is most of the
+ * point of pooling. If the sqlite library was built without thread safety,
+ * connections are only handed back to the thread that opened them. The
+ * connection's query instrumentation is switched on or off to match
+ * `registry::stats`. Idle connections to a file that has since been deleted or
+ * replaced are closed rather than reused.
+ *
+ * `file` should be a normalized path, since it is compared as a string. Sets
+ * the interp result and returns NULL on error.
+ */
+sqlite3* pool_lease(Tcl_Interp* interp, const char* file, int flags) {
+    Tcl_ThreadId self = Tcl_GetCurrentThread();
+    int shared = sqlite3_threadsafe();
+    pool_conn** link;
+    sqlite3* db = NULL;
+    struct stat st;
+    int exists = (stat(file, &st) == 0);
+    Tcl_MutexLock(&pool_mutex);
+    if (!pool_exit_handler) {
+        Tcl_CreateExitHandler(pool_shutdown, NULL);
+        pool_exit_handler = 1;
+    }
+    link = &pool;
+    while (*link != NULL) {
+        pool_conn* conn = *link;
+        if (conn->leased || conn->flags != flags
+                || strcmp(conn->file, file) != 0) {
+            link = &conn->next;
+        } else if (!exists || conn->dev != st.st_dev
+                || conn->ino != st.st_ino) {
+            /* the file was replaced since this connection opened it */
+            *link = conn->next;
+            pool_close(conn->db);
+            free(conn->file);
+            free(conn);
+        } else if (shared || conn->owner == self) {
+            conn->leased = 1;
+            db = conn->db;
+            break;
+        } else {
+            link = &conn->next;
+        }
+    }
+    Tcl_MutexUnlock(&pool_mutex);
+    if (db == NULL) {
+        /* not under the pool mutex; the new connection is nobody else's yet */
+        db = pool_open(interp, file, flags);
+        if (db != NULL && stat(file, &st) != 0) {
+            memset(&st, 0, sizeof(st));
+        }
+        if (db != NULL) {
+            pool_conn* conn = malloc(sizeof(pool_conn));
+            conn->file = strdup(file);
+            conn->flags = flags;
+            conn->dev = st.st_dev;
+            conn->ino = st.st_ino;
+            conn->db = db;
+            conn->owner = self;
+            conn->leased = 1;
+            Tcl_MutexLock(&pool_mutex);
+            conn->next = pool;
+            pool = conn;
+            Tcl_MutexUnlock(&pool_mutex);
+        }
+    }
+    if (db != NULL) {
+        stats_attach(db);
+    }
+    return db;
+}
+
+/**
+ * Returns a leased connection to the pool.
+ *
+ * Cached statements are reset so they hold no read locks while the connection
+ * sits idle; any other statement still open on it is finalized, and any
+ * progress handler the lessee installed is removed. Returns 0 if
+ * `db` did not come from the pool, in which case the caller still owns it.
+ */
+int pool_release(sqlite3* db) {
+    pool_conn** link;
+    pool_conn* conn = NULL;
+    int idle = 0;
+    sqlite3_stmt* stmt;
+    Tcl_MutexLock(&pool_mutex);
+    for (link = &pool; *link != NULL; link = &(*link)->next) {
+        if ((*link)->db == db) {
+            conn = *link;
+            break;
+        }
+    }
+    if (conn == NULL) {
+        Tcl_MutexUnlock(&pool_mutex);
+        return 0;
+    }
+    stmt = sqlite3_next_stmt(db, NULL);
+    while (stmt != NULL) {
+        if (reg_stmt_cached(stmt)) {
+            sqlite3_reset(stmt);
+            stmt = sqlite3_next_stmt(db, stmt);
+        } else {
+            sqlite3_finalize(stmt);
+            stmt = sqlite3_next_stmt(db, NULL);
+        }
+    }
+    if (!sqlite3_get_autocommit(db)) {
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    }
+    sqlite3_progress_handler(db, 0, NULL, NULL);
+    for (link = &pool; *link != NULL; link = &(*link)->next) {
+        if (*link != conn && !(*link)->leased && (*link)->flags == conn->flags
+                && strcmp((*link)->file, conn->file) == 0) {
+            idle++;
+        }
+    }
+    if (idle >= POOL_MAX_IDLE) {
+        for (link = &pool; *link != conn; link = &(*link)->next);
+        *link = conn->next;
+        pool_close(conn->db);
+        free(conn->file);
+        free(conn);
+    } else {
+        conn->leased = 0;
+    }
+    Tcl_MutexUnlock(&pool_mutex);
+    return 1;
+}
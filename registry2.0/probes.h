@@ -0,0 +1,99 @@
+/*
+ * probes.h
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/*
+ * Static tracepoints.
+ *
+ * Building with REGISTRY_PROBES defined (`make REGISTRY_PROBES=1`) compiles
+ * USDT probes into the library through <sys/sdt.h>, so that perf, bpftrace or
+ * SystemTap can attach to a running process, e.g.
+ *
+ *     bpftrace -e 'usdt:registry.so:registry:map { @[arg1] = hist(arg3); }'
+ *
+ * Without it every probe, and the clock reads feeding them, compile away.
+ * Durations are in nanoseconds of CLOCK_MONOTONIC. The probes, all in the
+ * `registry` provider, are:
+ *
+ * prepare(const char* sql, int cached, uint64_t ns)
+ *     `reg_prepare` returned a statement; `cached` is set if it came from the
+ *     connection's statement cache.
+ * step(const char* sql, int rc, uint64_t ns)
+ *     One `sqlite3_step` in centry.c; `rc` is its result code.
+ * txn_begin(const char* kind)
+ *     The background writer ("writer") or an async map ("async") began a
+ *     transaction.
+ * txn_commit(const char* kind, int ops, uint64_t ns)
+ * txn_rollback(const char* kind, int ops, uint64_t ns)
+ *     That transaction ended, after `ops` operations (writer) or files
+ *     (async); `ns` runs from begin to end.
+ * map(int64_t rowid, int files, int mapped, uint64_t ns)
+ * unmap(int64_t rowid, int files, int unmapped, uint64_t ns)
+ *     `reg_entry_map` or `reg_entry_unmap` handled a batch of `files` for the
+ *     entry `rowid`; all of them or none were done.
+ * owner(const char* path, int64_t rowid, uint64_t ns)
+ *     `reg_entry_owner` looked up `path`; `rowid` is 0 if nothing owns it and
+ *     -1 on error.
+ * handle_create(const char* name, int64_t rowid, int live)
+ *     An entry proc was created; `live` counts the interp's procs afterwards.
+ */
+
+#ifdef REGISTRY_PROBES
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/sdt.h>
+
+static inline uint64_t reg_probe_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Declares `var` holding the current time; must be the last declaration. */
+#define REG_PROBE_START(var) uint64_t var = reg_probe_now()
+#define REG_PROBE_SINCE(var) (reg_probe_now() - (var))
+
+#define REG_PROBE1(name, a) DTRACE_PROBE1(registry, name, a)
+#define REG_PROBE3(name, a, b, c) DTRACE_PROBE3(registry, name, a, b, c)
+#define REG_PROBE4(name, a, b, c, d) DTRACE_PROBE4(registry, name, a, b, c, d)
+
+#else
+
+#define REG_PROBE_START(var)
+#define REG_PROBE_SINCE(var) 0
+
+#define REG_PROBE1(name, a)
+#define REG_PROBE3(name, a, b, c)
+#define REG_PROBE4(name, a, b, c, d)
+
+#endif /* REGISTRY_PROBES */
+
+#endif /* _PROBES_H */
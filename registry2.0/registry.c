@@ -31,6 +31,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <tcl.h>
 #include <sqlite3.h>
@@ -38,43 +39,72 @@
 #include "graph.h"
 #include "item.h"
 #include "entry.h"
+#include "registry.h"
 #include "util.h"
 #include "sql.h"
+#include "pool.h"
+#include "writer.h"
+#include "async.h"
+#include "stats.h"
+#include "client.h"
+#include "changes.h"
+#include "migrate.h"
+#include "maintain.h"
+#include "dump.h"
+#include "snapshot.h"
+#include "diff.h"
 
 /**
  * Deletes the sqlite3 DB associated with interp.
  *
- * This function will close an interp's associated DB, although there doesn't
- * seem to be a way of verifying that it happened properly. This will be a
- * problem if we get lazy and forget to finalize a sqlite3_stmt somewhere, so
- * this function will be noisy and complain if we do.
+ * A connection leased from the pool is just handed back. Otherwise this
+ * function will close an interp's associated DB, although there doesn't seem
+ * to be a way of verifying that it happened properly. This will be a problem
+ * if we get lazy and forget to finalize a sqlite3_stmt somewhere, so this
+ * function will be noisy and complain if we do.
  *
  * Then it will leak memory :(
  */
-static void delete_db(ClientData db, Tcl_Interp* interp UNUSED) {
+static void delete_db(ClientData db, Tcl_Interp* interp) {
+    changes_detach(interp, (sqlite3*)db);
+    if (pool_release((sqlite3*)db)) {
+        return;
+    }
     if (sqlite3_close((sqlite3*)db) != SQLITE_OK) {
         fprintf(stderr, "error: registry db not closed correctly (%s)\n",
                 sqlite3_errmsg((sqlite3*)db));
     }
 }
 
+static sqlite3* lease_db(Tcl_Interp* interp, const char* file, int flags);
+
 /**
  * Returns the sqlite3 DB associated with interp.
  *
  * The registry keeps its state in a sqlite3 database that is keyed to the
- * current interpreter context. Different interps will have different instances
- * of the connection, although I don't know if the Apple-provided sqlite3 lib
- * was compiled with thread-safety, so I can't be certain that it's safe to use
- * the registry from multiple threads. I'm pretty sure it's unsafe to alias a
- * registry function into a different thread.
+ * current interpreter context. Until a registry is opened, each interp gets a
+ * private connection of its own; `registry::open` swaps it for one leased from
+ * the process-wide pool (see pool.c), which may be shared over time with other
+ * interps on other threads, but never by two at once. It's still unsafe to
+ * alias a registry function into a different thread.
  *
  * If `attached` is set to true, then this function will additionally check if
  * a real registry database has been attached. If not, then it will return NULL.
+ * A registry that was opened through registryd gets its connection leased here,
+ * the first time one is needed; see client.c.
  *
  * This function sets its own Tcl result.
  */
 sqlite3* registry_db(Tcl_Interp* interp, int attached) {
-    sqlite3* db = Tcl_GetAssocData(interp, "registry::db", NULL);
+    sqlite3* db;
+    if (attached && client_pending(interp) != NULL) {
+        db = lease_db(interp, client_pending(interp), registry_flags(interp));
+        if (db != NULL) {
+            client_detach(interp);
+        }
+        return db;
+    }
+    db = Tcl_GetAssocData(interp, "registry::db", NULL);
     if (db == NULL) {
         if (sqlite3_open(NULL, &db) == SQLITE_OK) {
             if (init_db(interp, db) == TCL_OK) {
@@ -96,67 +126,338 @@ sqlite3* registry_db(Tcl_Interp* interp, int attached) {
     return db;
 }
 
+/**
+ * Returns how the interp's registry was opened, as REGISTRY_* flags, or 0 if
+ * none is open.
+ */
+int registry_flags(Tcl_Interp* interp) {
+    return (int)(size_t)Tcl_GetAssocData(interp, "registry::attached", NULL);
+}
+
+/*
+ * Progress reporting.
+ *
+ * `registry::progress` installs a script that is evaluated every `interval`
+ * sqlite virtual machine instructions while the interp's registry connection is
+ * working, so long operations can show that they are alive. If the script
+ * returns with `break` (or an error, which is also reported as a background
+ * error), the running statement is aborted; the registry command using it
+ * fails, and whatever it had written so far is rolled back. The script must not
+ * use the registry itself.
+ */
+
+#define PROGRESS_INTERVAL 10000
+
+typedef struct {
+    Tcl_Interp* interp;
+    Tcl_Obj* script;
+    int interval;
+    int running;
+} progress_state;
+
+static void delete_progress(ClientData clientData, Tcl_Interp* interp UNUSED) {
+    progress_state* state = (progress_state*)clientData;
+    if (state->script != NULL) {
+        Tcl_DecrRefCount(state->script);
+    }
+    ckfree((char*)state);
+}
+
+static int progress_handler(void* userdata) {
+    progress_state* state = (progress_state*)userdata;
+    Tcl_SavedResult saved;
+    int code;
+    if (state->running || state->script == NULL) {
+        return 0;
+    }
+    state->running = 1;
+    Tcl_SaveResult(state->interp, &saved);
+    code = Tcl_EvalObjEx(state->interp, state->script, TCL_EVAL_GLOBAL);
+    if (code == TCL_ERROR) {
+        Tcl_AddErrorInfo(state->interp, "\n    (registry progress script)");
+        Tcl_BackgroundError(state->interp);
+    }
+    Tcl_RestoreResult(state->interp, &saved);
+    state->running = 0;
+    return (code == TCL_BREAK || code == TCL_ERROR);
+}
+
+/*
+ * Installs (or removes) the interp's progress script on `db`.
+ */
+static void progress_attach(Tcl_Interp* interp, sqlite3* db) {
+    progress_state* state = Tcl_GetAssocData(interp, "registry::progress",
+            NULL);
+    if (state != NULL && state->script != NULL) {
+        sqlite3_progress_handler(db, state->interval, progress_handler, state);
+    } else {
+        sqlite3_progress_handler(db, 0, NULL, NULL);
+    }
+}
+
+/*
+ * registry::progress ?-interval n? ?script?
+ *
+ * Sets the progress script, or removes it if `script` is empty, and returns the
+ * current one. The setting outlives `registry::close` and applies to every
+ * registry opened afterwards.
+ */
+static int registry_progress(ClientData clientData UNUSED, Tcl_Interp* interp,
+        int objc, Tcl_Obj* CONST objv[]) {
+    progress_state* state = Tcl_GetAssocData(interp, "registry::progress",
+            NULL);
+    int start = 1;
+    int interval = -1;
+    if (objc > 2 && strcmp(Tcl_GetString(objv[1]), "-interval") == 0) {
+        if (Tcl_GetIntFromObj(interp, objv[2], &interval) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (interval < 1) {
+            Tcl_SetResult(interp, "interval must be positive", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        start = 3;
+    }
+    if (objc - start > 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-interval n? ?script?");
+        return TCL_ERROR;
+    }
+    if (state == NULL) {
+        state = (progress_state*)ckalloc(sizeof(progress_state));
+        state->interp = interp;
+        state->script = NULL;
+        state->interval = PROGRESS_INTERVAL;
+        state->running = 0;
+        Tcl_SetAssocData(interp, "registry::progress", delete_progress, state);
+    }
+    if (interval > 0) {
+        state->interval = interval;
+    }
+    if (start < objc) {
+        int len;
+        if (state->script != NULL) {
+            Tcl_DecrRefCount(state->script);
+            state->script = NULL;
+        }
+        Tcl_GetStringFromObj(objv[start], &len);
+        if (len > 0) {
+            state->script = objv[start];
+            Tcl_IncrRefCount(state->script);
+        }
+    }
+    if (Tcl_GetAssocData(interp, "registry::attached", NULL)
+            && client_pending(interp) == NULL) {
+        progress_attach(interp, registry_db(interp, 1));
+    }
+    if (state->script != NULL) {
+        Tcl_SetObjResult(interp, state->script);
+    }
+    return TCL_OK;
+}
+
+/*
+ * Schema migrations.
+ *
+ * `registry::migrate` brings the open registry up to the latest schema version
+ * right away, with `reg_migrate` (see migrate.c), rather than leaving it to the
+ * next process to open it. The progress script is called with the version
+ * being migrated to, the step, and how many of the step's rowids are done out
+ * of how many, after each transaction.
+ */
+
+typedef struct {
+    Tcl_Interp* interp;
+    Tcl_Obj* script;
+    int code;
+} migrate_state;
+
+static int migrate_progress(void* userdata, int version, int step,
+        sqlite_int64 done, sqlite_int64 total) {
+    migrate_state* state = (migrate_state*)userdata;
+    Tcl_Obj* command = Tcl_DuplicateObj(state->script);
+    Tcl_IncrRefCount(command);
+    Tcl_ListObjAppendElement(NULL, command, Tcl_NewIntObj(version));
+    Tcl_ListObjAppendElement(NULL, command, Tcl_NewIntObj(step));
+    Tcl_ListObjAppendElement(NULL, command, Tcl_NewWideIntObj(done));
+    Tcl_ListObjAppendElement(NULL, command, Tcl_NewWideIntObj(total));
+    state->code = Tcl_EvalObjEx(state->interp, command, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(command);
+    return state->code == TCL_OK || state->code == TCL_CONTINUE;
+}
+
+/*
+ * registry::migrate ?-chunk rows? ?-progress command?
+ *
+ * Migrates the open registry to the latest schema version and returns that
+ * version. Steps that rewrite a table do `rows` rows per transaction (10000 by
+ * default). If `command` returns with `break`, the migration stops with a
+ * `registry::interrupted` error; if it throws, the migration stops and the
+ * error is passed on. Either way, the work done so far is kept, and the next
+ * `registry::migrate` or open of the registry picks up from there.
+ */
+static int registry_migrate(ClientData clientData UNUSED, Tcl_Interp* interp,
+        int objc, Tcl_Obj* CONST objv[]) {
+    static const char* options[] = { "-chunk", "-progress", NULL };
+    migrate_state state;
+    reg_error error;
+    sqlite3* db;
+    int chunk = REG_MIGRATE_CHUNK;
+    int version;
+    int i;
+    state.interp = interp;
+    state.script = NULL;
+    state.code = TCL_OK;
+    if (objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-chunk rows? ?-progress command?");
+        return TCL_ERROR;
+    }
+    for (i=1; i<objc; i+=2) {
+        int index;
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &index)
+                != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (index == 1) {
+            state.script = objv[i+1];
+        } else if (Tcl_GetIntFromObj(interp, objv[i+1], &chunk) != TCL_OK) {
+            return TCL_ERROR;
+        } else if (chunk < 1) {
+            Tcl_SetResult(interp, "chunk must be positive", TCL_STATIC);
+            return TCL_ERROR;
+        }
+    }
+    db = registry_db(interp, 1);
+    if (db == NULL) {
+        return TCL_ERROR;
+    }
+    if (registry_flags(interp) & REGISTRY_READONLY) {
+        Tcl_SetResult(interp, "registry is open read-only", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    version = reg_migrate(db, reg_migrations, chunk,
+            state.script != NULL ? migrate_progress : NULL, &state, &error);
+    if (version < 0) {
+        if (state.code == TCL_ERROR) {
+            reg_error_destruct(&error);
+            return TCL_ERROR;
+        }
+        return registry_failed(interp, &error);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(version));
+    return TCL_OK;
+}
+
+/*
+ * Leases a connection to `file` and makes it the interp's registry, opened as
+ * `flags` say. A snapshot starts its read transaction here, and keeps it until
+ * the connection goes back to the pool, which rolls it back.
+ */
+static sqlite3* lease_db(Tcl_Interp* interp, const char* file, int flags) {
+    sqlite3* db = pool_lease(interp, file,
+            (flags & REGISTRY_READONLY) ? POOL_READONLY : 0);
+    if (db != NULL && (flags & REGISTRY_SNAPSHOT)) {
+        char* query = "BEGIN; SELECT COUNT(*) FROM registry.sqlite_master";
+        if (sqlite3_exec(db, query, NULL, NULL, NULL) != SQLITE_OK) {
+            set_sqlite_result(interp, db, query);
+            pool_release(db);
+            return NULL;
+        }
+    }
+    if (db != NULL) {
+        progress_attach(interp, db);
+        changes_attach(interp, db);
+        Tcl_DeleteAssocData(interp, "registry::db");
+        Tcl_SetAssocData(interp, "registry::db", delete_db, db);
+        Tcl_SetAssocData(interp, "registry::attached", NULL,
+                (void*)(size_t)(flags | REGISTRY_ATTACHED));
+    }
+    return db;
+}
+
+/**
+ * registry::open ?-readonly ?-snapshot?? db-file
+ *
+ * Opens the registry at `db-file`, creating its tables if it is new. The
+ * connection comes from the pool shared by every interp in the process, so
+ * opening a registry another interp has already used is cheap. If a registryd
+ * is serving `db-file`, no connection is leased until one is needed, and
+ * queries go to the daemon meanwhile; see client.c.
+ *
+ * With `-readonly`, the file must exist, and is opened with sqlite's `mode=ro`
+ * so nothing can write to it through this interp; see `pool_open`. Adding
+ * `-snapshot` keeps one read transaction open until `registry::close`, so every
+ * query sees the registry as it was when it was opened, whatever is written to
+ * it meanwhile. In WAL mode that neither blocks writers nor waits for them;
+ * checkpoints just can't get past the snapshot until it's closed. Snapshots
+ * never use registryd, and can't run `-async` queries, whose connections would
+ * see newer data.
+ */
 static int registry_open(ClientData clientData UNUSED, Tcl_Interp* interp,
         int objc, Tcl_Obj* CONST objv[]) {
-    if (objc != 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, "db-file");
+    static const char* options[] = { "-readonly", "-snapshot", NULL };
+    int flags = 0;
+    int i;
+    for (i=1; i<objc-1; i++) {
+        int index;
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &index)
+                != TCL_OK) {
+            return TCL_ERROR;
+        }
+        flags |= (index == 0) ? REGISTRY_READONLY : REGISTRY_SNAPSHOT;
+    }
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-readonly ?-snapshot?? db-file");
         return TCL_ERROR;
+    } else if ((flags & REGISTRY_SNAPSHOT) && !(flags & REGISTRY_READONLY)) {
+        Tcl_SetResult(interp, "-snapshot requires -readonly", TCL_STATIC);
+    } else if (Tcl_GetAssocData(interp, "registry::attached", NULL)) {
+        Tcl_SetResult(interp, "registry is already open", TCL_STATIC);
     } else {
-        int needsInit = (Tcl_FSAccess(objv[1], F_OK) != 0);
-        char* file = Tcl_GetString(objv[1]);
-        /*
-         * If registry needs initialization, we need write access. However, it
-         * seems you can't test W_OK for a file that doesn't yet exist. We need
-         * a better way to test if a location is writable, then. Maybe strip off
-         * the last path component?
-         */
-        /* if (!needsInit || (Tcl_FSAccess(objv[1], W_OK) == 0)) { */
-        if (1) {
-            sqlite3* db = registry_db(interp, 0);
-            sqlite3_stmt* stmt;
-            char* query = sqlite3_mprintf("ATTACH DATABASE '%q' AS registry",
-                    file);
-            if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
-                    && (sqlite3_step(stmt) == SQLITE_DONE)) {
-                if (!needsInit || (create_tables(interp, db) == TCL_OK)) {
-                    Tcl_SetAssocData(interp, "registry::attached", NULL,
-                            (void*)1);
-                    return TCL_OK;
-                }
-            } else {
-                set_sqlite_result(interp, db, query);
-            }
-        } else {
-            Tcl_ResetResult(interp);
-            Tcl_AppendResult(interp, "port registry doesn't exist at ", file,
-                    " and couldn't write layout to this location", NULL);
+        Tcl_Obj* path = Tcl_FSGetNormalizedPath(interp, objv[objc-1]);
+        if (path == NULL) {
+            return TCL_ERROR;
+        }
+        if (!(flags & REGISTRY_SNAPSHOT)
+                && client_attach(interp, Tcl_GetString(path))) {
+            Tcl_SetAssocData(interp, "registry::attached", NULL,
+                    (void*)(size_t)(flags | REGISTRY_ATTACHED));
+            return TCL_OK;
+        }
+        if (lease_db(interp, Tcl_GetString(path), flags) != NULL) {
+            return TCL_OK;
         }
     }
     return TCL_ERROR;
 }
 
+/**
+ * registry::close
+ *
+ * Closes the registry. A background writer is drained and stopped first, every
+ * entry proc is deleted, the planner's statistics are refreshed if need be (see
+ * maintain.c) and the connection is returned to the pool, with its cached
+ * statements reset and every other statement finalized (or the connection to
+ * registryd is closed), so nothing from this registry outlives the call. The
+ * next command that needs a connection will open a fresh private one.
+ *
+ * If a queued write had failed and not yet been reported by `registry::flush`,
+ * the registry is still closed, but the error is thrown.
+ */
 static int registry_close(ClientData clientData UNUSED, Tcl_Interp* interp,
         int objc, Tcl_Obj* CONST objv[]) {
     if (objc != 1) {
         Tcl_WrongNumArgs(interp, 1, objv, NULL);
         return TCL_ERROR;
+    } else if (!Tcl_GetAssocData(interp, "registry::attached", NULL)) {
+        Tcl_SetResult(interp, "registry is not open", TCL_STATIC);
     } else {
-        sqlite3* db = registry_db(interp, 1);
-        if (db == NULL) {
-            Tcl_SetResult(interp, "registry is not open", TCL_STATIC);
-        } else {
-            sqlite3_stmt* stmt;
-            char* query = "DETACH DATABASE registry";
-            if ((sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK)
-                    && (sqlite3_step(stmt) == SQLITE_DONE)) {
-                sqlite3_finalize(stmt);
-                Tcl_SetAssocData(interp, "registry::attached", NULL, (void*)0);
-                return TCL_OK;
-            } else {
-                set_sqlite_result(interp, db, query);
-                sqlite3_finalize(stmt);
-            }
-        }
+        int result = writer_stop(interp);
+        close_all_entries(interp);
+        maintain_close(interp);
+        client_detach(interp);
+        Tcl_DeleteAssocData(interp, "registry::attached");
+        Tcl_DeleteAssocData(interp, "registry::db");
+        return result;
     }
     return TCL_ERROR;
 }
@@ -178,6 +479,23 @@ int Registry_Init(Tcl_Interp* interp) {
     /* Tcl_CreateObjCommand(interp, "registry::graph", GraphCmd, NULL, NULL); */
     /* Tcl_CreateObjCommand(interp, "registry::item", item_cmd, NULL, NULL); */
     Tcl_CreateObjCommand(interp, "registry::entry", entry_cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "registry::writer", writer_cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "registry::flush", flush_cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "registry::cancel", cancel_cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "registry::progress", registry_progress, NULL,
+            NULL);
+    Tcl_CreateObjCommand(interp, "registry::migrate", registry_migrate, NULL,
+            NULL);
+    Tcl_CreateObjCommand(interp, "registry::maintain", maintain_cmd, NULL,
+            NULL);
+    Tcl_CreateObjCommand(interp, "registry::export", export_cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "registry::import", import_cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "registry::snapshot", snapshot_cmd, NULL,
+            NULL);
+    Tcl_CreateObjCommand(interp, "registry::diff", diff_cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "registry::stats", stats_cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "registry::latency", latency_cmd, NULL, NULL);
+    install_ref_handler(interp);
     if (Tcl_PkgProvide(interp, "registry", "2.0") != TCL_OK) {
         return TCL_ERROR;
     }
@@ -31,6 +31,16 @@
 #include <tcl.h>
 #include <sqlite3.h>
 
+/*
+ * How the interp's registry was opened, kept as its "registry::attached" assoc
+ * data; REGISTRY_ATTACHED is always set, so the data is never NULL while a
+ * registry is open.
+ */
+#define REGISTRY_ATTACHED 0x01
+#define REGISTRY_READONLY 0x02
+#define REGISTRY_SNAPSHOT 0x04
+
 sqlite3* registry_db(Tcl_Interp* interp, int attached);
+int registry_flags(Tcl_Interp* interp);
 
 #endif /* _REGISTRY_H */
@@ -0,0 +1,214 @@
+/*
+ * registry_query.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * registry-query: answers common questions about the registry from the shell.
+ *
+ *     registry-query ?-f registry.db? owner path ...
+ *     registry-query ?-f registry.db? installed ?name ?version??
+ *     registry-query ?-f registry.db? active ?name ?version??
+ *     registry-query ?-f registry.db? files name ?version?
+ *
+ * `owner` prints the port owning each path, one per line, or an empty line for
+ * a path nobody owns. `installed` and `active` print one port per line as
+ * `name @version_revision+variants`. `files` prints the files of the ports with
+ * that name, whatever their state. The registry is opened read-only through
+ * libregistry, with no Tcl involved, so a query on a warm page cache costs
+ * little more than process startup.
+ *
+ * Exits 0 if everything asked about was found, 1 if something wasn't, and 2 on
+ * error.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "cregistry.h"
+
+static const char* progname = "registry-query";
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: %s ?-f registry.db? owner path ...\n"
+            "       %s ?-f registry.db? installed|active ?name ?version??\n"
+            "       %s ?-f registry.db? files name ?version?\n",
+            progname, progname, progname);
+    exit(2);
+}
+
+static int failed(reg_error* error) {
+    fprintf(stderr, "%s: %s\n", progname, error->description);
+    reg_error_destruct(error);
+    return 2;
+}
+
+/*
+ * Prints `entry` as `name @version_revision+variants`.
+ */
+static int print_entry(sqlite3* db, reg_entry* entry, reg_error* errPtr) {
+    static char* keys[] = { "name", "version", "revision", "variants" };
+    char* values[4];
+    int i;
+    for (i=0; i<4; i++) {
+        if (!reg_entry_propget(db, entry, keys[i], &values[i], errPtr)) {
+            while (i-- > 0) {
+                free(values[i]);
+            }
+            return 0;
+        }
+    }
+    printf("%s @%s_%s%s\n", values[0], values[1], values[2], values[3]);
+    for (i=0; i<4; i++) {
+        free(values[i]);
+    }
+    return 1;
+}
+
+static int print_file(void* userdata UNUSED, int row UNUSED,
+        const char* value, int len, reg_error* errPtr UNUSED) {
+    fwrite(value, 1, len, stdout);
+    putchar('\n');
+    return 1;
+}
+
+static int query_owner(sqlite3* db, int argc, char** argv) {
+    int i, status = 0;
+    reg_error error;
+    if (argc == 0) {
+        usage();
+    }
+    for (i=0; i<argc; i++) {
+        reg_entry* entry;
+        char* name;
+        if (!reg_entry_owner(db, argv[i], &entry, &error)) {
+            return failed(&error);
+        }
+        if (entry == NULL) {
+            putchar('\n');
+            status = 1;
+            continue;
+        }
+        if (!reg_entry_propget(db, entry, "name", &name, &error)) {
+            reg_entry_free(db, &entry, 1);
+            return failed(&error);
+        }
+        puts(name);
+        free(name);
+        reg_entry_free(db, &entry, 1);
+    }
+    return status;
+}
+
+static int query_entries(sqlite3* db, const char* cmd, int argc,
+        char** argv) {
+    char* name = argc > 0 ? argv[0] : NULL;
+    char* version = argc > 1 ? argv[1] : NULL;
+    reg_entry** entries;
+    reg_arena arena;
+    reg_error error;
+    int i, count, ok = 1;
+    if (argc > 2 || (strcmp(cmd, "files") == 0 && argc == 0)) {
+        usage();
+    }
+    reg_arena_init(&arena, 1024);
+    if (strcmp(cmd, "files") == 0) {
+        char* keys[] = { "name", "version" };
+        char* vals[2];
+        vals[0] = name;
+        vals[1] = version;
+        count = reg_entry_search(db, keys, vals, argc, 0, &entries, &arena,
+                &error);
+    } else if (strcmp(cmd, "active") == 0) {
+        count = reg_entry_active(db, name, version, &entries, &arena, &error);
+    } else {
+        count = reg_entry_installed(db, name, version, &entries, &arena,
+                &error);
+    }
+    if (count < 0) {
+        reg_arena_free(&arena);
+        return failed(&error);
+    }
+    for (i=0; ok && i<count; i++) {
+        if (strcmp(cmd, "files") == 0) {
+            ok = (reg_entry_files_visit(db, entries[i], print_file, NULL,
+                        &error) >= 0);
+        } else {
+            ok = print_entry(db, entries[i], &error);
+        }
+    }
+    reg_arena_free(&arena);
+    if (!ok) {
+        return failed(&error);
+    }
+    return count == 0;
+}
+
+int main(int argc, char** argv) {
+    const char* file = REG_DEFAULT_PATH;
+    const char* cmd;
+    sqlite3* db;
+    reg_error error;
+    int status;
+    if (argc > 0) {
+        const char* slash = strrchr(argv[0], '/');
+        progname = slash != NULL ? slash + 1 : argv[0];
+    }
+    argc--;
+    argv++;
+    if (argc >= 2 && strcmp(argv[0], "-f") == 0) {
+        file = argv[1];
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc == 0) {
+        usage();
+    }
+    cmd = *argv++;
+    argc--;
+    if (strcmp(cmd, "owner") != 0 && strcmp(cmd, "installed") != 0
+            && strcmp(cmd, "active") != 0 && strcmp(cmd, "files") != 0) {
+        usage();
+    }
+    db = reg_open(file, REG_OPEN_READONLY, &error);
+    if (db == NULL) {
+        return failed(&error);
+    }
+    if (strcmp(cmd, "owner") == 0) {
+        status = query_owner(db, argc, argv);
+    } else {
+        status = query_entries(db, cmd, argc, argv);
+    }
+    reg_close(db);
+    return status;
+}
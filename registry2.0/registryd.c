@@ -0,0 +1,383 @@
+/*
+ * registryd.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * registryd: keeps a registry open and answers queries about it.
+ *
+ *     registryd ?-f registry.db?
+ *
+ * Opening the registry, registering its SQL functions and warming sqlite's
+ * page cache is most of the cost of a short query. registryd pays it once: it
+ * holds a read-only connection with its prepared statements and a large page
+ * cache, and serves searches, owner lookups, properties and file lists over
+ * the Unix-domain socket `registry.db.sock`, using the protocol in daemon.h.
+ * The Tcl extension uses it whenever it is running; see client.c.
+ *
+ * Every query runs in its own read transaction, so changes committed by other
+ * processes are seen straight away. registryd runs in the foreground until it
+ * gets SIGINT or SIGTERM, and removes its socket on the way out.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sqlite3.h>
+
+#include "cregistry.h"
+#include "daemon.h"
+
+/* most search keys a request may have */
+#define MAX_KEYS 16
+
+/*
+ * How long a client may take to send the rest of a request, or to make room
+ * for a reply, in seconds; the daemon serves nobody else meanwhile.
+ */
+#define CLIENT_TIMEOUT 1
+
+static const char* progname = "registryd";
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig UNUSED) {
+    stopping = 1;
+}
+
+static const char* entry_keys[] = {
+    "name", "portfile", "url", "location", "epoch", "version", "revision",
+    "variants", "date", "state", NULL
+};
+
+static int bad_request(reg_error* errPtr) {
+    errPtr->code = "registry::daemon-error";
+    errPtr->description = "malformed request";
+    errPtr->free = NULL;
+    return 0;
+}
+
+/*
+ * Reads a field naming a column of the ports table. Anything else is refused,
+ * since the keys end up in SQL.
+ */
+static char* next_key(reg_msg* request, reg_arena* arena) {
+    const char* data;
+    size_t len;
+    int i;
+    if (!reg_msg_next(request, &data, &len)) {
+        return NULL;
+    }
+    for (i=0; entry_keys[i] != NULL; i++) {
+        if (strlen(entry_keys[i]) == len
+                && memcmp(entry_keys[i], data, len) == 0) {
+            return reg_arena_strdup(arena, data, len);
+        }
+    }
+    return NULL;
+}
+
+static int next_rowid(reg_msg* request, sqlite_int64* rowid) {
+    const char* data;
+    size_t len;
+    return reg_msg_next(request, &data, &len)
+        && reg_msg_rowid(data, len, rowid);
+}
+
+static int add_rowid(void* userdata, sqlite_int64 rowid,
+        reg_error* errPtr UNUSED) {
+    reg_msg_add_rowid((reg_msg*)userdata, rowid);
+    return 1;
+}
+
+static int add_file(void* userdata, int row UNUSED, const char* value,
+        int len, reg_error* errPtr UNUSED) {
+    reg_msg_add((reg_msg*)userdata, value, len);
+    return 1;
+}
+
+static int serve_search(sqlite3* db, reg_msg* request, reg_msg* reply,
+        reg_arena* arena, reg_error* errPtr) {
+    char* keys[MAX_KEYS];
+    char* vals[MAX_KEYS];
+    int key_count = 0;
+    int strategy;
+    const char* data;
+    size_t len;
+    if (!reg_msg_next(request, &data, &len) || len != 1
+            || (unsigned char)data[0] > 2) {
+        return bad_request(errPtr);
+    }
+    strategy = data[0];
+    while (request->pos < request->len) {
+        if (key_count == MAX_KEYS) {
+            return bad_request(errPtr);
+        }
+        keys[key_count] = next_key(request, arena);
+        if (keys[key_count] == NULL
+                || !reg_msg_next(request, &data, &len)) {
+            return bad_request(errPtr);
+        }
+        vals[key_count++] = reg_arena_strdup(arena, data, len);
+    }
+    return reg_entry_search_visit(db, keys, vals, key_count, strategy,
+            add_rowid, reply, errPtr) >= 0;
+}
+
+static int serve_owner(sqlite3* db, reg_msg* request, reg_msg* reply,
+        reg_arena* arena, reg_error* errPtr) {
+    const char* data;
+    size_t len;
+    reg_entry* entry;
+    if (!reg_msg_next(request, &data, &len)) {
+        return bad_request(errPtr);
+    }
+    if (!reg_entry_owner(db, reg_arena_strdup(arena, data, len), &entry,
+                errPtr)) {
+        return 0;
+    }
+    if (entry != NULL) {
+        reg_msg_add_rowid(reply, entry->rowid);
+        reg_entry_free(db, &entry, 1);
+    }
+    return 1;
+}
+
+static int serve_propget(sqlite3* db, reg_msg* request, reg_msg* reply,
+        reg_arena* arena, reg_error* errPtr) {
+    reg_entry entry;
+    char* key;
+    char* value;
+    if (!next_rowid(request, &entry.rowid)) {
+        return bad_request(errPtr);
+    }
+    key = next_key(request, arena);
+    if (key == NULL) {
+        return bad_request(errPtr);
+    }
+    entry.db = db;
+    if (!reg_entry_propget(db, &entry, key, &value, errPtr)) {
+        return 0;
+    }
+    reg_msg_add(reply, value, strlen(value));
+    free(value);
+    return 1;
+}
+
+static int serve_files(sqlite3* db, reg_msg* request, reg_msg* reply,
+        reg_arena* arena UNUSED, reg_error* errPtr) {
+    reg_entry entry;
+    if (!next_rowid(request, &entry.rowid)) {
+        return bad_request(errPtr);
+    }
+    entry.db = db;
+    return reg_entry_files_visit(db, &entry, add_file, reply, errPtr) >= 0;
+}
+
+/*
+ * Answers one request from `fd`. Returns 0 if the client went away or can't
+ * be talked to any more.
+ */
+static int serve(sqlite3* db, int fd) {
+    reg_msg request, reply;
+    reg_arena arena;
+    reg_error error;
+    int ok;
+    if (!reg_msg_recv(fd, &request)) {
+        reg_msg_free(&request);
+        return 0;
+    }
+    reg_arena_init(&arena, 256);
+    reg_msg_init(&reply, REG_DAEMON_OK);
+    switch (reg_msg_type(&request)) {
+        case REG_DAEMON_SEARCH:
+            ok = serve_search(db, &request, &reply, &arena, &error);
+            break;
+        case REG_DAEMON_OWNER:
+            ok = serve_owner(db, &request, &reply, &arena, &error);
+            break;
+        case REG_DAEMON_PROPGET:
+            ok = serve_propget(db, &request, &reply, &arena, &error);
+            break;
+        case REG_DAEMON_FILES:
+            ok = serve_files(db, &request, &reply, &arena, &error);
+            break;
+        default:
+            ok = bad_request(&error);
+            break;
+    }
+    if (!ok) {
+        reg_msg_free(&reply);
+        reg_msg_init(&reply, REG_DAEMON_ERROR);
+        reg_msg_add(&reply, error.code, strlen(error.code));
+        reg_msg_add(&reply, error.description, strlen(error.description));
+        reg_error_destruct(&error);
+    }
+    ok = reg_msg_send(fd, &reply);
+    reg_msg_free(&reply);
+    reg_msg_free(&request);
+    reg_arena_free(&arena);
+    return ok;
+}
+
+/*
+ * Creates the listening socket at `path`. A socket left behind by a daemon
+ * that died is replaced; one with a live daemon behind it is not. The socket
+ * is made under a temporary name and renamed into place once it is listening,
+ * so clients never find one they can't connect to yet.
+ */
+static int listen_on(const char* file, const char* path) {
+    struct sockaddr_un addr;
+    int fd = reg_daemon_connect(file);
+    if (fd >= 0) {
+        close(fd);
+        fprintf(stderr, "%s: already running for %s\n", progname, file);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    sprintf(addr.sun_path, "%s.new", path);
+    unlink(addr.sun_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror(progname);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+            || listen(fd, 64) != 0 || rename(addr.sun_path, path) != 0) {
+        perror(path);
+        close(fd);
+        unlink(addr.sun_path);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    const char* file = REG_DEFAULT_PATH;
+    struct pollfd* fds;
+    struct sigaction action;
+    int fd_count = 1, fd_space = 16;
+    sqlite3* db;
+    reg_error error;
+    char* path;
+    int i;
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        file = argv[2];
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s ?-f registry.db?\n", progname);
+        return 2;
+    }
+    db = reg_open(file, REG_OPEN_READONLY, &error);
+    if (db == NULL) {
+        fprintf(stderr, "%s: %s\n", progname, error.description);
+        reg_error_destruct(&error);
+        return 2;
+    }
+    /* keep the registry in memory as far as reasonable */
+    sqlite3_exec(db, "PRAGMA registry.cache_size=-65536", NULL, NULL, NULL);
+    sqlite3_exec(db, "PRAGMA registry.mmap_size=268435456", NULL, NULL, NULL);
+    path = reg_daemon_socket(file);
+    if (path == NULL) {
+        fprintf(stderr, "%s: path too long: %s\n", progname, file);
+        reg_close(db);
+        return 2;
+    }
+    fds = malloc(fd_space * sizeof(struct pollfd));
+    fds[0].fd = listen_on(file, path);
+    fds[0].events = POLLIN;
+    if (fds[0].fd < 0) {
+        free(fds);
+        free(path);
+        reg_close(db);
+        return 2;
+    }
+
+    /* no SA_RESTART, so a signal wakes up poll */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stopping) {
+        if (poll(fds, fd_count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror(progname);
+            break;
+        }
+        /* walk backwards, so closing a client doesn't skip another */
+        for (i=fd_count-1; i>0; i--) {
+            if (fds[i].revents != 0 && !serve(db, fds[i].fd)) {
+                close(fds[i].fd);
+                fds[i] = fds[--fd_count];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int client = accept(fds[0].fd, NULL, NULL);
+            if (client >= 0) {
+                struct timeval timeout;
+                timeout.tv_sec = CLIENT_TIMEOUT;
+                timeout.tv_usec = 0;
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                        sizeof(timeout));
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                        sizeof(timeout));
+                if (fd_count == fd_space) {
+                    fd_space *= 2;
+                    fds = realloc(fds, fd_space * sizeof(struct pollfd));
+                }
+                fds[fd_count].fd = client;
+                fds[fd_count].events = POLLIN;
+                fds[fd_count].revents = 0;
+                fd_count++;
+            }
+        }
+    }
+
+    for (i=0; i<fd_count; i++) {
+        close(fds[i].fd);
+    }
+    unlink(path);
+    free(fds);
+    free(path);
+    reg_close(db);
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * results.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "changes.h"
+#include "results.h"
+
+/*
+ * Search result cache.
+ *
+ * Different parts of a front end often ask the same question, like `entry
+ * search state active`, several times in one command. Each interp keeps the
+ * rowids found by its recent searches, keyed by the search's strategy and its
+ * key-value pairs in sorted order, so the same search asked with its pairs in
+ * another order still hits. Searches only read the ports table, so any change
+ * to it empties the cache, whoever made it (see changes.c); changes to files
+ * don't. At most RESULTS_MAX searches are kept, least recently used first out,
+ * and results of more than RESULTS_MAX_ROWS rows aren't kept at all.
+ */
+
+#define RESULTS_MAX 64
+#define RESULTS_MAX_ROWS 4096
+
+typedef struct result result;
+
+struct result {
+    Tcl_HashEntry* hash;
+    result* prev;
+    result* next;
+    int count;
+    sqlite_int64 rowids[1];
+};
+
+typedef struct {
+    Tcl_HashTable by_key;
+    result* head;
+    result* tail;
+    unsigned long hits;
+    unsigned long misses;
+} result_cache;
+
+static void result_unlink(result_cache* cache, result* r) {
+    if (r->prev != NULL) {
+        r->prev->next = r->next;
+    } else {
+        cache->head = r->next;
+    }
+    if (r->next != NULL) {
+        r->next->prev = r->prev;
+    } else {
+        cache->tail = r->prev;
+    }
+}
+
+static void result_link(result_cache* cache, result* r) {
+    r->prev = NULL;
+    r->next = cache->head;
+    if (cache->head != NULL) {
+        cache->head->prev = r;
+    } else {
+        cache->tail = r;
+    }
+    cache->head = r;
+}
+
+static void result_remove(result_cache* cache, result* r) {
+    result_unlink(cache, r);
+    Tcl_DeleteHashEntry(r->hash);
+    ckfree((char*)r);
+}
+
+static void results_clear(result_cache* cache) {
+    while (cache->head != NULL) {
+        result_remove(cache, cache->head);
+    }
+}
+
+static void results_changed(ClientData clientData, int tables,
+        int op UNUSED, sqlite_int64 rowid UNUSED) {
+    if (tables & CHANGE_PORTS) {
+        results_clear((result_cache*)clientData);
+    }
+}
+
+static void delete_results(ClientData clientData, Tcl_Interp* interp) {
+    result_cache* cache = (result_cache*)clientData;
+    changes_unlisten(interp, results_changed, cache);
+    results_clear(cache);
+    Tcl_DeleteHashTable(&cache->by_key);
+    ckfree((char*)cache);
+}
+
+static result_cache* get_results(Tcl_Interp* interp) {
+    result_cache* cache = Tcl_GetAssocData(interp, "registry::results", NULL);
+    if (cache == NULL) {
+        cache = (result_cache*)ckalloc(sizeof(result_cache));
+        Tcl_InitHashTable(&cache->by_key, TCL_STRING_KEYS);
+        cache->head = NULL;
+        cache->tail = NULL;
+        cache->hits = 0;
+        cache->misses = 0;
+        Tcl_SetAssocData(interp, "registry::results", delete_results, cache);
+        changes_listen(interp, results_changed, cache);
+    }
+    return cache;
+}
+
+static int compare_pairs(const void* a, const void* b) {
+    char* const* pa = (char* const*)a;
+    char* const* pb = (char* const*)b;
+    int result = strcmp(pa[0], pb[0]);
+    return result != 0 ? result : strcmp(pa[1], pb[1]);
+}
+
+/*
+ * Builds the cache key for a search into `key`. Every string is preceded by
+ * its length, so no choice of keys and values can collide with another.
+ */
+static void result_key(Tcl_DString* key, int strategy, char** keys,
+        char** vals, int key_count) {
+    char** pairs = (char**)ckalloc(2 * key_count * sizeof(char*) + 1);
+    char buf[TCL_INTEGER_SPACE + 2];
+    int i;
+    for (i=0; i<key_count; i++) {
+        pairs[2*i] = keys[i];
+        pairs[2*i+1] = vals[i];
+    }
+    qsort(pairs, key_count, 2 * sizeof(char*), compare_pairs);
+    Tcl_DStringInit(key);
+    sprintf(buf, "%d", strategy);
+    Tcl_DStringAppend(key, buf, -1);
+    for (i=0; i<2*key_count; i++) {
+        sprintf(buf, " %d:", (int)strlen(pairs[i]));
+        Tcl_DStringAppend(key, buf, -1);
+        Tcl_DStringAppend(key, pairs[i], -1);
+    }
+    ckfree((char*)pairs);
+}
+
+/**
+ * Looks up a search in the interp's cache. On a hit, returns the number of
+ * entries found, with them and the list holding them allocated from `arena`
+ * and bound to `db`. On a miss, returns -1.
+ */
+int results_get(Tcl_Interp* interp, int strategy, char** keys, char** vals,
+        int key_count, sqlite3* db, reg_entry*** entries, reg_arena* arena) {
+    result_cache* cache = get_results(interp);
+    Tcl_DString key;
+    Tcl_HashEntry* hash;
+    result* r;
+    reg_entry** list;
+    int i;
+    result_key(&key, strategy, keys, vals, key_count);
+    hash = Tcl_FindHashEntry(&cache->by_key, Tcl_DStringValue(&key));
+    Tcl_DStringFree(&key);
+    if (hash == NULL) {
+        cache->misses++;
+        return -1;
+    }
+    cache->hits++;
+    r = (result*)Tcl_GetHashValue(hash);
+    result_unlink(cache, r);
+    result_link(cache, r);
+    list = reg_arena_alloc(arena, (r->count + 1) * sizeof(reg_entry*));
+    for (i=0; i<r->count; i++) {
+        list[i] = reg_arena_alloc(arena, sizeof(reg_entry));
+        list[i]->rowid = r->rowids[i];
+        list[i]->db = db;
+    }
+    *entries = list;
+    return r->count;
+}
+
+/**
+ * Remembers the entries a search found, replacing what was kept for the same
+ * search if anything was.
+ */
+void results_put(Tcl_Interp* interp, int strategy, char** keys, char** vals,
+        int key_count, reg_entry** entries, int entry_count) {
+    result_cache* cache;
+    Tcl_DString key;
+    Tcl_HashEntry* hash;
+    result* r;
+    int created, i;
+    if (entry_count > RESULTS_MAX_ROWS) {
+        return;
+    }
+    cache = get_results(interp);
+    result_key(&key, strategy, keys, vals, key_count);
+    hash = Tcl_CreateHashEntry(&cache->by_key, Tcl_DStringValue(&key),
+            &created);
+    Tcl_DStringFree(&key);
+    if (!created) {
+        /* the newer answer replaces the one kept, in the same hash entry */
+        r = (result*)Tcl_GetHashValue(hash);
+        result_unlink(cache, r);
+        ckfree((char*)r);
+    }
+    r = (result*)ckalloc(sizeof(result)
+            + entry_count * sizeof(sqlite_int64));
+    r->hash = hash;
+    r->count = entry_count;
+    for (i=0; i<entry_count; i++) {
+        r->rowids[i] = entries[i]->rowid;
+    }
+    Tcl_SetHashValue(hash, r);
+    result_link(cache, r);
+    if (cache->by_key.numEntries > RESULTS_MAX) {
+        result_remove(cache, cache->tail);
+    }
+}
+
+/**
+ * Returns a dict of the interp's cache `hits` and `misses` and how many
+ * searches it holds (`size`). With `reset`, zeroes the counts afterwards.
+ */
+Tcl_Obj* results_counts(Tcl_Interp* interp, int reset) {
+    result_cache* cache = get_results(interp);
+    Tcl_Obj* result = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("hits", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(cache->hits));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("misses", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(cache->misses));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("size", -1));
+    Tcl_ListObjAppendElement(interp, result,
+            Tcl_NewIntObj(cache->by_key.numEntries));
+    if (reset) {
+        cache->hits = 0;
+        cache->misses = 0;
+    }
+    return result;
+}
@@ -0,0 +1,648 @@
+/*
+ * snapshot.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "changes.h"
+#include "dump.h"
+#include "entry.h"
+#include "maintain.h"
+#include "migrate.h"
+#include "registry.h"
+#include "snapshot.h"
+#include "sql.h"
+#include "util.h"
+#include "writer.h"
+
+/*
+ * Snapshots.
+ *
+ * `registry::snapshot save` writes the ports and files of the registry to a
+ * file in a compact binary form, and `registry::snapshot restore` replaces
+ * the ports and files of a registry with those of a snapshot. Restoring a
+ * snapshot is much quicker than making the same entries and mapping the same
+ * files one at a time, or importing an export (see dump.c): files are saved in
+ * order of path, so restoring them appends to the unique index on paths
+ * instead of inserting all over it, and the other indexes are built once at
+ * the end. A snapshot is laid out as:
+ *
+ *     magic     SNAPSHOT_MAGIC, 8 bytes
+ *     format    SNAPSHOT_FORMAT, 4 bytes
+ *     schema    the registry's schema version, 4 bytes
+ *     ports     a varint count, then SNAPSHOT_COLUMNS values for each port,
+ *               which are numbered from 1 in this order
+ *     files     for each file, in order of path: a varint of its port's
+ *               number, a varint of how many leading bytes its path shares
+ *               with the one before, a varint length and the bytes of the
+ *               rest of its path, and its mtime value; then a varint 0
+ *     checksum  CRC-32 of all that comes before, 4 bytes
+ *
+ * Fixed-size integers are little-endian and varints are LEB128. A value is a
+ * byte giving its sqlite type, then for an integer a zigzag varint, for a real
+ * its 8 bytes, and for text a varint length and its bytes.
+ *
+ * Files whose port has been deleted aren't saved.
+ */
+
+#define SNAPSHOT_MAGIC "regsnap\0"
+#define SNAPSHOT_FORMAT 1
+#define SNAPSHOT_COLUMNS 10
+#define SNAPSHOT_BUFFER 65536
+
+/*
+ * Writing a snapshot.
+ */
+
+typedef struct {
+    Tcl_Interp* interp;
+    Tcl_Channel chan;
+    Tcl_DString buffer;
+    unsigned int crc;
+} snapshot_writer;
+
+static int write_flush(snapshot_writer* w) {
+    const char* bytes = Tcl_DStringValue(&w->buffer);
+    int length = Tcl_DStringLength(&w->buffer);
+    int ok = (length == 0 || Tcl_Write(w->chan, bytes, length) >= 0);
+    w->crc = Tcl_ZlibCRC32(w->crc, (const unsigned char*)bytes, length);
+    Tcl_DStringSetLength(&w->buffer, 0);
+    if (!ok) {
+        Tcl_ResetResult(w->interp);
+        Tcl_AppendResult(w->interp, "error writing snapshot: ",
+                Tcl_PosixError(w->interp), NULL);
+    }
+    return ok;
+}
+
+static void write_u32(snapshot_writer* w, unsigned int value) {
+    unsigned char bytes[4];
+    int i;
+    for (i=0; i<4; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    Tcl_DStringAppend(&w->buffer, (char*)bytes, 4);
+}
+
+static void write_varint(snapshot_writer* w, sqlite_uint64 value) {
+    unsigned char bytes[10];
+    int n = 0;
+    do {
+        bytes[n] = (unsigned char)(value & 0x7f);
+        value >>= 7;
+        if (value != 0) {
+            bytes[n] |= 0x80;
+        }
+        n++;
+    } while (value != 0);
+    Tcl_DStringAppend(&w->buffer, (char*)bytes, n);
+}
+
+static void write_value(snapshot_writer* w, sqlite3_stmt* stmt, int col) {
+    int type = sqlite3_column_type(stmt, col);
+    char byte = (char)type;
+    Tcl_DStringAppend(&w->buffer, &byte, 1);
+    switch (type) {
+        case SQLITE_INTEGER: {
+            sqlite_int64 value = sqlite3_column_int64(stmt, col);
+            write_varint(w, ((sqlite_uint64)value << 1)
+                    ^ (sqlite_uint64)(value >> 63));
+            break;
+        }
+        case SQLITE_FLOAT: {
+            double value = sqlite3_column_double(stmt, col);
+            sqlite_uint64 bits;
+            memcpy(&bits, &value, sizeof(bits));
+            write_u32(w, (unsigned int)bits);
+            write_u32(w, (unsigned int)(bits >> 32));
+            break;
+        }
+        case SQLITE_NULL:
+            break;
+        default: {
+            /* blobs, which the registry doesn't have, are kept as text */
+            const char* text = (const char*)sqlite3_column_text(stmt, col);
+            int length = sqlite3_column_bytes(stmt, col);
+            Tcl_DStringSetLength(&w->buffer,
+                    Tcl_DStringLength(&w->buffer) - 1);
+            byte = SQLITE_TEXT;
+            Tcl_DStringAppend(&w->buffer, &byte, 1);
+            write_varint(w, (sqlite_uint64)length);
+            Tcl_DStringAppend(&w->buffer, text, length);
+        }
+    }
+}
+
+/* a port's rowid and its number in the snapshot */
+typedef struct {
+    sqlite_int64 rowid;
+    sqlite_int64 number;
+} snapshot_port;
+
+static int compare_ports(const void* a, const void* b) {
+    sqlite_int64 x = ((const snapshot_port*)a)->rowid;
+    sqlite_int64 y = ((const snapshot_port*)b)->rowid;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Writes the ports and files of the registry after the header, and counts
+ * them.
+ */
+static int save_rows(snapshot_writer* w, sqlite3* db, sqlite_int64* port_count,
+        sqlite_int64* file_count) {
+    char* count_query = "SELECT COUNT(*) FROM registry.ports";
+    char* port_query = "SELECT rowid, name, portfile, url, location, epoch, "
+        "version, revision, variants, state, date FROM registry.ports "
+        "ORDER BY name, epoch, version, revision, variants";
+    char* file_query = "SELECT port_id, path, mtime FROM registry.files "
+        "ORDER BY path";
+    sqlite3_stmt* stmt = NULL;
+    snapshot_port* ports = NULL;
+    sqlite_int64 count = 0, n = 0;
+    Tcl_DString prev;
+    char* query = count_query;
+    int r, ok;
+    ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+        && (sqlite3_step(stmt) == SQLITE_ROW);
+    if (ok) {
+        count = sqlite3_column_int64(stmt, 0);
+        ports = (snapshot_port*)ckalloc((count + 1) * sizeof(snapshot_port));
+        write_varint(w, (sqlite_uint64)count);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (ok) {
+        query = port_query;
+        ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK);
+    }
+    while (ok && n < count && (r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int i;
+        ports[n].rowid = sqlite3_column_int64(stmt, 0);
+        ports[n].number = n + 1;
+        for (i=1; i<=SNAPSHOT_COLUMNS; i++) {
+            write_value(w, stmt, i);
+        }
+        n++;
+        if (Tcl_DStringLength(&w->buffer) >= SNAPSHOT_BUFFER
+                && !write_flush(w)) {
+            ok = 0;
+            query = NULL;
+        }
+    }
+    if (ok && n < count) {
+        ok = 0;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (ok) {
+        qsort(ports, (size_t)count, sizeof(snapshot_port), compare_ports);
+        query = file_query;
+        ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK);
+    }
+    Tcl_DStringInit(&prev);
+    while (ok && (r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        snapshot_port key;
+        snapshot_port* port;
+        const char* path = (const char*)sqlite3_column_text(stmt, 1);
+        int length = sqlite3_column_bytes(stmt, 1);
+        int shared = 0;
+        key.rowid = sqlite3_column_int64(stmt, 0);
+        port = bsearch(&key, ports, (size_t)count, sizeof(snapshot_port),
+                compare_ports);
+        if (port == NULL || path == NULL) {
+            continue;
+        }
+        while (shared < length && shared < Tcl_DStringLength(&prev)
+                && path[shared] == Tcl_DStringValue(&prev)[shared]) {
+            shared++;
+        }
+        write_varint(w, (sqlite_uint64)port->number);
+        write_varint(w, (sqlite_uint64)shared);
+        write_varint(w, (sqlite_uint64)(length - shared));
+        Tcl_DStringAppend(&w->buffer, path + shared, length - shared);
+        write_value(w, stmt, 2);
+        Tcl_DStringSetLength(&prev, shared);
+        Tcl_DStringAppend(&prev, path + shared, length - shared);
+        (*file_count)++;
+        if (Tcl_DStringLength(&w->buffer) >= SNAPSHOT_BUFFER
+                && !write_flush(w)) {
+            ok = 0;
+            query = NULL;
+        }
+    }
+    if (ok && r != SQLITE_DONE) {
+        ok = 0;
+    }
+    Tcl_DStringFree(&prev);
+    sqlite3_finalize(stmt);
+    if (ports != NULL) {
+        ckfree((char*)ports);
+    }
+    if (!ok && query != NULL) {
+        set_sqlite_result(w->interp, db, query);
+    }
+    write_varint(w, 0);
+    *port_count = count;
+    return ok;
+}
+
+/*
+ * registry::snapshot save file
+ */
+static int snapshot_save(Tcl_Interp* interp, sqlite3* db, Tcl_Obj* path) {
+    snapshot_writer w;
+    sqlite_int64 ports = 0, files = 0;
+    reg_error error;
+    int version, ok;
+    int in_transaction = !sqlite3_get_autocommit(db);
+    version = reg_schema_version(db, &error);
+    if (version < 0) {
+        return registry_failed(interp, &error);
+    }
+    w.interp = interp;
+    w.crc = 0;
+    w.chan = Tcl_FSOpenFileChannel(interp, path, "w", 0644);
+    if (w.chan == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_SetChannelOption(NULL, w.chan, "-translation", "binary");
+    Tcl_DStringInit(&w.buffer);
+    Tcl_DStringAppend(&w.buffer, SNAPSHOT_MAGIC, 8);
+    write_u32(&w, SNAPSHOT_FORMAT);
+    write_u32(&w, (unsigned int)version);
+    /* ports and files as they are at one moment */
+    ok = in_transaction
+        || sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK;
+    if (!ok) {
+        set_sqlite_result(interp, db, "BEGIN");
+    }
+    ok = ok && save_rows(&w, db, &ports, &files) && write_flush(&w);
+    if (!in_transaction && !sqlite3_get_autocommit(db)) {
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+    if (ok) {
+        write_u32(&w, w.crc);
+        ok = write_flush(&w);
+    }
+    Tcl_DStringFree(&w.buffer);
+    if (Tcl_Close(ok ? interp : NULL, w.chan) != TCL_OK) {
+        ok = 0;
+    }
+    if (!ok) {
+        Tcl_FSDeleteFile(path);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, dump_counts(interp, ports, files));
+    return TCL_OK;
+}
+
+/*
+ * Reading a snapshot.
+ */
+
+typedef struct {
+    const unsigned char* p;
+    const unsigned char* end;
+    int ok;
+} snapshot_reader;
+
+static unsigned int read_u32(snapshot_reader* r) {
+    unsigned int value = 0;
+    int i;
+    if (r->end - r->p < 4) {
+        r->ok = 0;
+        return 0;
+    }
+    for (i=0; i<4; i++) {
+        value |= (unsigned int)r->p[i] << (8 * i);
+    }
+    r->p += 4;
+    return value;
+}
+
+static sqlite_uint64 read_varint(snapshot_reader* r) {
+    sqlite_uint64 value = 0;
+    int shift;
+    for (shift=0; shift<64 && r->p < r->end; shift+=7) {
+        unsigned char byte = *r->p++;
+        value |= (sqlite_uint64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    r->ok = 0;
+    return 0;
+}
+
+/*
+ * Reads `length` bytes, returning where they start.
+ */
+static const char* read_bytes(snapshot_reader* r, sqlite_uint64 length) {
+    const char* bytes = (const char*)r->p;
+    if ((sqlite_uint64)(r->end - r->p) < length) {
+        r->ok = 0;
+        return NULL;
+    }
+    r->p += length;
+    return bytes;
+}
+
+/*
+ * Reads a value and binds it to parameter `index` of `stmt`.
+ */
+static void read_value(snapshot_reader* r, sqlite3_stmt* stmt, int index) {
+    int type = (r->p < r->end) ? *r->p++ : -1;
+    switch (type) {
+        case SQLITE_INTEGER: {
+            sqlite_uint64 value = read_varint(r);
+            sqlite3_bind_int64(stmt, index,
+                    (sqlite_int64)(value >> 1) ^ -(sqlite_int64)(value & 1));
+            break;
+        }
+        case SQLITE_FLOAT: {
+            sqlite_uint64 bits = read_u32(r);
+            double value;
+            bits |= (sqlite_uint64)read_u32(r) << 32;
+            memcpy(&value, &bits, sizeof(value));
+            sqlite3_bind_double(stmt, index, value);
+            break;
+        }
+        case SQLITE_TEXT: {
+            sqlite_uint64 length = read_varint(r);
+            const char* text = read_bytes(r, length);
+            if (r->ok) {
+                sqlite3_bind_text(stmt, index, text, (int)length,
+                        SQLITE_STATIC);
+            }
+            break;
+        }
+        case SQLITE_NULL:
+            sqlite3_bind_null(stmt, index);
+            break;
+        default:
+            r->ok = 0;
+    }
+}
+
+/*
+ * Reads the whole of the snapshot at `path` into `data` and checks its
+ * header and checksum.
+ */
+static int restore_read(Tcl_Interp* interp, Tcl_Obj* path, Tcl_Obj* data,
+        snapshot_reader* r) {
+    Tcl_Channel chan = Tcl_FSOpenFileChannel(interp, path, "r", 0);
+    const char* problem = NULL;
+    int length, result;
+    if (chan == NULL) {
+        return 0;
+    }
+    Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+    result = Tcl_ReadChars(chan, data, -1, 0);
+    Tcl_Close(NULL, chan);
+    if (result < 0) {
+        Tcl_AppendResult(interp, "error reading snapshot: ",
+                Tcl_PosixError(interp), NULL);
+        return 0;
+    }
+    r->p = Tcl_GetByteArrayFromObj(data, &length);
+    r->end = r->p + length;
+    r->ok = 1;
+    if (length < 20 || memcmp(r->p, SNAPSHOT_MAGIC, 8) != 0) {
+        problem = "not a registry snapshot";
+    } else {
+        snapshot_reader trailer;
+        trailer.p = r->end - 4;
+        trailer.end = r->end;
+        if (read_u32(&trailer) != Tcl_ZlibCRC32(0, r->p, length - 4)) {
+            problem = "snapshot is damaged";
+        }
+        r->end -= 4;
+        r->p += 8;
+    }
+    if (problem == NULL) {
+        unsigned int format = read_u32(r);
+        unsigned int schema = read_u32(r);
+        if (format != SNAPSHOT_FORMAT) {
+            problem = "snapshot format is unknown";
+        } else if (schema > REG_SCHEMA_VERSION) {
+            problem = "snapshot is from a newer registry";
+        }
+    }
+    if (problem != NULL) {
+        Tcl_SetResult(interp, (char*)problem, TCL_STATIC);
+        Tcl_SetErrorCode(interp, "registry::invalid-snapshot", NULL);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Loads the ports and files of the snapshot `r` into the emptied registry.
+ */
+static int restore_rows(Tcl_Interp* interp, sqlite3* db, snapshot_reader* r,
+        sqlite_int64* port_count, sqlite_int64* file_count) {
+    char* port_query = "INSERT INTO registry.ports (name, portfile, url, "
+        "location, epoch, version, revision, variants, state, date) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    char* file_query = "INSERT INTO registry.files (port_id, path, mtime) "
+        "VALUES (?, ?, ?)";
+    sqlite3_stmt* stmt = NULL;
+    sqlite_int64* rowids = NULL;
+    sqlite_uint64 count, n;
+    Tcl_DString path;
+    char* query = port_query;
+    int ok;
+    count = read_varint(r);
+    /* each port takes at least a byte per column */
+    if (!r->ok || count > (sqlite_uint64)(r->end - r->p)) {
+        r->ok = 0;
+        return 0;
+    }
+    rowids = (sqlite_int64*)ckalloc((size_t)(count + 1)
+            * sizeof(sqlite_int64));
+    ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK);
+    for (n=0; ok && r->ok && n<count; n++) {
+        int i;
+        for (i=1; i<=SNAPSHOT_COLUMNS; i++) {
+            read_value(r, stmt, i);
+        }
+        if (r->ok) {
+            ok = (sqlite3_step(stmt) == SQLITE_DONE);
+            sqlite3_reset(stmt);
+            rowids[n] = sqlite3_last_insert_rowid(db);
+        }
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    *port_count = (sqlite_int64)n;
+    if (ok && r->ok) {
+        query = file_query;
+        ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK);
+    }
+    Tcl_DStringInit(&path);
+    while (ok && r->ok) {
+        sqlite_uint64 port = read_varint(r);
+        sqlite_uint64 shared, length;
+        const char* rest;
+        if (port == 0 || port > count) {
+            r->ok = r->ok && (port == 0);
+            break;
+        }
+        shared = read_varint(r);
+        length = read_varint(r);
+        rest = read_bytes(r, length);
+        if (!r->ok || shared > (sqlite_uint64)Tcl_DStringLength(&path)) {
+            r->ok = 0;
+            break;
+        }
+        Tcl_DStringSetLength(&path, (int)shared);
+        Tcl_DStringAppend(&path, rest, (int)length);
+        sqlite3_bind_int64(stmt, 1, rowids[port - 1]);
+        sqlite3_bind_text(stmt, 2, Tcl_DStringValue(&path),
+                Tcl_DStringLength(&path), SQLITE_STATIC);
+        read_value(r, stmt, 3);
+        if (r->ok) {
+            ok = (sqlite3_step(stmt) == SQLITE_DONE);
+            sqlite3_reset(stmt);
+            (*file_count)++;
+        }
+    }
+    if (!ok) {
+        set_sqlite_result(interp, db, query);
+    }
+    Tcl_DStringFree(&path);
+    sqlite3_finalize(stmt);
+    ckfree((char*)rowids);
+    return ok && r->ok;
+}
+
+/*
+ * registry::snapshot restore file
+ */
+static int snapshot_restore(Tcl_Interp* interp, sqlite3* db, Tcl_Obj* path) {
+    snapshot_reader r;
+    dump_indexes indexes;
+    sqlite_int64 ports = 0, files = 0;
+    Tcl_Obj* data = Tcl_NewObj();
+    char* query = "BEGIN IMMEDIATE; DELETE FROM registry.files; "
+        "DELETE FROM registry.ports";
+    int ok;
+    Tcl_IncrRefCount(data);
+    indexes.queries = NULL;
+    indexes.count = 0;
+    ok = restore_read(interp, path, data, &r);
+    if (ok && sqlite3_exec(db, query, NULL, NULL, NULL) != SQLITE_OK) {
+        set_sqlite_result(interp, db, query);
+        ok = 0;
+    }
+    ok = ok && dump_drop_indexes(interp, db, &indexes);
+    if (ok && !restore_rows(interp, db, &r, &ports, &files)) {
+        if (!r.ok) {
+            Tcl_SetResult(interp, "snapshot is damaged", TCL_STATIC);
+            Tcl_SetErrorCode(interp, "registry::invalid-snapshot", NULL);
+        }
+        ok = 0;
+    }
+    ok = ok && dump_create_indexes(interp, db, &indexes);
+    if (ok && sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        set_sqlite_result(interp, db, "COMMIT");
+        ok = 0;
+    }
+    if (!ok && !sqlite3_get_autocommit(db)) {
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    }
+    /* restored ports can get the rowids of the ones deleted, so no proc or
+     * tombstone may outlive them, as with `registry::close`; after a failed
+     * restore they all still stand for what they did */
+    if (ok) {
+        close_all_entries(interp);
+    }
+    dump_free_indexes(&indexes);
+    Tcl_DecrRefCount(data);
+    /* the DELETEs truncated the tables without telling the update hook */
+    changes_unknown(interp);
+    if (!ok) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, dump_counts(interp, ports, files));
+    return TCL_OK;
+}
+
+/**
+ * registry::snapshot save|restore file
+ *
+ * `save` writes the registry's ports and files to `file`, as described above.
+ * It works on a read-only registry too, and within a snapshot opened with
+ * `registry::open -snapshot` saves what that sees. `restore` replaces every
+ * port and file in the registry with those saved in `file`, all at once or, on
+ * error, not at all. Once it succeeds, entry procs are closed, as by
+ * `registry::entry close -all`, since the entries they stood for are gone. A
+ * file that isn't a snapshot, or whose checksum is wrong, is refused with the
+ * error code `registry::invalid-snapshot`. Both return a dict of how many
+ * `ports` and `files` they saved or restored.
+ */
+int snapshot_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    static const char* cmds[] = { "save", "restore", NULL };
+    enum { CMD_SAVE, CMD_RESTORE };
+    sqlite3* db;
+    int index, result;
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "save|restore file");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], cmds, "cmd", 0, &index)
+            != TCL_OK) {
+        return TCL_ERROR;
+    }
+    writer_sync(interp);
+    changes_check(interp);
+    db = registry_db(interp, 1);
+    if (db == NULL) {
+        return TCL_ERROR;
+    }
+    if (index == CMD_SAVE) {
+        return snapshot_save(interp, db, objv[2]);
+    }
+    if (registry_flags(interp) & REGISTRY_READONLY) {
+        Tcl_SetResult(interp, "registry is open read-only", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    result = snapshot_restore(interp, db, objv[2]);
+    maintain_check(interp);
+    return result;
+}
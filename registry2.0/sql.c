@@ -30,39 +30,16 @@
 #include <config.h>
 #endif
 
-#include <tcl.h>
 #include <sqlite3.h>
 #include <string.h>
+#include <stdlib.h>
 #include <time.h>
 #include <ctype.h>
+#include <regex.h>
 
-#include "util.h"
-
-/**
- * REGEXP function for sqlite3.
- *
- * Takes two arguments; the first is the value and the second the pattern. If
- * the pattern is invalid, errors out. Otherwise, returns true if the value
- * matches the pattern and false otherwise.
- *
- * This function is available in sqlite3 as the REGEXP operator.
- */
-static void sql_regexp(sqlite3_context* context, int argc UNUSED,
-        sqlite3_value** argv) {
-    const char* value = sqlite3_value_text(argv[0]);
-    const char* pattern = sqlite3_value_text(argv[1]);
-    switch (Tcl_RegExpMatch(NULL, value, pattern)) {
-        case 0:
-            sqlite3_result_int(context, 0);
-            break;
-        case 1:
-            sqlite3_result_int(context, 1);
-            break;
-        case -1:
-            sqlite3_result_error(context, "invalid pattern", -1);
-            break;
-    }
-}
+#include "centry.h"
+#include "sql.h"
+#include "migrate.h"
 
 /**
  * NOW function for sqlite3.
@@ -74,6 +51,37 @@ static void sql_now(sqlite3_context* context, int argc UNUSED,
     sqlite3_result_int(context, time(NULL));
 }
 
+static void sql_free_regex(void* re) {
+    regfree((regex_t*)re);
+    free(re);
+}
+
+/**
+ * REGEXP function for sqlite3, using POSIX extended regular expressions.
+ *
+ * sqlite evaluates `X REGEXP Y` as `regexp(Y, X)`, so the pattern comes first.
+ * The compiled pattern is kept as auxiliary data, so each statement compiles
+ * it only once. The Tcl layer replaces this with Tcl's own engine in `init_db`.
+ */
+static void sql_regexp(sqlite3_context* context, int argc UNUSED,
+        sqlite3_value** argv) {
+    regex_t* re = sqlite3_get_auxdata(context, 0);
+    const char* value = (const char*)sqlite3_value_text(argv[1]);
+    if (re == NULL) {
+        const char* pattern = (const char*)sqlite3_value_text(argv[0]);
+        re = malloc(sizeof(regex_t));
+        if (pattern == NULL
+                || regcomp(re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+            free(re);
+            sqlite3_result_error(context, "invalid regular expression", -1);
+            return;
+        }
+        sqlite3_set_auxdata(context, 0, re, sql_free_regex);
+    }
+    sqlite3_result_int(context, value != NULL
+            && regexec(re, value, 0, NULL, 0) == 0);
+}
+
 static int rpm_vercomp (const char *versionA, const char *versionB) {
 	const char *ptrA, *ptrB;
 	const char *eptrA, *eptrB;
@@ -187,12 +195,54 @@ static int rpm_vercomp (const char *versionA, const char *versionB) {
  *
  * TODO: share rpm-vercomp properly with pextlib. Currently it's copy-pasted in.
  */
-static int sql_version(void* userdata UNUSED, int alen UNUSED, const void* a,
-        int blen UNUSED, const void* b) {
-    /* I really hope that the strings are null-terminated. sqlite doesn't
-     * describe this API well.
+static int sql_version(void* userdata UNUSED, int alen, const void* a,
+        int blen, const void* b) {
+    /* sqlite hands us pointers into its record buffers, which are not
+     * null-terminated, so copy them before comparing.
      */
-    return rpm_vercomp((const char*)a, (const char*)b);
+    char a_buf[64], b_buf[64];
+    char* a_str = alen < (int)sizeof(a_buf) ? a_buf : malloc(alen + 1);
+    char* b_str = blen < (int)sizeof(b_buf) ? b_buf : malloc(blen + 1);
+    int result;
+    memcpy(a_str, a, alen);
+    a_str[alen] = '\0';
+    memcpy(b_str, b, blen);
+    b_str[blen] = '\0';
+    result = rpm_vercomp(a_str, b_str);
+    if (a_str != a_buf) {
+        free(a_str);
+    }
+    if (b_str != b_buf) {
+        free(b_str);
+    }
+    return result;
+}
+
+/**
+ * Compares two versions the way the VERSION collation does, for code that
+ * merges rows sqlite sorted by it.
+ */
+int reg_version_compare(int alen, const void* a, int blen, const void* b) {
+    return sql_version(NULL, alen, a, blen, b);
+}
+
+/**
+ * Executes a null-terminated list of queries, stopping at the first that
+ * fails.
+ */
+static int reg_do_queries(sqlite3* db, char** queries, reg_error* errPtr) {
+    char** query;
+    for (query = queries; *query != NULL; query++) {
+        sqlite3_stmt* stmt;
+        if ((sqlite3_prepare_v2(db, *query, -1, &stmt, NULL) != SQLITE_OK)
+                || (sqlite3_step(stmt) != SQLITE_DONE)) {
+            reg_sqlite_error(db, errPtr, *query);
+            sqlite3_finalize(stmt);
+            return 0;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return 1;
 }
 
 /**
@@ -201,8 +251,11 @@ static int sql_version(void* userdata UNUSED, int alen UNUSED, const void* a,
  * This function is called upon an uninitialized database to create the tables
  * needed to record state between invocations of `port`.
  */
-int create_tables(Tcl_Interp* interp, sqlite3* db) {
+int reg_create_tables(sqlite3* db, reg_error* errPtr) {
     static char* queries[] = {
+        /* free pages can be given back a few at a time; see maintain.c */
+        "PRAGMA registry.auto_vacuum=INCREMENTAL",
+
         "BEGIN",
 
         /* metadata table */
@@ -227,45 +280,156 @@ int create_tables(Tcl_Interp* interp, sqlite3* db) {
         "CREATE TABLE registry.files (port_id, path UNIQUE, mtime)",
         "CREATE INDEX registry.file_port ON files (port_id)",
 
+        /* the version in metadata, where reg_check_tables looks first */
+        "PRAGMA registry.user_version=1",
+
         "END",
         NULL
     };
-    return do_queries(interp, db, queries);
+    return reg_do_queries(db, queries, errPtr);
 }
 
 /**
- * Initializes database connection.
+ * Makes sure the attached registry has its tables, creating them if it's empty,
+ * and that they are of the latest schema version, migrating them if not.
  *
- * This function creates all the temporary tables used by the registry. It also
- * registers the user functions and collations declared in "sql.h", making them
- * available.
+ * A registry whose tables were created or checked before has
+ * `PRAGMA user_version` set to REG_SCHEMA_VERSION, which sqlite keeps in the
+ * file header, so the usual case costs one read of a page every open reads
+ * anyway. Otherwise the registry is either empty, and gets its tables, or was
+ * last opened by an older version of this code; it's then brought up to date
+ * with `reg_migrate` and its new version copied to `user_version`, so the next
+ * open takes the fast path. A registry of a newer version than this code knows
+ * is refused with the error code `registry::newer-schema`.
  */
-int init_db(Tcl_Interp* interp, sqlite3* db) {
-    static char* queries[] = {
-        "BEGIN",
-
-        /* items cache */
-        "CREATE TEMPORARY TABLE items (refcount, proc UNIQUE, name, url, path, "
-            "worker, options, variants)",
-
-        /* indexes list */
-        "CREATE TEMPORARY TABLE indexes (file, name, attached)",
-
-        /* entry => proc mapping */
-        "CREATE TEMPORARY TABLE entry_procs (entry_id UNIQUE, proc UNIQUE)",
+int reg_check_tables(sqlite3* db, reg_error* errPtr) {
+    sqlite3_stmt* stmt = NULL;
+    char* query = "PRAGMA registry.user_version";
+    int ok, version = 0, empty = 0;
+    ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+        && (sqlite3_step(stmt) == SQLITE_ROW);
+    if (ok) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (ok && version == REG_SCHEMA_VERSION) {
+        return 1;
+    } else if (ok && version > REG_SCHEMA_VERSION) {
+        /* its tables may have changed in ways this code can't know */
+        errPtr->code = "registry::newer-schema";
+        errPtr->description = "registry was written by a newer version";
+        errPtr->free = NULL;
+        return 0;
+    }
+    if (ok) {
+        query = "SELECT COUNT(*) FROM registry.sqlite_master";
+        ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+            && (sqlite3_step(stmt) == SQLITE_ROW);
+        if (ok) {
+            empty = (sqlite3_column_int(stmt, 0) == 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (!ok) {
+        reg_sqlite_error(db, errPtr, query);
+        return 0;
+    }
+    if (empty && !reg_create_tables(db, errPtr)) {
+        return 0;
+    }
+    version = reg_schema_version(db, errPtr);
+    if (version > 0 && version < REG_SCHEMA_VERSION) {
+        version = reg_migrate(db, reg_migrations, REG_MIGRATE_CHUNK, NULL, NULL,
+                errPtr);
+    }
+    if (version < 0) {
+        return 0;
+    }
+    if (version == REG_SCHEMA_VERSION) {
+        query = sqlite3_mprintf("PRAGMA registry.user_version=%d", version);
+        ok = (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+            && (sqlite3_step(stmt) == SQLITE_DONE);
+        sqlite3_finalize(stmt);
+        if (!ok) {
+            reg_sqlite_error(db, errPtr, query);
+        }
+        sqlite3_free(query);
+    }
+    return ok;
+}
 
-        "END",
-        NULL
-    };
+/**
+ * Returns `path` as a read-only sqlite URI. Characters with a meaning in URIs
+ * are escaped, so any file name can be opened. Free the result with
+ * `sqlite3_free`.
+ */
+char* reg_readonly_uri(const char* path) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = strlen(path);
+    char* uri = sqlite3_malloc(3 * len + sizeof("file:?mode=ro"));
+    char* out;
+    const char* in;
+    if (uri == NULL) {
+        return NULL;
+    }
+    strcpy(uri, "file:");
+    out = uri + 5;
+    for (in = path; *in != '\0'; in++) {
+        if (*in == '%' || *in == '?' || *in == '#') {
+            *out++ = '%';
+            *out++ = hex[(unsigned char)*in >> 4];
+            *out++ = hex[*in & 0xf];
+        } else {
+            *out++ = *in;
+        }
+    }
+    strcpy(out, "?mode=ro");
+    return uri;
+}
 
+/**
+ * Registers the registry's SQL functions on a connection.
+ *
+ * These are the NOW function, the VERSION collation and the REGEXP operator.
+ * Every connection that touches the registry needs them, including read-only
+ * ones that never use the temporary tables.
+ */
+void reg_init_functions(sqlite3* db) {
     /* I'm not error-checking these. I don't think I need to. */
-    sqlite3_create_function(db, "REGEXP", 2, SQLITE_UTF8, NULL, sql_regexp,
-            NULL, NULL);
     sqlite3_create_function(db, "NOW", 0, SQLITE_ANY, NULL, sql_now, NULL,
             NULL);
-
+    sqlite3_create_function(db, "REGEXP", 2, SQLITE_UTF8, NULL, sql_regexp,
+            NULL, NULL);
     sqlite3_create_collation(db, "VERSION", SQLITE_UTF8, NULL, sql_version);
+}
 
-    return do_queries(interp, db, queries);
+/**
+ * Initializes database connection.
+ *
+ * This function registers the SQL functions with `reg_init_functions`. The
+ * temporary tables are left to `reg_init_temp`, since most connections never
+ * use them.
+ */
+int reg_init_db(sqlite3* db, reg_error* errPtr UNUSED) {
+    reg_init_functions(db);
+    return 1;
 }
 
+/**
+ * Creates the temporary tables used by the registry, unless they already exist.
+ *
+ * Call this before using `items` or `indexes` on a connection.
+ */
+int reg_init_temp(sqlite3* db, reg_error* errPtr) {
+    static char* queries[] = {
+        /* items cache */
+        "CREATE TEMPORARY TABLE IF NOT EXISTS items (refcount, proc UNIQUE, "
+            "name, url, path, worker, options, variants)",
+
+        /* indexes list */
+        "CREATE TEMPORARY TABLE IF NOT EXISTS indexes (file, name, attached)",
+
+        NULL
+    };
+    return reg_do_queries(db, queries, errPtr);
+}
@@ -30,7 +30,17 @@
 
 #include <sqlite3.h>
 
-int create_tables(Tcl_Interp* interp, sqlite3* db);
-int init_db(Tcl_Interp* interp, sqlite3* db);
+#include "centry.h"
+
+/* the schema version reg_migrations end at; see migrate.c */
+#define REG_SCHEMA_VERSION 1
+
+char* reg_readonly_uri(const char* path);
+int reg_version_compare(int alen, const void* a, int blen, const void* b);
+void reg_init_functions(sqlite3* db);
+int reg_create_tables(sqlite3* db, reg_error* errPtr);
+int reg_check_tables(sqlite3* db, reg_error* errPtr);
+int reg_init_db(sqlite3* db, reg_error* errPtr);
+int reg_init_temp(sqlite3* db, reg_error* errPtr);
 
 #endif /* _SQL_H */
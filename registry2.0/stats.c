@@ -0,0 +1,606 @@
+/*
+ * stats.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "registry.h"
+#include "stats.h"
+#include "client.h"
+#include "changes.h"
+#include "results.h"
+
+/*
+ * Query instrumentation.
+ *
+ * While enabled, every pooled connection carries a sqlite trace hook that
+ * counts the rows each statement returns and, when the statement finishes,
+ * folds its run time and row count into a process-wide table keyed by the
+ * statement's SQL. Connections pick up the setting when they are leased, so a
+ * writer or async job that is already running keeps whatever it started with.
+ * While disabled no hook is installed at all, and sqlite skips tracing
+ * entirely.
+ */
+
+typedef struct {
+    unsigned long calls;
+    Tcl_WideInt rows;
+    Tcl_WideInt time;
+    Tcl_WideInt max;
+} stmt_stats;
+
+static int stats_enabled = 0;
+static int stats_initialized = 0;
+static Tcl_HashTable stats_by_sql;  /* SQL text -> stmt_stats* */
+static Tcl_HashTable stats_running; /* sqlite3_stmt* -> rows so far */
+TCL_DECLARE_MUTEX(stats_mutex)
+
+/*
+ * Drops the row counts of statements in progress. Called with the mutex held.
+ */
+static void stats_clear_running(void) {
+    Tcl_DeleteHashTable(&stats_running);
+    Tcl_InitHashTable(&stats_running, TCL_ONE_WORD_KEYS);
+}
+
+/*
+ * Drops every statement's totals. Called with the mutex held.
+ */
+static void stats_clear(void) {
+    Tcl_HashSearch search;
+    Tcl_HashEntry* entry;
+    for (entry = Tcl_FirstHashEntry(&stats_by_sql, &search); entry != NULL;
+            entry = Tcl_NextHashEntry(&search)) {
+        ckfree((char*)Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&stats_by_sql);
+    Tcl_InitHashTable(&stats_by_sql, TCL_STRING_KEYS);
+    stats_clear_running();
+}
+
+/*
+ * The trace hook. Rows are tallied against the statement handle, which is
+ * cheap; the SQL-keyed table is only touched once per run, when sqlite reports
+ * the statement's elapsed time on reset or finalize.
+ */
+static int stats_trace(unsigned mask, void* context UNUSED, void* p, void* x) {
+    sqlite3_stmt* stmt = (sqlite3_stmt*)p;
+    Tcl_HashEntry* entry;
+    int isNew;
+    Tcl_MutexLock(&stats_mutex);
+    if (!stats_enabled) {
+        Tcl_MutexUnlock(&stats_mutex);
+        return 0;
+    }
+    if (mask == SQLITE_TRACE_ROW) {
+        long rows;
+        entry = Tcl_CreateHashEntry(&stats_running, (char*)stmt, &isNew);
+        rows = isNew ? 0 : (long)Tcl_GetHashValue(entry);
+        Tcl_SetHashValue(entry, (ClientData)(rows + 1));
+    } else if (mask == SQLITE_TRACE_PROFILE) {
+        Tcl_WideInt elapsed = *(sqlite3_int64*)x;
+        const char* sql = sqlite3_sql(stmt);
+        stmt_stats* stats;
+        long rows = 0;
+        entry = Tcl_FindHashEntry(&stats_running, (char*)stmt);
+        if (entry != NULL) {
+            rows = (long)Tcl_GetHashValue(entry);
+            Tcl_DeleteHashEntry(entry);
+        }
+        entry = Tcl_CreateHashEntry(&stats_by_sql, sql ? sql : "", &isNew);
+        if (isNew) {
+            stats = (stmt_stats*)ckalloc(sizeof(stmt_stats));
+            memset(stats, 0, sizeof(stmt_stats));
+            Tcl_SetHashValue(entry, stats);
+        } else {
+            stats = (stmt_stats*)Tcl_GetHashValue(entry);
+        }
+        stats->calls++;
+        stats->rows += rows;
+        stats->time += elapsed;
+        if (elapsed > stats->max) {
+            stats->max = elapsed;
+        }
+    }
+    Tcl_MutexUnlock(&stats_mutex);
+    return 0;
+}
+
+/**
+ * Installs the trace hook on `db` if instrumentation is enabled, and removes it
+ * otherwise. The caller must hold `db`.
+ */
+void stats_attach(sqlite3* db) {
+    int enabled;
+    Tcl_MutexLock(&stats_mutex);
+    enabled = stats_enabled;
+    Tcl_MutexUnlock(&stats_mutex);
+    if (enabled) {
+        sqlite3_trace_v2(db, SQLITE_TRACE_ROW | SQLITE_TRACE_PROFILE,
+                stats_trace, NULL);
+    } else {
+        sqlite3_trace_v2(db, 0, NULL, NULL);
+    }
+}
+
+static void append_pair(Tcl_Interp* interp, Tcl_Obj* list, const char* key,
+        Tcl_Obj* value) {
+    Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(key, -1));
+    Tcl_ListObjAppendElement(interp, list, value);
+}
+
+/*
+ * Appends the totals of every statement seen so far as a dict keyed by SQL, and
+ * then drops them if `reset` is set. Times are in microseconds.
+ */
+static void stats_statements(Tcl_Interp* interp, Tcl_Obj* result, int reset) {
+    Tcl_Obj* statements = Tcl_NewListObj(0, NULL);
+    Tcl_HashSearch search;
+    Tcl_HashEntry* entry;
+    Tcl_MutexLock(&stats_mutex);
+    if (stats_initialized) {
+        for (entry = Tcl_FirstHashEntry(&stats_by_sql, &search);
+                entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+            stmt_stats* stats = (stmt_stats*)Tcl_GetHashValue(entry);
+            Tcl_Obj* item = Tcl_NewListObj(0, NULL);
+            append_pair(interp, item, "calls", Tcl_NewLongObj(stats->calls));
+            append_pair(interp, item, "rows", Tcl_NewWideIntObj(stats->rows));
+            append_pair(interp, item, "time",
+                    Tcl_NewWideIntObj(stats->time / 1000));
+            append_pair(interp, item, "max",
+                    Tcl_NewWideIntObj(stats->max / 1000));
+            append_pair(interp, statements,
+                    Tcl_GetHashKey(&stats_by_sql, entry), item);
+        }
+        if (reset) {
+            stats_clear();
+        }
+    }
+    Tcl_MutexUnlock(&stats_mutex);
+    append_pair(interp, result, "statements", statements);
+}
+
+/*
+ * Appends the interp's statement cache and page cache counters. These are kept
+ * per connection whether or not instrumentation is enabled.
+ */
+static void stats_caches(Tcl_Interp* interp, Tcl_Obj* result, sqlite3* db,
+        int reset) {
+    static const struct {
+        const char* key;
+        int op;
+    } pager_ops[] = {
+        { "used", SQLITE_DBSTATUS_CACHE_USED },
+        { "hits", SQLITE_DBSTATUS_CACHE_HIT },
+        { "misses", SQLITE_DBSTATUS_CACHE_MISS },
+        { "writes", SQLITE_DBSTATUS_CACHE_WRITE },
+        { NULL, 0 }
+    };
+    Tcl_Obj* cache = Tcl_NewListObj(0, NULL);
+    Tcl_Obj* pager = Tcl_NewListObj(0, NULL);
+    unsigned long hits = 0, misses = 0;
+    int i;
+    reg_stmt_cache_stats(db, &hits, &misses, reset);
+    append_pair(interp, cache, "hits", Tcl_NewLongObj(hits));
+    append_pair(interp, cache, "misses", Tcl_NewLongObj(misses));
+    append_pair(interp, result, "cache", cache);
+    for (i=0; pager_ops[i].key != NULL; i++) {
+        int current = 0, highwater = 0;
+        sqlite3_db_status(db, pager_ops[i].op, &current, &highwater, reset);
+        append_pair(interp, pager, pager_ops[i].key, Tcl_NewIntObj(current));
+    }
+    append_pair(interp, result, "pager", pager);
+}
+
+/*
+ * registry::stats ?-enable bool? ?-reset?
+ *
+ * Returns a dict with `enabled`; `statements`, a dict from each statement's SQL
+ * to its `calls`, `rows` returned, total `time` and `max` time in
+ * microseconds; `cache`, the `hits` and `misses` of the interp's prepared
+ * statement cache; and `pager`, the bytes `used` by its page cache and that
+ * cache's `hits`, `misses` and `writes`; `changes`, the rows of `ports` and
+ * `files` the interp has changed and the number of `remote` changes it has
+ * noticed others make (see changes.c); `results`, the `hits` and `misses` of
+ * its search result cache and the searches it holds (see results.c); and
+ * `daemon`, whether the interp's queries are currently going to registryd.
+ * Statement totals are only gathered while enabled, and cover every connection
+ * in the process. `-enable` takes effect on the interp's connection at once and
+ * on others as they are leased. `-reset` zeroes the counters after reporting
+ * them.
+ */
+int stats_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    static const char* options[] = { "-enable", "-reset", NULL };
+    sqlite3* db;
+    Tcl_Obj* result;
+    int enable = -1;
+    int reset = 0;
+    int enabled;
+    int i;
+    for (i=1; i<objc; i++) {
+        int index;
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &index)
+                != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (index == 1) {
+            reset = 1;
+        } else if (i+1 == objc) {
+            Tcl_WrongNumArgs(interp, 1, objv, "?-enable bool? ?-reset?");
+            return TCL_ERROR;
+        } else if (Tcl_GetBooleanFromObj(interp, objv[++i], &enable)
+                != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+    db = registry_db(interp, 0);
+    if (db == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_MutexLock(&stats_mutex);
+    if (!stats_initialized) {
+        Tcl_InitHashTable(&stats_by_sql, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&stats_running, TCL_ONE_WORD_KEYS);
+        stats_initialized = 1;
+    }
+    if (enable == 1 && !stats_enabled) {
+        /* handles counted before the last disable may since have been reused */
+        stats_clear_running();
+    }
+    if (enable != -1) {
+        stats_enabled = enable;
+    }
+    enabled = stats_enabled;
+    Tcl_MutexUnlock(&stats_mutex);
+    if (enable != -1) {
+        stats_attach(db);
+    }
+    result = Tcl_NewListObj(0, NULL);
+    append_pair(interp, result, "enabled", Tcl_NewBooleanObj(enabled));
+    stats_statements(interp, result, reset);
+    stats_caches(interp, result, db, reset);
+    append_pair(interp, result, "changes", changes_counts(interp, reset));
+    append_pair(interp, result, "results", results_counts(interp, reset));
+    append_pair(interp, result, "daemon",
+            Tcl_NewBooleanObj(client_pending(interp) != NULL));
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+}
+
+/*
+ * Command latency.
+ *
+ * While enabled, each `registry::entry` subcommand and each per-entry command
+ * is timed from dispatch to return, so the figures include building the Tcl
+ * result, and the time is added to a histogram for that command. Histograms
+ * are kept per interp and need no locking. Buckets are logarithmic in the
+ * style of HdrHistogram: each power of two of microseconds is split into
+ * LATENCY_SUB linear sub-buckets, so a bucket's width is never more than a
+ * quarter of its lower bound, and the top bucket starts at about half an hour.
+ */
+
+#define LATENCY_SUB_BITS 2
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (LATENCY_SUB * (32 - LATENCY_SUB_BITS))
+
+typedef struct {
+    char* name;
+    unsigned long count;
+    Tcl_WideInt sum;
+    Tcl_WideInt min;
+    Tcl_WideInt max;
+    unsigned long buckets[LATENCY_BUCKETS];
+} latency_hist;
+
+typedef struct {
+    int enabled;
+    Tcl_HashTable hists; /* static subcommand name -> latency_hist* */
+} latency_state;
+
+static int latency_bucket(Tcl_WideInt us) {
+    int octave = 0;
+    int index;
+    if (us < LATENCY_SUB) {
+        return us < 0 ? 0 : (int)us;
+    }
+    while ((us >> octave) >= 2 * LATENCY_SUB) {
+        octave++;
+    }
+    index = LATENCY_SUB * (octave + 1)
+        + (int)((us >> octave) - LATENCY_SUB);
+    return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Returns the largest time, in microseconds, that falls into bucket `index`.
+ */
+static Tcl_WideInt latency_bucket_upper(int index) {
+    int octave;
+    if (index < LATENCY_SUB) {
+        return index;
+    }
+    octave = index / LATENCY_SUB - 1;
+    return ((Tcl_WideInt)(LATENCY_SUB + index % LATENCY_SUB + 1) << octave) - 1;
+}
+
+static void latency_clear(latency_state* state) {
+    Tcl_HashSearch search;
+    Tcl_HashEntry* entry;
+    for (entry = Tcl_FirstHashEntry(&state->hists, &search); entry != NULL;
+            entry = Tcl_NextHashEntry(&search)) {
+        latency_hist* hist = (latency_hist*)Tcl_GetHashValue(entry);
+        ckfree(hist->name);
+        ckfree((char*)hist);
+    }
+    Tcl_DeleteHashTable(&state->hists);
+    Tcl_InitHashTable(&state->hists, TCL_ONE_WORD_KEYS);
+}
+
+static void delete_latency(ClientData clientData, Tcl_Interp* interp UNUSED) {
+    latency_state* state = (latency_state*)clientData;
+    latency_clear(state);
+    Tcl_DeleteHashTable(&state->hists);
+    ckfree((char*)state);
+}
+
+/**
+ * Starts timing a command if latency tracking is enabled for `interp`. Returns
+ * false, and leaves `start` alone, if it isn't.
+ */
+int latency_start(Tcl_Interp* interp, Tcl_Time* start) {
+    latency_state* state = Tcl_GetAssocData(interp, "registry::latency", NULL);
+    if (state == NULL || !state->enabled) {
+        return 0;
+    }
+    Tcl_GetTime(start);
+    return 1;
+}
+
+/**
+ * Adds the time since `start` to the histogram for `name`, shown as `prefix`
+ * followed by `name`. `name` must have static storage, since its address
+ * identifies the histogram.
+ */
+void latency_record(Tcl_Interp* interp, const char* prefix, const char* name,
+        Tcl_Time* start) {
+    latency_state* state = Tcl_GetAssocData(interp, "registry::latency", NULL);
+    Tcl_HashEntry* entry;
+    latency_hist* hist;
+    Tcl_Time now;
+    Tcl_WideInt us;
+    int isNew;
+    if (state == NULL) {
+        return;
+    }
+    Tcl_GetTime(&now);
+    us = (Tcl_WideInt)(now.sec - start->sec) * 1000000
+        + (now.usec - start->usec);
+    entry = Tcl_CreateHashEntry(&state->hists, (char*)name, &isNew);
+    if (isNew) {
+        hist = (latency_hist*)ckalloc(sizeof(latency_hist));
+        memset(hist, 0, sizeof(latency_hist));
+        hist->name = ckalloc(strlen(prefix) + strlen(name) + 2);
+        sprintf(hist->name, "%s %s", prefix, name);
+        hist->min = us;
+        Tcl_SetHashValue(entry, hist);
+    } else {
+        hist = (latency_hist*)Tcl_GetHashValue(entry);
+    }
+    hist->count++;
+    hist->sum += us;
+    if (us < hist->min) {
+        hist->min = us;
+    }
+    if (us > hist->max) {
+        hist->max = us;
+    }
+    hist->buckets[latency_bucket(us)]++;
+}
+
+/*
+ * Returns the upper bound of the bucket holding the `quantile`th sample.
+ */
+static Tcl_WideInt latency_quantile(latency_hist* hist, double quantile) {
+    unsigned long rank = (unsigned long)(quantile * hist->count + 0.5);
+    unsigned long seen = 0;
+    int i;
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i=0; i<LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            Tcl_WideInt upper = latency_bucket_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static Tcl_Obj* latency_dict(Tcl_Interp* interp, latency_hist* hist) {
+    Tcl_Obj* item = Tcl_NewListObj(0, NULL);
+    Tcl_Obj* buckets = Tcl_NewListObj(0, NULL);
+    int i;
+    append_pair(interp, item, "count", Tcl_NewLongObj(hist->count));
+    append_pair(interp, item, "sum", Tcl_NewWideIntObj(hist->sum));
+    append_pair(interp, item, "min", Tcl_NewWideIntObj(hist->min));
+    append_pair(interp, item, "max", Tcl_NewWideIntObj(hist->max));
+    append_pair(interp, item, "p50",
+            Tcl_NewWideIntObj(latency_quantile(hist, 0.50)));
+    append_pair(interp, item, "p90",
+            Tcl_NewWideIntObj(latency_quantile(hist, 0.90)));
+    append_pair(interp, item, "p99",
+            Tcl_NewWideIntObj(latency_quantile(hist, 0.99)));
+    for (i=0; i<LATENCY_BUCKETS; i++) {
+        if (hist->buckets[i] != 0) {
+            Tcl_ListObjAppendElement(interp, buckets,
+                    Tcl_NewWideIntObj(latency_bucket_upper(i)));
+            Tcl_ListObjAppendElement(interp, buckets,
+                    Tcl_NewLongObj(hist->buckets[i]));
+        }
+    }
+    append_pair(interp, item, "buckets", buckets);
+    return item;
+}
+
+/*
+ * Writes every histogram to `path` in the Prometheus text exposition format,
+ * as cumulative buckets in seconds. The file is written beside `path` and
+ * renamed into place, so a collector never reads half of it.
+ */
+static int latency_export(Tcl_Interp* interp, latency_state* state,
+        Tcl_Obj* path) {
+    Tcl_Obj* temp = Tcl_DuplicateObj(path);
+    Tcl_Obj* text = Tcl_NewObj();
+    Tcl_Channel chan;
+    Tcl_HashSearch search;
+    Tcl_HashEntry* entry;
+    int ok;
+    Tcl_IncrRefCount(temp);
+    Tcl_IncrRefCount(text);
+    Tcl_AppendToObj(temp, ".tmp", -1);
+    Tcl_AppendToObj(text, "# HELP registry_command_seconds Latency of "
+            "registry commands.\n# TYPE registry_command_seconds histogram\n",
+            -1);
+    for (entry = Tcl_FirstHashEntry(&state->hists, &search); entry != NULL;
+            entry = Tcl_NextHashEntry(&search)) {
+        latency_hist* hist = (latency_hist*)Tcl_GetHashValue(entry);
+        unsigned long cumulative = 0;
+        char line[256];
+        int i;
+        for (i=0; i<LATENCY_BUCKETS; i++) {
+            if (hist->buckets[i] == 0) {
+                continue;
+            }
+            cumulative += hist->buckets[i];
+            sprintf(line, "registry_command_seconds_bucket{command=\"%s\","
+                    "le=\"%.6f\"} %lu\n", hist->name,
+                    latency_bucket_upper(i) / 1e6, cumulative);
+            Tcl_AppendToObj(text, line, -1);
+        }
+        sprintf(line, "registry_command_seconds_bucket{command=\"%s\","
+                "le=\"+Inf\"} %lu\n", hist->name, hist->count);
+        Tcl_AppendToObj(text, line, -1);
+        sprintf(line, "registry_command_seconds_sum{command=\"%s\"} %.6f\n",
+                hist->name, hist->sum / 1e6);
+        Tcl_AppendToObj(text, line, -1);
+        sprintf(line, "registry_command_seconds_count{command=\"%s\"} %lu\n",
+                hist->name, hist->count);
+        Tcl_AppendToObj(text, line, -1);
+    }
+    chan = Tcl_FSOpenFileChannel(interp, temp, "w", 0644);
+    ok = (chan != NULL);
+    if (ok) {
+        ok = (Tcl_WriteObj(chan, text) >= 0);
+        ok = (Tcl_Close(interp, chan) == TCL_OK) && ok;
+        if (ok) {
+            ok = (Tcl_FSRenameFile(temp, path) == 0);
+        }
+        if (!ok) {
+            Tcl_AppendResult(interp, "couldn't write ", Tcl_GetString(path),
+                    ": ", Tcl_PosixError(interp), NULL);
+            Tcl_FSDeleteFile(temp);
+        }
+    }
+    Tcl_DecrRefCount(text);
+    Tcl_DecrRefCount(temp);
+    return ok ? TCL_OK : TCL_ERROR;
+}
+
+/*
+ * registry::latency ?-enable bool? ?-reset? ?-export file?
+ *
+ * Returns a dict from each command timed so far (such as `entry search` or
+ * `entry files`) to its `count`, `sum`, `min`, `max`, `p50`, `p90` and `p99`
+ * in microseconds, and its non-empty `buckets` as a list of each bucket's
+ * upper bound and count. `-export` also writes the histograms to `file` for a
+ * metrics collector to scrape, and `-reset` drops them after reporting.
+ * Tracking is off until enabled, and applies to this interp only.
+ */
+int latency_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    static const char* options[] = { "-enable", "-reset", "-export", NULL };
+    latency_state* state = Tcl_GetAssocData(interp, "registry::latency", NULL);
+    Tcl_Obj* export = NULL;
+    Tcl_Obj* result;
+    Tcl_HashSearch search;
+    Tcl_HashEntry* entry;
+    int enable = -1;
+    int reset = 0;
+    int i;
+    for (i=1; i<objc; i++) {
+        int index;
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &index)
+                != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (index == 1) {
+            reset = 1;
+        } else if (i+1 == objc) {
+            Tcl_WrongNumArgs(interp, 1, objv,
+                    "?-enable bool? ?-reset? ?-export file?");
+            return TCL_ERROR;
+        } else if (index == 2) {
+            export = objv[++i];
+        } else if (Tcl_GetBooleanFromObj(interp, objv[++i], &enable)
+                != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+    if (state == NULL) {
+        state = (latency_state*)ckalloc(sizeof(latency_state));
+        state->enabled = 0;
+        Tcl_InitHashTable(&state->hists, TCL_ONE_WORD_KEYS);
+        Tcl_SetAssocData(interp, "registry::latency", delete_latency, state);
+    }
+    if (enable != -1) {
+        state->enabled = enable;
+    }
+    if (export != NULL && latency_export(interp, state, export) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    result = Tcl_NewListObj(0, NULL);
+    for (entry = Tcl_FirstHashEntry(&state->hists, &search); entry != NULL;
+            entry = Tcl_NextHashEntry(&search)) {
+        latency_hist* hist = (latency_hist*)Tcl_GetHashValue(entry);
+        append_pair(interp, result, hist->name, latency_dict(interp, hist));
+    }
+    if (reset) {
+        latency_clear(state);
+    }
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+}
@@ -0,0 +1,79 @@
+# Test file for asynchronous registry operations
+# Syntax:
+# tclsh async.tcl <Pextlib name>
+
+proc collect {token kind data} {
+    global results
+    lappend results($token) $kind $data
+    if {$kind ne "chunk"} {
+        set ::finished $token
+    }
+}
+
+proc wait_for {token} {
+    while {![info exists ::finished] || $::finished ne $token} {
+        vwait ::finished
+    }
+    return $::results($token)
+}
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+
+    registry::open test.db
+    set zlib [registry::entry create zlib 1.2.3 1 {} 0]
+    for {set i 0} {$i < 20} {incr i} {
+        registry::entry create pkg$i 1.0 0 {} 0
+    }
+
+    set files {}
+    for {set i 0} {$i < 1000} {incr i} {
+        lappend files /opt/local/share/zlib/$i
+    }
+    set token [$zlib map -async collect {*}$files]
+    set result [wait_for $token]
+    test_equal {[lrange $result end-1 end]} {done 1000}
+    test_equal {[llength [$zlib files]]} 1000
+
+    set token [$zlib files -async collect]
+    set listed {}
+    foreach {kind data} [wait_for $token] {
+        if {$kind eq "chunk"} {
+            lappend listed {*}$data
+        }
+    }
+    test_equal {[lsort $listed]} [lsort $files]
+
+    set token [registry::entry search -async collect name zlib]
+    set result [wait_for $token]
+    test_equal {[lindex $result 0]} chunk
+    test_equal {[[lindex $result 1 0] version]} 1.2.3
+    test_equal {[lrange $result end-1 end]} {done 1}
+
+    # a failed async map leaves nothing behind
+    set token [$zlib map -async collect /opt/local/lib/libz.dylib \
+        /opt/local/share/zlib/0]
+    test_equal {[lindex [wait_for $token] end-1]} error
+    test_equal {[llength [$zlib files]]} 1000
+
+    # cancelling rolls back, and the job then goes away
+    set files {}
+    for {set i 0} {$i < 100000} {incr i} {
+        lappend files /opt/local/share/big/$i
+    }
+    set big [registry::entry create big 1.0 0 {} 0]
+    set token [$big map -async collect {*}$files]
+    registry::cancel $token
+    test_equal {[lrange [wait_for $token] end-1 end]} {cancelled {}}
+    test_equal {[llength [$big files]]} 0
+    check_throws {registry::cancel $token}
+
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm
+}
+
+source tests/common.tcl
+main $argv
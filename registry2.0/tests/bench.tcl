@@ -0,0 +1,241 @@
+# Benchmarks for the registry on a synthetic database
+# Syntax:
+# tclsh bench.tcl <Pextlib name> ?option value ...?
+#
+# Options:
+#   -ports n        ports to create (default 1000)
+#   -files n        files mapped to each version of a port (default 50)
+#   -depth n        directories between the prefix and each file (default 3)
+#   -versions dist  versions per port: single, uniform or zipf (default zipf)
+#   -maxversions n  most versions a port can have (default 4)
+#   -samples n      lookups timed per read benchmark (default 1000)
+#   -seed n         seed for the generator (default 1)
+#   -db file        registry to build, deleted afterwards (default bench.db)
+#   -output file    where to write the JSON results (default stdout)
+#
+# The same options always generate the same registry. Each benchmark times
+# single commands, and the results report, per benchmark, how many were timed
+# and their total, mean, minimum, maximum and 50th, 90th and 99th percentile
+# times in microseconds.
+
+array set params {
+    -ports 1000
+    -files 50
+    -depth 3
+    -versions zipf
+    -maxversions 4
+    -samples 1000
+    -seed 1
+    -db bench.db
+    -output {}
+}
+
+# Returns a random integer in [0, n).
+proc random {n} {
+    return [expr {int(rand() * $n)}]
+}
+
+# Returns how many versions the next port gets.
+proc version_count {} {
+    global params
+    set max $params(-maxversions)
+    switch -- $params(-versions) {
+        single {
+            return 1
+        }
+        uniform {
+            return [expr {1 + [random $max]}]
+        }
+        zipf {
+            # P(k) is proportional to 1/k
+            set total 0.0
+            for {set k 1} {$k <= $max} {incr k} {
+                set total [expr {$total + 1.0 / $k}]
+            }
+            set r [expr {rand() * $total}]
+            for {set k 1} {$k < $max} {incr k} {
+                set r [expr {$r - 1.0 / $k}]
+                if {$r < 0} {
+                    break
+                }
+            }
+            return $k
+        }
+        default {
+            error "unknown version distribution \"$params(-versions)\":\
+                must be single, uniform or zipf"
+        }
+    }
+}
+
+# Returns the files for one version of a port. Directory names are drawn from a
+# small set, so ports share directories the way real ones do.
+proc port_files {name version} {
+    global params
+    set dirs {bin lib share include etc libexec man doc}
+    set files {}
+    for {set i 0} {$i < $params(-files)} {incr i} {
+        set path /opt/local
+        for {set d 0} {$d < $params(-depth)} {incr d} {
+            append path / [lindex $dirs [random [llength $dirs]]]
+        }
+        lappend files $path/$name/$version/file$i
+    }
+    return $files
+}
+
+# Times `script` in the caller's scope and adds the time to `bench`.
+proc timed {bench script} {
+    global samples
+    set start [clock microseconds]
+    set result [uplevel 1 $script]
+    lappend samples($bench) [expr {[clock microseconds] - $start}]
+    return $result
+}
+
+proc percentile {sorted p} {
+    set n [llength $sorted]
+    set rank [expr {int(ceil($p * $n)) - 1}]
+    if {$rank < 0} {
+        set rank 0
+    }
+    return [lindex $sorted $rank]
+}
+
+proc json_string {s} {
+    return "\"[string map {\\ \\\\ \" \\\" \n \\n} $s]\""
+}
+
+proc summary {times} {
+    set sorted [lsort -integer $times]
+    set total 0
+    foreach t $sorted {
+        incr total $t
+    }
+    set n [llength $sorted]
+    set fields [list \
+        "\"count\": $n" \
+        "\"total_us\": $total" \
+        "\"mean_us\": [format %.2f [expr {double($total) / $n}]]" \
+        "\"min_us\": [lindex $sorted 0]" \
+        "\"p50_us\": [percentile $sorted 0.50]" \
+        "\"p90_us\": [percentile $sorted 0.90]" \
+        "\"p99_us\": [percentile $sorted 0.99]" \
+        "\"max_us\": [lindex $sorted end]"]
+    return "{[join $fields {, }]}"
+}
+
+proc report {order} {
+    global params samples
+    set ps {}
+    foreach key [lsort [array names params]] {
+        if {$key in {-db -output}} {
+            continue
+        }
+        set value $params($key)
+        if {![string is integer -strict $value]} {
+            set value [json_string $value]
+        }
+        lappend ps "[json_string [string range $key 1 end]]: $value"
+    }
+    set rs {}
+    foreach bench $order {
+        if {[info exists samples($bench)]} {
+            lappend rs "    [json_string $bench]: [summary $samples($bench)]"
+        }
+    }
+    return "{\n  \"parameters\": {[join $ps {, }]},\n  \"results\": {\n[join $rs ",\n"]\n  }\n}"
+}
+
+proc main {pextlibname args} {
+    global params
+    if {[llength $args] % 2 != 0} {
+        error "usage: bench.tcl pextlib ?option value ...?"
+    }
+    foreach {key value} $args {
+        if {![info exists params($key)]} {
+            error "unknown option \"$key\""
+        }
+        set params($key) $value
+    }
+    load $pextlibname
+    expr {srand($params(-seed))}
+
+    set db $params(-db)
+    file delete -force $db $db-wal $db-shm
+
+    # generate the ports up front, so generation isn't timed
+    set ports {}
+    for {set p 0} {$p < $params(-ports)} {incr p} {
+        set name [format port%05d $p]
+        set n [version_count]
+        for {set v 0} {$v < $n} {incr v} {
+            set version [expr {1 + $v}].[random 10]
+            lappend ports [list $name $version [port_files $name $version]]
+        }
+    }
+
+    timed open {registry::open $db}
+    registry::entry limit 100
+
+    set refs {}
+    foreach port $ports {
+        lassign $port name version files
+        set entry [timed create {registry::entry create $name $version 0 {} 0}]
+        registry::entry close $entry
+        lappend refs [registry::entry search -refs name $name version $version]
+    }
+    foreach ref $refs port $ports {
+        timed map {registry::entry map $ref {*}[lindex $port 2]}
+    }
+
+    for {set i 0} {$i < $params(-samples)} {incr i} {
+        set name [format port%05d [random $params(-ports)]]
+        timed search_exact {registry::entry search -refs name $name}
+        set prefix [string range $name 0 end-1]
+        timed search_glob {registry::entry search -refs -glob name $prefix*}
+        timed search_regexp {
+            registry::entry search -refs -regexp name ^$prefix\[0-4\]$
+        }
+        set k [random [llength $ports]]
+        set files [lindex $ports $k 2]
+        timed owner {registry::entry owner -refs [lindex $files [random \
+            [llength $files]]]}
+        timed files {registry::entry files [lindex $refs $k]}
+    }
+
+    # unmap half of each port's files
+    foreach ref $refs port $ports {
+        set files [lindex $port 2]
+        timed unmap {registry::entry unmap $ref {*}[lrange $files 0 \
+            [expr {[llength $files] / 2 - 1}]]}
+    }
+
+    timed close {registry::close}
+    for {set i 0} {$i < 100} {incr i} {
+        timed open {registry::open $db}
+        timed close {registry::close}
+    }
+
+    registry::open $db
+    foreach ref $refs {
+        timed delete {registry::entry delete $ref}
+    }
+    registry::close
+    file delete -force $db $db-wal $db-shm
+
+    set json [report {create map unmap search_exact search_glob
+        search_regexp owner files delete open close}]
+    if {$params(-output) eq ""} {
+        puts $json
+    } else {
+        set chan [open $params(-output) w]
+        puts $chan $json
+        close $chan
+    }
+}
+
+# startup.tcl sources this file for its helpers
+if {[info script] eq $argv0} {
+    main {*}$argv
+}
@@ -0,0 +1,913 @@
+/*
+ * tests/centry_test.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests and microbenchmarks for the C registry API.
+ *
+ * This program links only libregistry and sqlite, so it exercises the
+ * reg_* functions without a Tcl interp in the way. Run with no arguments it
+ * checks every function and exits non-zero on failure. Run with `-bench` it
+ * builds a synthetic registry and times the same operations as
+ * tests/bench.tcl, with the same options and the same JSON output, so
+ * comparing the two runs separates the cost of the C layer from that of the
+ * Tcl bindings.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#include "../cregistry.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/*
+ * Opens `file` as the registry, exiting if that fails.
+ */
+static sqlite3* open_registry(const char* file) {
+    reg_error error;
+    sqlite3* db = reg_open(file, 0, &error);
+    if (db == NULL) {
+        fprintf(stderr, "%s\n", error.description);
+        reg_error_destruct(&error);
+        exit(2);
+    }
+    return db;
+}
+
+static void remove_registry(const char* file) {
+    char* journal = sqlite3_mprintf("%s-wal", file);
+    remove(file);
+    remove(journal);
+    sqlite3_free(journal);
+    journal = sqlite3_mprintf("%s-shm", file);
+    remove(journal);
+    sqlite3_free(journal);
+}
+
+/*
+ * Correctness tests.
+ */
+
+static int count_visit(void* userdata, sqlite_int64 rowid UNUSED,
+        reg_error* errPtr UNUSED) {
+    (*(int*)userdata)++;
+    return 1;
+}
+
+static int stop_visit(void* userdata UNUSED, sqlite_int64 rowid UNUSED,
+        reg_error* errPtr) {
+    errPtr->code = "test::stop";
+    errPtr->description = "stopped";
+    errPtr->free = NULL;
+    return 0;
+}
+
+static int file_visit(void* userdata, int row UNUSED, const char* value,
+        int len, reg_error* errPtr UNUSED) {
+    *(int*)userdata += len == (int)strlen(value);
+    return 1;
+}
+
+static void test_arena(void) {
+    reg_arena arena;
+    char* s;
+    void* big;
+    int i;
+    reg_arena_init(&arena, 64);
+    CHECK(arena.blocks == NULL);
+    for (i=0; i<100; i++) {
+        void* p = reg_arena_alloc(&arena, 3);
+        CHECK(p != NULL && ((size_t)p % sizeof(double)) == 0);
+    }
+    s = reg_arena_strdup(&arena, "hello world", 5);
+    CHECK(strcmp(s, "hello") == 0);
+    s = reg_arena_strdup(&arena, "hello world", -1);
+    CHECK(strcmp(s, "hello world") == 0);
+    big = reg_arena_alloc(&arena, 100000);
+    CHECK(big != NULL);
+    memset(big, 0, 100000);
+    CHECK(arena.block_count > 1);
+    reg_arena_free(&arena);
+    CHECK(arena.blocks == NULL && arena.block_count == 0);
+    CHECK(reg_arena_alloc(&arena, 8) != NULL);
+    reg_arena_free(&arena);
+}
+
+static void test_stmt_cache(sqlite3* db) {
+    sqlite3_stmt* a;
+    sqlite3_stmt* b;
+    unsigned long hits, misses;
+    static const char* query = "SELECT 1";
+    CHECK(reg_stmt_cache_stats(db, &hits, &misses, 1));
+    CHECK(reg_prepare(db, query, &a) == SQLITE_OK);
+    CHECK(reg_stmt_cached(a));
+    /* the cached statement is busy, so this one is freshly prepared */
+    CHECK(reg_prepare(db, query, &b) == SQLITE_OK);
+    CHECK(a != b);
+    reg_finalize(b);
+    reg_finalize(a);
+    CHECK(reg_prepare(db, query, &b) == SQLITE_OK);
+    CHECK(a == b || reg_stmt_cached(b));
+    reg_finalize(b);
+    reg_finalize(NULL);
+    CHECK(reg_stmt_cache_stats(db, &hits, &misses, 1));
+    CHECK(hits == 1 && misses == 2);
+    CHECK(reg_stmt_cache_stats(db, &hits, &misses, 0));
+    CHECK(hits == 0 && misses == 0);
+}
+
+static void test_entries(sqlite3* db) {
+    reg_error error;
+    reg_entry* vim;
+    reg_entry* zlib;
+    reg_entry* owner;
+    reg_entry** entries;
+    reg_arena arena;
+    char* keys[] = { "name" };
+    char* vals[1];
+    char* value;
+    char** files;
+    char* paths[] = { "/opt/local/bin/vim", "/opt/local/share/vim/vimrc" };
+    char* clash[] = { "/opt/local/lib/libz.dylib", "/opt/local/bin/vim" };
+    char* stranger[] = { "/opt/local/lib/libz.dylib", "/nowhere" };
+    int count;
+
+    vim = reg_entry_create(db, "vim", "7.1.002", "0", "", "0", &error);
+    zlib = reg_entry_create(db, "zlib", "1.2.3", "1", "", "0", &error);
+    CHECK(vim != NULL && zlib != NULL && vim->rowid != zlib->rowid);
+    CHECK(reg_entry_create(db, "vim", "7.1.002", "0", "", "0", &error)
+            == NULL);
+    CHECK(strcmp(error.code, "registry::sqlite-error") == 0);
+    CHECK(strstr(error.description, "INSERT INTO registry.ports") != NULL);
+    reg_error_destruct(&error);
+
+    CHECK(reg_entry_propset(db, vim, "state", "active", &error));
+    CHECK(reg_entry_propset(db, zlib, "state", "installed", &error));
+    CHECK(reg_entry_propget(db, zlib, "version", &value, &error));
+    CHECK(strcmp(value, "1.2.3") == 0);
+    free(value);
+
+    reg_arena_init(&arena, 256);
+    vals[0] = "vim";
+    CHECK(reg_entry_search(db, keys, vals, 1, 0, &entries, &arena, &error)
+            == 1);
+    CHECK(entries[0]->rowid == vim->rowid);
+    vals[0] = "*i*";
+    CHECK(reg_entry_search(db, keys, vals, 1, 1, &entries, &arena, &error)
+            == 2);
+    vals[0] = "^z";
+    CHECK(reg_entry_search(db, keys, vals, 1, 2, &entries, &arena, &error)
+            == 1);
+    CHECK(entries[0]->rowid == zlib->rowid);
+    CHECK(reg_entry_search(db, keys, vals, 1, 7, &entries, &arena, &error)
+            == -1);
+    CHECK(strcmp(error.code, "registry::invalid-strategy") == 0);
+    reg_error_destruct(&error);
+    vals[0] = "(";
+    CHECK(reg_entry_search(db, keys, vals, 1, 2, &entries, &arena, &error)
+            == -1);
+    reg_error_destruct(&error);
+    CHECK(reg_entry_search(db, NULL, NULL, 0, 0, &entries, &arena, &error)
+            == 2);
+    CHECK(reg_entry_installed(db, NULL, NULL, &entries, &arena, &error)
+            == 1);
+    CHECK(reg_entry_active(db, "vim", NULL, &entries, &arena, &error) == 1);
+    CHECK(reg_entry_active(db, "vim", "7.1.000", &entries, &arena, &error)
+            == 0);
+    reg_arena_free(&arena);
+
+    count = 0;
+    CHECK(reg_entry_search_visit(db, NULL, NULL, 0, 0, count_visit, &count,
+                &error) == 2);
+    CHECK(count == 2);
+    CHECK(reg_entry_search_visit(db, NULL, NULL, 0, 0, stop_visit, NULL,
+                &error) == -1);
+    CHECK(strcmp(error.code, "test::stop") == 0);
+
+    CHECK(reg_entry_map(db, vim, paths, 2, &error) == 2);
+    CHECK(reg_entry_file_count(db, vim, &error) == 2);
+    /* a clash maps nothing */
+    CHECK(reg_entry_map(db, zlib, clash, 2, &error) == 0);
+    reg_error_destruct(&error);
+    CHECK(reg_entry_file_count(db, zlib, &error) == 0);
+    CHECK(reg_entry_map(db, zlib, clash, 1, &error) == 1);
+
+    reg_arena_init(&arena, 256);
+    CHECK(reg_entry_files(db, vim, &files, &arena, &error) == 2);
+    CHECK(strcmp(files[0], paths[0]) == 0 || strcmp(files[1], paths[0]) == 0);
+    reg_arena_free(&arena);
+    count = 0;
+    CHECK(reg_entry_files_visit(db, vim, file_visit, &count, &error) == 2);
+    CHECK(count == 2);
+
+    CHECK(reg_entry_owner(db, "/opt/local/bin/vim", &owner, &error));
+    CHECK(owner != NULL && owner->rowid == vim->rowid);
+    reg_entry_free(db, &owner, 1);
+    CHECK(reg_entry_owner(db, "/nowhere", &owner, &error));
+    CHECK(owner == NULL);
+
+    /* unmapping a file the entry doesn't own unmaps nothing */
+    CHECK(reg_entry_unmap(db, zlib, stranger, 2, &error) == 0);
+    CHECK(strcmp(error.code, "registry::not-owned") == 0);
+    CHECK(reg_entry_file_count(db, zlib, &error) == 1);
+    CHECK(reg_entry_unmap(db, vim, paths, 2, &error) == 2);
+    CHECK(reg_entry_file_count(db, vim, &error) == 0);
+
+    CHECK(reg_entry_delete(db, &vim, 1, &error) == 1);
+    CHECK(reg_entry_delete(db, &vim, 1, &error) == 0);
+    CHECK(strcmp(error.code, "registry::invalid-entry") == 0);
+    CHECK(reg_entry_propget(db, vim, "name", &value, &error) == 0);
+    reg_entry_free(db, &vim, 1);
+    reg_entry_free(db, &zlib, 1);
+}
+
+static int user_version(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    int version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA registry.user_version", -1, &stmt,
+                NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+static int stop_progress(void* userdata, int version UNUSED, int step UNUSED,
+        sqlite_int64 done UNUSED, sqlite_int64 total UNUSED) {
+    return --*(int*)userdata > 0;
+}
+
+static int count_progress(void* userdata, int version UNUSED, int step UNUSED,
+        sqlite_int64 done UNUSED, sqlite_int64 total UNUSED) {
+    ++*(int*)userdata;
+    return 1;
+}
+
+static void test_migrate(void) {
+    static const reg_migration_step steps[] = {
+        { "ALTER TABLE registry.files ADD COLUMN dir", NULL },
+        { "UPDATE registry.files SET dir = rtrim(path, replace(path, '/', '')) "
+            "WHERE rowid > ?1 AND rowid <= ?2", "files" },
+        { NULL, NULL }
+    };
+    static const reg_migration migrations[] = {
+        { 2, "record each file's directory", steps },
+        { 0, NULL, NULL }
+    };
+    const char* file = "centry_migrate.db";
+    char* paths[25];
+    char buf[25][32];
+    sqlite3* db;
+    sqlite3_stmt* stmt;
+    reg_entry* entry;
+    reg_error error;
+    int calls, i;
+    remove_registry(file);
+    db = open_registry(file);
+    entry = reg_entry_create(db, "vim", "7.1.002", "0", "", "0", &error);
+    CHECK(entry != NULL);
+    for (i=0; i<25; i++) {
+        sprintf(buf[i], "/opt/local/d%d/file%d", i, i);
+        paths[i] = buf[i];
+    }
+    CHECK(reg_entry_map(db, entry, paths, 25, &error) == 25);
+    reg_entry_free(db, &entry, 1);
+    /* stop after the ALTER and two chunks of ten rows */
+    calls = 3;
+    CHECK(reg_migrate(db, migrations, 10, stop_progress, &calls, &error)
+            == -1);
+    CHECK(strcmp(error.code, "registry::interrupted") == 0);
+    CHECK(reg_schema_version(db, &error) == 1);
+    CHECK(sqlite3_prepare_v2(db, "SELECT COUNT(dir) FROM registry.files", -1,
+                &stmt, NULL) == SQLITE_OK);
+    CHECK(sqlite3_step(stmt) == SQLITE_ROW);
+    CHECK(sqlite3_column_int(stmt, 0) == 20);
+    sqlite3_finalize(stmt);
+    /* a new connection carries on: the last chunk, the end of the step, and
+     * recording the version */
+    reg_close(db);
+    db = open_registry(file);
+    calls = 0;
+    CHECK(reg_migrate(db, migrations, 10, count_progress, &calls, &error)
+            == 2);
+    CHECK(calls == 3);
+    CHECK(reg_schema_version(db, &error) == 2);
+    CHECK(user_version(db) == 2);
+    CHECK(sqlite3_prepare_v2(db, "SELECT COUNT(dir), MAX(dir), "
+                "(SELECT COUNT(*) FROM registry.metadata "
+                "WHERE key='migration') FROM registry.files", -1, &stmt, NULL)
+            == SQLITE_OK);
+    CHECK(sqlite3_step(stmt) == SQLITE_ROW);
+    CHECK(sqlite3_column_int(stmt, 0) == 25);
+    CHECK(strcmp((const char*)sqlite3_column_text(stmt, 1), "/opt/local/d9/")
+            == 0);
+    CHECK(sqlite3_column_int(stmt, 2) == 0);
+    sqlite3_finalize(stmt);
+    /* and there's nothing left to do */
+    calls = 0;
+    CHECK(reg_migrate(db, migrations, 10, count_progress, &calls, &error)
+            == 2);
+    CHECK(calls == 0);
+    CHECK(reg_migrate(db, reg_migrations, 0, NULL, NULL, &error) == 2);
+    reg_close(db);
+    remove_registry(file);
+}
+
+/*
+ * Query plans.
+ *
+ * Each hot operation is run with its statements traced, and the plan sqlite
+ * picks for each is compared with the one pinned here, on a registry that has
+ * been analyzed. A change to a query, an index or the statistics that makes
+ * sqlite plan one differently then fails, so that the new plan gets looked at
+ * before it ships. A plan is EXPLAIN QUERY PLAN's details joined with "; ",
+ * and the plans of an operation's statements are joined with " | ", leaving
+ * out statements without one, such as SAVEPOINT.
+ */
+
+#define PLAN_MAX_STMTS 16
+
+typedef struct {
+    char* sql[PLAN_MAX_STMTS];
+    int count;
+} plan_trace;
+
+static int plan_traced(unsigned type UNUSED, void* userdata, void* p UNUSED,
+        void* x) {
+    plan_trace* trace = (plan_trace*)userdata;
+    const char* sql = (const char*)x;
+    int i;
+    for (i=0; i<trace->count; i++) {
+        if (strcmp(trace->sql[i], sql) == 0) {
+            return 0;
+        }
+    }
+    if (trace->count < PLAN_MAX_STMTS) {
+        trace->sql[trace->count++] = strdup(sql);
+    }
+    return 0;
+}
+
+/* Returns the plans of the traced statements, and forgets them. */
+static char* plan_take(sqlite3* db, plan_trace* trace) {
+    char* plans = sqlite3_mprintf("");
+    int i;
+    for (i=0; i<trace->count; i++) {
+        char* query = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", trace->sql[i]);
+        char* plan = NULL;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                const char* detail = (const char*)sqlite3_column_text(stmt, 3);
+                char* joined = plan == NULL ? sqlite3_mprintf("%s", detail)
+                    : sqlite3_mprintf("%s; %s", plan, detail);
+                sqlite3_free(plan);
+                plan = joined;
+            }
+        }
+        sqlite3_finalize(stmt);
+        sqlite3_free(query);
+        if (plan != NULL) {
+            char* joined = *plans == '\0' ? sqlite3_mprintf("%s", plan)
+                : sqlite3_mprintf("%s | %s", plans, plan);
+            sqlite3_free(plans);
+            plans = joined;
+        }
+        sqlite3_free(plan);
+        free(trace->sql[i]);
+    }
+    trace->count = 0;
+    return plans;
+}
+
+static void test_plans(void) {
+    /*
+     * The index each hot query must use, and one it must not, as names only:
+     * the rest of EXPLAIN QUERY PLAN's wording changes between sqlite releases
+     * even when the plan doesn't. The search for installed ports of a name
+     * must not use port_state.
+     */
+    static const char* pins[] = {
+        "search name", "port_name", "port_state",
+        "search name version", "port_name", "port_state",
+        "search glob", "port_name", "port_state",
+        "installed name", "port_name", "port_state",
+        "active", "port_state", "SCAN",
+        "owner", "sqlite_autoindex_files_1", "SCAN",
+        "files", "file_port", "SCAN",
+        "file count", "file_port", "SCAN",
+        "propget", "PRIMARY KEY", "SCAN",
+        "propset", "PRIMARY KEY", "SCAN",
+        "unmap", "sqlite_autoindex_files_1", "SCAN",
+        "delete", "PRIMARY KEY", "SCAN",
+        NULL
+    };
+    const char* file = "centry_plans.db";
+    sqlite3* db;
+    reg_error error;
+    reg_arena arena;
+    reg_entry** entries;
+    reg_entry* entry;
+    plan_trace trace;
+    char name[16], path[64];
+    char* paths[1];
+    char** files;
+    char* value;
+    int i, j;
+    remove_registry(file);
+    db = open_registry(file);
+    /* most ports active, as in real registries, with a few files each */
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (i=0; i<500; i++) {
+        sprintf(name, "port%03d", i);
+        entry = reg_entry_create(db, name, "1.0", "0", "", "0", &error);
+        CHECK(entry != NULL);
+        if (entry == NULL) {
+            reg_error_destruct(&error);
+            continue;
+        }
+        CHECK(reg_entry_propset(db, entry, "state",
+                    i % 10 == 0 ? "installed" : "active", &error));
+        for (j=0; j<4; j++) {
+            sprintf(path, "/opt/local/share/%s/file%d", name, j);
+            paths[0] = path;
+            CHECK(reg_entry_map(db, entry, paths, 1, &error) == 1);
+        }
+        reg_entry_free(db, &entry, 1);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    CHECK(sqlite3_exec(db, "ANALYZE registry", NULL, NULL, NULL) == SQLITE_OK);
+    trace.count = 0;
+    sqlite3_trace_v2(db, SQLITE_TRACE_STMT, plan_traced, &trace);
+    reg_arena_init(&arena, 4096);
+    for (i=0; pins[i] != NULL; i+=3) {
+        char* keys[] = { "name", "version" };
+        char* vals[] = { "port042", "1.0" };
+        char* plans;
+        reg_entry_search(db, keys, vals, 1, 0, &entries, &arena, &error);
+        entry = entries[0];
+        trace.count = 0;
+        switch (i / 3) {
+            case 0:
+                reg_entry_search(db, keys, vals, 1, 0, &entries, &arena,
+                        &error);
+                break;
+            case 1:
+                reg_entry_search(db, keys, vals, 2, 0, &entries, &arena,
+                        &error);
+                break;
+            case 2:
+                vals[0] = "port04*";
+                reg_entry_search(db, keys, vals, 1, 1, &entries, &arena,
+                        &error);
+                break;
+            case 3:
+                reg_entry_installed(db, "port042", NULL, &entries, &arena,
+                        &error);
+                break;
+            case 4:
+                reg_entry_active(db, NULL, NULL, &entries, &arena, &error);
+                break;
+            case 5:
+                CHECK(reg_entry_owner(db, "/opt/local/share/port042/file1",
+                            &entries[0], &error) == 1);
+                break;
+            case 6:
+                CHECK(reg_entry_files(db, entry, &files, &arena, &error)
+                        == 4);
+                break;
+            case 7:
+                CHECK(reg_entry_file_count(db, entry, &error) == 4);
+                break;
+            case 8:
+                CHECK(reg_entry_propget(db, entry, "state", &value, &error));
+                free(value);
+                break;
+            case 9:
+                CHECK(reg_entry_propset(db, entry, "state", "installed",
+                            &error));
+                break;
+            case 10:
+                paths[0] = "/opt/local/share/port042/file3";
+                CHECK(reg_entry_unmap(db, entry, paths, 1, &error) == 1);
+                break;
+            case 11:
+                reg_entry_delete(db, &entry, 1, &error);
+                break;
+        }
+        plans = plan_take(db, &trace);
+        if (strstr(plans, pins[i+1]) == NULL
+                || strstr(plans, pins[i+2]) != NULL) {
+            fprintf(stderr, "plan for %s changed:\n  wanted: %s, not %s\n"
+                    "  now:    %s\n", pins[i], pins[i+1], pins[i+2], plans);
+            failures++;
+        }
+        sqlite3_free(plans);
+    }
+    sqlite3_trace_v2(db, 0, NULL, NULL);
+    reg_arena_free(&arena);
+    reg_close(db);
+    remove_registry(file);
+}
+
+static int run_tests(void) {
+    const char* file = "centry_test.db";
+    sqlite3* db;
+    reg_error error;
+    remove_registry(file);
+    test_arena();
+    db = open_registry(file);
+    test_stmt_cache(db);
+    test_entries(db);
+    reg_close(db);
+    test_migrate();
+    test_plans();
+    /* the registry survives being reopened */
+    db = open_registry(file);
+    {
+        reg_arena arena;
+        reg_entry** entries;
+        reg_arena_init(&arena, 256);
+        CHECK(reg_entry_search(db, NULL, NULL, 0, 0, &entries, &arena, &error)
+                == 1);
+        reg_arena_free(&arena);
+    }
+    /* registries from before user_version was kept get it on their next open */
+    CHECK(user_version(db) == REG_SCHEMA_VERSION);
+    CHECK(sqlite3_exec(db, "PRAGMA registry.user_version=0", NULL, NULL, NULL)
+            == SQLITE_OK);
+    reg_close(db);
+    db = open_registry(file);
+    CHECK(user_version(db) == REG_SCHEMA_VERSION);
+    reg_close(db);
+    /* read-only connections can search but not write */
+    {
+        reg_arena arena;
+        reg_entry** entries;
+        char* key = "name";
+        char* pattern = "^z";
+        db = reg_open(file, REG_OPEN_READONLY, &error);
+        CHECK(db != NULL);
+        reg_arena_init(&arena, 256);
+        CHECK(reg_entry_search(db, NULL, NULL, 0, 0, &entries, &arena, &error)
+                == 1);
+        CHECK(reg_entry_search(db, &key, &pattern, 1, 2,
+                    &entries, &arena, &error) == 1);
+        reg_arena_free(&arena);
+        CHECK(reg_entry_create(db, "pcre", "7.1", "1", "", "0", &error)
+                == NULL);
+        reg_error_destruct(&error);
+        reg_close(db);
+    }
+    CHECK(reg_open("centry_test_missing.db", REG_OPEN_READONLY, &error)
+            == NULL);
+    remove_registry(file);
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Benchmarks.
+ */
+
+typedef struct {
+    const char* name;
+    double* times; /* microseconds */
+    int count;
+    int space;
+} bench_samples;
+
+enum {
+    B_CREATE, B_MAP, B_UNMAP, B_SEARCH_EXACT, B_SEARCH_GLOB, B_SEARCH_REGEXP,
+    B_OWNER, B_FILES, B_DELETE, B_OPEN, B_CLOSE, B_COUNT
+};
+
+static bench_samples samples[B_COUNT] = {
+    { "create", NULL, 0, 0 }, { "map", NULL, 0, 0 }, { "unmap", NULL, 0, 0 },
+    { "search_exact", NULL, 0, 0 }, { "search_glob", NULL, 0, 0 },
+    { "search_regexp", NULL, 0, 0 }, { "owner", NULL, 0, 0 },
+    { "files", NULL, 0, 0 }, { "delete", NULL, 0, 0 }, { "open", NULL, 0, 0 },
+    { "close", NULL, 0, 0 }
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void record(int bench, double start) {
+    bench_samples* s = &samples[bench];
+    if (s->count == s->space) {
+        s->space = s->space ? 2 * s->space : 256;
+        s->times = realloc(s->times, s->space * sizeof(double));
+    }
+    s->times[s->count++] = now_us() - start;
+}
+
+static unsigned long long rng_state;
+
+/* xorshift64*; deterministic for a given seed */
+static unsigned long random_below(unsigned long n) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 2685821657736338717ULL) >> 33) % n;
+}
+
+typedef struct {
+    int ports;
+    int files;
+    int depth;
+    const char* versions;
+    int maxversions;
+    int samples;
+    unsigned long seed;
+    const char* db;
+    const char* output;
+} bench_params;
+
+static int version_count(bench_params* p) {
+    if (strcmp(p->versions, "single") == 0) {
+        return 1;
+    } else if (strcmp(p->versions, "uniform") == 0) {
+        return 1 + random_below(p->maxversions);
+    } else {
+        /* zipf: P(k) is proportional to 1/k */
+        double total = 0, r;
+        int k;
+        for (k=1; k<=p->maxversions; k++) {
+            total += 1.0 / k;
+        }
+        r = total * random_below(1000000) / 1000000.0;
+        for (k=1; k<p->maxversions; k++) {
+            r -= 1.0 / k;
+            if (r < 0) {
+                break;
+            }
+        }
+        return k;
+    }
+}
+
+typedef struct {
+    char name[16];
+    char version[16];
+    char** files;
+    reg_entry* entry;
+} bench_port;
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(bench_samples* s, double p) {
+    int rank = (int)(p * s->count + 0.999999) - 1;
+    return s->times[rank < 0 ? 0 : rank];
+}
+
+static void report(FILE* out, bench_params* p) {
+    int i, first = 1;
+    fprintf(out, "{\n  \"parameters\": {\"ports\": %d, \"files\": %d, "
+            "\"depth\": %d, \"versions\": \"%s\", \"maxversions\": %d, "
+            "\"samples\": %d, \"seed\": %lu},\n  \"results\": {\n", p->ports,
+            p->files, p->depth, p->versions, p->maxversions, p->samples,
+            p->seed);
+    for (i=0; i<B_COUNT; i++) {
+        bench_samples* s = &samples[i];
+        double total = 0;
+        int j;
+        if (s->count == 0) {
+            continue;
+        }
+        qsort(s->times, s->count, sizeof(double), compare_doubles);
+        for (j=0; j<s->count; j++) {
+            total += s->times[j];
+        }
+        fprintf(out, "%s    \"%s\": {\"count\": %d, \"total_us\": %.3f, "
+                "\"mean_us\": %.3f, \"min_us\": %.3f, \"p50_us\": %.3f, "
+                "\"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+                first ? "" : ",\n", s->name, s->count, total,
+                total / s->count, s->times[0], percentile(s, 0.50),
+                percentile(s, 0.90), percentile(s, 0.99),
+                s->times[s->count - 1]);
+        first = 0;
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+static int run_bench(int argc, char** argv) {
+    static const char* dirs[] = { "bin", "lib", "share", "include", "etc",
+        "libexec", "man", "doc" };
+    bench_params p = { 1000, 50, 3, "zipf", 4, 1000, 1, "bench.db", NULL };
+    bench_port* ports = NULL;
+    int port_count = 0;
+    sqlite3* db;
+    reg_error error;
+    reg_arena arena;
+    double start;
+    char path[1024];
+    int i, j, k;
+    for (i=0; i+1<argc; i+=2) {
+        if (strcmp(argv[i], "-ports") == 0) {
+            p.ports = atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-files") == 0) {
+            p.files = atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-depth") == 0) {
+            p.depth = atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-versions") == 0) {
+            p.versions = argv[i+1];
+        } else if (strcmp(argv[i], "-maxversions") == 0) {
+            p.maxversions = atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-samples") == 0) {
+            p.samples = atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            p.seed = strtoul(argv[i+1], NULL, 10);
+        } else if (strcmp(argv[i], "-db") == 0) {
+            p.db = argv[i+1];
+        } else if (strcmp(argv[i], "-output") == 0) {
+            p.output = argv[i+1];
+        } else {
+            fprintf(stderr, "unknown option \"%s\"\n", argv[i]);
+            return 2;
+        }
+    }
+    if (i != argc || p.ports < 1 || p.maxversions < 1) {
+        fprintf(stderr, "usage: centry_test -bench ?option value ...?\n");
+        return 2;
+    }
+    rng_state = p.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    /* generate the ports up front, so generation isn't timed */
+    ports = malloc(p.ports * p.maxversions * sizeof(bench_port));
+    for (i=0; i<p.ports; i++) {
+        int n = version_count(&p);
+        for (j=0; j<n; j++) {
+            bench_port* port = &ports[port_count++];
+            sprintf(port->name, "port%05d", i);
+            sprintf(port->version, "%d.%lu", 1 + j, random_below(10));
+            port->files = malloc(p.files * sizeof(char*));
+            for (k=0; k<p.files; k++) {
+                int d, len = sprintf(path, "/opt/local");
+                for (d=0; d<p.depth; d++) {
+                    len += sprintf(path + len, "/%s", dirs[random_below(8)]);
+                }
+                sprintf(path + len, "/%s/%s/file%d", port->name,
+                        port->version, k);
+                port->files[k] = strdup(path);
+            }
+        }
+    }
+
+    remove_registry(p.db);
+    start = now_us();
+    db = open_registry(p.db);
+    record(B_OPEN, start);
+    for (i=0; i<port_count; i++) {
+        start = now_us();
+        ports[i].entry = reg_entry_create(db, ports[i].name, ports[i].version,
+                "0", "", "0", &error);
+        record(B_CREATE, start);
+    }
+    for (i=0; i<port_count; i++) {
+        start = now_us();
+        reg_entry_map(db, ports[i].entry, ports[i].files, p.files, &error);
+        record(B_MAP, start);
+    }
+
+    reg_arena_init(&arena, 4096);
+    for (i=0; i<p.samples; i++) {
+        char name[16], pattern[24];
+        char* keys[] = { "name" };
+        char* vals[1];
+        reg_entry** entries;
+        reg_entry* owner;
+        char** files;
+        bench_port* port;
+        sprintf(name, "port%05lu", random_below(p.ports));
+        vals[0] = name;
+        start = now_us();
+        reg_entry_search(db, keys, vals, 1, 0, &entries, &arena, &error);
+        record(B_SEARCH_EXACT, start);
+        sprintf(pattern, "%.8s*", name);
+        vals[0] = pattern;
+        start = now_us();
+        reg_entry_search(db, keys, vals, 1, 1, &entries, &arena, &error);
+        record(B_SEARCH_GLOB, start);
+        sprintf(pattern, "^%.8s[0-4]$", name);
+        start = now_us();
+        reg_entry_search(db, keys, vals, 1, 2, &entries, &arena, &error);
+        record(B_SEARCH_REGEXP, start);
+        port = &ports[random_below(port_count)];
+        start = now_us();
+        if (reg_entry_owner(db, port->files[random_below(p.files)], &owner,
+                    &error) && owner != NULL) {
+            reg_entry_free(db, &owner, 1);
+        }
+        record(B_OWNER, start);
+        start = now_us();
+        reg_entry_files(db, port->entry, &files, &arena, &error);
+        record(B_FILES, start);
+        reg_arena_free(&arena);
+    }
+
+    /* unmap half of each port's files */
+    for (i=0; i<port_count; i++) {
+        start = now_us();
+        reg_entry_unmap(db, ports[i].entry, ports[i].files, p.files / 2,
+                &error);
+        record(B_UNMAP, start);
+    }
+
+    start = now_us();
+    reg_close(db);
+    record(B_CLOSE, start);
+    for (i=0; i<100; i++) {
+        start = now_us();
+        db = open_registry(p.db);
+        record(B_OPEN, start);
+        start = now_us();
+        reg_close(db);
+        record(B_CLOSE, start);
+    }
+
+    db = open_registry(p.db);
+    for (i=0; i<port_count; i++) {
+        ports[i].entry->db = db;
+        start = now_us();
+        reg_entry_delete(db, &ports[i].entry, 1, &error);
+        record(B_DELETE, start);
+        reg_entry_free(db, &ports[i].entry, 1);
+        for (k=0; k<p.files; k++) {
+            free(ports[i].files[k]);
+        }
+        free(ports[i].files);
+    }
+    reg_close(db);
+    free(ports);
+    remove_registry(p.db);
+
+    if (p.output == NULL) {
+        report(stdout, &p);
+    } else {
+        FILE* out = fopen(p.output, "w");
+        if (out == NULL) {
+            perror(p.output);
+            return 1;
+        }
+        report(out, &p);
+        fclose(out);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "-bench") == 0) {
+        return run_bench(argc - 2, argv + 2);
+    }
+    return run_tests();
+}
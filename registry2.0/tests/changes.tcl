@@ -0,0 +1,68 @@
+# Test file for change tracking
+# Syntax:
+# tclsh changes.tcl <Pextlib name>
+
+proc changes {} {
+    return [dict get [registry::stats] changes]
+}
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+
+    registry::open test.db
+    registry::stats -reset
+    set zlib [registry::entry create zlib 1.2.3 1 {} 0]
+    $zlib map /opt/local/lib/libz.dylib /opt/local/include/zlib.h
+    test_equal {[dict get [changes] ports]} 1
+    test_equal {[dict get [changes] files]} 2
+    test_equal {[dict get [changes] remote]} 0
+
+    # another process's writes are noticed by the next command, and read
+    elsewhere $pextlibname {
+        [registry::entry create pcre 7.1 1 {} 0] map /opt/local/lib/libpcre.dylib
+    }
+    test_equal {[llength [registry::entry search name pcre]]} 1
+    test_equal {[dict get [changes] remote]} 1
+    test_equal {[registry::entry name [registry::entry owner -refs \
+        /opt/local/lib/libpcre.dylib]]} pcre
+    test_equal {[dict get [changes] remote]} 1
+
+    elsewhere $pextlibname {
+        set pcre [registry::entry search -refs name pcre]
+        registry::entry unmap $pcre /opt/local/lib/libpcre.dylib
+        registry::entry delete $pcre
+    }
+    test_equal {[registry::entry owner /opt/local/lib/libpcre.dylib]} {}
+    test_equal {[registry::entry search name pcre]} {}
+    test_equal {[dict get [changes] remote]} 2
+    $zlib state active
+    elsewhere $pextlibname {
+        [registry::entry search name zlib] state installed
+    }
+    test_equal {[$zlib state]} installed
+
+    # the interp's own writes aren't remote
+    registry::stats -reset
+    $zlib unmap /opt/local/include/zlib.h
+    test_equal {[dict get [changes] files]} 1
+    test_equal {[dict get [changes] remote]} 0
+
+    # a deleted entry's evicted name doesn't come back
+    registry::entry limit 1
+    set bzip2 [registry::entry create bzip2 1.0.5 0 {} 0]
+    set xz [registry::entry create xz 5.0 0 {} 0]
+    test_equal {[llength [info commands $bzip2]]} 0
+    registry::entry delete [registry::entry search -refs name bzip2]
+    check_throws {$bzip2 name}
+    test_equal {[llength [info commands $bzip2]]} 0
+    registry::entry limit 0
+
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm
+}
+
+source tests/common.tcl
+main $argv
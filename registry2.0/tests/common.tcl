@@ -33,9 +33,19 @@ proc test_equal {statement value} {
 
 proc check_throws {statement} {
     uplevel 1 "\
-        if \{!\[catch $statement\]\} \{ \n\
+        if \{!\[catch \{$statement\}\]\} \{ \n\
             puts \{Did not error: $statement\} \n\
             exit 1 \n\
         \}"
 }
 
+# Runs `script` in a separate process with the registry at `db` open, for
+# tests of what other processes see and do.
+proc elsewhere {pextlibname script {db test.db}} {
+    exec [info nameofexecutable] << "
+        load [list $pextlibname]
+        registry::open [list $db]
+        $script
+        registry::close
+    "
+}
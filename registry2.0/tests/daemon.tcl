@@ -0,0 +1,99 @@
+# Test file for registryd and its use by the registry package
+# Syntax:
+# tclsh daemon.tcl <Pextlib name> <registryd>
+
+proc start_daemon {registryd} {
+    set pid [exec $registryd -f test.db &]
+    for {set i 0} {$i < 100 && ![file exists test.db.sock]} {incr i} {
+        after 20
+    }
+    test {[file exists test.db.sock]}
+    return $pid
+}
+
+proc stop_daemon {pid} {
+    exec kill $pid
+    for {set i 0} {$i < 100 && [file exists test.db.sock]} {incr i} {
+        after 20
+    }
+    test {![file exists test.db.sock]}
+}
+
+proc main {pextlibname registryd} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm test.db.sock
+
+    registry::open test.db
+    set zlib [registry::entry create zlib 1.2.3 1 {} 0]
+    $zlib state active
+    $zlib map /opt/local/lib/libz.dylib /opt/local/include/zlib.h
+    set pcre [registry::entry create pcre 7.1 1 {utf8 +} 0]
+    $pcre state installed
+    registry::close
+
+    set pid [start_daemon $registryd]
+    # only one daemon per registry
+    check_throws {exec $registryd -f test.db}
+
+    registry::open test.db
+    test_equal {[dict get [registry::stats] daemon]} 1
+    set refs [registry::entry search -refs name zlib]
+    test_equal {[llength $refs]} 1
+    set ref [lindex $refs 0]
+    test_equal {[registry::entry version $ref]} 1.2.3
+    test_equal {[registry::entry variants [lindex [registry::entry search \
+        -refs name pcre] 0]]} {utf8 +}
+    test_equal {[lsort [registry::entry files $ref]]} \
+        {/opt/local/include/zlib.h /opt/local/lib/libz.dylib}
+    test_equal {[llength [registry::entry search -refs -glob name *]]} 2
+    test_equal {[registry::entry owner -refs /opt/local/lib/libz.dylib]} $ref
+    test_equal {[registry::entry owner -refs /opt/local/lib/libnone]} {}
+    check_throws {registry::entry search -refs bogus zlib}
+    test_equal {[dict get [registry::stats] daemon]} 1
+
+    # writes from elsewhere are seen at once
+    interp create other
+    other eval [list load $pextlibname]
+    other eval {
+        registry::open test.db
+        [registry::entry create bzip2 1.0.5 0 {} 0] state installed
+        registry::close
+    }
+    interp delete other
+    test_equal {[llength [registry::entry search -refs name bzip2]]} 1
+
+    # anything needing a connection of its own switches to one
+    test_equal {[[registry::entry owner /opt/local/lib/libz.dylib] name]} zlib
+    test_equal {[dict get [registry::stats] daemon]} 0
+    test_equal {[registry::entry version $ref]} 1.2.3
+    registry::close
+
+    # if the daemon goes away, the registry carries on without it
+    registry::open test.db
+    test_equal {[dict get [registry::stats] daemon]} 1
+    stop_daemon $pid
+    test_equal {[registry::entry name $ref]} zlib
+    test_equal {[llength [registry::entry search -refs name zlib]]} 1
+    registry::close
+
+    registry::open test.db
+    test_equal {[dict get [registry::stats] daemon]} 0
+    registry::close
+
+    # nor does it wait forever on one that hangs
+    set pid [start_daemon $registryd]
+    registry::open test.db
+    test_equal {[dict get [registry::stats] daemon]} 1
+    exec kill -STOP $pid
+    test_equal {[llength [registry::entry search -refs name zlib]]} 1
+    test_equal {[dict get [registry::stats] daemon]} 0
+    registry::close
+    exec kill -CONT $pid
+    stop_daemon $pid
+
+	file delete -force test.db test.db-wal test.db-shm
+}
+
+source tests/common.tcl
+main {*}$argv
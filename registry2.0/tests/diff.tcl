@@ -0,0 +1,78 @@
+# Test file for registry::diff
+# Syntax:
+# tclsh diff.tcl <Pextlib name>
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+	file delete -force test2.db test2.db-wal test2.db-shm
+
+    # the other registry
+    registry::open test2.db
+    set vim [registry::entry create vim 7.1.002 0 {multibyte +} 0]
+    $vim state active
+    $vim map /opt/local/bin/vim /opt/local/bin/vimdiff /opt/local/bin/xxd
+    set zlib [registry::entry create zlib 1.2.10 1 {} 0]
+    $zlib state installed
+    $zlib map /opt/local/lib/libz.dylib
+    set pcre [registry::entry create pcre 8.0 0 {} 0]
+    $pcre state active
+    registry::close
+
+    # this registry
+    check_throws {registry::diff test2.db}
+    registry::open test.db
+    test_equal {[registry::diff test.db]} {}
+    set vim [registry::entry create vim 7.1.002 0 {multibyte +} 0]
+    $vim state installed
+    $vim map /opt/local/bin/ex /opt/local/bin/vim /opt/local/bin/xxd
+    # 1.2.9 sorts before 1.2.10 as a version, after it as text
+    set zlib [registry::entry create zlib 1.2.9 1 {} 0]
+    $zlib state installed
+    $zlib map /opt/local/lib/libz.dylib
+    set pcre [registry::entry create pcre 8.0 0 {} 0]
+    $pcre state active
+
+    test_equal {[registry::diff test2.db]} [list \
+        {changed {vim 0 7.1.002 0 {multibyte +}} state installed active} \
+        {unmapped {vim 0 7.1.002 0 {multibyte +}} /opt/local/bin/ex} \
+        {mapped {vim 0 7.1.002 0 {multibyte +}} /opt/local/bin/vimdiff} \
+        {removed {zlib 0 1.2.9 1 {}}} \
+        {added {zlib 0 1.2.10 1 {}}}]
+
+    # streamed to a command, which can stop it
+    set ::seen {}
+    test_equal {[registry::diff -command {lappend ::seen} test2.db]} {}
+    test_equal {[llength $::seen]} 5
+    test_equal {[lindex $::seen 0 0]} changed
+    set ::seen {}
+    registry::diff -command {apply {{d} {
+        lappend ::seen $d
+        if {[lindex $d 0] eq "unmapped"} {
+            return -code break
+        }
+    }}} test2.db
+    test_equal {[llength $::seen]} 2
+    check_throws {registry::diff -command {error oops} test2.db}
+    check_throws {registry::diff -bogus x test2.db}
+    check_throws {registry::diff nonexistent.db}
+
+    # the other registry is only read, and let go of afterwards
+    test_equal {[llength [registry::diff test2.db]]} 5
+    registry::close
+    registry::open test2.db
+    test_equal {[llength [registry::entry search -refs]]} 3
+    test_equal {[llength [registry::diff test.db]]} 5
+    registry::close
+
+    registry::open -readonly -snapshot test.db
+    check_throws {registry::diff test2.db}
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm
+	file delete -force test2.db test2.db-wal test2.db-shm
+}
+
+source tests/common.tcl
+main $argv
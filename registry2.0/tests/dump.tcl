@@ -0,0 +1,110 @@
+# Test file for registry::export and registry::import
+# Syntax:
+# tclsh dump.tcl <Pextlib name>
+
+# Exports the open registry and returns what was written.
+proc export {} {
+    set chan [file tempfile path]
+    fconfigure $chan -encoding utf-8
+    registry::export $chan
+    seek $chan 0
+    set dump [read $chan]
+    close $chan
+    file delete $path
+    return $dump
+}
+
+# Imports `dump` into the open registry.
+proc import {dump} {
+    set chan [file tempfile path]
+    fconfigure $chan -encoding utf-8
+    puts -nonewline $chan $dump
+    seek $chan 0
+    catch {registry::import $chan} counts options
+    close $chan
+    file delete $path
+    return -options $options $counts
+}
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+	file delete -force test2.db test2.db-wal test2.db-shm
+
+    check_throws {registry::export stdout}
+    registry::open test.db
+
+    set vim [registry::entry create vim 7.1.002 0 {multibyte +} 0]
+    $vim state active
+    $vim map /opt/local/bin/vim "/opt/local/share/vim/a \"quoted\"\tname" \
+        "/opt/local/share/vim/été \U1f600"
+    set zlib [registry::entry create zlib 1.2.3 1 {} 0]
+    $zlib state installed
+    $zlib map /opt/local/lib/libz.dylib
+    registry::entry create empty 1.0 0 {} 0
+
+    set dump [export]
+    set lines [split [string trim $dump] \n]
+    test_equal {[llength $lines]} 8
+    test_equal {[lindex $lines 0]} {{"registry": 1, "schema": 1}}
+    test {[string match {{"type": "port", "name": "vim", *}} [lindex $lines 1]]}
+    test {[string match {*"state": "active"*} [lindex $lines 1]]}
+    test_equal {[lindex $lines 3]} \
+        {{"type": "file", "path": "/opt/local/share/vim/a \"quoted\"\tname"}}
+    registry::close
+
+    # a round trip gives the same registry
+    registry::open test2.db
+    test_equal {[import $dump]} {ports 3 files 4}
+    test_equal {[export]} $dump
+    set e [registry::entry owner "/opt/local/share/vim/été \U1f600"]
+    test_equal {[$e name]} vim
+    test_equal {[$e variants]} {multibyte +}
+    test_equal {[$e state]} active
+    test_equal {[llength [registry::entry search -refs name vim state active]]} 1
+    test_equal {[[registry::entry owner /opt/local/lib/libz.dylib] version]} \
+        1.2.3
+
+    # an import that conflicts, or fails partway, adds nothing
+    check_throws {import $dump}
+    test_equal {$::errorCode} registry::constraint
+    set other [string map {vim nvi zlib zlib2 libz libz2} $dump]
+    set other [string map {/opt/local/bin/nvi /opt/local/lib/libz.dylib} \
+        $other]
+    check_throws {import $other}
+    test_equal {$::errorCode} registry::already-owned
+    test_equal {[llength [registry::entry search -refs name nvi]]} 0
+    set truncated [join [lrange [split $other \n] 0 2] \n]
+    check_throws {import [string range $truncated 0 end-3]}
+    test_equal {$::errorCode} registry::invalid-dump
+    test {[string match {line 3: *} $::errorInfo]}
+    test_equal {[llength [registry::entry search -refs name nvi]]} 0
+    check_throws {import "{\"registry\": 1, \"schema\": 99}\n"}
+    check_throws {import "[lindex $lines 0]\n[lindex $lines 2]\n"}
+    check_throws {import "[lindex $lines 0]\n{\"type\": \"port\", \"bogus\": 1}"}
+    check_throws {registry::import stdout}
+    test_equal {[import "[lindex $lines 0]\n\n"]} {ports 0 files 0}
+
+    # values keep their types
+    test_equal {[import [join [list [lindex $lines 0] \
+        {{"type": "port", "name": "näme", "epoch": 2, "date": 1.5}} \
+        {{"type": "file", "path": "/opt/local/x", "mtime": 3}}] \n]]} \
+        {ports 1 files 1}
+    set e [registry::entry owner /opt/local/x]
+    test_equal {[$e name]} näme
+    test_equal {[$e date]} 1.5
+    test {[string match *\"epoch\":\ 2,* [export]]}
+    registry::close
+
+    registry::open -readonly test2.db
+    check_throws {import $dump}
+    test {[string first $dump [export]] == 0}
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm
+	file delete -force test2.db test2.db-wal test2.db-shm
+}
+
+source tests/common.tcl
+main $argv
@@ -27,6 +27,72 @@ proc main {pextlibname} {
     test_equal {[$vim3 version]} 7.1.002
     test_equal {[$zlib revision]} 1
     test_equal {[$pcre variants]} {utf8 +}
+
+    # entry references
+    set commands [llength [info commands ::registry::*]]
+    set refs [registry::entry search -refs name vim]
+    test_equal {[llength $refs]} 3
+    test_equal {[llength [info commands ::registry::*]]} $commands
+    set ref [lindex [registry::entry search -refs name zlib] 0]
+    test_equal {[registry::entry version $ref]} 1.2.3
+    test_equal {[registry::entry state $ref]} active
+    test_equal {[registry::entry name [lindex $refs 0]]} vim
+    test_equal {[$ref revision]} 1
+    test_equal {[llength [info commands ::registry::*]]} [expr {$commands + 1}]
+    registry::entry close $ref
+    test_equal {[llength [info commands ::registry::*]]} $commands
+
+    # evicted entry procs come back when used
+    test_equal {[registry::entry limit 2]} 2
+    test {[llength [info commands ::registry::entry?*]] <= 2}
+    test_equal {[$vim1 version]} 7.1.000
+    test_equal {[$pcre name]} pcre
+    registry::entry limit 0
+
+    # other unknown commands go to ::unknown from the caller's frame
+    rename ::unknown ::saved_unknown
+    proc ::unknown {args} {
+        uplevel 1 {set x 1}
+    }
+    proc lookup {} {
+        set x 5
+        no_such_command
+        return $x
+    }
+    test_equal {[lookup]} 1
+    test {![info exists ::x]}
+    rename ::unknown {}
+    rename ::saved_unknown ::unknown
+
+    # an aborted write leaves nothing behind
+    set files {}
+    for {set i 0} {$i < 5000} {incr i} {
+        lappend files /opt/local/share/vim/$i
+    }
+    set ::ticks 0
+    registry::progress -interval 100 {incr ::ticks}
+    $vim1 map {*}$files
+    test {$::ticks > 0}
+    registry::progress {if {[incr ::ticks] == 1} break}
+    set ::ticks 0
+    check_throws {$vim1 unmap {*}$files}
+    test_equal {[llength [$vim1 files]]} 5000
+    registry::progress {}
+    test_equal {[registry::progress]} {}
+    $vim1 unmap {*}$files
+    check_throws {$vim1 map /opt/local/bin/vim /opt/local/bin/vim}
+    test_equal {[llength [$vim1 files]]} 0
+
+    # matching strategies and file owners
+    test_equal {[llength [registry::entry search -refs -glob name v*]]} 3
+    test_equal {[llength [registry::entry search -refs -regexp name {^(zlib|pcre)$}]]} 2
+    test_equal {[llength [registry::entry search -refs -exact name v*]]} 0
+    check_throws {registry::entry search -regexp name (}
+    $zlib map /opt/local/lib/libz.dylib
+    test_equal {[[registry::entry owner /opt/local/lib/libz.dylib] name]} zlib
+    test_equal {[registry::entry version [registry::entry owner -refs \
+        /opt/local/lib/libz.dylib]]} 1.2.3
+    test_equal {[registry::entry owner /opt/local/lib/libnone.dylib]} {}
     
     set installed [registry::entry installed]
     set active [registry::entry active]
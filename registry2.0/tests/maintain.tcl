@@ -0,0 +1,97 @@
+# Test file for registry::maintain and automatic planner statistics
+# Syntax:
+# tclsh maintain.tcl <Pextlib name>
+
+# Returns whether `sql` was run since the last call.
+proc ran {sql} {
+    set statements [dict get [registry::stats -reset] statements]
+    return [dict exists $statements $sql]
+}
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+
+    check_throws {registry::maintain -analyze}
+    registry::open test.db
+    registry::stats -enable 1 -reset
+    set vim [registry::entry create vim 7.1.002 0 {} 0]
+    set files {}
+    for {set i 0} {$i < 2000} {incr i} {
+        lappend files /opt/local/share/vim/$i
+    }
+
+    # changing enough rows of a table analyzes it
+    $vim map {*}[lrange $files 0 1499]
+    test {[ran {ANALYZE registry.files;}]}
+    $vim map {*}[lrange $files 1500 end]
+    test {![ran {ANALYZE registry.files;}]}
+    test {![ran {ANALYZE registry.ports;}]}
+
+    registry::maintain -analyze
+    test {[ran {ANALYZE registry;}]}
+    check_throws {registry::maintain -bogus}
+
+    # deleted rows leave free pages, which -vacuum gives back
+    set report [registry::maintain]
+    test_equal {[dict get $report auto_vacuum]} incremental
+    test {[dict get $report free_pages] == 0}
+    $vim unmap {*}$files
+    set report [registry::maintain]
+    set free [dict get $report free_pages]
+    test {$free > 0}
+    test {[dict exists $report fragmentation]}
+    check_throws {registry::maintain -pages 1}
+    check_throws {registry::maintain -full}
+    check_throws {registry::maintain -vacuum -pages 0}
+    check_throws {registry::maintain -vacuum -pages 1 -full}
+    set report [registry::maintain -vacuum -pages 1]
+    test_equal {[dict get $report free_pages]} [expr {$free - 1}]
+    set report [registry::maintain -vacuum]
+    test {[dict get $report free_pages] < $free - 1}
+    set report [registry::maintain -vacuum -full]
+    test_equal {[dict get $report free_pages]} 0
+    test_equal {[dict get $report auto_vacuum]} incremental
+    $vim map {*}$files
+
+    # closing lets sqlite refresh what it wants to
+    registry::close
+    test {[ran {PRAGMA registry.optimize}]}
+
+    registry::open -readonly test.db
+    check_throws {registry::maintain -analyze}
+    check_throws {registry::maintain -vacuum}
+    test_equal {[dict get [registry::maintain] auto_vacuum]} incremental
+    test_equal {[llength [registry::entry files \
+        [registry::entry search -refs name vim]]]} 2000
+    registry::close
+    test {![ran {PRAGMA registry.optimize}]}
+    registry::stats -enable 0
+
+    # registries from before incremental vacuum are converted by -vacuum -full
+    if {![catch {package require sqlite3}]} {
+        exec [info nameofexecutable] << {
+            package require sqlite3
+            sqlite3 db test.db
+            # near enough for the one version here
+            db collate VERSION {package vcompare}
+            db eval {PRAGMA auto_vacuum=NONE; VACUUM}
+            db close
+        }
+        test_equal {[elsewhere $pextlibname {
+            puts [dict get [registry::maintain] auto_vacuum]
+            puts [catch {registry::maintain -vacuum} message]
+            puts [string match *-full* $message]
+            puts [dict get [registry::maintain -vacuum -full] auto_vacuum]
+        }]} "none\n1\n1\nincremental"
+        test_equal {[elsewhere $pextlibname {
+            puts [dict get [registry::maintain -vacuum] auto_vacuum]
+        }]} incremental
+    }
+
+	file delete -force test.db test.db-wal test.db-shm
+}
+
+source tests/common.tcl
+main $argv
@@ -0,0 +1,43 @@
+# Test file for registry::migrate
+# Syntax:
+# tclsh migrate.tcl <Pextlib name>
+#
+# The migration engine itself is tested with migrations of its own in
+# centry_test.c; this covers the command.
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+	file delete -force test2.db test2.db-wal test2.db-shm
+
+    check_throws {registry::migrate}
+    registry::open test.db
+    set ::calls {}
+    test_equal {[registry::migrate]} 1
+    test_equal {[registry::migrate -chunk 100 -progress {lappend ::calls}]} 1
+    test_equal {$::calls} {}
+    check_throws {registry::migrate -chunk 0}
+    check_throws {registry::migrate -chunk}
+    check_throws {registry::migrate -bogus 1}
+    registry::close
+
+    registry::open -readonly test.db
+    check_throws {registry::migrate}
+    registry::close
+
+    # one from a newer version isn't opened
+    if {![catch {package require sqlite3}]} {
+        sqlite3 db test2.db
+        db eval {CREATE TABLE ports (id INTEGER); PRAGMA user_version=99}
+        db close
+        check_throws {registry::open test2.db}
+        test_equal {$::errorCode} registry::newer-schema
+    }
+
+	file delete -force test.db test.db-wal test.db-shm
+	file delete -force test2.db test2.db-wal test2.db-shm
+}
+
+source tests/common.tcl
+main $argv
@@ -0,0 +1,59 @@
+# Test file for read-only and snapshot opens
+# Syntax:
+# tclsh readonly.tcl <Pextlib name>
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+
+    check_throws {registry::open -readonly test.db}
+    check_throws {registry::open -snapshot test.db}
+    check_throws {registry::open -bogus test.db}
+    registry::open test.db
+    [registry::entry create vim 7.1.002 0 {} 0] state installed
+    registry::close
+
+    # reads work and writes don't
+    registry::open -readonly test.db
+    test_equal {[llength [registry::entry search name vim]]} 1
+    test_equal {[registry::entry state [registry::entry search -refs \
+        name vim]]} installed
+    check_throws {registry::entry create zlib 1.2.3 1 {} 0}
+    check_throws {[registry::entry search name vim] state active}
+    check_throws {registry::writer start}
+    test_equal {[registry::entry state [registry::entry search -refs \
+        name vim]]} installed
+    # other processes' writes are seen at once
+    elsewhere $pextlibname {registry::entry create zlib 1.2.3 1 {} 0}
+    test_equal {[llength [registry::entry search]]} 2
+    registry::close
+
+    # a snapshot sees the registry as it was when opened
+    registry::open -readonly -snapshot test.db
+    test_equal {[llength [registry::entry search]]} 2
+    elsewhere $pextlibname {
+        registry::entry create pcre 7.1 1 {} 0
+        [registry::entry search name vim] state active
+    }
+    test_equal {[llength [registry::entry search]]} 2
+    test_equal {[registry::entry search name pcre]} {}
+    test_equal {[[registry::entry search name vim] state]} installed
+    check_throws {registry::entry search -async {set ::done} name vim}
+    registry::close
+
+    # and after closing, the registry is as the writer left it
+    registry::open -readonly test.db
+    test_equal {[llength [registry::entry search]]} 3
+    test_equal {[[registry::entry search name vim] state]} active
+    registry::close
+    registry::open test.db
+    registry::entry create gettext 0.17 3 {} 0
+    test_equal {[llength [registry::entry search]]} 4
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm
+}
+
+source tests/common.tcl
+main $argv
@@ -0,0 +1,77 @@
+# Test file for the search result cache
+# Syntax:
+# tclsh results.tcl <Pextlib name>
+
+proc results {} {
+    return [dict get [registry::stats -reset] results]
+}
+
+# Returns the sorted names of the entries found by a search.
+proc found {args} {
+    set names {}
+    foreach entry [registry::entry search {*}$args] {
+        lappend names [registry::entry name $entry]
+    }
+    return [lsort $names]
+}
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+
+    registry::open test.db
+    set vim [registry::entry create vim 7.1.002 0 {} 0]
+    set zlib [registry::entry create zlib 1.2.3 1 {} 0]
+    $vim state installed
+    $zlib state active
+    registry::stats -reset
+
+    # the same search, in any order, is answered from the cache
+    test_equal {[found name vim state installed]} vim
+    test_equal {[found state installed name vim]} vim
+    test_equal {[found -refs state installed]} vim
+    test_equal {[found state installed]} vim
+    test_equal {[found -glob name z*]} zlib
+    test_equal {[found -exact name z*]} {}
+    test_equal {[results]} {hits 2 misses 4 size 4}
+
+    # changes to ports empty it; changes to files don't
+    $vim map /opt/local/bin/vim
+    test_equal {[found state installed]} vim
+    test_equal {[dict get [results] hits]} 1
+    $zlib state installed
+    test_equal {[found state installed]} {vim zlib}
+    test_equal {[results]} {hits 0 misses 1 size 1}
+    [registry::entry create pcre 7.1 1 {} 0] state installed
+    test_equal {[llength [registry::entry search state installed]]} 3
+    $vim unmap /opt/local/bin/vim
+    registry::entry delete $vim
+    test_equal {[llength [registry::entry search state installed]]} 2
+    test_equal {[results]} {hits 0 misses 2 size 1}
+
+    # so do another process's
+    elsewhere $pextlibname {
+        [registry::entry search name pcre] state active
+    }
+    test_equal {[found state installed]} zlib
+    test_equal {[dict get [results] hits]} 0
+
+    # and reopening the registry
+    registry::close
+    registry::open test.db
+    test_equal {[found -refs state installed]} zlib
+    test_equal {[results]} {hits 0 misses 1 size 1}
+
+    # only so many searches are kept
+    for {set i 0} {$i < 100} {incr i} {
+        registry::entry search -refs name port$i
+    }
+    test_equal {[dict get [results] size]} 64
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm
+}
+
+source tests/common.tcl
+main $argv
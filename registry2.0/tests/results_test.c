@@ -0,0 +1,115 @@
+/*
+ * tests/results_test.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the search result cache that scripts can't reach.
+ *
+ * A search only stores its result after missing the cache, so from Tcl the
+ * same search is never stored twice; this program calls results.c directly to
+ * check that storing it again replaces what was kept. It links results.c and
+ * changes.c against Tcl itself rather than its stubs.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "../centry.h"
+#include "../results.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* stores a search for `name` as having found `rowid` */
+static void put(Tcl_Interp* interp, char* name, sqlite_int64 rowid) {
+    char* key = "name";
+    reg_entry entry;
+    reg_entry* entries[1];
+    entry.rowid = rowid;
+    entry.db = NULL;
+    entries[0] = &entry;
+    results_put(interp, 0, &key, &name, 1, entries, 1);
+}
+
+/* returns the rowid the search for `name` found, or -1 on a miss */
+static sqlite_int64 get(Tcl_Interp* interp, char* name) {
+    char* key = "name";
+    reg_entry** entries;
+    reg_arena arena;
+    sqlite_int64 rowid = -1;
+    reg_arena_init(&arena, 256);
+    if (results_get(interp, 0, &key, &name, 1, NULL, &entries, &arena) == 1) {
+        rowid = entries[0]->rowid;
+    }
+    reg_arena_free(&arena);
+    return rowid;
+}
+
+static void test_replace(Tcl_Interp* interp) {
+    char name[16];
+    int i;
+    /* storing a search again keeps the newer answer */
+    put(interp, "vim", 1);
+    put(interp, "vim", 2);
+    CHECK(get(interp, "vim") == 2);
+    /* and makes it the most recently used, so it outlives older searches */
+    for (i=0; i<63; i++) {
+        sprintf(name, "port%d", i);
+        put(interp, name, i);
+    }
+    put(interp, "vim", 3);
+    put(interp, "zlib", 4);
+    CHECK(get(interp, "port0") == -1);
+    CHECK(get(interp, "vim") == 3);
+    CHECK(get(interp, "zlib") == 4);
+}
+
+int main(int argc UNUSED, char** argv) {
+    Tcl_Interp* interp;
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    test_replace(interp);
+    Tcl_DeleteInterp(interp);
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
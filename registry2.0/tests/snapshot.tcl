@@ -0,0 +1,117 @@
+# Test file for registry::snapshot
+# Syntax:
+# tclsh snapshot.tcl <Pextlib name>
+
+# Returns the ports of the open registry with their files, in a stable order.
+proc contents {} {
+    set result {}
+    foreach e [registry::entry search -refs] {
+        set port [list]
+        foreach key {name epoch version revision variants state date} {
+            lappend port [registry::entry $key $e]
+        }
+        lappend port [lsort [registry::entry files $e]]
+        lappend result $port
+    }
+    return [lsort $result]
+}
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+	file delete -force test2.db test2.db-wal test2.db-shm
+	file delete -force test.snapshot
+
+    check_throws {registry::snapshot save test.snapshot}
+    registry::open test.db
+
+    set vim [registry::entry create vim 7.1.002 0 {multibyte +} 0]
+    $vim state active
+    set files {}
+    for {set i 0} {$i < 1000} {incr i} {
+        lappend files /opt/local/share/vim/[expr {$i % 7}]/$i
+    }
+    $vim map {*}$files /opt/local/bin/vim "/opt/local/share/été \U1f600"
+    set zlib [registry::entry create zlib 1.2.3 1 {} 0]
+    $zlib state installed
+    $zlib date 1.5
+    $zlib map /opt/local/lib/libz.dylib
+    registry::entry create empty 1.0 0 {} 0
+    # a deleted port's files stay behind, but aren't saved
+    set gone [registry::entry create gone 1.0 0 {} 0]
+    $gone map /opt/local/bin/gone
+    registry::entry delete $gone
+
+    test_equal {[registry::snapshot save test.snapshot]} {ports 3 files 1003}
+    set saved [contents]
+    registry::close
+
+    # restoring replaces everything
+    registry::open test2.db
+    set other [registry::entry create other 2.0 0 {} 0]
+    $other map /opt/local/bin/other
+    test_equal {[registry::snapshot restore test.snapshot]} {ports 3 files 1003}
+    check_throws {$other name}
+    test_equal {[contents]} $saved
+    test_equal {[registry::entry owner /opt/local/bin/other]} {}
+    test_equal {[[registry::entry owner "/opt/local/share/été \U1f600"] name]} vim
+    test_equal {[[registry::entry owner /opt/local/lib/libz.dylib] date]} 1.5
+    test_equal {[llength [registry::entry search -refs state active]]} 1
+
+    # and again over what it restored, closing the procs from before, whose
+    # rowids restored ports may have taken
+    set vim [registry::entry owner /opt/local/bin/vim]
+    test_equal {[$vim name]} vim
+    test_equal {[registry::snapshot restore test.snapshot]} {ports 3 files 1003}
+    test_equal {[contents]} $saved
+    check_throws {$vim name}
+
+    # a restore that fails partway leaves the procs alone
+    if {![catch {package require sqlite3}]} {
+        sqlite3 db test2.db
+        db collate VERSION {package vcompare}
+        db eval {CREATE TRIGGER no_zlib BEFORE INSERT ON ports
+            WHEN NEW.name = 'zlib' BEGIN SELECT RAISE(ABORT, 'no zlib'); END}
+        set vim [registry::entry owner /opt/local/bin/vim]
+        check_throws {registry::snapshot restore test.snapshot}
+        test_equal {[$vim name]} vim
+        test_equal {[contents]} $saved
+        db eval {DROP TRIGGER no_zlib}
+        db close
+    }
+
+    # damaged snapshots are refused, and change nothing
+    set chan [open test.snapshot r]
+    fconfigure $chan -translation binary
+    set data [read $chan]
+    close $chan
+    foreach bad [list [string range $data 0 end-1] \
+            [string replace $data 100 100 [format %c [expr {
+                ([scan [string index $data 100] %c] + 1) % 256}]]] \
+            "not a snapshot at all"] {
+        set chan [open test.snapshot w]
+        fconfigure $chan -translation binary
+        puts -nonewline $chan $bad
+        close $chan
+        check_throws {registry::snapshot restore test.snapshot}
+        test_equal {$::errorCode} registry::invalid-snapshot
+    }
+    test_equal {[contents]} $saved
+    check_throws {registry::snapshot restore nonexistent.snapshot}
+    check_throws {registry::snapshot bogus test.snapshot}
+    registry::close
+
+    registry::open -readonly test2.db
+    file delete test.snapshot
+    test_equal {[registry::snapshot save test.snapshot]} {ports 3 files 1003}
+    check_throws {registry::snapshot restore test.snapshot}
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm
+	file delete -force test2.db test2.db-wal test2.db-shm
+	file delete -force test.snapshot
+}
+
+source tests/common.tcl
+main $argv
@@ -0,0 +1,123 @@
+# Benchmarks for the time from process start to the first registry query
+# Syntax:
+# tclsh startup.tcl <Pextlib name> ?option value ...?
+#
+# Options:
+#   -ports n        ports in the registry (default 1000)
+#   -files n        files mapped to each port (default 50)
+#   -samples n      processes started per benchmark (default 50)
+#   -drop command   shell command that empties the OS page cache, run before
+#                   each cold sample (default: purge on Darwin, drop_caches on
+#                   Linux)
+#   -db file        registry to build, deleted afterwards (default startup.db)
+#   -output file    where to write the JSON results (default stdout)
+#
+# Each sample starts a new tclsh that loads the registry, opens it and runs one
+# search, and reports how long each step took; `total` also counts starting
+# the interpreter. The warm benchmarks run with the registry in the page cache,
+# the cold ones after emptying it with -drop, which usually needs root. If it
+# fails, the cold benchmarks are left out of the results. Times are in
+# microseconds, summarized as by bench.tcl.
+
+source [file join [file dirname [info script]] bench.tcl]
+
+array unset params
+array set params {
+    -ports 1000
+    -files 50
+    -samples 50
+    -drop {}
+    -db startup.db
+    -output {}
+}
+
+# Runs one sample in a new process, adding its times to `prefix`_*.
+proc sample {pextlibname prefix} {
+    global params samples
+    set script [string map [list @lib [list $pextlibname] @db \
+        [list $params(-db)]] {
+        set start [clock microseconds]
+        load @lib
+        set loaded [clock microseconds]
+        registry::open @db
+        set opened [clock microseconds]
+        registry::entry search -refs name port00000
+        set queried [clock microseconds]
+        registry::close
+        puts "[expr {$loaded - $start}] [expr {$opened - $loaded}]\
+            [expr {$queried - $opened}]"
+    }]
+    set start [clock microseconds]
+    set times [exec [info nameofexecutable] << $script]
+    set total [expr {[clock microseconds] - $start}]
+    foreach bench {load open first_query} t $times {
+        lappend samples(${prefix}_$bench) $t
+    }
+    lappend samples(${prefix}_total) $total
+}
+
+proc main {pextlibname args} {
+    global params tcl_platform
+    if {[llength $args] % 2 != 0} {
+        error "usage: startup.tcl pextlib ?option value ...?"
+    }
+    foreach {key value} $args {
+        if {![info exists params($key)]} {
+            error "unknown option \"$key\""
+        }
+        set params($key) $value
+    }
+    if {$params(-drop) eq ""} {
+        if {$tcl_platform(os) eq "Darwin"} {
+            set params(-drop) purge
+        } else {
+            set params(-drop) "sync && echo 1 > /proc/sys/vm/drop_caches"
+        }
+    }
+    load $pextlibname
+
+    set db $params(-db)
+    file delete -force $db $db-wal $db-shm
+    registry::open $db
+    for {set p 0} {$p < $params(-ports)} {incr p} {
+        set name [format port%05d $p]
+        set entry [registry::entry create $name 1.0 0 {} 0]
+        set files {}
+        for {set i 0} {$i < $params(-files)} {incr i} {
+            lappend files /opt/local/share/$name/file$i
+        }
+        $entry map {*}$files
+        registry::entry close $entry
+    }
+    registry::close
+
+    set order {}
+    if {[catch {exec sh -c $params(-drop)} message]} {
+        puts stderr "skipping cold starts: $message"
+    } else {
+        for {set i 0} {$i < $params(-samples)} {incr i} {
+            exec sh -c $params(-drop)
+            sample $pextlibname cold
+        }
+        lappend order cold_load cold_open cold_first_query cold_total
+    }
+    # one unsampled start to warm the cache
+    sample $pextlibname warmup
+    array unset ::samples warmup_*
+    for {set i 0} {$i < $params(-samples)} {incr i} {
+        sample $pextlibname warm
+    }
+    lappend order warm_load warm_open warm_first_query warm_total
+    file delete -force $db $db-wal $db-shm
+
+    set json [report $order]
+    if {$params(-output) eq ""} {
+        puts $json
+    } else {
+        set chan [open $params(-output) w]
+        puts $chan $json
+        close $chan
+    }
+}
+
+main {*}$argv
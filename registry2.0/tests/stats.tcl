@@ -0,0 +1,100 @@
+# Test file for registry::stats
+# Syntax:
+# tclsh stats.tcl <Pextlib name>
+
+proc total {stats key} {
+    set sum 0
+    dict for {sql counts} [dict get $stats statements] {
+        incr sum [dict get $counts $key]
+    }
+    return $sum
+}
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+
+    check_throws {registry::stats -bogus}
+    check_throws {registry::stats -enable}
+    test_equal {[dict get [registry::stats] enabled]} 0
+
+    registry::open test.db
+    set zlib [registry::entry create zlib 1.2.3 1 {} 0]
+    $zlib map /opt/local/lib/libz.dylib /opt/local/include/zlib.h
+
+    # nothing is gathered while disabled
+    test_equal {[dict size [dict get [registry::stats] statements]]} 0
+
+    registry::stats -enable 1
+    for {set i 0} {$i < 5} {incr i} {
+        $zlib files
+    }
+    set stats [registry::stats]
+    test_equal {[dict get $stats enabled]} 1
+    test {[total $stats calls] >= 5}
+    test {[total $stats rows] >= 10}
+    test {[dict get $stats cache hits] > 0}
+    test {[dict get $stats pager used] > 0}
+    dict for {sql counts} [dict get $stats statements] {
+        test {[dict get $counts max] <= [dict get $counts time]}
+    }
+
+    # -reset reports, then zeroes
+    set stats [registry::stats -reset]
+    test {[total $stats calls] >= 5}
+    set stats [registry::stats]
+    test_equal {[total $stats calls]} 0
+    test_equal {[dict get $stats cache hits]} 0
+
+    registry::stats -enable 0
+    $zlib files
+    test_equal {[total [registry::stats] calls]} 0
+
+    # the setting outlives close, and is picked up by the next lease
+    registry::close
+    registry::stats -enable 1
+    registry::open test.db
+    set zlib [registry::entry search name zlib]
+    test {[total [registry::stats] calls] > 0}
+    registry::stats -enable 0 -reset
+
+    # command latency is only tracked once enabled
+    test_equal {[registry::latency]} {}
+    check_throws {registry::latency -export}
+    registry::latency -enable 1
+    for {set i 0} {$i < 10} {incr i} {
+        $zlib files
+    }
+    registry::entry files $zlib
+    registry::entry search name zlib
+    set latency [registry::latency]
+    test_equal {[dict get $latency {entry files} count]} 11
+    test_equal {[dict get $latency {entry search} count]} 1
+    set files [dict get $latency {entry files}]
+    test {[dict get $files min] <= [dict get $files p50]}
+    test {[dict get $files p50] <= [dict get $files p99]}
+    test {[dict get $files p99] <= [dict get $files max]}
+    set counted 0
+    foreach {upper count} [dict get $files buckets] {
+        incr counted $count
+    }
+    test_equal {$counted} 11
+
+    registry::latency -export test.prom -reset
+    set chan [open test.prom]
+    set prom [read $chan]
+    close $chan
+    test {[string match {*registry_command_seconds_count{command="entry files"} 11*} $prom]}
+    test {[string match {*le="+Inf"*} $prom]}
+    test_equal {[registry::latency]} {}
+    registry::latency -enable 0
+    $zlib files
+    test_equal {[registry::latency]} {}
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm test.prom
+}
+
+source tests/common.tcl
+main $argv
@@ -0,0 +1,70 @@
+# Test file for sharing a registry between threads
+# Syntax:
+# tclsh thread.tcl <Pextlib name>
+
+proc main {pextlibname} {
+    if {[catch {package require Thread}]} {
+        puts "Thread package not available; skipping"
+        return
+    }
+    set lib [file normalize $pextlibname]
+    set db [file normalize test.db]
+    load $lib
+
+	file delete -force $db $db-wal $db-shm
+
+    registry::open $db
+    registry::close
+
+    # each thread keeps opening and closing the registry, so connections are
+    # passed back and forth between threads through the pool
+    set threads 8
+    set rounds 10
+    set perround 5
+    set workers {}
+    for {set t 0} {$t < $threads} {incr t} {
+        set tid [thread::create]
+        thread::send $tid [list load $lib]
+        thread::send -async $tid [list apply {{t db rounds perround} {
+            for {set r 0} {$r < $rounds} {incr r} {
+                registry::open $db
+                for {set i 0} {$i < $perround} {incr i} {
+                    set entry [registry::entry create t$t $r.$i 0 {} 0]
+                    $entry map /t$t/$r/$i/a /t$t/$r/$i/b
+                    $entry state installed
+                }
+                set found [llength [registry::entry search name t$t]]
+                if {$found != ($r + 1) * $perround} {
+                    registry::close
+                    return "thread $t saw $found entries in round $r"
+                }
+                registry::close
+            }
+            return ok
+        }} $t $db $rounds $perround] ::result($t)
+        lappend workers $tid
+    }
+    for {set t 0} {$t < $threads} {incr t} {
+        if {![info exists ::result($t)]} {
+            vwait ::result($t)
+        }
+        test_equal {$::result($t)} ok
+    }
+    foreach tid $workers {
+        thread::release $tid
+    }
+
+    registry::open $db
+    test_equal {[llength [registry::entry search]]} \
+        [expr {$threads * $rounds * $perround}]
+    test_equal {[llength [registry::entry search name t3]]} \
+        [expr {$rounds * $perround}]
+    set entry [lindex [registry::entry search name t5 version 2.1] 0]
+    test_equal {[$entry files]} {/t5/2/1/a /t5/2/1/b}
+    registry::close
+
+	file delete -force $db $db-wal $db-shm
+}
+
+source tests/common.tcl
+main $argv
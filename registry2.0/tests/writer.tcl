@@ -0,0 +1,55 @@
+# Test file for the background writer
+# Syntax:
+# tclsh writer.tcl <Pextlib name>
+
+proc main {pextlibname} {
+    load $pextlibname
+
+	file delete -force test.db test.db-wal test.db-shm
+
+    registry::open test.db
+    check_throws {registry::writer stats}
+    registry::writer start -batch 10 -window 1000
+    check_throws {registry::writer start}
+
+    set zlib [registry::entry create zlib 1.2.3 1 {} 0]
+    for {set i 0} {$i < 25} {incr i} {
+        $zlib map /opt/local/lib/libz.$i.dylib
+    }
+    $zlib state installed
+
+    # reads wait for the queue, so they see the writes above
+    test_equal {[llength [$zlib files]]} 25
+    test_equal {[$zlib state]} installed
+    test_equal {[dict get [registry::writer stats] queued]} 0
+    test_equal {[dict get [registry::writer stats] ops]} 26
+    test {[dict get [registry::writer stats] largest] <= 10}
+
+    # errors turn up at the next flush, and only once
+    $zlib map /opt/local/lib/libz.0.dylib
+    $zlib map /opt/local/lib/libz.dylib
+    check_throws {registry::flush}
+    registry::flush
+    test_equal {[llength [$zlib files]]} 26
+    test_equal {[dict get [registry::writer stats] failures]} 1
+
+    $zlib unmap /opt/local/lib/libz.dylib
+    registry::writer stop
+    test_equal {[llength [$zlib files]]} 25
+    registry::flush
+
+    registry::writer start
+    $zlib map /opt/local/lib/libz.0.dylib
+    check_throws {registry::close}
+    check_throws {registry::writer stats}
+
+    registry::open test.db
+    set zlib [registry::entry search name zlib]
+    test_equal {[llength [$zlib files]]} 25
+    registry::close
+
+	file delete -force test.db test.db-wal test.db-shm
+}
+
+source tests/common.tcl
+main $argv
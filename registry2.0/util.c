@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <tcl.h>
 
+#include "sql.h"
 #include "util.h"
 
 /**
@@ -45,20 +46,23 @@
  * `interp create` command, and is intended to generate names for created
  * objects of a similar nature.
  *
- * TODO: add a int* parameter so that functions which need large numbers of
- * unique names can keep track of the lower bound between calls,thereby turning
- * N^2 to N. It'll be alchemy for the 21st century.
+ * If `lower_bound` is not NULL, the search starts there and the integer after
+ * the chosen one is stored back, so functions which need large numbers of
+ * unique names can keep track of it between calls, thereby turning N^2 to N.
  */
-char* unique_name(Tcl_Interp* interp, char* prefix) {
+char* unique_name(Tcl_Interp* interp, char* prefix, int* lower_bound) {
     char* result = malloc(strlen(prefix) + TCL_INTEGER_SPACE + 1);
     Tcl_CmdInfo info;
     int i;
-    for (i=0; ; i++) {
+    for (i = (lower_bound == NULL) ? 0 : *lower_bound; ; i++) {
         sprintf(result, "%s%d", prefix, i);
         if (Tcl_GetCommandInfo(interp, result, &info) == 0) {
             break;
         }
     }
+    if (lower_bound != NULL) {
+        *lower_bound = i + 1;
+    }
     return result;
 }
 
@@ -168,7 +172,7 @@ int do_queries(Tcl_Interp* interp, sqlite3* db, char** queries) {
     char** query;
     for (query = queries; *query != NULL; query++) {
         sqlite3_stmt* stmt;
-        if ((sqlite3_prepare(db, *query, -1, &stmt, NULL) != SQLITE_OK)
+        if ((sqlite3_prepare_v2(db, *query, -1, &stmt, NULL) != SQLITE_OK)
                 || (sqlite3_step(stmt) != SQLITE_DONE)) {
             set_sqlite_result(interp, db, *query);
             sqlite3_finalize(stmt);
@@ -179,6 +183,82 @@ int do_queries(Tcl_Interp* interp, sqlite3* db, char** queries) {
     return TCL_OK;
 }
 
+/**
+ * REGEXP function for sqlite3.
+ *
+ * Takes two arguments; the first is the pattern and the second the value, since
+ * sqlite3 implements `X REGEXP Y` as `regexp(Y, X)`. If the pattern is invalid,
+ * errors out. Otherwise, returns true if the value matches the pattern and
+ * false otherwise.
+ *
+ * This function is available in sqlite3 as the REGEXP operator.
+ */
+static void sql_regexp(sqlite3_context* context, int argc UNUSED,
+        sqlite3_value** argv) {
+    const char* pattern = sqlite3_value_text(argv[0]);
+    const char* value = sqlite3_value_text(argv[1]);
+    switch (Tcl_RegExpMatch(NULL, value, pattern)) {
+        case 0:
+            sqlite3_result_int(context, 0);
+            break;
+        case 1:
+            sqlite3_result_int(context, 1);
+            break;
+        case -1:
+            sqlite3_result_error(context, "invalid pattern", -1);
+            break;
+    }
+}
+
+/*
+ * Sets the interp result from `errPtr` and releases it.
+ */
+static int sql_failed(Tcl_Interp* interp, reg_error* errPtr) {
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(errPtr->description, -1));
+    Tcl_SetErrorCode(interp, errPtr->code, NULL);
+    reg_error_destruct(errPtr);
+    return TCL_ERROR;
+}
+
+/**
+ * Makes sure the registry attached to `db` has its tables (see
+ * `reg_check_tables`), setting the interp result on failure.
+ */
+int check_tables(Tcl_Interp* interp, sqlite3* db) {
+    reg_error error;
+    if (!reg_check_tables(db, &error)) {
+        return sql_failed(interp, &error);
+    }
+    return TCL_OK;
+}
+
+/**
+ * Creates the temporary tables on `db` if need be (see `reg_init_temp`),
+ * setting the interp result on failure.
+ */
+int init_temp(Tcl_Interp* interp, sqlite3* db) {
+    reg_error error;
+    if (!reg_init_temp(db, &error)) {
+        return sql_failed(interp, &error);
+    }
+    return TCL_OK;
+}
+
+/**
+ * Initializes a connection for use by the Tcl layer: everything
+ * `reg_init_db` does, with its POSIX REGEXP operator replaced by one using
+ * Tcl's regular expressions, so patterns mean the same thing as in Tcl.
+ */
+int init_db(Tcl_Interp* interp, sqlite3* db) {
+    reg_error error;
+    if (!reg_init_db(db, &error)) {
+        return sql_failed(interp, &error);
+    }
+    sqlite3_create_function(db, "REGEXP", 2, SQLITE_UTF8, NULL, sql_regexp,
+            NULL, NULL);
+    return TCL_OK;
+}
+
 /**
  * Reports a sqlite3 error to Tcl.
  *
@@ -210,12 +290,12 @@ void set_sqlite_result(Tcl_Interp* interp, sqlite3* db, const char* query) {
 int all_objects(Tcl_Interp* interp, sqlite3* db, char* query, char* prefix,
         set_object_function* setter) {
     sqlite3_stmt* stmt;
-    if (sqlite3_prepare(db, query, -1, &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK) {
         Tcl_Obj* result = Tcl_NewListObj(0, NULL);
         Tcl_SetObjResult(interp, result);
         while (sqlite3_step(stmt) == SQLITE_ROW) {
             sqlite_int64 rowid = sqlite3_column_int64(stmt, 0);
-            char* name = unique_name(interp, prefix);
+            char* name = unique_name(interp, prefix, NULL);
             if (setter(interp, name, rowid) == TCL_OK) {
                 Tcl_Obj* element = Tcl_NewStringObj(name, -1);
                 Tcl_ListObjAppendElement(interp, result, element);
@@ -40,7 +40,7 @@ typedef struct {
 
 #define END_FLAGS 0
 
-char* unique_name(Tcl_Interp* interp, char* prefix);
+char* unique_name(Tcl_Interp* interp, char* prefix, int* lower_bound);
 
 int parse_flags(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[], int* start,
         option_spec options[], int* flags);
@@ -52,6 +52,10 @@ int set_object(Tcl_Interp* interp, char* name, void* value, char* type,
 
 int do_queries(Tcl_Interp* interp, sqlite3* db, char** queries);
 
+int check_tables(Tcl_Interp* interp, sqlite3* db);
+int init_temp(Tcl_Interp* interp, sqlite3* db);
+int init_db(Tcl_Interp* interp, sqlite3* db);
+
 void set_sqlite_result(Tcl_Interp* interp, sqlite3* db, const char* query);
 
 typedef int set_object_function(Tcl_Interp* interp, char* name,
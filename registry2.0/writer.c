@@ -0,0 +1,558 @@
+/*
+ * writer.c
+ * $Id: $
+ *
+ * Copyright (c) 2007 Chris Pickel <sfiera@macports.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include <sqlite3.h>
+
+#include "centry.h"
+#include "pool.h"
+#include "probes.h"
+#include "registry.h"
+#include "util.h"
+#include "writer.h"
+
+/*
+ * Background writer.
+ *
+ * With `registry::writer start`, the mapping and property writes an interp
+ * makes are queued for a thread of its own instead of being run on the spot.
+ * The thread works on its own pooled connection and commits whatever has piled
+ * up in a single transaction, so a thousand `map` calls during activation cost
+ * a handful of fsyncs rather than a thousand. A batch is committed once it
+ * holds `batch` operations, or `window` milliseconds after its first one
+ * arrived, whichever comes first.
+ *
+ * Every other registry command waits for the queue to drain before it runs, so
+ * an interp always sees its own writes. Errors from queued writes can't be
+ * thrown where they happened; the first one is kept and thrown by the next
+ * `registry::flush`.
+ */
+
+#define WRITER_BATCH 512
+#define WRITER_WINDOW 50
+
+/* enqueuing blocks once this many batches are waiting */
+#define WRITER_BACKLOG 16
+
+typedef enum {
+    WRITER_MAP,
+    WRITER_UNMAP,
+    WRITER_PROPSET
+} writer_op_type;
+
+typedef struct writer_op {
+    writer_op_type type;
+    sqlite_int64 rowid;
+    int count;
+    char** strings;
+    struct writer_op* next;
+} writer_op;
+
+struct reg_writer {
+    sqlite3* db;
+    Tcl_ThreadId thread;
+    Tcl_Mutex mutex;
+    Tcl_Condition wake;
+    Tcl_Condition done;
+    writer_op* head;
+    writer_op** tail;
+    int depth;
+    int batch;
+    int window;
+    int waiters;
+    int stopping;
+    unsigned long enqueued;
+    unsigned long committed;
+    unsigned long batches;
+    unsigned long largest;
+    unsigned long failures;
+    char* error;
+};
+
+reg_writer* interp_writer(Tcl_Interp* interp) {
+    return (reg_writer*)Tcl_GetAssocData(interp, "registry::writer", NULL);
+}
+
+static void op_free(writer_op* op) {
+    int i;
+    for (i=0; i<op->count; i++) {
+        ckfree(op->strings[i]);
+    }
+    ckfree((char*)op->strings);
+    ckfree((char*)op);
+}
+
+/*
+ * Notes the first failure since the last flush. Later ones are only counted;
+ * once one write has failed, the ones after it are usually failing for the same
+ * reason.
+ */
+static void writer_failed(reg_writer* writer, reg_error* errPtr) {
+    Tcl_MutexLock(&writer->mutex);
+    writer->failures++;
+    if (writer->error == NULL) {
+        writer->error = strdup(errPtr->description);
+    }
+    Tcl_MutexUnlock(&writer->mutex);
+    reg_error_destruct(errPtr);
+}
+
+static void writer_apply(reg_writer* writer, writer_op* op) {
+    reg_entry entry;
+    reg_error error;
+    int ok = 1;
+    entry.rowid = op->rowid;
+    entry.db = writer->db;
+    switch (op->type) {
+        case WRITER_MAP:
+            ok = (reg_entry_map(writer->db, &entry, op->strings, op->count,
+                        &error) == op->count);
+            break;
+        case WRITER_UNMAP:
+            ok = (reg_entry_unmap(writer->db, &entry, op->strings, op->count,
+                        &error) == op->count);
+            break;
+        case WRITER_PROPSET:
+            ok = reg_entry_propset(writer->db, &entry, op->strings[0],
+                    op->strings[1], &error);
+            break;
+    }
+    if (!ok) {
+        writer_failed(writer, &error);
+    }
+}
+
+/*
+ * Runs `ops` in one transaction. A failed operation doesn't spoil the batch:
+ * it is rolled back on its own, and the rest of the batch still commits.
+ */
+static void writer_commit(reg_writer* writer, writer_op* ops) {
+    reg_error error;
+    int count = 0;
+    REG_PROBE_START(start);
+    REG_PROBE1(txn_begin, "writer");
+    if (sqlite3_exec(writer->db, "BEGIN IMMEDIATE", NULL, NULL, NULL)
+            != SQLITE_OK) {
+        reg_sqlite_error(writer->db, &error, "BEGIN IMMEDIATE");
+        writer_failed(writer, &error);
+    }
+    while (ops != NULL) {
+        writer_op* next = ops->next;
+        writer_apply(writer, ops);
+        op_free(ops);
+        ops = next;
+        count++;
+    }
+    if (!sqlite3_get_autocommit(writer->db)
+            && sqlite3_exec(writer->db, "COMMIT", NULL, NULL, NULL)
+            != SQLITE_OK) {
+        reg_sqlite_error(writer->db, &error, "COMMIT");
+        writer_failed(writer, &error);
+        sqlite3_exec(writer->db, "ROLLBACK", NULL, NULL, NULL);
+        REG_PROBE3(txn_rollback, "writer", count, REG_PROBE_SINCE(start));
+    } else {
+        REG_PROBE3(txn_commit, "writer", count, REG_PROBE_SINCE(start));
+    }
+}
+
+static long ms_since(Tcl_Time* start) {
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (now.sec - start->sec) * 1000 + (now.usec - start->usec) / 1000;
+}
+
+static Tcl_ThreadCreateType writer_main(ClientData clientData) {
+    reg_writer* writer = (reg_writer*)clientData;
+    Tcl_MutexLock(&writer->mutex);
+    while (1) {
+        writer_op* ops;
+        writer_op** link;
+        int count;
+        Tcl_Time start;
+        while (writer->head == NULL && !writer->stopping) {
+            Tcl_ConditionWait(&writer->wake, &writer->mutex, NULL);
+        }
+        if (writer->head == NULL) {
+            break;
+        }
+        /* hold the batch open until it's full, or someone is waiting */
+        Tcl_GetTime(&start);
+        while (writer->depth < writer->batch && !writer->waiters
+                && !writer->stopping) {
+            long left = writer->window - ms_since(&start);
+            Tcl_Time timeout;
+            if (left <= 0) {
+                break;
+            }
+            timeout.sec = left / 1000;
+            timeout.usec = (left % 1000) * 1000;
+            Tcl_ConditionWait(&writer->wake, &writer->mutex, &timeout);
+        }
+        ops = writer->head;
+        link = &writer->head;
+        for (count = 0; count < writer->batch && *link != NULL; count++) {
+            link = &(*link)->next;
+        }
+        writer->head = *link;
+        *link = NULL;
+        if (writer->head == NULL) {
+            writer->tail = &writer->head;
+        }
+        writer->depth -= count;
+        Tcl_MutexUnlock(&writer->mutex);
+
+        writer_commit(writer, ops);
+
+        Tcl_MutexLock(&writer->mutex);
+        writer->committed += count;
+        writer->batches++;
+        if ((unsigned long)count > writer->largest) {
+            writer->largest = count;
+        }
+        Tcl_ConditionNotify(&writer->done);
+    }
+    Tcl_MutexUnlock(&writer->mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+static void writer_enqueue(reg_writer* writer, writer_op* op) {
+    op->next = NULL;
+    Tcl_MutexLock(&writer->mutex);
+    while (writer->depth >= writer->batch * WRITER_BACKLOG) {
+        Tcl_ConditionWait(&writer->done, &writer->mutex, NULL);
+    }
+    *writer->tail = op;
+    writer->tail = &op->next;
+    writer->depth++;
+    writer->enqueued++;
+    /* the first operation opens a window; a full batch closes it */
+    if (writer->depth == 1 || writer->depth == writer->batch) {
+        Tcl_ConditionNotify(&writer->wake);
+    }
+    Tcl_MutexUnlock(&writer->mutex);
+}
+
+static writer_op* op_new(writer_op_type type, sqlite_int64 rowid, int count) {
+    writer_op* op = (writer_op*)ckalloc(sizeof(writer_op));
+    op->type = type;
+    op->rowid = rowid;
+    op->count = count;
+    op->strings = (char**)ckalloc(count * sizeof(char*));
+    return op;
+}
+
+static char* obj_strdup(Tcl_Obj* obj) {
+    int len;
+    char* src = Tcl_GetStringFromObj(obj, &len);
+    char* dst = ckalloc(len + 1);
+    memcpy(dst, src, len + 1);
+    return dst;
+}
+
+void writer_map(reg_writer* writer, sqlite_int64 rowid, int objc,
+        Tcl_Obj* CONST objv[]) {
+    writer_op* op = op_new(WRITER_MAP, rowid, objc);
+    int i;
+    for (i=0; i<objc; i++) {
+        op->strings[i] = obj_strdup(objv[i]);
+    }
+    writer_enqueue(writer, op);
+}
+
+void writer_unmap(reg_writer* writer, sqlite_int64 rowid, int objc,
+        Tcl_Obj* CONST objv[]) {
+    writer_op* op = op_new(WRITER_UNMAP, rowid, objc);
+    int i;
+    for (i=0; i<objc; i++) {
+        op->strings[i] = obj_strdup(objv[i]);
+    }
+    writer_enqueue(writer, op);
+}
+
+void writer_propset(reg_writer* writer, sqlite_int64 rowid, const char* key,
+        Tcl_Obj* value) {
+    writer_op* op = op_new(WRITER_PROPSET, rowid, 2);
+    op->strings[0] = ckalloc(strlen(key) + 1);
+    strcpy(op->strings[0], key);
+    op->strings[1] = obj_strdup(value);
+    writer_enqueue(writer, op);
+}
+
+/*
+ * Waits, with the writer's mutex held, until everything queued so far has been
+ * committed. Registering as a waiter makes the thread commit at once instead of
+ * sitting out the rest of its window.
+ */
+static void writer_wait(reg_writer* writer) {
+    unsigned long target = writer->enqueued;
+    if (writer->committed < target) {
+        writer->waiters++;
+        Tcl_ConditionNotify(&writer->wake);
+        while (writer->committed < target) {
+            Tcl_ConditionWait(&writer->done, &writer->mutex, NULL);
+        }
+        writer->waiters--;
+    }
+}
+
+/**
+ * Waits for the writer of `interp`, if it has one, to catch up. Errors are left
+ * for `registry::flush`; this only guarantees that what follows sees every
+ * write queued before it.
+ */
+void writer_sync(Tcl_Interp* interp) {
+    reg_writer* writer = interp_writer(interp);
+    if (writer != NULL) {
+        Tcl_MutexLock(&writer->mutex);
+        writer_wait(writer);
+        Tcl_MutexUnlock(&writer->mutex);
+    }
+}
+
+/*
+ * Drains the queue, stops the thread and hands its connection back.
+ */
+static char* writer_shutdown(reg_writer* writer) {
+    int status;
+    char* error;
+    Tcl_MutexLock(&writer->mutex);
+    writer->stopping = 1;
+    Tcl_ConditionNotify(&writer->wake);
+    Tcl_MutexUnlock(&writer->mutex);
+    Tcl_JoinThread(writer->thread, &status);
+    error = writer->error;
+    pool_release(writer->db);
+    Tcl_ConditionFinalize(&writer->wake);
+    Tcl_ConditionFinalize(&writer->done);
+    Tcl_MutexFinalize(&writer->mutex);
+    ckfree((char*)writer);
+    return error;
+}
+
+static void delete_writer(ClientData clientData, Tcl_Interp* interp UNUSED) {
+    free(writer_shutdown((reg_writer*)clientData));
+}
+
+/**
+ * Stops the writer of `interp`, if it has one, once its queue is empty. Returns
+ * TCL_ERROR with the first pending error in the result if a queued write had
+ * failed; the writer is stopped either way.
+ */
+int writer_stop(Tcl_Interp* interp) {
+    reg_writer* writer = interp_writer(interp);
+    char* error;
+    if (writer == NULL) {
+        return TCL_OK;
+    }
+    Tcl_SetAssocData(interp, "registry::writer", NULL, NULL);
+    Tcl_DeleteAssocData(interp, "registry::writer");
+    error = writer_shutdown(writer);
+    if (error != NULL) {
+        Tcl_SetResult(interp, error, TCL_VOLATILE);
+        free(error);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * registry::writer start ?-batch count? ?-window ms?
+ */
+static int writer_start(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[]) {
+    static const char* options[] = { "-batch", "-window", NULL };
+    sqlite3* db = registry_db(interp, 1);
+    const char* file;
+    reg_writer* writer;
+    int batch = WRITER_BATCH;
+    int window = WRITER_WINDOW;
+    int i;
+    if (db == NULL) {
+        return TCL_ERROR;
+    }
+    if (interp_writer(interp) != NULL) {
+        Tcl_SetResult(interp, "writer is already running", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (registry_flags(interp) & REGISTRY_READONLY) {
+        Tcl_SetResult(interp, "registry is open read-only", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (!sqlite3_threadsafe()) {
+        Tcl_SetResult(interp, "sqlite was built without thread support",
+                TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-batch count? ?-window ms?");
+        return TCL_ERROR;
+    }
+    for (i=2; i<objc; i+=2) {
+        int index, value;
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &index)
+                != TCL_OK
+                || Tcl_GetIntFromObj(interp, objv[i+1], &value) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (value < (index == 0 ? 1 : 0)) {
+            Tcl_AppendResult(interp, "bad value for ", Tcl_GetString(objv[i]),
+                    NULL);
+            return TCL_ERROR;
+        }
+        if (index == 0) {
+            batch = value;
+        } else {
+            window = value;
+        }
+    }
+    file = sqlite3_db_filename(db, "registry");
+    writer = (reg_writer*)ckalloc(sizeof(reg_writer));
+    memset(writer, 0, sizeof(reg_writer));
+    writer->db = pool_lease(interp, file, 0);
+    if (writer->db == NULL) {
+        ckfree((char*)writer);
+        return TCL_ERROR;
+    }
+    writer->tail = &writer->head;
+    writer->batch = batch;
+    writer->window = window;
+    if (Tcl_CreateThread(&writer->thread, writer_main, writer,
+                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+        pool_release(writer->db);
+        ckfree((char*)writer);
+        Tcl_SetResult(interp, "couldn't create writer thread", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    Tcl_SetAssocData(interp, "registry::writer", delete_writer, writer);
+    return TCL_OK;
+}
+
+/*
+ * registry::writer stats
+ *
+ * Returns a dict of `queued` (operations waiting), `ops` (committed so far),
+ * `batches`, `largest` and `mean` batch size, and `failures`.
+ */
+static int writer_stats(Tcl_Interp* interp, reg_writer* writer) {
+    Tcl_Obj* result = Tcl_NewListObj(0, NULL);
+    unsigned long queued, ops, batches, largest, failures;
+    Tcl_MutexLock(&writer->mutex);
+    queued = writer->depth;
+    ops = writer->committed;
+    batches = writer->batches;
+    largest = writer->largest;
+    failures = writer->failures;
+    Tcl_MutexUnlock(&writer->mutex);
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("queued", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(queued));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("ops", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(ops));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("batches", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(batches));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("largest", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(largest));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("mean", -1));
+    Tcl_ListObjAppendElement(interp, result,
+            Tcl_NewDoubleObj(batches ? (double)ops / batches : 0.0));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("failures", -1));
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewLongObj(failures));
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+}
+
+/*
+ * registry::writer start ?-batch count? ?-window ms?
+ * registry::writer stop
+ * registry::writer stats
+ */
+int writer_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    static const char* cmds[] = { "start", "stop", "stats", NULL };
+    int index;
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "cmd ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], cmds, "cmd", 0, &index)
+            != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (index == 0) {
+        return writer_start(interp, objc, objv);
+    }
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
+    }
+    if (index == 1) {
+        return writer_stop(interp);
+    } else {
+        reg_writer* writer = interp_writer(interp);
+        if (writer == NULL) {
+            Tcl_SetResult(interp, "writer is not running", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        return writer_stats(interp, writer);
+    }
+}
+
+/*
+ * registry::flush
+ *
+ * Durability barrier: returns once every write queued before it has been
+ * committed. If any of them failed since the last flush, throws the first
+ * error. Without a writer there is nothing to wait for.
+ */
+int flush_cmd(ClientData clientData UNUSED, Tcl_Interp* interp, int objc,
+        Tcl_Obj* CONST objv[]) {
+    reg_writer* writer;
+    if (objc != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, NULL);
+        return TCL_ERROR;
+    }
+    writer = interp_writer(interp);
+    if (writer != NULL) {
+        char* error;
+        Tcl_MutexLock(&writer->mutex);
+        writer_wait(writer);
+        error = writer->error;
+        writer->error = NULL;
+        Tcl_MutexUnlock(&writer->mutex);
+        if (error != NULL) {
+            Tcl_SetResult(interp, error, TCL_VOLATILE);
+            free(error);
+            return TCL_ERROR;
+        }
+    }
+    return TCL_OK;
+}